@@ -0,0 +1,344 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/appimpl.h"
+#include "common/common.h"
+#include "common/fec.h"
+
+#include "server/src/ports_pull.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+}
+
+namespace
+{
+
+// Application with running io_service for Post and BlockedCall.
+class BenchApplication : public Common::ApplicationImpl<BenchApplication>
+{
+public:
+    BenchApplication() : Common::ApplicationImpl<BenchApplication>("benchmarks")
+    {
+    }
+
+    void AppRun() override
+    {
+    }
+
+    void AppStop() override
+    {
+    }
+
+    std::string GetServiceName() const override
+    {
+        return "benchmarks";
+    }
+};
+
+Common::IApplicationPtr g_app;
+std::thread g_app_thread;
+
+void StartApplication()
+{
+    g_app = std::make_shared<BenchApplication>();
+    Common::IApplicationPtr app = g_app;
+    g_app_thread = std::thread([app]() { app->Run(); });
+
+    // io_service is running when posted call returns
+    g_app->BlockedCall([]() {});
+}
+
+void StopApplication()
+{
+    // last reference is held by the run thread, so application stops at once
+    Common::IApplication* app = g_app.get();
+    g_app.reset();
+    app->Unload();
+    g_app_thread.join();
+}
+
+void BM_TraceLog(benchmark::State& state)
+{
+    const std::string text = "Receiver 101 queue overflow, drop datagram";
+    uint64_t dropped = Common::log_dropped_count();
+
+    for (auto _ : state)
+        Common::trace_log(Common::LogLevel::DBG, text, false, __FILE__, __LINE__);
+
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0)
+        state.counters["dropped"] = benchmark::Counter(Common::log_dropped_count() - dropped);
+}
+BENCHMARK(BM_TraceLog)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_TraceLogDeferred(benchmark::State& state)
+{
+    int id = 101;
+    for (auto _ : state)
+        LOGW_FMT("Receiver {} queue overflow, drop datagram {}", id, state.iterations());
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TraceLogDeferred)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_ApplicationPost(benchmark::State& state)
+{
+    // posts and waits for the call on application thread
+    for (auto _ : state)
+    {
+        std::atomic<bool> done{false};
+        g_app->Post([&done]() { done.store(true, std::memory_order_release); });
+        while (!done.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+}
+BENCHMARK(BM_ApplicationPost)->UseRealTime();
+
+void BM_ApplicationBlockedCall(benchmark::State& state)
+{
+    int value = 0;
+    for (auto _ : state)
+        g_app->BlockedCall([&value]() { ++value; });
+    benchmark::DoNotOptimize(value);
+}
+BENCHMARK(BM_ApplicationBlockedCall)->UseRealTime();
+
+struct Counted : public Common::ObjectCounter<Counted>
+{
+    int value = 0;
+};
+
+void BM_ObjectCounter(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        Counted object;
+        benchmark::DoNotOptimize(object);
+    }
+}
+BENCHMARK(BM_ObjectCounter)->ThreadRange(1, 8);
+
+void BM_ObjectCounterShared(benchmark::State& state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(std::make_shared<Counted>());
+}
+BENCHMARK(BM_ObjectCounterShared);
+
+void BM_PortsPool(benchmark::State& state)
+{
+    Server::PortsPool pool(state.range(0));
+    for (auto _ : state)
+    {
+        uint16_t port = pool.pop();
+        benchmark::DoNotOptimize(port);
+        pool.return_port(port);
+    }
+}
+BENCHMARK(BM_PortsPool)->Arg(10)->Arg(1000);
+
+// ffmpeg baseline: the av_rescale_q calls sender.cpp makes inline per packet,
+// from mp4 track to rtp clock plus the pacing time, not a sender code path
+void BM_RescaleTimestamps(benchmark::State& state)
+{
+    const AVRational in = {1, 15360};
+    const AVRational out = {1, 90000};
+    const AVRounding rounding = AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+
+    int64_t dts = 0;
+    for (auto _ : state)
+    {
+        dts += 512;
+        int64_t pts = av_rescale_q_rnd(dts + 1024, in, out, rounding);
+        int64_t out_dts = av_rescale_q_rnd(dts, in, out, rounding);
+        int64_t duration = av_rescale_q(512, in, out);
+        int64_t pace = av_rescale_q(dts, in, AVRational{1, AV_TIME_BASE});
+        benchmark::DoNotOptimize(pts);
+        benchmark::DoNotOptimize(out_dts);
+        benchmark::DoNotOptimize(duration);
+        benchmark::DoNotOptimize(pace);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RescaleTimestamps);
+
+// ffmpeg baseline: av_packet_ref of a packet which does not own its payload
+// copies the payload, the cost a stage pays when it refs a demuxed packet
+void BM_PacketCopy(benchmark::State& state)
+{
+    std::vector<uint8_t> payload(state.range(0), 0x5a);
+
+    AVPacket* source = av_packet_alloc();
+    AVPacket* copy = av_packet_alloc();
+    source->data = payload.data();
+    source->size = static_cast<int>(payload.size());
+    source->pts = source->dts = 1000;
+
+    for (auto _ : state)
+    {
+        av_packet_ref(copy, source);
+        benchmark::DoNotOptimize(copy->data);
+        av_packet_unref(copy);
+    }
+
+    state.SetBytesProcessed(state.iterations() * payload.size());
+    av_packet_free(&copy);
+    av_packet_free(&source);
+}
+BENCHMARK(BM_PacketCopy)->Arg(188)->Arg(1400)->Arg(64 * 1024)->Arg(512 * 1024);
+
+// counted reference of owned payload, as muxer stages pass packets
+void BM_PacketRef(benchmark::State& state)
+{
+    AVPacket* source = av_packet_alloc();
+    AVPacket* copy = av_packet_alloc();
+    av_new_packet(source, static_cast<int>(state.range(0)));
+
+    for (auto _ : state)
+    {
+        av_packet_ref(copy, source);
+        benchmark::DoNotOptimize(copy->data);
+        av_packet_unref(copy);
+    }
+
+    av_packet_free(&copy);
+    av_packet_free(&source);
+}
+BENCHMARK(BM_PacketRef)->Arg(1400)->Arg(64 * 1024);
+
+// xor kernel of fec, bytes per second is the GB/s figure
+void BM_FecXor(benchmark::State& state)
+{
+    auto kernel = static_cast<Common::Fec::XorKernel>(state.range(0));
+    if (!Common::Fec::xor_supported(kernel))
+    {
+        state.SkipWithError("kernel is not supported by cpu");
+        return;
+    }
+    state.SetLabel(Common::Fec::xor_name(kernel));
+
+    std::vector<uint8_t> dst(state.range(1), 0x5a);
+    std::vector<uint8_t> src(state.range(1), 0xa5);
+    for (auto _ : state)
+    {
+        Common::Fec::xor_into(dst.data(), src.data(), src.size(), kernel);
+        benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_FecXor)->ArgsProduct({{0, 1, 2}, {1200, 64 * 1024}});
+
+// rtp packets of a group with sequence numbers and random lengths around mtu
+std::vector<std::vector<uint8_t>> FecGroup(unsigned count)
+{
+    std::vector<std::vector<uint8_t>> packets;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        std::vector<uint8_t> packet(1000 + (i * 7919) % 400, static_cast<uint8_t>(i));
+        packet[0] = 0x80;
+        packet[1] = 96;
+        packet[2] = 0;
+        packet[3] = static_cast<uint8_t>(i);
+        packets.push_back(packet);
+    }
+    return packets;
+}
+
+void BM_FecEncode(benchmark::State& state)
+{
+    unsigned group = static_cast<unsigned>(state.range(0));
+    auto packets = FecGroup(group);
+    Common::Fec::Encoder encoder(group);
+
+    size_t bytes = 0;
+    for (auto _ : state)
+    {
+        for (auto& packet : packets)
+        {
+            bytes += packet.size();
+            if (encoder.Add(packet.data(), packet.size()))
+                benchmark::DoNotOptimize(encoder.Parity().data());
+        }
+    }
+    state.SetBytesProcessed(bytes);
+    state.SetLabel(Common::Fec::xor_name(Common::Fec::xor_best()));
+}
+BENCHMARK(BM_FecEncode)->Arg(5)->Arg(10)->Arg(20);
+
+// recovery of one lost packet of a group from parity and the rest
+void BM_FecDecode(benchmark::State& state)
+{
+    unsigned group = static_cast<unsigned>(state.range(0));
+    auto packets = FecGroup(group);
+    Common::Fec::Encoder encoder(group);
+    for (auto& packet : packets)
+        encoder.Add(packet.data(), packet.size());
+    std::vector<uint8_t> data = encoder.Parity();
+
+    Common::Fec::Parity parity;
+    Common::Fec::parse_parity(data.data(), data.size(), parity);
+
+    // first packet is lost
+    std::vector<const uint8_t*> present;
+    std::vector<size_t> sizes;
+    size_t bytes = data.size();
+    for (unsigned i = 1; i < group; ++i)
+    {
+        present.push_back(packets[i].data());
+        sizes.push_back(packets[i].size());
+        bytes += packets[i].size();
+    }
+    std::vector<uint8_t> out(parity.payload_size);
+
+    for (auto _ : state)
+    {
+        size_t size = Common::Fec::recover(parity, present.data(), sizes.data(), group - 1, out.data());
+        benchmark::DoNotOptimize(size);
+    }
+    state.SetBytesProcessed(state.iterations() * bytes);
+    state.SetLabel(Common::Fec::xor_name(Common::Fec::xor_best()));
+}
+BENCHMARK(BM_FecDecode)->Arg(5)->Arg(10)->Arg(20);
+
+}
+
+// JSON results go to benchmarks.json unless --benchmark_out is given
+int main(int argc, char** argv)
+{
+    std::vector<char*> args(argv, argv + argc);
+    bool out = false;
+    for (int i = 1; i < argc; ++i)
+        out = out || !strncmp(argv[i], "--benchmark_out=", strlen("--benchmark_out="));
+
+    std::string out_file = "--benchmark_out=benchmarks.json";
+    std::string out_format = "--benchmark_out_format=json";
+    if (!out)
+    {
+        args.push_back(&out_file[0]);
+        args.push_back(&out_format[0]);
+    }
+    int count = static_cast<int>(args.size());
+
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+        return 1;
+
+    // records go to benchmarks.log only, console would measure the terminal
+    Common::LogParams log_params;
+    log_params.console = false;
+    Common::initialize_log("benchmarks", log_params);
+
+    StartApplication();
+    benchmark::RunSpecifiedBenchmarks();
+    StopApplication();
+
+    benchmark::Shutdown();
+    return 0;
+}
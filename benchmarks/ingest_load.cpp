@@ -0,0 +1,338 @@
+// In-process capacity test: server on loopback, load generator ramps senders
+// of a synthetic clip in steps until loss of a step goes over the threshold.
+
+#include "synthetic_media.h"
+
+#include "common/common.h"
+#include "common/metrics.h"
+
+#include "client/src/client_app.h"
+#include "client/src/load_generator.h"
+#include "server/src/server_app.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+struct LoadTestParams
+{
+    unsigned start = 10;
+    unsigned step = 10;
+    unsigned max = 500;
+    // measured after all senders of a step are started
+    unsigned step_duration_s = 20;
+    unsigned settle_s = 2;
+    // lost and dropped datagrams to received ones
+    double loss_threshold = 0.001;
+    unsigned ramp_interval_ms = 20;
+    unsigned load_threads = 2;
+    int port = 18080;
+    // admission of server is off unless enabled, steps measure loss only
+    bool admission = false;
+    std::string dir = "ingest_load";
+    std::string out = "ingest_load.json";
+    Bench::SyntheticClipParams clip;
+};
+
+struct StepResult
+{
+    unsigned streams = 0;
+    Client::LoadReport report;
+    unsigned active = 0;
+    double received = 0;
+    double lost = 0;
+    double dropped = 0;
+    double loss = 0;
+    // server threads cpu over measurement window
+    double cores = 0;
+    double streams_per_core = 0;
+    bool passed = false;
+};
+
+class Handler : public Client::ISenderEvents
+{
+public:
+    void OnSenderStopped(Client::ISenderPtr) override
+    {
+    }
+};
+
+double ServerCpuSeconds()
+{
+    double total = 0;
+    for (const char* prefix : {"ingest", "writer", "ctl", "server"})
+        total += Common::Metrics::ThreadCpuSeconds(prefix);
+    return total;
+}
+
+double Seconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double>>(duration).count();
+}
+
+bool WaitFor(const std::function<bool()>& done, unsigned timeout_ms)
+{
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > until)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return true;
+}
+
+bool CanConnect(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool connected = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    close(fd);
+    return connected;
+}
+
+// recordings of finished steps
+void RemoveRecordings()
+{
+    DIR* dir = opendir(".");
+    if (!dir)
+        return;
+
+    while (dirent* entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.compare(0, 3, "out") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".mp4") == 0)
+            unlink(name.c_str());
+    }
+    closedir(dir);
+}
+
+StepResult RunStep(const LoadTestParams& params, unsigned streams)
+{
+    StepResult result;
+    result.streams = streams;
+
+    Client::ClientParams client;
+    client.mode = Client::ClientParams::load_mode;
+    client.server_port = params.port;
+    client.url = "synthetic.mp4";
+    client.senders = streams;
+    client.load_threads = params.load_threads;
+    client.loop = true;
+    client.ramp_interval_ms = params.ramp_interval_ms;
+
+    auto generator = Client::CreateLoadGenerator(client, std::make_shared<Handler>());
+    generator->Initialize();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(streams * params.ramp_interval_ms) + std::chrono::seconds(params.settle_s));
+
+    auto start = std::chrono::steady_clock::now();
+    double cpu = ServerCpuSeconds();
+    std::this_thread::sleep_for(std::chrono::seconds(params.step_duration_s));
+    result.cores = (ServerCpuSeconds() - cpu) / Seconds(std::chrono::steady_clock::now() - start);
+
+    // receivers of the step are alive until generator closes streams
+    result.active = static_cast<unsigned>(Common::Metrics::Total("streamer_streams"));
+    result.received = Common::Metrics::Total("streamer_receiver_datagrams_total");
+    result.lost = Common::Metrics::Total("streamer_receiver_rtp_lost");
+    result.dropped = Common::Metrics::Total("streamer_receiver_dropped_datagrams_total");
+
+    generator->Uninitialize();
+    result.report = generator->Report();
+
+    if (!WaitFor([]() { return Common::Metrics::Total("streamer_streams") == 0; }, 15000))
+        LOGW("Streams of step " << streams << " are still open");
+    RemoveRecordings();
+
+    double expected = result.received + result.lost;
+    result.loss = expected > 0 ? (result.lost + result.dropped) / expected : 1;
+    result.streams_per_core = result.cores > 0 ? streams / result.cores : 0;
+    result.passed = result.report.started == streams && !result.report.failed
+            && result.active == streams && result.loss <= params.loss_threshold;
+    return result;
+}
+
+double Ms(const Common::HistogramPtr& histogram, double q)
+{
+    return histogram ? histogram->Quantile(q) / 1e6 : 0;
+}
+
+void WriteJson(const LoadTestParams& params, const std::vector<StepResult>& steps, const StepResult* best)
+{
+    std::ofstream out(params.out);
+    out << "{\n"
+        << "  \"loss_threshold\": " << params.loss_threshold << ",\n"
+        << "  \"cores\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"clip\": {\"width\": " << params.clip.width << ", \"height\": " << params.clip.height
+        << ", \"fps\": " << params.clip.fps << ", \"video_bitrate\": " << params.clip.video_bitrate
+        << ", \"audio_bitrate\": " << params.clip.audio_bitrate << "},\n"
+        << "  \"max_streams\": " << (best ? best->streams : 0) << ",\n"
+        << "  \"streams_per_core\": " << (best ? best->streams_per_core : 0) << ",\n"
+        << "  \"steps\": [\n";
+
+    for (size_t i = 0; i < steps.size(); ++i)
+    {
+        const StepResult& step = steps[i];
+        out << "    {\"streams\": " << step.streams
+            << ", \"passed\": " << (step.passed ? "true" : "false")
+            << ", \"started\": " << step.report.started
+            << ", \"failed\": " << step.report.failed
+            << ", \"busy\": " << step.report.busy
+            << ", \"active\": " << step.active
+            << ", \"sent_datagrams\": " << step.report.datagrams
+            << ", \"send_errors\": " << step.report.send_errors
+            << ", \"received_datagrams\": " << static_cast<uint64_t>(step.received)
+            << ", \"lost\": " << static_cast<uint64_t>(step.lost)
+            << ", \"dropped\": " << static_cast<uint64_t>(step.dropped)
+            << ", \"loss\": " << step.loss
+            << ", \"server_cores\": " << step.cores
+            << ", \"streams_per_core\": " << step.streams_per_core
+            << ", \"setup_ms\": {\"p50\": " << Ms(step.report.setup_latency, 0.5)
+            << ", \"p99\": " << Ms(step.report.setup_latency, 0.99)
+            << ", \"max\": " << (step.report.setup_latency ? step.report.setup_latency->Max() / 1e6 : 0) << "}}"
+            << (i + 1 < steps.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+bool ParseArg(const char* arg, LoadTestParams& params)
+{
+    std::string text = arg;
+    size_t eq = text.find('=');
+    if (text.compare(0, 2, "--") != 0 || eq == std::string::npos)
+        return false;
+
+    std::string name = text.substr(2, eq - 2);
+    std::istringstream value(text.substr(eq + 1));
+
+    if (name == "start") value >> params.start;
+    else if (name == "step") value >> params.step;
+    else if (name == "max") value >> params.max;
+    else if (name == "duration") value >> params.step_duration_s;
+    else if (name == "loss") value >> params.loss_threshold;
+    else if (name == "ramp_interval_ms") value >> params.ramp_interval_ms;
+    else if (name == "load_threads") value >> params.load_threads;
+    else if (name == "port") value >> params.port;
+    else if (name == "admission") value >> params.admission;
+    else if (name == "dir") value >> params.dir;
+    else if (name == "out") value >> params.out;
+    else if (name == "video_bitrate") value >> params.clip.video_bitrate;
+    else
+        return false;
+
+    return !value.fail();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    LoadTestParams params;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!ParseArg(argv[i], params))
+        {
+            std::cerr << "Unknown argument " << argv[i] << "\n"
+                      << "usage: ingest_load [--start=N] [--step=N] [--max=N] [--duration=s] [--loss=ratio]\n"
+                      << "    [--ramp_interval_ms=N] [--load_threads=N] [--port=N] [--admission=0|1]\n"
+                      << "    [--video_bitrate=bps] [--dir=path] [--out=file.json]\n";
+            return 1;
+        }
+    }
+
+    mkdir(params.dir.c_str(), 0755);
+    if (chdir(params.dir.c_str()) != 0)
+    {
+        std::cerr << "Cannot enter " << params.dir << "\n";
+        return 1;
+    }
+
+    // records go to ingest_load.log, console is for results
+    Common::LogParams log_params;
+    log_params.console = false;
+    Common::initialize_log("ingest_load", log_params);
+
+    if (!Bench::WriteSyntheticClip(params.clip, "synthetic.mp4"))
+    {
+        std::cerr << "Cannot write synthetic clip, see ingest_load.log\n";
+        return 1;
+    }
+
+    Server::ServerParams server_params;
+    server_params.port = params.port;
+    server_params.max_clients = params.max;
+    server_params.metrics_port = 0;
+    if (!params.admission)
+    {
+        server_params.admission.max_cpu = 0;
+        server_params.admission.min_free_memory = 0;
+    }
+
+    Server::IServerAppPtr server = Server::CreateServerApp(server_params);
+    std::thread server_thread([server]() { server->Run(); });
+
+    if (!WaitFor([&params]() { return CanConnect(params.port); }, 10000))
+    {
+        std::cerr << "Server does not listen on port " << params.port << "\n";
+        return 1;
+    }
+
+    std::cout << "streams  started  failed  loss       server cores  streams/core  setup p50/p99 ms\n";
+
+    std::vector<StepResult> steps;
+    const StepResult* best = nullptr;
+    for (unsigned streams = params.start; streams <= params.max; streams += params.step)
+    {
+        steps.push_back(RunStep(params, streams));
+        const StepResult& step = steps.back();
+
+        std::cout << step.streams << "\t " << step.report.started << "\t  " << step.report.failed
+                  << "\t  " << step.loss << "\t     " << step.cores << "\t   " << step.streams_per_core
+                  << "\t  " << Ms(step.report.setup_latency, 0.5) << "/" << Ms(step.report.setup_latency, 0.99)
+                  << (step.passed ? "" : "  over threshold") << std::endl;
+
+        if (!step.passed)
+            break;
+        if (!params.step)
+            break;
+    }
+
+    // pointers are taken after the vector stops growing
+    for (auto& step : steps)
+    {
+        if (step.passed)
+            best = &step;
+    }
+
+    WriteJson(params, steps, best);
+    std::cout << "max streams with loss under " << params.loss_threshold << ": " << (best ? best->streams : 0)
+              << ", " << (best ? best->streams_per_core : 0) << " streams per core, results in "
+              << params.dir << "/" << params.out << std::endl;
+
+    // the run thread holds the last reference, so server stops at once
+    Common::IApplication* app = server.get();
+    server.reset();
+    app->Unload();
+    server_thread.join();
+
+    Common::flush_log();
+    return best ? 0 : 2;
+}
@@ -0,0 +1,480 @@
+#include "synthetic_media.h"
+#include "common/common.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace Bench
+{
+
+namespace
+{
+
+// rbsp bits, msb first
+class BitWriter
+{
+    std::vector<uint8_t> bytes;
+    uint8_t current = 0;
+    int count = 0;
+
+public:
+    void Bit(unsigned bit)
+    {
+        current = static_cast<uint8_t>((current << 1) | (bit & 1));
+        if (++count == 8)
+        {
+            bytes.push_back(current);
+            current = 0;
+            count = 0;
+        }
+    }
+
+    void Bits(uint32_t value, int bits)
+    {
+        for (int i = bits - 1; i >= 0; --i)
+            Bit((value >> i) & 1);
+    }
+
+    // exp-golomb
+    void Ue(uint32_t value)
+    {
+        uint32_t code = value + 1;
+        int bits = 32 - __builtin_clz(code);
+        Bits(0, bits - 1);
+        Bits(code, bits);
+    }
+
+    void Se(int32_t value)
+    {
+        Ue(value <= 0 ? static_cast<uint32_t>(-2 * value) : static_cast<uint32_t>(2 * value - 1));
+    }
+
+    void AlignZero()
+    {
+        while (count)
+            Bit(0);
+    }
+
+    // byte aligned
+    void Byte(uint8_t value)
+    {
+        bytes.push_back(value);
+    }
+
+    void Trailing()
+    {
+        Bit(1);
+        AlignZero();
+    }
+
+    const std::vector<uint8_t>& Bytes() const
+    {
+        return bytes;
+    }
+};
+
+enum NalType
+{
+    nal_slice = 1,
+    nal_idr = 5,
+    nal_sps = 7,
+    nal_pps = 8,
+    nal_filler = 12,
+};
+
+// annex b start code, header and rbsp with emulation prevention
+void AppendNal(std::vector<uint8_t>& out, int ref_idc, int type, const std::vector<uint8_t>& rbsp)
+{
+    out.insert(out.end(), {0, 0, 0, 1, static_cast<uint8_t>((ref_idc << 5) | type)});
+
+    int zeros = 0;
+    for (uint8_t byte : rbsp)
+    {
+        if (zeros >= 2 && byte <= 3)
+        {
+            out.push_back(3);
+            zeros = 0;
+        }
+        out.push_back(byte);
+        zeros = byte ? 0 : zeros + 1;
+    }
+}
+
+// H.264 constrained baseline: I_PCM key frames, P frames of skipped macroblocks
+class H264Writer
+{
+    static constexpr int log2_max_frame_num = 8;
+
+    const int mbs_wide;
+    const int mbs_high;
+    unsigned idr_id = 0;
+
+public:
+    H264Writer(int width, int height) : mbs_wide(width / 16), mbs_high(height / 16)
+    {
+    }
+
+    std::vector<uint8_t> Headers() const
+    {
+        std::vector<uint8_t> out;
+
+        BitWriter sps;
+        sps.Bits(66, 8);    // profile_idc baseline
+        sps.Bits(0xc0, 8);  // constraint_set0 and 1, constrained baseline
+        sps.Bits(30, 8);    // level_idc
+        sps.Ue(0);          // seq_parameter_set_id
+        sps.Ue(log2_max_frame_num - 4);
+        sps.Ue(2);          // pic_order_cnt_type, output order is decode order
+        sps.Ue(1);          // max_num_ref_frames
+        sps.Bit(0);         // gaps_in_frame_num_value_allowed_flag
+        sps.Ue(mbs_wide - 1);
+        sps.Ue(mbs_high - 1);
+        sps.Bit(1);         // frame_mbs_only_flag
+        sps.Bit(1);         // direct_8x8_inference_flag
+        sps.Bit(0);         // frame_cropping_flag
+        sps.Bit(0);         // vui_parameters_present_flag
+        sps.Trailing();
+        AppendNal(out, 3, nal_sps, sps.Bytes());
+
+        BitWriter pps;
+        pps.Ue(0);          // pic_parameter_set_id
+        pps.Ue(0);          // seq_parameter_set_id
+        pps.Bit(0);         // entropy_coding_mode_flag, cavlc
+        pps.Bit(0);         // bottom_field_pic_order_in_frame_present_flag
+        pps.Ue(0);          // num_slice_groups_minus1
+        pps.Ue(0);          // num_ref_idx_l0_default_active_minus1
+        pps.Ue(0);          // num_ref_idx_l1_default_active_minus1
+        pps.Bit(0);         // weighted_pred_flag
+        pps.Bits(0, 2);     // weighted_bipred_idc
+        pps.Se(0);          // pic_init_qp_minus26
+        pps.Se(0);          // pic_init_qs_minus26
+        pps.Se(0);          // chroma_qp_index_offset
+        pps.Bit(0);         // deblocking_filter_control_present_flag
+        pps.Bit(0);         // constrained_intra_pred_flag
+        pps.Bit(0);         // redundant_pic_cnt_present_flag
+        pps.Trailing();
+        AppendNal(out, 3, nal_pps, pps.Bytes());
+
+        return out;
+    }
+
+    // moving gradient, samples stay in 16..235
+    std::vector<uint8_t> KeyFrame(int frame)
+    {
+        std::vector<uint8_t> out = Headers();
+
+        BitWriter slice;
+        slice.Ue(0);        // first_mb_in_slice
+        slice.Ue(7);        // slice_type I, all slices of picture
+        slice.Ue(0);        // pic_parameter_set_id
+        slice.Bits(0, log2_max_frame_num);
+        slice.Ue(idr_id++ & 0xffff);
+        slice.Bit(0);       // no_output_of_prior_pics_flag
+        slice.Bit(0);       // long_term_reference_flag
+        slice.Se(0);        // slice_qp_delta
+
+        for (int my = 0; my < mbs_high; ++my)
+        {
+            for (int mx = 0; mx < mbs_wide; ++mx)
+            {
+                slice.Ue(25);   // mb_type I_PCM
+                slice.AlignZero();
+                for (int y = 0; y < 16; ++y)
+                {
+                    for (int x = 0; x < 16; ++x)
+                        slice.Byte(static_cast<uint8_t>(16 + (mx * 16 + x + (my * 16 + y) * 2 + frame * 4) % 200));
+                }
+                for (int plane = 0; plane < 2; ++plane)
+                {
+                    for (int i = 0; i < 64; ++i)
+                        slice.Byte(static_cast<uint8_t>(64 + (mx * 4 + my * 8 + plane * 32 + frame) % 128));
+                }
+            }
+        }
+        slice.Trailing();
+        AppendNal(out, 3, nal_idr, slice.Bytes());
+        return out;
+    }
+
+    // repeats reference, padded with filler data to size when it is bigger
+    std::vector<uint8_t> Frame(int frame_num, size_t size) const
+    {
+        std::vector<uint8_t> out;
+
+        BitWriter slice;
+        slice.Ue(0);        // first_mb_in_slice
+        slice.Ue(5);        // slice_type P, all slices of picture
+        slice.Ue(0);        // pic_parameter_set_id
+        slice.Bits(frame_num % (1 << log2_max_frame_num), log2_max_frame_num);
+        slice.Bit(0);       // num_ref_idx_active_override_flag
+        slice.Bit(0);       // ref_pic_list_modification_flag_l0
+        slice.Bit(0);       // adaptive_ref_pic_marking_mode_flag
+        slice.Se(0);        // slice_qp_delta
+        slice.Ue(mbs_wide * mbs_high);  // mb_skip_run
+        slice.Trailing();
+        AppendNal(out, 2, nal_slice, slice.Bytes());
+
+        // start code, header and trailing byte
+        const size_t filler_overhead = 6;
+        if (size > out.size() + filler_overhead)
+        {
+            std::vector<uint8_t> filler(size - out.size() - filler_overhead, 0xff);
+            filler.push_back(0x80);
+            AppendNal(out, 0, nal_filler, filler);
+        }
+        return out;
+    }
+};
+
+class ClipWriter
+{
+    const SyntheticClipParams& params;
+
+    AVFormatContext* ctx = nullptr;
+    AVCodecContext* audio = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* packet = nullptr;
+    int64_t samples = 0;
+    char error_buff[512];
+
+public:
+    ClipWriter(const SyntheticClipParams& params) : params(params)
+    {
+        packet = av_packet_alloc();
+    }
+
+    ~ClipWriter()
+    {
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        avcodec_free_context(&audio);
+        if (ctx)
+        {
+            if (ctx->pb)
+                avio_closep(&ctx->pb);
+            avformat_free_context(ctx);
+        }
+    }
+
+    bool Write(const std::string& path)
+    {
+        if (params.width % 16 || params.height % 16 || params.fps <= 0 || params.gop_frames <= 0)
+        {
+            LOGE("Synthetic clip size must be multiple of 16 with positive fps and gop");
+            return false;
+        }
+
+        int ret;
+        if ((ret = avformat_alloc_output_context2(&ctx, nullptr, "mp4", path.c_str())) < 0)
+        {
+            LOGE("Cannot create synthetic clip " << ff_error(ret));
+            return false;
+        }
+
+        H264Writer h264(params.width, params.height);
+        if (!AddVideo(h264.Headers()) || !AddAudio())
+            return false;
+
+        if ((ret = avio_open(&ctx->pb, path.c_str(), AVIO_FLAG_WRITE)) < 0)
+        {
+            LOGE("Cannot open " << path << " " << ff_error(ret));
+            return false;
+        }
+
+        if ((ret = avformat_write_header(ctx, nullptr)) < 0)
+        {
+            LOGE("Cannot write synthetic clip header " << ff_error(ret));
+            return false;
+        }
+
+        // rate left for non key frames
+        size_t key_size = h264.KeyFrame(0).size();
+        double keys_per_second = static_cast<double>(params.fps) / params.gop_frames;
+        double frames_per_second = params.fps - keys_per_second;
+        double left = params.video_bitrate / 8.0 - key_size * keys_per_second;
+        size_t frame_size = left > 0 && frames_per_second > 0 ? static_cast<size_t>(left / frames_per_second) : 0;
+
+        int frames = params.duration_s * params.fps;
+        for (int i = 0; i < frames; ++i)
+        {
+            // audio up to the end of this video frame
+            while (samples * params.fps < static_cast<int64_t>(i + 1) * params.sample_rate)
+            {
+                if (!EncodeAudio(false))
+                    return false;
+            }
+
+            int in_gop = i % params.gop_frames;
+            std::vector<uint8_t> data = in_gop ? h264.Frame(in_gop, frame_size) : h264.KeyFrame(i);
+            if (!WriteVideo(data, i, !in_gop))
+                return false;
+        }
+
+        if (!EncodeAudio(true))
+            return false;
+
+        if ((ret = av_write_trailer(ctx)) < 0)
+        {
+            LOGE("Cannot write synthetic clip trailer " << ff_error(ret));
+            return false;
+        }
+
+        LOG("Synthetic clip " << path << " " << params.width << "x" << params.height << " " << params.duration_s
+            << "s key frame " << key_size << " bytes, other frames " << frame_size << " bytes");
+        return true;
+    }
+
+private:
+    const char* ff_error(int errcode)
+    {
+        error_buff[0] = 0;
+        av_strerror(errcode, error_buff, sizeof(error_buff));
+        return error_buff;
+    }
+
+    bool AddVideo(const std::vector<uint8_t>& headers)
+    {
+        AVStream* stream = avformat_new_stream(ctx, nullptr);
+        if (!stream)
+            return false;
+
+        AVCodecParameters* par = stream->codecpar;
+        par->codec_type = AVMEDIA_TYPE_VIDEO;
+        par->codec_id = AV_CODEC_ID_H264;
+        par->width = params.width;
+        par->height = params.height;
+        par->format = AV_PIX_FMT_YUV420P;
+        par->bit_rate = params.video_bitrate;
+
+        // annex b sps and pps, mp4 muxer converts them to avcC
+        par->extradata = static_cast<uint8_t*>(av_mallocz(headers.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        memcpy(par->extradata, headers.data(), headers.size());
+        par->extradata_size = static_cast<int>(headers.size());
+
+        stream->time_base = AVRational{1, params.fps};
+        return true;
+    }
+
+    bool AddAudio()
+    {
+        AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+        if (!codec)
+        {
+            LOGE("AAC encoder is not available");
+            return false;
+        }
+
+        audio = avcodec_alloc_context3(codec);
+        audio->sample_fmt = AV_SAMPLE_FMT_FLTP;
+        audio->sample_rate = params.sample_rate;
+        audio->channel_layout = params.channels == 1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO;
+        audio->channels = av_get_channel_layout_nb_channels(audio->channel_layout);
+        audio->bit_rate = params.audio_bitrate;
+        audio->time_base = AVRational{1, params.sample_rate};
+        if (ctx->oformat->flags & AVFMT_GLOBALHEADER)
+            audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+        int ret;
+        if ((ret = avcodec_open2(audio, codec, nullptr)) < 0)
+        {
+            LOGE("Cannot open AAC encoder " << ff_error(ret));
+            return false;
+        }
+
+        AVStream* stream = avformat_new_stream(ctx, nullptr);
+        if (!stream || avcodec_parameters_from_context(stream->codecpar, audio) < 0)
+            return false;
+        stream->time_base = audio->time_base;
+
+        frame = av_frame_alloc();
+        frame->format = audio->sample_fmt;
+        frame->channel_layout = audio->channel_layout;
+        frame->sample_rate = audio->sample_rate;
+        frame->nb_samples = audio->frame_size;
+        if (av_frame_get_buffer(frame, 0) < 0)
+            return false;
+
+        return true;
+    }
+
+    bool WriteVideo(const std::vector<uint8_t>& data, int index, bool key)
+    {
+        if (av_new_packet(packet, static_cast<int>(data.size())) < 0)
+            return false;
+
+        memcpy(packet->data, data.data(), data.size());
+        packet->pts = packet->dts = index;
+        packet->duration = 1;
+        packet->flags = key ? AV_PKT_FLAG_KEY : 0;
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, AVRational{1, params.fps}, ctx->streams[0]->time_base);
+
+        int ret = av_interleaved_write_frame(ctx, packet);
+        av_packet_unref(packet);
+        if (ret < 0)
+        {
+            LOGE("Cannot write synthetic video frame " << ff_error(ret));
+            return false;
+        }
+        return true;
+    }
+
+    // 440 Hz tone, flush drains encoder
+    bool EncodeAudio(bool flush)
+    {
+        int ret;
+        if (flush)
+            ret = avcodec_send_frame(audio, nullptr);
+        else
+        {
+            if (av_frame_make_writable(frame) < 0)
+                return false;
+
+            for (int c = 0; c < audio->channels; ++c)
+            {
+                float* data = reinterpret_cast<float*>(frame->data[c]);
+                for (int i = 0; i < frame->nb_samples; ++i)
+                    data[i] = 0.2f * static_cast<float>(std::sin(2 * M_PI * 440 * (samples + i) / params.sample_rate));
+            }
+            frame->pts = samples;
+            samples += frame->nb_samples;
+            ret = avcodec_send_frame(audio, frame);
+        }
+
+        if (ret < 0)
+        {
+            LOGE("Cannot encode synthetic audio " << ff_error(ret));
+            return false;
+        }
+
+        while ((ret = avcodec_receive_packet(audio, packet)) == 0)
+        {
+            packet->stream_index = 1;
+            av_packet_rescale_ts(packet, audio->time_base, ctx->streams[1]->time_base);
+            if ((ret = av_interleaved_write_frame(ctx, packet)) < 0)
+            {
+                LOGE("Cannot write synthetic audio frame " << ff_error(ret));
+                return false;
+            }
+        }
+
+        return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+    }
+};
+
+}
+
+bool WriteSyntheticClip(const SyntheticClipParams& params, const std::string& path)
+{
+    ClipWriter writer(params);
+    return writer.Write(path);
+}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+namespace Bench
+{
+
+struct SyntheticClipParams
+{
+    // multiples of 16
+    int width = 320;
+    int height = 192;
+    int fps = 25;
+    int gop_frames = 50;
+    int duration_s = 10;
+    // key frames are I_PCM, non key frames are padded with filler data to
+    // reach the rate, the rate is not reached when key frames alone exceed it
+    int video_bitrate = 1000000;
+    int sample_rate = 48000;
+    int channels = 2;
+    int audio_bitrate = 128000;
+};
+
+// Writes mp4 with H.264 baseline video built bit by bit, so no H.264 encoder
+// is needed, and AAC of a sine tone by the native ffmpeg encoder.
+bool WriteSyntheticClip(const SyntheticClipParams& params, const std::string& path);
+
+}
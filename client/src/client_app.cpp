@@ -7,6 +7,7 @@
 #include "common/appimpl.h"
 
 #include "sender.h"
+#include "load_generator.h"
 
 namespace Client
 {
@@ -15,7 +16,10 @@ void ClientParams::Dump()
 {
     LOG("Params: " << "server_addr: "<< server_addr << std::endl
     << "server_port: "<< server_port << std::endl
-    << "file: "<< url << std::endl);
+    << "file: "<< url << std::endl
+    << "speed: "<< speed << std::endl
+    << "drop rate: "<< drop_rate << std::endl
+    << "fec group: "<< fec_group << std::endl);
 }
 
 class ClientApplication
@@ -41,7 +45,10 @@ public:
     {
         params.Dump();
 
-        sender = CreateSender(params, shared_from_this());
+        if (params.mode == ClientParams::load_mode)
+            sender = CreateLoadGenerator(params, shared_from_this());
+        else
+            sender = CreateSender(params, shared_from_this());
 
         sender->Initialize();
     }
@@ -113,6 +120,70 @@ int RunClientApplication(int argc, char* argv[])
                 params.server_port = atoi(argv[++i]);
             }
         }
+        else if (!strcmp(argv[i],"-senders"))
+        {
+            if (i+1==argc)
+            {
+                std::cerr << "unknown senders count" << std::endl;
+                return 1;
+            }
+            else
+            {
+                params.senders = atoi(argv[++i]);
+            }
+        }
+        else if (!strcmp(argv[i],"-threads"))
+        {
+            if (i+1==argc)
+            {
+                std::cerr << "unknown threads count" << std::endl;
+                return 1;
+            }
+            else
+            {
+                params.load_threads = atoi(argv[++i]);
+            }
+        }
+        else if (!strcmp(argv[i],"-loop"))
+        {
+            params.loop = true;
+        }
+        else if (!strcmp(argv[i],"-speed"))
+        {
+            if (i+1==argc)
+            {
+                std::cerr << "unknown speed" << std::endl;
+                return 1;
+            }
+            else
+            {
+                params.speed = atof(argv[++i]);
+            }
+        }
+        else if (!strcmp(argv[i],"-drop"))
+        {
+            if (i+1==argc)
+            {
+                std::cerr << "unknown drop rate" << std::endl;
+                return 1;
+            }
+            else
+            {
+                params.drop_rate = atof(argv[++i]);
+            }
+        }
+        else if (!strcmp(argv[i],"-fec"))
+        {
+            if (i+1==argc)
+            {
+                std::cerr << "unknown fec group" << std::endl;
+                return 1;
+            }
+            else
+            {
+                params.fec_group = atoi(argv[++i]);
+            }
+        }
         else
         {
             params.url = argv[i];
@@ -14,12 +14,29 @@ struct ClientParams
         server_mode = 0,
         single_mode = 1,
         file_mode = 2,
+        load_mode = 3,
     };
 
     std::string server_addr = "127.0.0.1";
     int server_port = 8080;
     std::string url;
     int mode = server_mode;
+    // pacing by packet timestamps: 1 - real time, 0 - as fast as possible
+    double speed = 1.0;
+    // share of rtp datagrams dropped instead of sent, retransmissions too,
+    // to measure recovery by nacks
+    double drop_rate = 0;
+    // xor parity packet after every fec_group rtp packets of a stream, 0 - off
+    unsigned fec_group = 0;
+
+    // load_mode
+    unsigned senders = 100;
+    // 0 - one per core
+    unsigned load_threads = 4;
+    // restart file at the end with continuous timestamps
+    bool loop = false;
+    // delay between starts of senders
+    unsigned ramp_interval_ms = 10;
 
     void Dump();
 };
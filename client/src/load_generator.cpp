@@ -0,0 +1,946 @@
+#include "load_generator.h"
+#include "common/common.h"
+#include "common/fec.h"
+#include "common/messages.h"
+#include "common/sdp.hpp"
+
+#include "client_app.h"
+#include "packet_cache.h"
+#include "pacer.h"
+
+#include <atomic>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+using boost::asio::ip::tcp;
+
+namespace Client
+{
+
+namespace
+{
+
+constexpr int rtp_packet_size = 1472;
+// queued requests, e.g. CLOSE_STREAM of stopped senders, are written
+// before the socket is closed unless the server stops reading
+constexpr unsigned close_timeout_ms = 1000;
+
+struct LoadStats
+{
+    unsigned started = 0;
+    unsigned failed = 0;
+    uint64_t packets = 0;
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t send_errors = 0;
+    uint64_t loops = 0;
+    // busy replies of server
+    uint64_t busy = 0;
+    // rtp datagrams dropped by loss injection
+    uint64_t dropped = 0;
+    PacingStats pacing;
+};
+
+// Control connection of one worker shared by its senders. Requests are
+// pipelined, replies and server events are dispatched by request id.
+class ControlConnection : public std::enable_shared_from_this<ControlConnection>
+        , public Common::ObjectCounter<ControlConnection>
+{
+public:
+    // null frame when connection is lost
+    typedef std::function<void(const Common::Messages::Frame*)> Callback;
+
+private:
+    boost::asio::io_service& io;
+    tcp::socket socket;
+    const tcp::endpoint endpoint;
+    boost::asio::steady_timer close_timer;
+
+    bool connecting = false;
+    bool connected = false;
+    bool failed = false;
+    bool closing = false;
+    std::function<void()> on_closed;
+
+    Common::Messages::FrameParser parser;
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> writing;
+
+    uint32_t next_id = 1;
+    // waiting for reply
+    std::map<uint32_t, Callback> pending;
+    // opened streams waiting for STREAM_CLOSED
+    std::map<uint32_t, Callback> watched;
+
+public:
+    ControlConnection(boost::asio::io_service& io, const tcp::endpoint& endpoint)
+        : io(io), socket(io), endpoint(endpoint), close_timer(io)
+    {
+    }
+
+    // worker thread, connects on first request
+    uint32_t Request(uint8_t type, const void* payload, size_t size, const Callback& on_reply)
+    {
+        uint32_t request_id = next_id++;
+
+        if (failed || closing)
+        {
+            if (on_reply)
+                io.post([on_reply]() { on_reply(nullptr); });
+            return request_id;
+        }
+
+        Common::Messages::append_frame(out, type, request_id, payload, size);
+        if (on_reply)
+            pending[request_id] = on_reply;
+
+        if (!connected)
+            Connect();
+        else
+            Flush();
+
+        return request_id;
+    }
+
+    void Watch(uint32_t request_id, const Callback& on_closed)
+    {
+        watched[request_id] = on_closed;
+    }
+
+    void Forget(uint32_t request_id)
+    {
+        pending.erase(request_id);
+        watched.erase(request_id);
+    }
+
+    // on_closed runs on worker thread once queued requests are written
+    void Close(const std::function<void()>& on_closed)
+    {
+        closing = true;
+        this->on_closed = on_closed;
+        pending.clear();
+        watched.clear();
+
+        if (!connected || failed || (writing.empty() && out.empty()))
+        {
+            Shutdown();
+            return;
+        }
+
+        auto self(shared_from_this());
+        close_timer.expires_from_now(std::chrono::milliseconds(close_timeout_ms));
+        close_timer.async_wait([this, self](const boost::system::error_code& ec)
+        {
+            if (ec)
+                return;
+
+            LOGW("Control connection is not drained in " << close_timeout_ms << "ms, close");
+            Shutdown();
+        });
+        Flush();
+    }
+
+private:
+    void Connect()
+    {
+        if (connecting)
+            return;
+
+        connecting = true;
+        auto self(shared_from_this());
+        socket.async_connect(endpoint, [this, self](const boost::system::error_code& ec)
+        {
+            connecting = false;
+            if (ec)
+                return Fail("connect", ec);
+
+            boost::system::error_code opt_ec;
+            socket.set_option(tcp::no_delay(true), opt_ec);
+            connected = true;
+            Flush();
+            Read();
+        });
+    }
+
+    void Flush()
+    {
+        if (!connected || failed || !writing.empty())
+            return;
+
+        if (out.empty())
+        {
+            if (closing)
+                Shutdown();
+            return;
+        }
+
+        writing.swap(out);
+        auto self(shared_from_this());
+        boost::asio::async_write(socket, boost::asio::buffer(writing), [this, self](const boost::system::error_code& ec, size_t)
+        {
+            if (ec)
+                return Fail("write", ec);
+
+            writing.clear();
+            Flush();
+        });
+    }
+
+    void Read()
+    {
+        size_t size = 0;
+        uint8_t* data = parser.Prepare(Common::Messages::frame_header_size, size);
+
+        auto self(shared_from_this());
+        socket.async_read_some(boost::asio::buffer(data, size), [this, self](const boost::system::error_code& ec, size_t bytes)
+        {
+            if (ec)
+                return Fail("read", ec);
+
+            parser.Commit(bytes);
+
+            Common::Messages::Frame frame;
+            while (!failed && parser.Next(frame))
+                Dispatch(frame);
+
+            if (parser.Error())
+                return Fail("parse", boost::asio::error::invalid_argument);
+
+            if (!failed)
+                Read();
+        });
+    }
+
+    void Dispatch(const Common::Messages::Frame& frame)
+    {
+        auto& callbacks = frame.type == Common::Messages::REPLY ? pending : watched;
+        auto it = callbacks.find(frame.request_id);
+        if (it == callbacks.end())
+            return;
+
+        Callback callback = std::move(it->second);
+        callbacks.erase(it);
+        callback(&frame);
+    }
+
+    void Fail(const char* what, const boost::system::error_code& ec)
+    {
+        if (failed)
+            return;
+
+        LOGW("Control connection " << what << " failed " << ec.message());
+        failed = true;
+        boost::system::error_code close_ec;
+        socket.close(close_ec);
+
+        auto callbacks = std::move(pending);
+        callbacks.insert(watched.begin(), watched.end());
+        pending.clear();
+        watched.clear();
+
+        for (auto& item : callbacks)
+            item.second(nullptr);
+
+        if (closing)
+            Shutdown();
+    }
+
+    void Shutdown()
+    {
+        failed = true;
+        close_timer.cancel();
+        boost::system::error_code ec;
+        socket.close(ec);
+
+        auto callback = std::move(on_closed);
+        on_closed = nullptr;
+        if (callback)
+            callback();
+    }
+};
+
+DECLARE_PTR(ControlConnection)
+
+// Event loop thread with one UDP socket and one control connection shared by
+// all its senders.
+class LoadWorker : public Common::ObjectCounter<LoadWorker>
+{
+    const unsigned index;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::thread thread;
+
+public:
+    boost::asio::io_service io;
+    int udp_fd = -1;
+    ControlConnectionPtr control;
+
+    LoadWorker(unsigned index, const tcp::endpoint& server) : index(index)
+    {
+        control = std::make_shared<ControlConnection>(io, server);
+
+        udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (udp_fd < 0)
+        {
+            LOGE("Cannot create udp socket " << strerror(errno));
+            return;
+        }
+
+        int size = 4 * 1024 * 1024;
+        setsockopt(udp_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    ~LoadWorker()
+    {
+        Join();
+        if (udp_fd >= 0)
+            close(udp_fd);
+    }
+
+    void Start()
+    {
+        work.reset(new boost::asio::io_service::work(io));
+        thread = std::thread([this]()
+        {
+            Common::register_current_thread("load" + std::to_string(index));
+            TRY
+            {
+                io.run();
+            }
+            CATCH_ERR("Load worker error: ");
+        });
+    }
+
+    // runs f on worker thread and waits for it
+    void Call(const std::function<void()>& f)
+    {
+        std::promise<void> done;
+        io.post([&]()
+        {
+            f();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    void Join()
+    {
+        work.reset();
+        io.stop();
+        if (thread.joinable())
+            thread.join();
+    }
+};
+
+// One emulated camera: stream on the control connection of its worker, RTP
+// muxers writing to the shared socket of the worker, packets scheduled by timer.
+class VirtualSender : public std::enable_shared_from_this<VirtualSender>
+        , public Common::ObjectCounter<VirtualSender>
+{
+    // packets sent in one turn when not paced, other senders of the worker run between turns
+    static constexpr unsigned burst = 32;
+
+    enum indexes
+    {
+        video_idx = IPacketCache::video_idx,
+        audio_idx = IPacketCache::audio_idx,
+        streams_count = IPacketCache::streams_count,
+    };
+
+    struct RtpOutput
+    {
+        VirtualSender* owner = nullptr;
+        sockaddr_in rtp = {};
+        sockaddr_in rtcp = {};
+        std::unique_ptr<Common::Fec::Encoder> fec;
+    };
+
+    LoadWorker& worker;
+    const ClientParams& params;
+    const int id;
+    const std::function<void(VirtualSender*, bool)> on_stopped;
+    Common::Histogram& setup_latency;
+
+    boost::asio::steady_timer timer;
+    // OPEN_STREAM request id, 0 before request
+    uint32_t stream_id = 0;
+    std::string sdp;
+    bool opened = false;
+
+    IPacketCachePtr cache;
+    // next packet in cache
+    size_t position = 0;
+    // added to cache timestamps, grows by file duration every loop
+    int64_t loop_offset_us = 0;
+
+    AVFormatContext* output_fmts[streams_count] = {};
+    RtpOutput outputs[streams_count];
+
+    AVPacket* packet = nullptr;
+    bool pending = false;
+    int64_t pending_due = 0;
+    // first OPEN_STREAM request, busy retries are part of setup
+    std::chrono::steady_clock::time_point setup_start;
+
+    Pacer pacer;
+    std::minstd_rand drop_random;
+    std::bernoulli_distribution drop;
+
+    bool stopped = false;
+    char error_buff[512];
+
+public:
+    LoadStats stats;
+
+    VirtualSender(LoadWorker& worker, const ClientParams& params, int id, const std::function<void(VirtualSender*, bool)>& on_stopped,
+                  Common::Histogram& setup_latency)
+        : worker(worker), params(params), id(id), on_stopped(on_stopped), setup_latency(setup_latency)
+        , timer(worker.io), pacer(params.speed), drop_random(id + 1), drop(params.drop_rate)
+    {
+        packet = av_packet_alloc();
+    }
+
+    ~VirtualSender()
+    {
+        Close();
+        av_packet_free(&packet);
+    }
+
+    // worker thread
+    void Start(unsigned delay_ms)
+    {
+        auto self(shared_from_this());
+        timer.expires_from_now(std::chrono::milliseconds(delay_ms));
+        timer.async_wait([this, self](const boost::system::error_code& ec)
+        {
+            if (ec || stopped)
+                return;
+
+            if (!OpenInput())
+            {
+                Finish(true);
+                return;
+            }
+
+            OpenStream();
+        });
+    }
+
+    // worker thread
+    void Stop()
+    {
+        if (stopped)
+            return;
+
+        stopped = true;
+        stats.pacing = pacer.Stats();
+        timer.cancel();
+
+        if (stream_id)
+        {
+            worker.control->Forget(stream_id);
+            if (opened)
+            {
+                std::vector<uint8_t> payload;
+                Common::Messages::put_be32(payload, stream_id);
+                worker.control->Request(Common::Messages::CLOSE_STREAM, payload.data(), payload.size(), nullptr);
+            }
+        }
+    }
+
+private:
+    const char* ff_error(int errcode)
+    {
+        error_buff[0] = 0;
+        av_strerror(errcode, error_buff, sizeof(error_buff));
+        return error_buff;
+    }
+
+    void Finish(bool failed)
+    {
+        if (stopped)
+            return;
+
+        Stop();
+        on_stopped(this, failed);
+    }
+
+    void Close()
+    {
+        for (auto& ctx : output_fmts)
+        {
+            if (!ctx)
+                continue;
+
+            if (ctx->pb)
+            {
+                av_freep(&ctx->pb->buffer);
+                avio_context_free(&ctx->pb);
+            }
+            avformat_free_context(ctx);
+            ctx = nullptr;
+        }
+    }
+
+    bool OpenInput()
+    {
+        cache = GetPacketCache(params.url);
+        if (!cache)
+            LOGE("Sender " << id << " cannot load " << params.url);
+        return cache != nullptr;
+    }
+
+    // ports in sdp are ignored by server, real ones come in reply
+    void OpenStream()
+    {
+        if (!CreateOutput(video_idx) || !CreateOutput(audio_idx))
+        {
+            Finish(true);
+            return;
+        }
+
+        char buffer[2000];
+        av_sdp_create(output_fmts, streams_count, buffer, sizeof(buffer));
+        sdp = Common::Sdp::add_ssrcs(buffer, {Ssrc(video_idx), Ssrc(audio_idx)});
+
+        setup_start = std::chrono::steady_clock::now();
+        RequestStream();
+    }
+
+    void RequestStream()
+    {
+        auto self(shared_from_this());
+        stream_id = worker.control->Request(Common::Messages::OPEN_STREAM, sdp.data(), sdp.size(), [this, self](const Common::Messages::Frame* frame)
+        {
+            OnOpened(frame);
+        });
+    }
+
+    void RetryStream(unsigned delay_ms)
+    {
+        ++stats.busy;
+
+        auto self(shared_from_this());
+        timer.expires_from_now(std::chrono::milliseconds(delay_ms));
+        timer.async_wait([this, self](const boost::system::error_code& ec)
+        {
+            if (!ec && !stopped)
+                RequestStream();
+        });
+    }
+
+    void OnOpened(const Common::Messages::Frame* frame)
+    {
+        if (stopped)
+            return;
+
+        if (!frame)
+        {
+            LOGW("Sender " << id << " lost control connection");
+            Finish(true);
+            return;
+        }
+
+        if (frame->size >= 5 && frame->payload[0] == Common::Messages::BUSY)
+        {
+            RetryStream(Common::Messages::get_be32(frame->payload + 1));
+            return;
+        }
+
+        if (frame->size < 5 || frame->payload[0] != Common::Messages::OK)
+        {
+            if (frame->size && frame->payload[0] == Common::Messages::NO_PORTS)
+                LOGW("Sender " << id << " server has no free ports");
+            else
+                LOGW("Sender " << id << " rejected by server");
+            Finish(true);
+            return;
+        }
+
+        opened = true;
+
+        auto self(shared_from_this());
+        worker.control->Watch(stream_id, [this, self](const Common::Messages::Frame* frame)
+        {
+            if (!stopped)
+                LOGW("Sender " << id << (frame ? " stream closed by server" : " lost control connection"));
+            opened = false;
+            Finish(true);
+        });
+
+        uint16_t port1 = Common::Messages::get_be16(frame->payload + 1);
+        uint16_t port2 = Common::Messages::get_be16(frame->payload + 3);
+
+        if (!StartOutput(video_idx, port1) || !StartOutput(audio_idx, port2))
+        {
+            Finish(true);
+            return;
+        }
+
+        ++stats.started;
+        setup_latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - setup_start).count());
+        Send();
+    }
+
+    static int WritePacket(void* opaque, uint8_t* buf, int buf_size)
+    {
+        auto output = static_cast<RtpOutput*>(opaque);
+        return output->owner->SendDatagram(*output, buf, buf_size);
+    }
+
+    int SendDatagram(const RtpOutput& output, const uint8_t* buf, int size)
+    {
+        // rtp muxer writes RTCP sender reports to the same context
+        bool rtcp = size >= 2 && buf[1] >= 200 && buf[1] <= 204;
+        Send(output, rtcp, buf, size);
+
+        if (!rtcp && output.fec && output.fec->Add(buf, size))
+            Send(output, false, output.fec->Parity().data(), output.fec->Parity().size());
+
+        // losses are not muxer errors
+        return size;
+    }
+
+    void Send(const RtpOutput& output, bool rtcp, const uint8_t* buf, size_t size)
+    {
+        const sockaddr_in& addr = rtcp ? output.rtcp : output.rtp;
+
+        // no retransmission here, senders share the socket nacks come to
+        if (!rtcp && params.drop_rate > 0 && drop(drop_random))
+            ++stats.dropped;
+        else if (sendto(worker.udp_fd, buf, size, 0, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0)
+            ++stats.send_errors;
+        else
+        {
+            ++stats.datagrams;
+            stats.bytes += size;
+        }
+    }
+
+    bool CreateOutput(int idx)
+    {
+        int ret;
+        std::string url = "rtp://" + params.server_addr + ":0";
+
+        AVFormatContext*& ctx = output_fmts[idx];
+        AVOutputFormat* oformat = av_guess_format("rtp", nullptr, nullptr);
+
+        if ((ret = avformat_alloc_output_context2(&ctx, oformat, nullptr, url.c_str())) < 0)
+        {
+            LOGE("Sender " << id << " cannot open output stream " << ff_error(ret));
+            return false;
+        }
+
+        AVStream* out_stream = avformat_new_stream(ctx, nullptr);
+        if (!out_stream || avcodec_parameters_copy(out_stream->codecpar, cache->Stream(idx).codecpar) < 0)
+        {
+            LOGE("Sender " << id << " cannot copy codec parameters");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool StartOutput(int idx, uint16_t port)
+    {
+        int ret;
+        AVFormatContext* ctx = output_fmts[idx];
+
+        RtpOutput& output = outputs[idx];
+        output.owner = this;
+        output.rtp.sin_family = AF_INET;
+        output.rtp.sin_port = htons(port);
+        inet_pton(AF_INET, params.server_addr.c_str(), &output.rtp.sin_addr);
+        output.rtcp = output.rtp;
+        output.rtcp.sin_port = htons(port + 1);
+        if (params.fec_group)
+            output.fec.reset(new Common::Fec::Encoder(params.fec_group));
+
+        uint8_t* buffer = static_cast<uint8_t*>(av_malloc(rtp_packet_size));
+        ctx->pb = avio_alloc_context(buffer, rtp_packet_size, 1, &output, nullptr, &VirtualSender::WritePacket, nullptr);
+        if (!ctx->pb)
+        {
+            av_free(buffer);
+            return false;
+        }
+        // one RTP packet per write
+        ctx->pb->max_packet_size = rtp_packet_size;
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        // distinct SSRC for every stream of every sender
+        AVDictionary* opts = nullptr;
+        av_dict_set_int(&opts, "ssrc", static_cast<int32_t>(Ssrc(idx)), 0);
+
+        ret = avformat_write_header(ctx, &opts);
+        av_dict_free(&opts);
+        if (ret < 0)
+        {
+            LOGE("Sender " << id << " cannot write rtp header " << ff_error(ret));
+            return false;
+        }
+
+        return true;
+    }
+
+    uint32_t Ssrc(int idx) const
+    {
+        // streams of a sender differ only in bit 0, server steers them to one worker
+        static const uint32_t base = std::random_device()() & ~1u;
+        return base + id * streams_count + idx;
+    }
+
+    // wraps to the start of cache in loop mode
+    bool NextPacket()
+    {
+        if (position < cache->Packets().size())
+            return true;
+
+        if (!params.loop)
+            return false;
+
+        // next loop continues timeline after the end of the last packet
+        position = 0;
+        loop_offset_us += cache->DurationUs();
+        ++stats.loops;
+        return true;
+    }
+
+    void Write()
+    {
+        pending = false;
+        pacer.Sent(pending_due);
+
+        const CachedPacket& cached = cache->Packets()[position++];
+        const CachedStream& stream = cache->Stream(cached.stream);
+        AVRational tb = {stream.time_base_num, stream.time_base_den};
+        int64_t offset = av_rescale_q(loop_offset_us, AVRational{1, AV_TIME_BASE}, tb);
+
+        // payload stays in cache, muxer does not keep the packet
+        packet->data = const_cast<uint8_t*>(cache->Data(cached));
+        packet->size = cached.size;
+        packet->pts = cached.pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : cached.pts + offset;
+        packet->dts = cached.dts + offset;
+        packet->duration = cached.duration;
+        packet->flags = cached.key ? AV_PKT_FLAG_KEY : 0;
+        packet->pos = -1;
+        packet->stream_index = 0;
+
+        AVFormatContext* ctx = output_fmts[cached.stream];
+        av_packet_rescale_ts(packet, tb, ctx->streams[0]->time_base);
+
+        int ret;
+        if ((ret = av_write_frame(ctx, packet)) < 0)
+            LOGW_FMT("Sender {} write frame error {}", id, ff_error(ret));
+
+        ++stats.packets;
+        av_packet_unref(packet);
+    }
+
+    // sends due packets and arms timer for the next one
+    void Send()
+    {
+        if (stopped)
+            return;
+
+        for (unsigned i = 0; i < burst; ++i)
+        {
+            if (!pending)
+            {
+                if (!NextPacket())
+                {
+                    Finish(false);
+                    return;
+                }
+
+                pending = true;
+                pending_due = pacer.Schedule(loop_offset_us + cache->Packets()[position].time_us);
+            }
+
+            if (pending_due > Pacer::Now())
+            {
+                auto self(shared_from_this());
+                timer.expires_at(std::chrono::steady_clock::time_point(std::chrono::microseconds(pending_due)));
+                timer.async_wait([this, self](const boost::system::error_code& ec)
+                {
+                    if (!ec)
+                        Send();
+                });
+                return;
+            }
+
+            Write();
+        }
+
+        auto self(shared_from_this());
+        worker.io.post([this, self]() { Send(); });
+    }
+};
+
+DECLARE_PTR(VirtualSender)
+
+class LoadGenerator : public ILoadGenerator
+        , public std::enable_shared_from_this<LoadGenerator>
+        , public Common::ObjectCounter<LoadGenerator>
+{
+    const ClientParams params;
+    const ISenderEventsPtr handler;
+
+    std::vector<std::unique_ptr<LoadWorker>> workers;
+    // senders of worker i are at i, i + workers.size(), ...
+    std::vector<VirtualSenderPtr> senders;
+
+    std::atomic<unsigned> stopped{0};
+    mutable std::mutex mx;
+    LoadStats total;
+    const Common::HistogramPtr setup_latency;
+
+public:
+    LoadGenerator(const ClientParams& params, const ISenderEventsPtr& handler)
+        : params(params), handler(handler), setup_latency(std::make_shared<Common::Histogram>())
+    {
+    }
+
+    ~LoadGenerator()
+    {
+        LOG("LoadGenerator DESTROY " << this);
+    }
+
+    void Initialize() override
+    {
+        av_register_all();
+        avformat_network_init();
+
+        unsigned threads = params.load_threads ? params.load_threads : std::max(1u, std::thread::hardware_concurrency());
+        tcp::endpoint server(boost::asio::ip::address::from_string(params.server_addr), params.server_port);
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back(new LoadWorker(i, server));
+
+        for (unsigned i = 0; i < params.senders; ++i)
+        {
+            LoadWorker& worker = *workers[i % workers.size()];
+            senders.push_back(std::make_shared<VirtualSender>(worker, params, i, [this](VirtualSender* sender, bool failed)
+            {
+                OnSenderStopped(sender, failed);
+            }, *setup_latency));
+        }
+
+        for (size_t i = 0; i < senders.size(); ++i)
+        {
+            auto sender = senders[i];
+            unsigned delay = static_cast<unsigned>(i) * params.ramp_interval_ms;
+            workers[i % workers.size()]->io.post([sender, delay]() { sender->Start(delay); });
+        }
+
+        for (auto& worker : workers)
+            worker->Start();
+
+        LOG("Load generator started " << senders.size() << " senders on " << workers.size() << " threads");
+    }
+
+    void Uninitialize() override
+    {
+        // CLOSE_STREAM of every sender reaches the server before the loops
+        // stop, otherwise its streams run until the receiver timeout
+        std::vector<std::future<void>> closed;
+        for (size_t w = 0; w < workers.size(); ++w)
+        {
+            auto done = std::make_shared<std::promise<void>>();
+            closed.push_back(done->get_future());
+            workers[w]->Call([this, w, done]()
+            {
+                for (size_t i = w; i < senders.size(); i += workers.size())
+                    senders[i]->Stop();
+                workers[w]->control->Close([done]() { done->set_value(); });
+            });
+        }
+
+        for (auto& future : closed)
+            future.wait();
+
+        for (auto& worker : workers)
+            worker->Join();
+
+        for (auto& sender : senders)
+            Add(sender->stats);
+        senders.clear();
+        workers.clear();
+
+        LOG("Load generator finished: started " << total.started << "/" << params.senders
+            << " failed " << total.failed << " packets " << total.packets
+            << " datagrams " << total.datagrams << " bytes " << total.bytes
+            << " send errors " << total.send_errors << " loops " << total.loops << " busy " << total.busy
+            << " dropped " << total.dropped);
+        LOG("Load generator pacing: packets " << total.pacing.packets << " waited " << total.pacing.waited
+            << " late " << total.pacing.late << " max error " << total.pacing.max_error_us
+            << "us mean abs error " << total.pacing.mean_abs_error_us << "us");
+        LOG("Load generator setup latency us " << setup_latency->Summary(1e3));
+    }
+
+    LoadReport Report() const override
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        LoadReport report;
+        report.senders = params.senders;
+        report.started = total.started;
+        report.failed = total.failed;
+        report.packets = total.packets;
+        report.datagrams = total.datagrams;
+        report.bytes = total.bytes;
+        report.send_errors = total.send_errors;
+        report.busy = total.busy;
+        report.setup_latency = setup_latency;
+        return report;
+    }
+
+private:
+    void Add(const LoadStats& stats)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        total.started += stats.started;
+        total.failed += stats.failed;
+        total.packets += stats.packets;
+        total.datagrams += stats.datagrams;
+        total.bytes += stats.bytes;
+        total.send_errors += stats.send_errors;
+        total.loops += stats.loops;
+        total.busy += stats.busy;
+        total.dropped += stats.dropped;
+        Pacer::Merge(total.pacing, stats.pacing);
+    }
+
+    // worker thread
+    void OnSenderStopped(VirtualSender* sender, bool failed)
+    {
+        // stats are summed at Uninitialize
+        if (failed)
+            ++sender->stats.failed;
+
+        if (++stopped == params.senders)
+            handler->OnSenderStopped(shared_from_this());
+    }
+};
+
+}
+
+ILoadGeneratorPtr CreateLoadGenerator(const ClientParams& params, const ISenderEventsPtr& handler)
+{
+    return std::make_shared<LoadGenerator>(params, handler);
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "sender.h"
+
+#include "common/histogram.h"
+
+#include <cstdint>
+
+namespace Client
+{
+
+struct LoadReport
+{
+    unsigned senders = 0;
+    unsigned started = 0;
+    unsigned failed = 0;
+    uint64_t packets = 0;
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t send_errors = 0;
+    uint64_t busy = 0;
+    // first OPEN_STREAM request to OK reply of every started sender, ns
+    Common::HistogramPtr setup_latency;
+};
+
+struct ILoadGenerator : public ISender
+{
+    // totals of all senders, complete after Uninitialize
+    virtual LoadReport Report() const = 0;
+};
+
+DECLARE_PTR_S(ILoadGenerator)
+
+// ClientParams::load_mode: params.senders virtual senders of params.url on
+// params.load_threads event loops. Reports stopped when all senders are done.
+ILoadGeneratorPtr CreateLoadGenerator(const ClientParams& params, const ISenderEventsPtr& handler);
+
+}
@@ -0,0 +1,104 @@
+#include "pacer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include <time.h>
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+namespace Client
+{
+
+Pacer::Pacer(double speed)
+    : speed(speed > 0 ? speed : 0)
+{
+}
+
+int64_t Pacer::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t Pacer::Schedule(int64_t media_us)
+{
+    ++stats.packets;
+
+    if (!speed || media_us == AV_NOPTS_VALUE)
+        return 0;
+
+    int64_t now = Now();
+    scheduled_at = now;
+
+    if (!anchored || std::llabs(media_us - last_media_us) > resync_threshold_us)
+    {
+        if (anchored)
+            ++stats.resyncs;
+
+        anchored = true;
+        anchor_clock_us = now;
+        anchor_media_us = media_us;
+    }
+
+    last_media_us = media_us;
+
+    // 0 is reserved for not paced
+    return std::max<int64_t>(1, anchor_clock_us + static_cast<int64_t>((media_us - anchor_media_us) / speed));
+}
+
+void Pacer::Sent(int64_t due)
+{
+    if (!due)
+        return;
+
+    if (due > scheduled_at)
+        ++stats.waited;
+
+    int64_t error = Now() - due;
+    if (error > late_threshold_us)
+        ++stats.late;
+    if (error > stats.max_error_us)
+        stats.max_error_us = error;
+    total_abs_error_us += std::llabs(error);
+}
+
+PacingStats Pacer::Stats() const
+{
+    PacingStats result = stats;
+    if (stats.packets)
+        result.mean_abs_error_us = total_abs_error_us / static_cast<int64_t>(stats.packets);
+    return result;
+}
+
+void Pacer::Merge(PacingStats& total, const PacingStats& stats)
+{
+    int64_t packets = static_cast<int64_t>(total.packets + stats.packets);
+    if (packets)
+        total.mean_abs_error_us = (total.mean_abs_error_us * static_cast<int64_t>(total.packets)
+                                   + stats.mean_abs_error_us * static_cast<int64_t>(stats.packets)) / packets;
+
+    total.packets += stats.packets;
+    total.waited += stats.waited;
+    total.late += stats.late;
+    total.resyncs += stats.resyncs;
+    total.max_error_us = std::max(total.max_error_us, stats.max_error_us);
+}
+
+std::string Pacer::Dump() const
+{
+    PacingStats result = Stats();
+
+    std::ostringstream sstr;
+    sstr << "speed " << speed << " packets " << result.packets << " waited " << result.waited
+         << " late " << result.late << " resyncs " << result.resyncs
+         << " max error " << result.max_error_us << "us mean abs error " << result.mean_abs_error_us << "us";
+    return sstr.str();
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace Client
+{
+
+struct PacingStats
+{
+    uint64_t packets = 0;
+    // packets which had to wait for their time
+    uint64_t waited = 0;
+    // sent later than scheduled by more than late_threshold_us
+    uint64_t late = 0;
+    // timeline restarts on timestamp jumps
+    uint64_t resyncs = 0;
+    // sent time minus scheduled time
+    int64_t max_error_us = 0;
+    int64_t mean_abs_error_us = 0;
+};
+
+// Schedules packets by media timestamp against the monotonic clock.
+class Pacer
+{
+    static constexpr int64_t late_threshold_us = 1000;
+    // timestamp jump which restarts the timeline
+    static constexpr int64_t resync_threshold_us = 10 * 1000 * 1000;
+
+    const double speed;
+
+    bool anchored = false;
+    int64_t anchor_clock_us = 0;
+    int64_t anchor_media_us = 0;
+    int64_t last_media_us = 0;
+
+    // clock of the last Schedule
+    int64_t scheduled_at = 0;
+
+    PacingStats stats;
+    int64_t total_abs_error_us = 0;
+
+public:
+    // 1 - real time, 2 - twice faster, 0 - as fast as possible
+    explicit Pacer(double speed);
+
+    // monotonic due time of packet in microseconds, 0 - send now, e.g. for
+    // AV_NOPTS_VALUE; Sent is called when the packet is written
+    int64_t Schedule(int64_t media_us);
+    void Sent(int64_t due);
+
+    PacingStats Stats() const;
+    // sums stats of several pacers
+    static void Merge(PacingStats& total, const PacingStats& stats);
+    std::string Dump() const;
+
+    static int64_t Now();
+};
+
+}
@@ -0,0 +1,194 @@
+#include "packet_cache.h"
+#include "common/common.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace Client
+{
+
+class PacketCache : public IPacketCache
+        , public Common::ObjectCounter<PacketCache>
+{
+    std::vector<CachedPacket> packets;
+    std::vector<uint8_t> arena;
+    CachedStream streams[streams_count];
+    int64_t duration_us = 0;
+
+    char error_buff[512];
+
+public:
+    ~PacketCache()
+    {
+        for (auto& stream : streams)
+            avcodec_parameters_free(&stream.codecpar);
+    }
+
+    bool Load(const std::string& url)
+    {
+        AVFormatContext* input_fmt = nullptr;
+        int ret;
+
+        if ((ret = avformat_open_input(&input_fmt, url.c_str(), nullptr, nullptr)) < 0)
+        {
+            LOGE("Cannot open input file " << url << " " << ff_error(ret));
+            return false;
+        }
+
+        bool result = Demux(input_fmt);
+        avformat_close_input(&input_fmt);
+
+        if (result)
+            LOG("Packet cache " << url << " packets " << packets.size() << " bytes " << arena.size()
+                << " duration " << duration_us << "us");
+        return result;
+    }
+
+    const std::vector<CachedPacket>& Packets() const override
+    {
+        return packets;
+    }
+
+    const uint8_t* Data(const CachedPacket& packet) const override
+    {
+        return arena.data() + packet.offset;
+    }
+
+    const CachedStream& Stream(int idx) const override
+    {
+        return streams[idx];
+    }
+
+    int64_t DurationUs() const override
+    {
+        return duration_us;
+    }
+
+private:
+    const char* ff_error(int errcode)
+    {
+        error_buff[0] = 0;
+        av_strerror(errcode, error_buff, sizeof(error_buff));
+        return error_buff;
+    }
+
+    bool Demux(AVFormatContext* input_fmt)
+    {
+        int ret;
+
+        if ((ret = avformat_find_stream_info(input_fmt, nullptr)) < 0)
+        {
+            LOGE("Cannot find stream information");
+            return false;
+        }
+
+        int input_streams[streams_count];
+        input_streams[video_idx] = av_find_best_stream(input_fmt, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0);
+        input_streams[audio_idx] = av_find_best_stream(input_fmt, AVMEDIA_TYPE_AUDIO, -1, -1, 0, 0);
+        if (input_streams[video_idx] < 0 || input_streams[audio_idx] < 0)
+        {
+            LOGE("Cannot find video and audio streams");
+            return false;
+        }
+
+        for (int i = 0; i < streams_count; ++i)
+        {
+            AVStream* stream = input_fmt->streams[input_streams[i]];
+            streams[i].codecpar = avcodec_parameters_alloc();
+            avcodec_parameters_copy(streams[i].codecpar, stream->codecpar);
+            streams[i].time_base_num = stream->time_base.num;
+            streams[i].time_base_den = stream->time_base.den;
+        }
+
+        // payload size is close to file size
+        if (input_fmt->pb)
+        {
+            int64_t size = avio_size(input_fmt->pb);
+            if (size > 0)
+                arena.reserve(size);
+        }
+
+        AVRational us = {1, AV_TIME_BASE};
+        int64_t first_us = AV_NOPTS_VALUE;
+        int64_t end_us = 0;
+
+        AVPacket* pkt = av_packet_alloc();
+        while ((ret = av_read_frame(input_fmt, pkt)) >= 0)
+        {
+            int idx = pkt->stream_index == input_streams[video_idx] ? video_idx
+                    : pkt->stream_index == input_streams[audio_idx] ? audio_idx : -1;
+
+            if (idx >= 0 && pkt->dts != AV_NOPTS_VALUE)
+            {
+                AVRational tb = input_fmt->streams[pkt->stream_index]->time_base;
+
+                CachedPacket packet;
+                packet.offset = arena.size();
+                packet.size = pkt->size;
+                packet.stream = idx;
+                packet.key = pkt->flags & AV_PKT_FLAG_KEY;
+                packet.dts = pkt->dts;
+                packet.pts = pkt->pts;
+                packet.duration = pkt->duration;
+
+                int64_t dts_us = av_rescale_q(pkt->dts, tb, us);
+                if (first_us == AV_NOPTS_VALUE)
+                    first_us = dts_us;
+                packet.time_us = dts_us - first_us;
+                end_us = std::max(end_us, packet.time_us + av_rescale_q(pkt->duration, tb, us));
+
+                arena.insert(arena.end(), pkt->data, pkt->data + pkt->size);
+                packets.push_back(packet);
+            }
+
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+
+        if (ret != AVERROR_EOF)
+        {
+            LOGE("Error read frame: " << ff_error(ret));
+            return false;
+        }
+
+        if (packets.empty())
+        {
+            LOGE("Input has no packets");
+            return false;
+        }
+
+        arena.shrink_to_fit();
+        packets.shrink_to_fit();
+        duration_us = end_us;
+        return true;
+    }
+};
+
+IPacketCachePtr GetPacketCache(const std::string& url)
+{
+    static std::mutex mx;
+    static std::map<std::string, std::weak_ptr<IPacketCache>> caches;
+
+    // concurrent senders wait for the first one to demux
+    std::lock_guard<std::mutex> lock(mx);
+
+    IPacketCachePtr cache = caches[url].lock();
+    if (cache)
+        return cache;
+
+    auto created = std::make_shared<PacketCache>();
+    if (!created->Load(url))
+        return nullptr;
+
+    caches[url] = created;
+    return created;
+}
+
+}
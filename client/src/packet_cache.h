@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct AVCodecParameters;
+
+namespace Client
+{
+
+struct CachedPacket
+{
+    // payload in arena
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    // index in CachedStreams
+    uint8_t stream = 0;
+    bool key = false;
+    // stream time base
+    int64_t pts = 0;
+    int64_t dts = 0;
+    int64_t duration = 0;
+    // dts from the start of file in microseconds
+    int64_t time_us = 0;
+};
+
+struct CachedStream
+{
+    AVCodecParameters* codecpar = nullptr;
+    int time_base_num = 1;
+    int time_base_den = 1;
+};
+
+// Read-only demuxed file: video and audio packets of a file in one arena.
+// Shared by all senders of the same url, each sender keeps its own position
+// and timestamp offset.
+struct IPacketCache : public virtual Common::IObject
+{
+    enum indexes
+    {
+        video_idx = 0,
+        audio_idx = 1,
+        streams_count = 2,
+    };
+
+    virtual const std::vector<CachedPacket>& Packets() const = 0;
+    virtual const uint8_t* Data(const CachedPacket& packet) const = 0;
+    virtual const CachedStream& Stream(int idx) const = 0;
+    // end of the last packet, offset of the next loop
+    virtual int64_t DurationUs() const = 0;
+};
+
+DECLARE_PTR_S(IPacketCache)
+
+// demuxes url once, later calls return the same cache while it is referenced
+IPacketCachePtr GetPacketCache(const std::string& url);
+
+}
@@ -0,0 +1,66 @@
+#include "rtp_history.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace Client
+{
+
+RtpHistory::RtpHistory(size_t capacity)
+{
+    size_t size = 16;
+    while (size < capacity && size < 0x8000)
+        size *= 2;
+    entries.resize(size);
+    mask = size - 1;
+}
+
+void RtpHistory::Store(const uint8_t* data, size_t size)
+{
+    if (size < 12)
+        return;
+
+    uint16_t seq = (static_cast<uint16_t>(data[2]) << 8) | data[3];
+    Entry& entry = entries[seq & mask];
+    entry.used = true;
+    entry.seq = seq;
+    entry.resent_us = 0;
+    // capacity of the slot stays, no allocation after warm up
+    entry.data.assign(data, data + size);
+
+    budget = std::min<double>(budget + size * budget_ratio, max_budget);
+}
+
+void RtpHistory::Retransmit(uint16_t seq, int64_t now_us, const std::function<void(const uint8_t*, size_t)>& send)
+{
+    ++stats.requested;
+
+    Entry& entry = entries[seq & mask];
+    if (!entry.used || entry.seq != seq)
+    {
+        ++stats.missing;
+        return;
+    }
+
+    // receiver repeats nacks until the packet arrives, answer once per interval
+    if ((entry.resent_us && now_us - entry.resent_us < min_resend_interval_us) || budget < entry.data.size())
+    {
+        ++stats.limited;
+        return;
+    }
+
+    budget -= entry.data.size();
+    entry.resent_us = now_us;
+    ++stats.retransmitted;
+    send(entry.data.data(), entry.data.size());
+}
+
+std::string RtpHistory::Dump() const
+{
+    std::ostringstream out;
+    out << "requested " << stats.requested << " retransmitted " << stats.retransmitted
+        << " missing " << stats.missing << " limited " << stats.limited;
+    return out.str();
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Client
+{
+
+struct RetransmitStats
+{
+    // sequence numbers requested by nacks
+    uint64_t requested = 0;
+    uint64_t retransmitted = 0;
+    // no longer in history
+    uint64_t missing = 0;
+    // over retransmit budget or resent within min interval
+    uint64_t limited = 0;
+};
+
+// Recently sent rtp packets of one ssrc, indexed by sequence number, for
+// retransmission on rtcp nack. Retransmitted bytes are limited to a share of
+// sent bytes, so retransmissions cannot multiply the load on a congested
+// path, and a packet is resent at most once per min interval.
+class RtpHistory
+{
+public:
+    // retransmitted bytes per sent byte
+    static constexpr double budget_ratio = 0.25;
+    // budget saved up at most, a burst of retransmissions
+    static constexpr int64_t max_budget = 64 * 1024;
+    static constexpr int64_t min_resend_interval_us = 20 * 1000;
+
+private:
+    struct Entry
+    {
+        bool used = false;
+        uint16_t seq = 0;
+        int64_t resent_us = 0;
+        std::vector<uint8_t> data;
+    };
+
+    std::vector<Entry> entries;
+    size_t mask = 0;
+    double budget = 0;
+    RetransmitStats stats;
+
+public:
+    // packets kept, rounded up to a power of two
+    explicit RtpHistory(size_t capacity = 1024);
+
+    // rtp packet as written by muxer
+    void Store(const uint8_t* data, size_t size);
+
+    // resends requested packets which are in history and in budget
+    void Retransmit(uint16_t seq, int64_t now_us, const std::function<void(const uint8_t*, size_t)>& send);
+
+    const RetransmitStats& Stats() const
+    {
+        return stats;
+    }
+
+    std::string Dump() const;
+};
+
+}
@@ -1,12 +1,24 @@
 #include "sender.h"
 #include "common/common.h"
+#include "common/fec.h"
 #include "common/messages.h"
+#include "common/rtcp.hpp"
+#include "common/sdp.hpp"
 
 #include <boost/asio.hpp>
 
 #include "client_app.h"
+#include "pacer.h"
+#include "rtp_history.h"
 
 #include <fstream>
+#include <random>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 extern "C"
 {
 #include <libavcodec/avcodec.h>
@@ -23,6 +35,8 @@ class SenderImpl : public ISender
         , public std::enable_shared_from_this<SenderImpl>
         , public Common::ObjectCounter<SenderImpl>
 {
+    static constexpr int rtp_packet_size = 1472;
+
     std::thread thread;
 
     boost::asio::io_service io_service;
@@ -53,11 +67,41 @@ class SenderImpl : public ISender
 
     AVFormatContext* output_fmts[streams_count] = {};
     int input_streams[streams_count] = {};
+    // announced in sdp, server with shared ingest port routes by them,
+    // streams differ only in bit 0 to be steered to one server worker
+    uint32_t ssrcs[streams_count] = {};
+
+    // rtp and rtcp of a stream go from one socket, receiver sends nacks
+    // back to the source of rtp
+    struct RtpOutput
+    {
+        SenderImpl* owner = nullptr;
+        int fd = -1;
+        sockaddr_in rtp = {};
+        sockaddr_in rtcp = {};
+        RtpHistory history;
+        std::unique_ptr<Common::Fec::Encoder> fec;
+    };
+
+    RtpOutput outputs[streams_count];
+
+    // reused for every packet, only the payload is owned by demuxer
+    AVPacket* packet = nullptr;
+
+    Pacer pacer;
+
+    // per sender, senders run on own threads
+    std::mt19937 ssrc_random{std::random_device{}()};
+    std::mt19937 drop_random{std::random_device{}()};
+    std::bernoulli_distribution drop;
+    uint64_t dropped = 0;
 
 public:
     SenderImpl(const ClientParams& params, const ISenderEventsPtr& handler)
-        : work(io_service), params(params), handler(handler)
-    {}
+        : work(io_service), params(params), handler(handler), pacer(params.speed), drop(params.drop_rate)
+    {
+        packet = av_packet_alloc();
+    }
 
     ~SenderImpl()
     {
@@ -68,12 +112,36 @@ public:
 
         for (size_t i = 0; i < streams_count; ++i)
         {
-            if (output_fmts[i] && !(output_fmts[i]->oformat->flags & AVFMT_NOFILE))
+            if (!output_fmts[i])
+                continue;
+
+            if (output_fmts[i]->flags & AVFMT_FLAG_CUSTOM_IO)
+            {
+                av_freep(&output_fmts[i]->pb->buffer);
+                avio_context_free(&output_fmts[i]->pb);
+                avformat_free_context(output_fmts[i]);
+            }
+            else if (!(output_fmts[i]->oformat->flags & AVFMT_NOFILE))
             {
                 avio_closep(&output_fmts[i]->pb);
                 avformat_free_context(output_fmts[i]);
             }
         }
+
+        for (auto& output : outputs)
+        {
+            if (output.fd >= 0)
+                close(output.fd);
+        }
+
+        av_packet_free(&packet);
+
+        if (params.mode != ClientParams::file_mode)
+        {
+            LOG("Pacing " << pacer.Dump());
+            LOG("Retransmission video " << outputs[video_idx].history.Dump() << " audio " << outputs[audio_idx].history.Dump()
+                << " dropped by loss injection " << dropped);
+        }
     }
 
     void Initialize() override
@@ -240,6 +308,8 @@ public:
         return true;
     }
 
+    static constexpr uint32_t max_busy_retries = 10;
+
     // using blocking socket I/O for simplicity
     bool OpenOutput()
     {
@@ -249,52 +319,81 @@ public:
 
         s.connect(endpoint);
 
-        char request = Common::Messages::RESERVE_TWO_PORTS;
-        boost::asio::write(s, boost::asio::buffer(&request, 1));
+        // server takes ports from reply, not from sdp
+        if (!CreateOutputContext(video_idx, RtpUrl(0)) || !CreateOutputContext(audio_idx, RtpUrl(0)))
+            return false;
 
-        uint16_t reply[2];
-        size_t reply_length = boost::asio::read(s, boost::asio::buffer(reply));
+        char buffer[4096];
+        av_sdp_create(output_fmts, 2, buffer, sizeof(buffer));
+        std::string sdp = Common::Sdp::add_ssrcs(buffer, {ssrcs[video_idx], ssrcs[audio_idx]});
 
-        uint16_t port1 = ntohs(reply[0]);
-        uint16_t port2 = ntohs(reply[1]);
+        LOG(sdp);
 
-        LOG("Got ports from server " << port1 << ";" << port2);
+        Common::Messages::FrameParser parser;
+        Common::Messages::Frame frame;
 
-        if (!OpenContexts(port1, port2))
-            return false;
+        for (uint32_t request_id = 1; ; ++request_id)
+        {
+            std::vector<uint8_t> request;
+            Common::Messages::append_frame(request, Common::Messages::OPEN_STREAM, request_id, sdp.data(), sdp.size());
+            boost::asio::write(s, boost::asio::buffer(request));
 
-        char sdp[2000];
-        sdp[0] = Common::Messages::START_STREAM;
-        av_sdp_create(output_fmts, 2, sdp+1, 2000-1);
+            while (!parser.Next(frame))
+            {
+                if (parser.Error())
+                    return false;
 
-        LOG(sdp);
+                size_t size = 0;
+                uint8_t* data = parser.Prepare(Common::Messages::frame_header_size, size);
+                parser.Commit(s.read_some(boost::asio::buffer(data, size)));
+            }
+
+            if (frame.type != Common::Messages::REPLY || frame.request_id != request_id || frame.size < 1)
+            {
+                LOGE("Unexpected reply on OPEN_STREAM");
+                return false;
+            }
+
+            if (frame.payload[0] != Common::Messages::BUSY || frame.size < 5 || request_id > max_busy_retries)
+                break;
 
-        boost::asio::write(s, boost::asio::buffer(sdp, strlen(sdp)+1));
+            unsigned retry_after_ms = Common::Messages::get_be32(frame.payload + 1);
+            LOGW("Server is busy, retry after " << retry_after_ms << " ms");
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_after_ms));
+        }
+
+        if (frame.payload[0] != Common::Messages::OK || frame.size < 5)
+        {
+            LOGE("Server refused stream, status " << (int)frame.payload[0]);
+            return false;
+        }
+
+        uint16_t port1 = Common::Messages::get_be16(frame.payload + 1);
+        uint16_t port2 = Common::Messages::get_be16(frame.payload + 3);
 
-        uint8_t sdpreply[2] = {};
-        boost::asio::read(s, boost::asio::buffer(sdpreply, 2));
+        LOG("Got ports from server " << port1 << ";" << port2);
 
-        LOG("Got reply on START_STREAM: " << sdpreply[0] << sdpreply[1]);
-        return (sdpreply[0] == 'O' && sdpreply[1] == 'K');
+        return StartOutputContext(video_idx, port1) && StartOutputContext(audio_idx, port2);
     }
 
-    bool OpenContexts(uint16_t port1, uint16_t port2)
+    std::string RtpUrl(uint16_t port) const
     {
-        auto rtp_ep = [this](int port){
-            return "rtp://" + params.server_addr + ":" + std::to_string(port);
-        };
+        return "rtp://" + params.server_addr + ":" + std::to_string(port);
+    }
 
-        if (!OpenOutputContext(video_idx, rtp_ep(port1)))
+    bool OpenContexts(uint16_t port1, uint16_t port2)
+    {
+        if (!CreateOutputContext(video_idx, RtpUrl(port1)) || !StartOutputContext(video_idx, port1))
             return false;
 
-        if (!OpenOutputContext(audio_idx, rtp_ep(port2)))
+        if (!CreateOutputContext(audio_idx, RtpUrl(port2)) || !StartOutputContext(audio_idx, port2))
             return false;
 
         return true;
 
     }
 
-    bool OpenOutputContext(int idx, const std::string& url)
+    bool CreateOutputContext(int idx, const std::string& url)
     {
         int ret;
 
@@ -312,6 +411,10 @@ public:
         AVStream* in_stream = input_fmt->streams[stream_idx];
         AVStream* out_stream = avformat_new_stream(ctx, nullptr);
 
+        if (!ssrcs[video_idx])
+            ssrcs[video_idx] = ssrc_random() & ~1u;
+        ssrcs[idx] = ssrcs[video_idx] | idx;
+
         ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
 
         if(ret < 0)
@@ -320,11 +423,51 @@ public:
             return  false;
         }
 
-        if (!(ctx->flags & AVFMT_NOFILE))
-            avio_open(&ctx->pb, url.c_str(), AVIO_FLAG_WRITE);
+        return true;
+    }
+
+    bool StartOutputContext(int idx, uint16_t port)
+    {
+        int ret;
+
+        AVFormatContext* ctx = output_fmts[idx];
+
+        RtpOutput& output = outputs[idx];
+        output.owner = this;
+        output.rtp.sin_family = AF_INET;
+        output.rtp.sin_port = htons(port);
+        inet_pton(AF_INET, params.server_addr.c_str(), &output.rtp.sin_addr);
+        output.rtcp = output.rtp;
+        output.rtcp.sin_port = htons(port + 1);
+        if (params.fec_group)
+            output.fec.reset(new Common::Fec::Encoder(params.fec_group));
+
+        output.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (output.fd < 0)
+        {
+            LOGE("Cannot create udp socket " << strerror(errno));
+            return false;
+        }
+
+        uint8_t* buffer = static_cast<uint8_t*>(av_malloc(rtp_packet_size));
+        ctx->pb = avio_alloc_context(buffer, rtp_packet_size, 1, &output, nullptr, &SenderImpl::WritePacket, nullptr);
+        if (!ctx->pb)
+        {
+            av_free(buffer);
+            return false;
+        }
+        // one rtp packet per write
+        ctx->pb->max_packet_size = rtp_packet_size;
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        std::string url = RtpUrl(port);
+
+        AVDictionary* opts = nullptr;
+        av_dict_set_int(&opts, "ssrc", static_cast<int32_t>(ssrcs[idx]), 0);
 
         // Write output file header
-         ret = avformat_write_header(ctx, NULL);
+         ret = avformat_write_header(ctx, &opts);
+         av_dict_free(&opts);
          if (ret < 0)
          {
              LOGE("Error occurred when opening output file " << ff_error(ret));
@@ -339,9 +482,8 @@ public:
     void Process()
     {
         int ret;
-        AVPacket packet;
 
-        if ((ret = av_read_frame(input_fmt, &packet)) < 0)
+        if ((ret = av_read_frame(input_fmt, packet)) < 0)
         {
             state = States::CriticalStop;
             LOGW("Error read frame: " << ff_error(ret));
@@ -353,15 +495,15 @@ public:
 
         if (params.mode == ClientParams::file_mode)
         {
-            WritePacketToFile(packet);
+            WritePacketToFile(*packet);
         }
         else
         {
-            SendPacketToServer(packet);
+            SendPacketToServer(*packet);
         }
 
 
-        av_packet_unref(&packet);
+        av_packet_unref(packet);
     }
 
     void WritePacketToFile(AVPacket& packet)
@@ -401,6 +543,10 @@ public:
         AVStream* in_stream = input_fmt->streams[packet.stream_index];
         AVStream* out_stream = output_fmts[idx]->streams[0];
 
+        int64_t due = pacer.Schedule(packet.dts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(packet.dts, in_stream->time_base, AVRational{1, AV_TIME_BASE}));
+        WaitFeedback(due);
+        pacer.Sent(due);
+
         packet.pts = av_rescale_q_rnd(packet.pts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
         packet.dts = av_rescale_q_rnd(packet.dts, in_stream->time_base, out_stream->time_base, AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
         packet.duration = av_rescale_q(packet.duration, in_stream->time_base, out_stream->time_base);
@@ -414,12 +560,94 @@ public:
             state = States::CriticalStop;
             LOGW("Error write frame: " << ff_error(ret));
         }
+    }
 
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    static int WritePacket(void* opaque, uint8_t* buf, int buf_size)
+    {
+        auto output = static_cast<RtpOutput*>(opaque);
+        return output->owner->SendDatagram(*output, buf, buf_size);
     }
 
+    int SendDatagram(RtpOutput& output, const uint8_t* buf, int size)
+    {
+        // rtp muxer writes rtcp sender reports to the same context
+        bool rtcp = size >= 2 && buf[1] >= 200 && buf[1] <= 204;
+        if (!rtcp)
+            output.history.Store(buf, size);
+
+        Send(output, rtcp, buf, size);
 
+        if (!rtcp && output.fec && output.fec->Add(buf, size))
+            Send(output, false, output.fec->Parity().data(), output.fec->Parity().size());
+        return size;
+    }
 
+    void Send(const RtpOutput& output, bool rtcp, const uint8_t* buf, size_t size)
+    {
+        // injected loss hits retransmissions as well
+        if (!rtcp && params.drop_rate > 0 && drop(drop_random))
+        {
+            ++dropped;
+            return;
+        }
+
+        const sockaddr_in& addr = rtcp ? output.rtcp : output.rtp;
+        if (sendto(output.fd, buf, size, 0, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0)
+            LOGD("Send datagram error " << strerror(errno));
+    }
+
+    // waits until due time of the next packet, answers nacks meanwhile,
+    // 0 - reads pending nacks only
+    void WaitFeedback(int64_t due)
+    {
+        pollfd fds[streams_count];
+        for (int i = 0; i < streams_count; ++i)
+            fds[i] = {outputs[i].fd, POLLIN, 0};
+
+        for (;;)
+        {
+            for (auto& output : outputs)
+                ReadFeedback(output);
+
+            int64_t wait_us = due - Pacer::Now();
+            if (!due || wait_us <= 0)
+                return;
+
+            timespec timeout = {static_cast<time_t>(wait_us / 1000000), static_cast<long>(wait_us % 1000000) * 1000};
+            if (ppoll(fds, streams_count, &timeout, nullptr) < 0 && errno != EINTR)
+            {
+                LOGW("Poll feedback error " << strerror(errno));
+                return;
+            }
+        }
+    }
+
+    void ReadFeedback(RtpOutput& output)
+    {
+        uint8_t buffer[1500];
+        for (;;)
+        {
+            ssize_t size = recv(output.fd, buffer, sizeof(buffer), 0);
+            if (size <= 0)
+                return;
+
+            int64_t now = Pacer::Now();
+            Common::Rtcp::parse_generic_nacks(buffer, size, [this, now](uint32_t ssrc, uint16_t seq)
+            {
+                for (int i = 0; i < streams_count; ++i)
+                {
+                    if (ssrcs[i] != ssrc)
+                        continue;
+
+                    RtpOutput& target = outputs[i];
+                    target.history.Retransmit(seq, now, [this, &target](const uint8_t* data, size_t size)
+                    {
+                        Send(target, false, data, size);
+                    });
+                }
+            });
+        }
+    }
 };
 
 ISenderPtr CreateSender(const ClientParams& params, const ISenderEventsPtr& handler)
@@ -1,5 +1,6 @@
 #include "appimpl.h"
 #include "common.h"
+#include "metrics.h"
 #include <boost/asio.hpp>
 #include <boost/stacktrace.hpp>
 
@@ -21,6 +22,7 @@ void handler(int sig) {
   std::cout << sstr.str();
 
   LOGE(sstr.str());
+  Common::flush_log();
 
   exit(1);
 }
@@ -34,6 +36,7 @@ void int_handler(int sig) {
         if (app->Unloading())
         {
             LOGW("Force stop by SIGINT");
+            Common::flush_log();
             exit(1);
         }
         else
@@ -95,6 +98,7 @@ public:
         });
 
         Common::dump_objects_count();
+        Common::Metrics::LogHistograms();
     }
 
     void Post(std::function<void()> f)
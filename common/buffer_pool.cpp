@@ -0,0 +1,147 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+namespace Common
+{
+
+BufferPool::BufferPool(const Params& params)
+    : params(params)
+{
+    std::vector<size_t> sizes = params.size_classes;
+    std::sort(sizes.begin(), sizes.end());
+
+    for (size_t size : sizes)
+    {
+        SizeClass cls;
+        // keep free list links aligned
+        cls.size = std::max((size + 63) & ~size_t(63), sizeof(FreeBuffer));
+        classes.push_back(cls);
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto& slab : slabs)
+        munmap(slab.data, slab.size);
+}
+
+BufferPool::SizeClass* BufferPool::FindClass(size_t size)
+{
+    for (auto& cls : classes)
+    {
+        if (cls.size >= size)
+            return &cls;
+    }
+
+    return nullptr;
+}
+
+bool BufferPool::AddSlab(SizeClass& cls)
+{
+    size_t size = std::max(params.slab_size, cls.size);
+    void* data = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (params.huge_pages)
+    {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+            ++stats.huge_page_slabs;
+    }
+#endif
+
+    if (data == MAP_FAILED)
+    {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return false;
+
+#ifdef MADV_HUGEPAGE
+        if (params.huge_pages)
+            madvise(data, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    ++stats.slabs;
+    slabs.push_back({data, size});
+
+    cls.slab_pos = static_cast<uint8_t*>(data);
+    cls.slab_end = cls.slab_pos + size;
+    return true;
+}
+
+uint8_t* BufferPool::Acquire(size_t size, size_t& capacity)
+{
+    ++stats.acquired;
+
+    std::unique_lock<std::mutex> lock(mx);
+
+    SizeClass* cls = FindClass(size);
+    if (!cls)
+    {
+        lock.unlock();
+        ++stats.oversized;
+        capacity = size;
+        return static_cast<uint8_t*>(malloc(size));
+    }
+
+    capacity = cls->size;
+
+    if (cls->free)
+    {
+        FreeBuffer* buffer = cls->free;
+        cls->free = buffer->next;
+        ++stats.reused;
+        return reinterpret_cast<uint8_t*>(buffer);
+    }
+
+    if (cls->slab_pos + cls->size > cls->slab_end && !AddSlab(*cls))
+        return nullptr;
+
+    uint8_t* data = cls->slab_pos;
+    cls->slab_pos += cls->size;
+    return data;
+}
+
+void BufferPool::Release(uint8_t* data, size_t capacity)
+{
+    if (!data)
+        return;
+
+    std::unique_lock<std::mutex> lock(mx);
+
+    SizeClass* cls = FindClass(capacity);
+    if (!cls || cls->size != capacity)
+    {
+        lock.unlock();
+        free(data);
+        return;
+    }
+
+    FreeBuffer* buffer = reinterpret_cast<FreeBuffer*>(data);
+    buffer->next = cls->free;
+    cls->free = buffer;
+}
+
+const BufferPoolStats& BufferPool::Stats() const
+{
+    return stats;
+}
+
+std::string BufferPool::Dump() const
+{
+    std::ostringstream sstr;
+    sstr << "acquired " << stats.acquired
+         << " reused " << stats.reused
+         << " slabs " << stats.slabs
+         << " huge " << stats.huge_page_slabs
+         << " oversized " << stats.oversized;
+    return sstr.str();
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "object.h"
+
+namespace Common
+{
+
+struct BufferPoolStats
+{
+    std::atomic<uint64_t> acquired{0};
+    // served from free list, no system allocation
+    std::atomic<uint64_t> reused{0};
+    std::atomic<uint64_t> slabs{0};
+    std::atomic<uint64_t> huge_page_slabs{0};
+    // bigger than largest size class, served by malloc
+    std::atomic<uint64_t> oversized{0};
+};
+
+// Size class buffer pool. Buffers are carved from large slabs, optionally
+// backed by huge pages, and go back to per class free lists on release.
+// Slab memory is returned to the system only when the pool is destroyed.
+class BufferPool : public ObjectCounter<BufferPool>
+{
+public:
+    struct Params
+    {
+        std::vector<size_t> size_classes = {512, 2048, 8192, 65536};
+        size_t slab_size = 2 * 1024 * 1024;
+        bool huge_pages = false;
+    };
+
+    BufferPool(const Params& params);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // capacity is set to size class of buffer, >= size
+    uint8_t* Acquire(size_t size, size_t& capacity);
+    void Release(uint8_t* data, size_t capacity);
+
+    const BufferPoolStats& Stats() const;
+    std::string Dump() const;
+
+private:
+    struct FreeBuffer
+    {
+        FreeBuffer* next;
+    };
+
+    struct SizeClass
+    {
+        size_t size;
+        FreeBuffer* free = nullptr;
+        uint8_t* slab_pos = nullptr;
+        uint8_t* slab_end = nullptr;
+    };
+
+    struct Slab
+    {
+        void* data;
+        size_t size;
+    };
+
+    const Params params;
+    std::mutex mx;
+    std::vector<SizeClass> classes;
+    std::vector<Slab> slabs;
+    BufferPoolStats stats;
+
+    SizeClass* FindClass(size_t size);
+    bool AddSlab(SizeClass& cls);
+};
+
+}
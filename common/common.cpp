@@ -1,6 +1,8 @@
 #include "common.h"
+#include "metrics.h"
 #include <fstream>
 #include <chrono>
+#include <atomic>
 #include <mutex>
 #include <vector>
 #include <thread>
@@ -11,17 +13,17 @@
 #include <syslog.h>
 
 #include "object.h"
+#include "log_backend.h"
 #include <boost/core/demangle.hpp>
 
 namespace Common
 {
 
+std::atomic<LogLevel> g_log_level{LogLevel::DBG};
+
 namespace
 {
-    std::ofstream m_file_log;
-    std::mutex g_log_mutex;
-    std::mutex g_thred_reg_mx;
-    LogLevel g_cons_force_level = LogLevel::NO;
+    std::atomic<LogLevel> g_cons_force_level{LogLevel::NO};
     std::string g_syslog_ident;
 }
 
@@ -45,52 +47,48 @@ LogLevel str_to_loglevel(const char* lvl)
     return Common::LogLevel::NO;
 }
 
-void initialize_log(std::string indent)
+void set_log_level(LogLevel level)
+{
+    g_log_level = level;
+}
+
+void initialize_log(std::string indent, const LogParams& params)
 {
+    if (LogBackend::Running())
+        return;
+
     if (indent.empty())
         indent = "log";
 
-    m_file_log.open(indent + ".log", std::ofstream::out|std::ofstream::app);
     g_syslog_ident = indent;
+    LogBackend::Start(indent + ".log", params);
 
-    g_cons_force_level = Common::LogLevel::DBG;
+    g_cons_force_level = params.console ? Common::LogLevel::DBG : Common::LogLevel::NO;
 }
 
-namespace {
-// maxinum 10 named threads, for lockfree using
-std::vector< std::pair<std::thread::id, std::string > > m_threads(10);
-    
-std::string thread_name(const std::thread::id& id)
+void flush_log()
 {
-    for(size_t i = 0; i < m_threads.size(); ++i) {
-        if (m_threads[i].first == id)
-            return m_threads[i].second;
-    }
-    
-    return "";
+    LogBackend::Flush();
 }
 
+uint64_t log_dropped_count()
+{
+    return LogBackend::Dropped();
 }
 
 void register_thread(const std::thread::id& id, const std::string& name)
 {
-    std::unique_lock<std::mutex> lock(g_thred_reg_mx);
-    
-    for(size_t i = 0; i < m_threads.size(); ++i) {
-        if (m_threads[i].first == std::thread::id()) {
-            m_threads[i].first = id;
-            m_threads[i].second = name;
-            break;
-        }
-    }
+    LogBackend::RegisterThread(id, name);
 
-    pthread_setname_np(pthread_self(), name.c_str());
+    if (id == std::this_thread::get_id())
+        pthread_setname_np(pthread_self(), name.c_str());
 }
 
 void register_current_thread(const std::string& name)
 {
     auto id = std::this_thread::get_id();
     register_thread(id, name);
+    Metrics::RegisterThread(name);
 }
 
 namespace {
@@ -166,25 +164,6 @@ void dump_objects_count(unsigned mincount)
 }
 
 
-const char* LogLevel2Prefix(LogLevel level)
-{
-    switch(level)
-    {
-    case LogLevel::INF:
-        return "I>";
-    case LogLevel::ERR:
-        return "E>";
-    case LogLevel::WRN:
-        return "W>";
-    case LogLevel::DBG:
-        return "D>";
-    default:
-        break;
-    }
-
-    return "L>";
-}
-
 int get_sys_log_level(LogLevel level)
 {
     switch(level)
@@ -208,59 +187,85 @@ void trace_log(LogLevel level, const std::string& str, bool copy_to_console, con
 {
     //syslog(GetSyslogLevel(level), "%s", str.c_str());
 
-    char buffer[26];
-    int millisec;
-    struct tm* tm_info;
-    struct timeval tv;
-
-    gettimeofday(&tv, nullptr);
+    bool console = copy_to_console || g_cons_force_level.load(std::memory_order_relaxed) >= level;
 
-    millisec = static_cast<int>(lrint(tv.tv_usec/1000.0)); // Round to nearest millisec
-    if (millisec>=1000)
-    { // Allow for rounding up to nearest second
-        millisec -=1000;
-        tv.tv_sec++;
+    if (!LogBackend::Running())
+    {
+        // log is not initialized yet, nothing goes to file
+        if (console)
+        {
+            LogRecord record;
+            record.level = level;
+            record.file = file;
+            record.line = line;
+            record.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            std::ostringstream sstr;
+            sstr << std::this_thread::get_id();
+            record.thread = sstr.str();
+            record.text = str;
+            LogBackend::Write(record);
+        }
+        return;
     }
 
-    tm_info = localtime(&tv.tv_sec);
+    LogRecord* record = LogBackend::Acquire();
+    if (!record)
+        return;
+
+    record->level = level;
+    record->console = console;
+    record->file = file;
+    record->line = line;
+    record->site = nullptr;
+    record->text = str;
+    LogBackend::Commit(record);
+}
 
-    strftime(buffer, 26, "%y:%m:%d %H:%M:%S", tm_info);
-    char smilli[12];
-    snprintf(smilli, 12, ".%03d", millisec);
+namespace
+{
+// deferred record formatted on the calling thread before log is initialized
+thread_local LogRecord t_sync_record;
+}
 
-    std::string tname = thread_name(std::this_thread::get_id());
-    
-    auto dump = [&](std::ostream& strm, LogLevel colorLevel = LogLevel::NO) {
-        switch(colorLevel)
-        {
-        case LogLevel::INF:
-            strm << "\e[1;32m";break;
-        case LogLevel::ERR:
-            strm << "\e[1;31m";break;
-        case LogLevel::WRN:
-            strm << "\e[1;33m";break;
-        default:
-            break;
-        }
+LogRecord* begin_deferred_log(const LogSite& site, bool copy_to_console)
+{
+    bool console = copy_to_console || g_cons_force_level.load(std::memory_order_relaxed) >= site.level;
 
-        strm << LogLevel2Prefix(level) << buffer << smilli << " t:";
-        if (tname.empty())
-            strm << std::this_thread::get_id();
-        else
-            strm << tname;
-        
-        strm << " " << str << " (" << file << ":" << line << ")" << std::endl;
-        if (colorLevel != LogLevel::NO)
-            strm << "\e[m";
-    };
-    
-
-    std::unique_lock<std::mutex> lock(g_log_mutex);
-    dump(m_file_log);
-
-    if (copy_to_console || g_cons_force_level >= level)
-        dump(std::cout, level);
-    lock.unlock();
+    LogRecord* record = nullptr;
+    if (!LogBackend::Running())
+    {
+        if (!console)
+            return nullptr;
+
+        record = &t_sync_record;
+        record->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::ostringstream sstr;
+        sstr << std::this_thread::get_id();
+        record->thread = sstr.str();
+    }
+    else if (!(record = LogBackend::Acquire()))
+        return nullptr;
+
+    record->level = site.level;
+    record->console = console;
+    record->file = site.file;
+    record->line = site.line;
+    record->site = &site;
+    record->args.clear();
+    return record;
+}
+
+std::string& deferred_log_args(LogRecord* record)
+{
+    return record->args;
+}
+
+void commit_deferred_log(LogRecord* record)
+{
+    if (record == &t_sync_record)
+        LogBackend::Write(*record);
+    else
+        LogBackend::Commit(record);
 }
 
 }
@@ -1,4 +1,6 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <sstream>
 #include <memory>
@@ -7,9 +9,18 @@
 #include <string.h>
 
 #include "types.h"
+#include "log_args.hpp"
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define LOG_(ARGS, cc, lvl) do{std::ostringstream __l_sstr; __l_sstr << ARGS; Common::trace_log(lvl, __l_sstr.str(), cc, __FILENAME__, __LINE__);}while(0)
+// levels above are compiled out: 0 - NO, 1 - INF, 2 - ERR, 3 - WRN, 4 - DBG
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 4
+#endif
+#define LOG_ENABLED(lvl) (static_cast<int>(lvl) <= LOG_COMPILE_LEVEL && Common::log_enabled(lvl))
+
+#define LOG_(ARGS, cc, lvl) do{if (LOG_ENABLED(lvl)) {std::ostringstream __l_sstr; __l_sstr << ARGS; Common::trace_log(lvl, __l_sstr.str(), cc, __FILENAME__, __LINE__);}}while(0)
+// deferred: arguments are captured binary, "{}" in FMT are replaced by log writer thread
+#define LOG_FMT_(lvl, cc, FMT, ...) do{if (LOG_ENABLED(lvl)) {static const Common::LogSite __l_site = {lvl, FMT, __FILENAME__, __LINE__}; Common::trace_log_deferred(__l_site, cc, ##__VA_ARGS__);}}while(0)
 #define LOG(ARGS) LOG_(ARGS, false, Common::LogLevel::DBG)
 #define LOG_CONS(ARGS) LOG_(ARGS, true, Common::LogLevel::DBG)
 #define THROW_ERR(ARGS) do {std::ostringstream __l_sstr; __l_sstr << ARGS;  __l_sstr << "(" << __FILENAME__ << ":" << __LINE__ << ")"; throw std::logic_error(__l_sstr.str());}while(0)
@@ -18,6 +29,11 @@
 #define LOGE(ARGS) LOG_(ARGS, false, Common::LogLevel::ERR)
 #define LOGW(ARGS) LOG_(ARGS, false, Common::LogLevel::WRN)
 
+#define LOG_FMT(FMT, ...) LOG_FMT_(Common::LogLevel::DBG, false, FMT, ##__VA_ARGS__)
+#define LOGI_FMT(FMT, ...) LOG_FMT_(Common::LogLevel::INF, false, FMT, ##__VA_ARGS__)
+#define LOGE_FMT(FMT, ...) LOG_FMT_(Common::LogLevel::ERR, false, FMT, ##__VA_ARGS__)
+#define LOGW_FMT(FMT, ...) LOG_FMT_(Common::LogLevel::WRN, false, FMT, ##__VA_ARGS__)
+
 #define TRY try
 #define CATCH_(ARGS, lvl, rethrow) catch(std::exception& e) {LOG_(ARGS << " " << e.what(), false, lvl); if(rethrow) throw;} catch(...) {LOG_(ARGS << " undefined error", false, lvl); if(rethrow) throw;}
 #define CATCH_ERR(ARGS) CATCH_(ARGS, Common::LogLevel::ERR, false)
@@ -27,8 +43,10 @@
 
 #ifndef NDEBUG
 #define LOGD(ARGS) LOG(ARGS)
+#define LOGD_FMT(FMT, ...) LOG_FMT(FMT, ##__VA_ARGS__)
 #else
 #define LOGD(ARGS)
+#define LOGD_FMT(FMT, ...)
 #endif
 /*#undef LOG
 #define LOG(ARGS)*/
@@ -41,9 +59,52 @@
 namespace Common
 {
 
+struct LogParams
+{
+    // log file is rotated to <indent>.log.1 ... when it grows over, 0 - no rotation
+    size_t max_file_size = 64 * 1024 * 1024;
+    unsigned max_files = 5;
+    // records queued per thread, overflow drops records
+    size_t queue_depth = 4096;
+    unsigned flush_interval_ms = 20;
+    // records are copied to stdout
+    bool console = true;
+};
+
+struct LogRecord;
+
+extern std::atomic<LogLevel> g_log_level;
+
+inline bool log_enabled(LogLevel level)
+{
+    return level <= g_log_level.load(std::memory_order_relaxed);
+}
+
+// records of higher levels are skipped before formatting
+void set_log_level(LogLevel level);
+
 LogLevel str_to_loglevel(const char* lvl);
-void initialize_log(std::string indent);
+// starts log writer thread, later calls keep the first params
+void initialize_log(std::string indent, const LogParams& params = LogParams());
+// writes queued records, e.g. before exit
+void flush_log();
+uint64_t log_dropped_count();
 void trace_log(LogLevel level, const std::string& str, bool copy_to_console, const char* file, int line);
+
+LogRecord* begin_deferred_log(const LogSite& site, bool copy_to_console);
+std::string& deferred_log_args(LogRecord* record);
+void commit_deferred_log(LogRecord* record);
+
+template <typename... Args>
+void trace_log_deferred(const LogSite& site, bool copy_to_console, const Args&... args)
+{
+    LogRecord* record = begin_deferred_log(site, copy_to_console);
+    if (!record)
+        return;
+
+    LogArgs::encode_all(deferred_log_args(record), args...);
+    commit_deferred_log(record);
+}
 int get_sys_log_level(LogLevel level);
 std::string demangle_type_name(const char* tname);
 void register_thread(const std::thread::id& id, const std::string& name);
@@ -0,0 +1,242 @@
+#include "fec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FEC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace Common
+{ namespace Fec {
+
+namespace
+{
+
+void xor_scalar(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < size; ++i)
+        dst[i] ^= src[i];
+}
+
+#ifdef FEC_X86
+// kernels are compiled for their instruction set only, picked at run time
+__attribute__((target("sse2")))
+void xor_sse2(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i + 16));
+        __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i + 32));
+        __m128i a3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i + 48));
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 48)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), a0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), a1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 32), a2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 48), a3);
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        a = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), a);
+    }
+    xor_scalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+void xor_avx2(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128)
+    {
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i + 32));
+        __m256i a2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i + 64));
+        __m256i a3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i + 96));
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 96)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), a0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), a1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 64), a2);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 96), a3);
+    }
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), a);
+    }
+    xor_sse2(dst + i, src + i, size - i);
+}
+#endif
+
+XorKernel select_kernel()
+{
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return XorKernel::Avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return XorKernel::Sse2;
+#endif
+    return XorKernel::Scalar;
+}
+
+const XorKernel best_kernel = select_kernel();
+
+void put_be16(uint8_t* out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value & 0xff;
+}
+
+uint16_t get_be16(const uint8_t* data)
+{
+    return (static_cast<uint16_t>(data[0]) << 8) | data[1];
+}
+
+}
+
+void xor_into(uint8_t* dst, const uint8_t* src, size_t size, XorKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef FEC_X86
+    case XorKernel::Avx2:
+        xor_avx2(dst, src, size);
+        return;
+    case XorKernel::Sse2:
+        xor_sse2(dst, src, size);
+        return;
+#endif
+    default:
+        xor_scalar(dst, src, size);
+        return;
+    }
+}
+
+void xor_into(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    xor_into(dst, src, size, best_kernel);
+}
+
+bool xor_supported(XorKernel kernel)
+{
+    return kernel <= best_kernel;
+}
+
+const char* xor_name(XorKernel kernel)
+{
+    switch (kernel)
+    {
+    case XorKernel::Avx2:
+        return "avx2";
+    case XorKernel::Sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+XorKernel xor_best()
+{
+    return best_kernel;
+}
+
+bool parse_parity(const uint8_t* data, size_t size, Parity& parity)
+{
+    if (!is_parity(data, size))
+        return false;
+
+    parity.ssrc = (static_cast<uint32_t>(data[8]) << 24) | (static_cast<uint32_t>(data[9]) << 16)
+            | (static_cast<uint32_t>(data[10]) << 8) | data[11];
+    parity.base = get_be16(data + rtp_header_size);
+    parity.count = data[rtp_header_size + 2];
+    parity.length_xor = get_be16(data + rtp_header_size + 4);
+    parity.payload = data + header_size;
+    parity.payload_size = size - header_size;
+    return parity.count >= 2 && parity.count <= max_group;
+}
+
+size_t recover(const Parity& parity, const uint8_t* const* packets, const size_t* sizes, unsigned count, uint8_t* out)
+{
+    memcpy(out, parity.payload, parity.payload_size);
+    uint16_t length = parity.length_xor;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        // shorter packets are padded with zeros, which XOR keeps
+        xor_into(out, packets[i], std::min(sizes[i], parity.payload_size));
+        length ^= static_cast<uint16_t>(sizes[i]);
+    }
+
+    if (length < rtp_header_size || length > parity.payload_size || (out[0] >> 6) != 2)
+        return 0;
+    return length;
+}
+
+Encoder::Encoder(unsigned group)
+    : group(std::min(std::max(group, 2u), max_group))
+{
+}
+
+bool Encoder::Add(const uint8_t* packet, size_t size)
+{
+    if (size < rtp_header_size)
+        return false;
+
+    if (!count)
+    {
+        base = get_be16(packet + 2);
+        length_xor = 0;
+        payload_size = 0;
+        parity.assign(header_size, 0);
+
+        // version 2, no marker
+        parity[0] = 0x80;
+        parity[1] = payload_type;
+        memcpy(parity.data() + 8, packet + 8, 4);
+    }
+
+    if (size > payload_size)
+    {
+        payload_size = size;
+        parity.resize(header_size + payload_size, 0);
+    }
+
+    xor_into(parity.data() + header_size, packet, size);
+    length_xor ^= static_cast<uint16_t>(size);
+
+    // timestamp of the last protected packet
+    memcpy(parity.data() + 4, packet + 4, 4);
+
+    if (++count < group)
+        return false;
+
+    put_be16(parity.data() + 2, seq++);
+    put_be16(parity.data() + rtp_header_size, base);
+    parity[rtp_header_size + 2] = static_cast<uint8_t>(count);
+    put_be16(parity.data() + rtp_header_size + 4, length_xor);
+    count = 0;
+    return true;
+}
+
+}}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Common
+{ namespace Fec {
+
+// XOR parity packets, one per group of consecutive rtp packets of an ssrc,
+// recover one lost packet of the group. A parity packet is rtp with its own
+// payload type and sequence numbers, same ssrc as the media:
+//   rtp header | be16 base seq | u8 count | u8 0 | be16 length xor | be16 0 | payload
+// payload is XOR of whole protected rtp packets padded with zeros to the
+// longest one, length xor is XOR of their lengths.
+constexpr uint8_t payload_type = 127;
+constexpr size_t rtp_header_size = 12;
+constexpr size_t header_size = rtp_header_size + 8;
+constexpr unsigned max_group = 48;
+
+enum class XorKernel
+{
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// dst ^= src with the best kernel of the cpu
+void xor_into(uint8_t* dst, const uint8_t* src, size_t size);
+void xor_into(uint8_t* dst, const uint8_t* src, size_t size, XorKernel kernel);
+bool xor_supported(XorKernel kernel);
+const char* xor_name(XorKernel kernel);
+XorKernel xor_best();
+
+inline bool is_parity(const uint8_t* data, size_t size)
+{
+    return size >= header_size && (data[0] >> 6) == 2 && (data[1] & 0x7f) == payload_type;
+}
+
+struct Parity
+{
+    uint32_t ssrc = 0;
+    uint16_t base = 0;
+    uint8_t count = 0;
+    uint16_t length_xor = 0;
+    const uint8_t* payload = nullptr;
+    size_t payload_size = 0;
+
+    bool Covers(uint16_t seq) const
+    {
+        return static_cast<uint16_t>(seq - base) < count;
+    }
+};
+
+bool parse_parity(const uint8_t* data, size_t size, Parity& parity);
+
+// Lost packet of a group from its parity and the other count - 1 packets,
+// out takes payload_size bytes. Returns length of the recovered packet,
+// 0 if the result is not an rtp packet.
+size_t recover(const Parity& parity, const uint8_t* const* packets, const size_t* sizes, unsigned count, uint8_t* out);
+
+// Builds parity packets of one ssrc, every group rtp packets.
+class Encoder
+{
+    const unsigned group;
+    uint16_t seq = 0;
+    uint16_t base = 0;
+    unsigned count = 0;
+    uint16_t length_xor = 0;
+    size_t payload_size = 0;
+    std::vector<uint8_t> parity;
+
+public:
+    // group is clamped to 2..max_group
+    explicit Encoder(unsigned group);
+
+    // true when packet completed a group, then Parity() is ready to send
+    bool Add(const uint8_t* packet, size_t size);
+
+    const std::vector<uint8_t>& Parity() const
+    {
+        return parity;
+    }
+};
+
+}}
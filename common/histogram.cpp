@@ -0,0 +1,67 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace Common
+{
+
+void Histogram::Merge(const Histogram& other)
+{
+    uint64_t merged = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+    {
+        uint64_t count = other.counts[i].load(std::memory_order_relaxed);
+        if (count)
+        {
+            counts[i].fetch_add(count, std::memory_order_relaxed);
+            merged += count;
+        }
+    }
+
+    // total follows buckets which were read, quantiles stay consistent
+    total.fetch_add(merged, std::memory_order_relaxed);
+    sum.fetch_add(other.Sum(), std::memory_order_relaxed);
+
+    uint64_t value = other.Max();
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t Histogram::Quantile(double q) const
+{
+    uint64_t count = Count();
+    if (!count)
+        return 0;
+
+    q = std::min(std::max(q, 0.0), 1.0);
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(UpperBound(i), Max());
+    }
+
+    // owner records concurrently, total ran ahead of buckets
+    return Max();
+}
+
+std::string Histogram::Summary(double unit) const
+{
+    std::ostringstream out;
+    out.precision(4);
+    out << "count " << Count()
+        << " p50 " << Quantile(0.5) / unit
+        << " p99 " << Quantile(0.99) / unit
+        << " p999 " << Quantile(0.999) / unit
+        << " max " << Max() / unit;
+    return out.str();
+}
+
+}
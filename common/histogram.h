@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Common
+{
+
+// Log-linear histogram in HdrHistogram style: every power of two range is
+// split into sub_buckets linear buckets, relative error of a recorded value
+// is below 1 / sub_buckets. Counts are relaxed atomics, so a histogram is read
+// and merged while its owner records into it.
+class Histogram
+{
+public:
+    static constexpr unsigned sub_bucket_bits = 5;
+    static constexpr uint64_t sub_buckets = 1 << sub_bucket_bits;
+    // bigger values are recorded as max_value, about 68 s in nanoseconds
+    static constexpr unsigned value_bits = 36;
+    static constexpr uint64_t max_value = (uint64_t(1) << value_bits) - 1;
+    static constexpr size_t bucket_count = (value_bits - sub_bucket_bits + 1) * sub_buckets;
+
+    Histogram() = default;
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    static size_t Index(uint64_t value)
+    {
+        if (value > max_value)
+            value = max_value;
+        if (value < sub_buckets)
+            return static_cast<size_t>(value);
+
+        unsigned shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+        return shift * sub_buckets + static_cast<size_t>(value >> shift);
+    }
+
+    // highest value which goes to bucket
+    static uint64_t UpperBound(size_t index)
+    {
+        if (index < sub_buckets)
+            return index;
+
+        unsigned shift = static_cast<unsigned>(index / sub_buckets - 1);
+        uint64_t sub = index % sub_buckets + sub_buckets;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    // any thread
+    void Record(uint64_t value)
+    {
+        counts[Index(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // cheaper form for histograms recorded by one thread only
+    void RecordSingle(uint64_t value)
+    {
+        AddSingle(counts[Index(value)], 1);
+        AddSingle(total, 1);
+        AddSingle(sum, value);
+        if (value > max.load(std::memory_order_relaxed))
+            max.store(value, std::memory_order_relaxed);
+    }
+
+    // adds counts of other, other may be recorded meanwhile
+    void Merge(const Histogram& other);
+
+    uint64_t Count() const
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Sum() const
+    {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Max() const
+    {
+        return max.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of bucket with the quantile, 0 for empty histogram
+    uint64_t Quantile(double q) const;
+
+    // "count N p50 A p99 B p999 C max D" with values divided by unit
+    std::string Summary(double unit = 1) const;
+
+private:
+    static void AddSingle(std::atomic<uint64_t>& value, uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[bucket_count] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+typedef std::shared_ptr<Histogram> HistogramPtr;
+
+}
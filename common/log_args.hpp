@@ -0,0 +1,138 @@
+#pragma once
+
+#include "types.h"
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+namespace Common
+{
+
+// Call site of a deferred log record, format placeholders are "{}".
+struct LogSite
+{
+    LogLevel level;
+    const char* format;
+    const char* file;
+    int line;
+};
+
+// Arguments of deferred records are captured as tagged binary values and
+// formatted by log writer thread.
+enum class LogArgTag : uint8_t
+{
+    Int,
+    UInt,
+    Double,
+    Bool,
+    Char,
+    Pointer,
+    String,
+};
+
+namespace LogArgs
+{
+
+template <typename T>
+inline void put_value(std::string& buffer, LogArgTag tag, T value)
+{
+    buffer += static_cast<char>(tag);
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void put_string(std::string& buffer, const char* str, size_t size)
+{
+    uint32_t length = static_cast<uint32_t>(size);
+    put_value(buffer, LogArgTag::String, length);
+    buffer.append(str, size);
+}
+
+inline void encode(std::string& buffer, bool value)
+{
+    put_value(buffer, LogArgTag::Bool, static_cast<uint8_t>(value));
+}
+
+inline void encode(std::string& buffer, char value)
+{
+    put_value(buffer, LogArgTag::Char, value);
+}
+
+inline void encode(std::string& buffer, const char* value)
+{
+    if (value)
+        put_string(buffer, value, strlen(value));
+    else
+        put_string(buffer, "(null)", 6);
+}
+
+inline void encode(std::string& buffer, char* value)
+{
+    encode(buffer, static_cast<const char*>(value));
+}
+
+inline void encode(std::string& buffer, const std::string& value)
+{
+    put_string(buffer, value.data(), value.size());
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+encode(std::string& buffer, T value)
+{
+    put_value(buffer, LogArgTag::Int, static_cast<int64_t>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value>::type
+encode(std::string& buffer, T value)
+{
+    put_value(buffer, LogArgTag::UInt, static_cast<uint64_t>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value>::type
+encode(std::string& buffer, T value)
+{
+    put_value(buffer, LogArgTag::Int, static_cast<int64_t>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+encode(std::string& buffer, T value)
+{
+    put_value(buffer, LogArgTag::Double, static_cast<double>(value));
+}
+
+template <typename T>
+inline void encode(std::string& buffer, const T* value)
+{
+    put_value(buffer, LogArgTag::Pointer, reinterpret_cast<uintptr_t>(value));
+}
+
+// anything else is streamed at call site
+template <typename T>
+inline typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_enum<T>::value && !std::is_pointer<T>::value>::type
+encode(std::string& buffer, const T& value)
+{
+    std::ostringstream sstr;
+    sstr << value;
+    encode(buffer, sstr.str());
+}
+
+inline void encode_all(std::string&)
+{
+}
+
+template <typename T, typename... Args>
+inline void encode_all(std::string& buffer, const T& value, const Args&... args)
+{
+    encode(buffer, value);
+    encode_all(buffer, args...);
+}
+
+}
+
+}
@@ -0,0 +1,568 @@
+#include "log_backend.h"
+#include "common.h"
+#include "spsc_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <time.h>
+
+namespace Common
+{
+
+namespace
+{
+
+struct ThreadQueue
+{
+    SpscRing<LogRecord*> filled;
+    SpscRing<LogRecord*> free;
+    std::vector<std::unique_ptr<LogRecord>> records;
+    std::atomic<bool> closed{false};
+
+    ThreadQueue(size_t depth)
+        : filled(depth), free(depth)
+    {
+        for (size_t i = 0; i < free.max_size(); ++i)
+        {
+            records.emplace_back(new LogRecord);
+            free.try_push(records.back().get());
+        }
+    }
+};
+
+struct ThreadState
+{
+    std::shared_ptr<ThreadQueue> queue;
+    std::string name;
+    bool named = false;
+
+    ~ThreadState()
+    {
+        if (queue)
+            queue->closed = true;
+    }
+};
+
+thread_local ThreadState t_state;
+
+const char* level_prefix(LogLevel level)
+{
+    switch(level)
+    {
+    case LogLevel::INF:
+        return "I>";
+    case LogLevel::ERR:
+        return "E>";
+    case LogLevel::WRN:
+        return "W>";
+    case LogLevel::DBG:
+        return "D>";
+    default:
+        break;
+    }
+
+    return "L>";
+}
+
+const char* level_color(LogLevel level)
+{
+    switch(level)
+    {
+    case LogLevel::INF:
+        return "\e[1;32m";
+    case LogLevel::ERR:
+        return "\e[1;31m";
+    case LogLevel::WRN:
+        return "\e[1;33m";
+    default:
+        break;
+    }
+
+    return nullptr;
+}
+
+// localtime and strftime once per second, milliseconds are patched in
+class TimeCache
+{
+    int64_t second = -1;
+    int64_t millisecond = -1;
+    char buffer[32];
+    size_t length = 0;
+
+public:
+    const char* Format(int64_t time_ms)
+    {
+        if (time_ms == millisecond)
+            return buffer;
+
+        int64_t sec = time_ms / 1000;
+        if (sec != second)
+        {
+            second = sec;
+            time_t t = static_cast<time_t>(sec);
+            struct tm tm_info;
+            localtime_r(&t, &tm_info);
+            length = strftime(buffer, 26, "%y:%m:%d %H:%M:%S", &tm_info);
+        }
+
+        millisecond = time_ms;
+        snprintf(buffer + length, sizeof(buffer) - length, ".%03d", static_cast<int>(time_ms % 1000));
+        return buffer;
+    }
+};
+
+template <typename T>
+T read_arg(const std::string& args, size_t& pos)
+{
+    T value;
+    memcpy(&value, args.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+// false when args are over
+bool format_arg(std::string& out, const std::string& args, size_t& pos)
+{
+    if (pos >= args.size())
+        return false;
+
+    char buffer[32];
+    auto tag = static_cast<LogArgTag>(args[pos++]);
+    switch (tag)
+    {
+    case LogArgTag::Int:
+        out += std::to_string(read_arg<int64_t>(args, pos));
+        break;
+    case LogArgTag::UInt:
+        out += std::to_string(read_arg<uint64_t>(args, pos));
+        break;
+    case LogArgTag::Double:
+        snprintf(buffer, sizeof(buffer), "%g", read_arg<double>(args, pos));
+        out += buffer;
+        break;
+    case LogArgTag::Bool:
+        out += read_arg<uint8_t>(args, pos) ? '1' : '0';
+        break;
+    case LogArgTag::Char:
+        out += read_arg<char>(args, pos);
+        break;
+    case LogArgTag::Pointer:
+        snprintf(buffer, sizeof(buffer), "%#jx", static_cast<uintmax_t>(read_arg<uintptr_t>(args, pos)));
+        out += buffer;
+        break;
+    case LogArgTag::String:
+    {
+        uint32_t length = read_arg<uint32_t>(args, pos);
+        out.append(args, pos, length);
+        pos += length;
+        break;
+    }
+    default:
+        pos = args.size();
+        return false;
+    }
+
+    return true;
+}
+
+void format_deferred(std::string& out, const LogSite& site, const std::string& args)
+{
+    size_t pos = 0;
+    for (const char* fmt = site.format; *fmt; ++fmt)
+    {
+        if (fmt[0] == '{' && fmt[1] == '}' && format_arg(out, args, pos))
+            ++fmt;
+        else
+            out += *fmt;
+    }
+
+    // arguments without placeholders
+    while (pos < args.size())
+    {
+        out += ' ';
+        format_arg(out, args, pos);
+    }
+}
+
+void format_record(std::string& out, TimeCache& time_cache, const LogRecord& record, bool color)
+{
+    const char* color_code = color ? level_color(record.level) : nullptr;
+    if (color_code)
+        out += color_code;
+
+    out += level_prefix(record.level);
+    out += time_cache.Format(record.time_ms);
+    out += " t:";
+    out += record.thread;
+    out += ' ';
+    if (record.site)
+        format_deferred(out, *record.site, record.args);
+    else
+        out += record.text;
+    out += " (";
+    out += record.file ? record.file : "";
+    out += ':';
+    out += std::to_string(record.line);
+    out += ")\n";
+
+    if (color_code)
+        out += "\e[m";
+}
+
+class Writer
+{
+    std::string path;
+    size_t max_file_size = 0;
+    unsigned max_files = 0;
+    size_t queue_depth = 0;
+    unsigned flush_interval_ms = 0;
+
+    std::ofstream file;
+    size_t file_size = 0;
+
+    std::mutex mx;
+    std::condition_variable cond_var;
+    std::condition_variable flushed_var;
+    std::vector<std::shared_ptr<ThreadQueue>> added;
+    uint64_t flush_requested = 0;
+    uint64_t flush_done = 0;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> dropped{0};
+
+    // writer thread
+    std::vector<std::shared_ptr<ThreadQueue>> queues;
+    std::vector<std::pair<ThreadQueue*, LogRecord*>> batch;
+    std::string file_out;
+    std::string console_out;
+    TimeCache time_cache;
+    uint64_t reported_dropped = 0;
+
+public:
+    ~Writer()
+    {
+        Stop();
+    }
+
+    void Start(const std::string& file_path, const LogParams& params)
+    {
+        if (running)
+            return;
+
+        path = file_path;
+        max_file_size = params.max_file_size;
+        max_files = std::max(1u, params.max_files);
+        queue_depth = std::max<size_t>(params.queue_depth, 2);
+        flush_interval_ms = std::max(1u, params.flush_interval_ms);
+
+        OpenFile();
+
+        stopping = false;
+        running = true;
+        thread = std::thread([this](){ Run(); });
+    }
+
+    void Stop()
+    {
+        if (!running)
+            return;
+
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            cond_var.notify_one();
+        }
+
+        if (thread.joinable())
+            thread.join();
+
+        running = false;
+        file.close();
+    }
+
+    bool Running() const
+    {
+        return running;
+    }
+
+    LogRecord* Acquire()
+    {
+        if (!t_state.queue)
+        {
+            t_state.queue = std::make_shared<ThreadQueue>(queue_depth);
+            std::lock_guard<std::mutex> lock(mx);
+            added.push_back(t_state.queue);
+        }
+
+        LogRecord* record = nullptr;
+        if (!t_state.queue->free.try_pop(record))
+        {
+            ++dropped;
+            return nullptr;
+        }
+
+        return record;
+    }
+
+    void Commit(LogRecord* record)
+    {
+        t_state.queue->filled.try_push(record);
+    }
+
+    void Flush()
+    {
+        if (!running || std::this_thread::get_id() == thread.get_id())
+            return;
+
+        std::unique_lock<std::mutex> lock(mx);
+        uint64_t request = ++flush_requested;
+        cond_var.notify_one();
+        // bounded, flush is called from crash handler too
+        flushed_var.wait_for(lock, std::chrono::seconds(1), [&](){ return flush_done >= request; });
+    }
+
+    uint64_t Dropped() const
+    {
+        return dropped;
+    }
+
+private:
+    void OpenFile(bool truncate = false)
+    {
+        file.open(path, std::ofstream::out|(truncate ? std::ofstream::trunc : std::ofstream::app));
+        file_size = file.is_open() ? static_cast<size_t>(file.tellp()) : 0;
+    }
+
+    void Rotate()
+    {
+        file.close();
+
+        for (unsigned i = max_files - 1; i > 0; --i)
+        {
+            std::string from = i == 1 ? path : path + "." + std::to_string(i - 1);
+            rename(from.c_str(), (path + "." + std::to_string(i)).c_str());
+        }
+
+        OpenFile(true);
+    }
+
+    void Run()
+    {
+        register_current_thread("log");
+
+        while (true)
+        {
+            uint64_t request;
+            {
+                std::lock_guard<std::mutex> lock(mx);
+                for (auto& queue : added)
+                    queues.push_back(queue);
+                added.clear();
+                request = flush_requested;
+            }
+
+            bool stop = stopping;
+            Drain();
+
+            {
+                std::lock_guard<std::mutex> lock(mx);
+                flush_done = request;
+                flushed_var.notify_all();
+            }
+
+            if (stop)
+                break;
+
+            std::unique_lock<std::mutex> lock(mx);
+            cond_var.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [&](){
+                return stopping || flush_requested != flush_done;
+            });
+        }
+    }
+
+    void Drain()
+    {
+        for (auto& queue : queues)
+        {
+            LogRecord* record = nullptr;
+            while (queue->filled.try_pop(record))
+                batch.emplace_back(queue.get(), record);
+        }
+
+        // queues are drained in turn, restore time order of the batch
+        std::stable_sort(batch.begin(), batch.end(), [](const std::pair<ThreadQueue*, LogRecord*>& l, const std::pair<ThreadQueue*, LogRecord*>& r){
+            return l.second->time_ms < r.second->time_ms;
+        });
+
+        for (auto& item : batch)
+        {
+            LogRecord& record = *item.second;
+            format_record(file_out, time_cache, record, false);
+            if (record.console)
+                format_record(console_out, time_cache, record, true);
+            item.first->free.try_push(item.second);
+        }
+        batch.clear();
+
+        uint64_t lost = dropped;
+        if (lost != reported_dropped)
+        {
+            LogRecord record;
+            record.level = LogLevel::WRN;
+            record.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            record.thread = "log";
+            record.text = std::to_string(lost - reported_dropped) + " log records dropped, total " + std::to_string(lost);
+            record.file = __FILENAME__;
+            record.line = __LINE__;
+            format_record(file_out, time_cache, record, false);
+            reported_dropped = lost;
+        }
+
+        for (size_t i = 0; i < queues.size();)
+        {
+            if (queues[i]->closed && queues[i]->filled.empty())
+            {
+                queues[i] = queues.back();
+                queues.pop_back();
+            }
+            else
+                ++i;
+        }
+
+        if (!file_out.empty())
+        {
+            file.write(file_out.data(), file_out.size());
+            file.flush();
+            file_size += file_out.size();
+            file_out.clear();
+
+            if (max_file_size && file_size >= max_file_size)
+                Rotate();
+        }
+
+        if (!console_out.empty())
+        {
+            std::cout.write(console_out.data(), console_out.size());
+            std::cout.flush();
+            console_out.clear();
+        }
+    }
+};
+
+Writer& writer()
+{
+    static Writer instance;
+    return instance;
+}
+
+std::mutex g_sync_mx;
+TimeCache g_sync_time_cache;
+
+// names given by other threads, looked up once by the named thread
+std::mutex g_names_mx;
+std::vector<std::pair<std::thread::id, std::string>> g_names;
+
+std::string registered_name(const std::thread::id& id)
+{
+    std::lock_guard<std::mutex> lock(g_names_mx);
+    for (auto& item : g_names)
+    {
+        if (item.first == id)
+            return item.second;
+    }
+    return std::string();
+}
+
+}
+
+namespace LogBackend
+{
+
+void Start(const std::string& path, const LogParams& params)
+{
+    writer().Start(path, params);
+}
+
+void Stop()
+{
+    writer().Stop();
+}
+
+bool Running()
+{
+    return writer().Running();
+}
+
+LogRecord* Acquire()
+{
+    LogRecord* record = writer().Acquire();
+    if (!record)
+        return nullptr;
+
+    if (!t_state.named)
+    {
+        t_state.named = true;
+        t_state.name = registered_name(std::this_thread::get_id());
+        if (t_state.name.empty())
+        {
+            std::ostringstream sstr;
+            sstr << std::this_thread::get_id();
+            t_state.name = sstr.str();
+        }
+    }
+
+    record->thread = t_state.name;
+    record->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    return record;
+}
+
+void Commit(LogRecord* record)
+{
+    writer().Commit(record);
+}
+
+void Flush()
+{
+    writer().Flush();
+}
+
+uint64_t Dropped()
+{
+    return writer().Dropped();
+}
+
+void RegisterThread(const std::thread::id& id, const std::string& name)
+{
+    if (id == std::this_thread::get_id())
+    {
+        t_state.name = name;
+        t_state.named = true;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(g_names_mx);
+    g_names.emplace_back(id, name);
+}
+
+void Write(const LogRecord& record)
+{
+    std::string out;
+    std::lock_guard<std::mutex> lock(g_sync_mx);
+    format_record(out, g_sync_time_cache, record, true);
+    std::cout << out;
+}
+
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.h"
+#include "log_args.hpp"
+
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace Common
+{
+
+struct LogParams;
+
+struct LogRecord
+{
+    LogLevel level = LogLevel::NO;
+    bool console = false;
+    const char* file = nullptr;
+    int line = 0;
+    // system clock, milliseconds
+    int64_t time_ms = 0;
+    std::string thread;
+    std::string text;
+    // deferred record, text is formatted from site format and args
+    const LogSite* site = nullptr;
+    std::string args;
+};
+
+// Log writer thread. Every logging thread owns a lock-free queue of
+// preallocated records, the writer formats and writes them in batches.
+namespace LogBackend
+{
+
+void Start(const std::string& path, const LogParams& params);
+void Stop();
+bool Running();
+
+// free record of current thread, nullptr if queue is full (record is dropped)
+LogRecord* Acquire();
+void Commit(LogRecord* record);
+
+// waits for records queued before the call to be written
+void Flush();
+uint64_t Dropped();
+
+void RegisterThread(const std::thread::id& id, const std::string& name);
+
+// synchronous output when writer thread is not running
+void Write(const LogRecord& record);
+
+}
+
+}
@@ -1,12 +1,172 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 namespace Common
 { namespace Messages {
 
+// Control connection carries frames:
+//   be32 size of the rest | u8 type | be32 request id | payload
+// Requests are pipelined, replies come in any order with the request id.
+constexpr size_t frame_header_size = 9;
+constexpr size_t max_frame_size = 64 * 1024;
+
 enum Types
 {
-    RESERVE_TWO_PORTS = 1,
-    START_STREAM = 2
+    // payload: sdp; reply after receiver started: status, be16 video port, be16 audio port, be32 stream id
+    OPEN_STREAM = 1,
+    // payload: be32 request id of OPEN_STREAM or SUBSCRIBE; reply: status
+    CLOSE_STREAM = 2,
+    // server event with request id of OPEN_STREAM or SUBSCRIBE, stream was
+    // stopped by server or subscriber was evicted
+    STREAM_CLOSED = 3,
+    // payload: be32 stream id, be16 udp port; rtp and rtcp of the stream go to
+    // the port at the address of the connection until it is closed;
+    // reply: status, sdp of the stream
+    SUBSCRIBE = 4,
+    // reply with request id, payload starts with Status
+    REPLY = 0x80,
+};
+
+enum Status
+{
+    OK = 0,
+    FAIL = 1,
+    NO_PORTS = 2,
+    // node is near saturation, payload: be32 retry after ms
+    BUSY = 3,
+};
+
+struct Frame
+{
+    uint8_t type = 0;
+    uint32_t request_id = 0;
+    const uint8_t* payload = nullptr;
+    size_t size = 0;
+};
+
+inline void put_be16(std::vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(value >> 8);
+    out.push_back(value & 0xff);
+}
+
+inline void put_be32(std::vector<uint8_t>& out, uint32_t value)
+{
+    out.push_back(value >> 24);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back(value & 0xff);
+}
+
+inline uint16_t get_be16(const uint8_t* data)
+{
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+inline uint32_t get_be32(const uint8_t* data)
+{
+    return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16)
+            | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+}
+
+inline void append_frame(std::vector<uint8_t>& out, uint8_t type, uint32_t request_id, const void* payload = nullptr, size_t size = 0)
+{
+    put_be32(out, static_cast<uint32_t>(frame_header_size - 4 + size));
+    out.push_back(type);
+    put_be32(out, request_id);
+    if (size)
+    {
+        auto data = static_cast<const uint8_t*>(payload);
+        out.insert(out.end(), data, data + size);
+    }
+}
+
+inline void append_reply(std::vector<uint8_t>& out, uint32_t request_id, Status status, const std::vector<uint8_t>& data = std::vector<uint8_t>())
+{
+    std::vector<uint8_t> payload(1, status);
+    payload.insert(payload.end(), data.begin(), data.end());
+    append_frame(out, REPLY, request_id, payload.data(), payload.size());
+}
+
+// Incremental frame parser. Socket reads go straight to Prepare() space,
+// complete frames are returned in place; only the unfinished tail is moved
+// to the front when space runs out.
+class FrameParser
+{
+    std::vector<uint8_t> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool error = false;
+
+public:
+    explicit FrameParser(size_t capacity = 8192)
+        : buffer(capacity)
+    {
+    }
+
+    // free space of at least min_size, frames returned before are invalidated
+    uint8_t* Prepare(size_t min_size, size_t& size)
+    {
+        if (begin == end)
+            begin = end = 0;
+
+        if (buffer.size() - end < min_size)
+        {
+            if (begin)
+            {
+                memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+
+            if (buffer.size() - end < min_size)
+                buffer.resize(end + min_size);
+        }
+
+        size = buffer.size() - end;
+        return buffer.data() + end;
+    }
+
+    void Commit(size_t size)
+    {
+        end += size;
+    }
+
+    // next complete frame, false if more data is needed or on error
+    bool Next(Frame& frame)
+    {
+        if (error || end - begin < frame_header_size)
+            return false;
+
+        const uint8_t* data = buffer.data() + begin;
+        size_t size = get_be32(data);
+        if (size < frame_header_size - 4 || size > max_frame_size)
+        {
+            error = true;
+            return false;
+        }
+
+        if (end - begin < size + 4)
+            return false;
+
+        frame.type = data[4];
+        frame.request_id = get_be32(data + 5);
+        frame.payload = data + frame_header_size;
+        frame.size = size + 4 - frame_header_size;
+
+        begin += size + 4;
+        return true;
+    }
+
+    // malformed frame, connection should be closed
+    bool Error() const
+    {
+        return error;
+    }
 };
 
 }}
@@ -0,0 +1,368 @@
+#include "metrics.h"
+#include "common.h"
+
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include <pthread.h>
+#include <time.h>
+
+namespace Common
+{
+
+namespace
+{
+
+class CallbackSource : public MetricSource
+{
+    const std::function<double()> value;
+
+public:
+    CallbackSource(const std::function<double()>& value) : value(value)
+    {}
+
+    double Value() const override
+    {
+        return value();
+    }
+};
+
+struct Series
+{
+    std::string labels;
+    std::weak_ptr<MetricSource> source;
+};
+
+struct Family
+{
+    std::string help;
+    Metrics::Type type = Metrics::Type::Counter;
+    std::vector<Series> series;
+};
+
+// merged series of a family by formatted labels
+typedef std::map<std::string, std::pair<Metrics::Labels, std::unique_ptr<Histogram>>> MergedHistograms;
+
+struct HistogramSeries
+{
+    Metrics::Labels labels;
+    // shared, so counts are still there when the owners are gone
+    HistogramPtr histogram;
+};
+
+struct HistogramFamily
+{
+    std::string help;
+    std::vector<HistogramSeries> series;
+    // counts of series whose owners are gone, keeps _count and _sum monotonic
+    MergedHistograms retired;
+};
+
+struct ThreadClock
+{
+    std::string name;
+    clockid_t clock;
+};
+
+struct Registry
+{
+    std::mutex mx;
+    std::map<std::string, Family> families;
+    std::map<std::string, HistogramFamily> histograms;
+    std::vector<ThreadClock> threads;
+};
+
+Registry& registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+std::string format_labels(const Metrics::Labels& labels)
+{
+    if (labels.empty())
+        return std::string();
+
+    std::string result = "{";
+    for (size_t i = 0; i < labels.size(); ++i)
+    {
+        if (i)
+            result += ',';
+        result += labels[i].first + "=\"";
+        for (char c : labels[i].second)
+        {
+            if (c == '\\' || c == '"')
+                result += '\\';
+            if (c == '\n')
+                result += "\\n";
+            else
+                result += c;
+        }
+        result += '"';
+    }
+    return result + "}";
+}
+
+void format_value(std::ostringstream& out, double value)
+{
+    // integers as integers, counters are never written in exponent form
+    if (std::floor(value) == value && std::fabs(value) < 1e15)
+        out << static_cast<int64_t>(value);
+    else
+    {
+        out.precision(12);
+        out << value;
+    }
+}
+
+void add_source(const std::string& name, const std::string& help, Metrics::Type type,
+                const Metrics::Labels& labels, const MetricSourcePtr& source)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    Family& family = reg.families[name];
+    if (family.series.empty())
+    {
+        family.help = help;
+        family.type = type;
+    }
+    family.series.push_back({format_labels(labels), source});
+}
+
+void merge_into(MergedHistograms& merged, const Metrics::Labels& labels, const Histogram& histogram)
+{
+    auto& slot = merged[format_labels(labels)];
+    if (!slot.second)
+    {
+        slot.first = labels;
+        slot.second.reset(new Histogram());
+    }
+    slot.second->Merge(histogram);
+}
+
+// retires series only the registry holds, registry lock is held
+MergedHistograms merge_histograms(std::map<std::string, HistogramFamily>::iterator family)
+{
+    MergedHistograms merged;
+    for (auto& retired : family->second.retired)
+        merge_into(merged, retired.second.first, *retired.second.second);
+
+    auto& series = family->second.series;
+    size_t kept = 0;
+    for (size_t i = 0; i < series.size(); ++i)
+    {
+        merge_into(merged, series[i].labels, *series[i].histogram);
+        // no owner can record or get it again
+        if (series[i].histogram.use_count() == 1)
+        {
+            merge_into(family->second.retired, series[i].labels, *series[i].histogram);
+            continue;
+        }
+        series[kept++] = series[i];
+    }
+    series.resize(kept);
+    return merged;
+}
+
+const double summary_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+}
+
+namespace Metrics
+{
+
+CounterPtr AddCounter(const std::string& name, const std::string& help, const Labels& labels)
+{
+    auto counter = std::make_shared<Counter>();
+    add_source(name, help, Type::Counter, labels, counter);
+    return counter;
+}
+
+GaugePtr AddGauge(const std::string& name, const std::string& help, const Labels& labels)
+{
+    auto gauge = std::make_shared<Gauge>();
+    add_source(name, help, Type::Gauge, labels, gauge);
+    return gauge;
+}
+
+MetricSourcePtr AddCallback(const std::string& name, const std::string& help, Type type, const Labels& labels,
+                            const std::function<double()>& value)
+{
+    auto source = std::make_shared<CallbackSource>(value);
+    add_source(name, help, type, labels, source);
+    return source;
+}
+
+HistogramPtr AddHistogram(const std::string& name, const std::string& help, const Labels& labels)
+{
+    auto histogram = std::make_shared<Histogram>();
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    HistogramFamily& family = reg.histograms[name];
+    if (family.series.empty())
+        family.help = help;
+    family.series.push_back({labels, histogram});
+    return histogram;
+}
+
+void LogHistograms()
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    for (auto it = reg.histograms.begin(); it != reg.histograms.end(); ++it)
+    {
+        for (auto& merged : merge_histograms(it))
+            LOG(it->first << merged.first << " us " << merged.second.second->Summary(1e3));
+    }
+}
+
+void RegisterThread(const std::string& name)
+{
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+        return;
+
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    reg.threads.push_back({name, clock});
+}
+
+std::string Render()
+{
+    // sources are read under registry lock, callbacks must not register metrics
+    struct Item
+    {
+        const std::string* labels;
+        MetricSourcePtr source;
+    };
+
+    std::ostringstream out;
+    Registry& reg = registry();
+    std::unique_lock<std::mutex> lock(reg.mx);
+
+    for (auto it = reg.families.begin(); it != reg.families.end();)
+    {
+        Family& family = it->second;
+        std::vector<Item> items;
+        size_t kept = 0;
+        for (size_t i = 0; i < family.series.size(); ++i)
+        {
+            MetricSourcePtr source = family.series[i].source.lock();
+            if (!source)
+                continue;
+            family.series[kept++] = family.series[i];
+            items.push_back({&family.series[kept - 1].labels, source});
+        }
+        family.series.resize(kept);
+
+        if (items.empty())
+        {
+            it = reg.families.erase(it);
+            continue;
+        }
+
+        out << "# HELP " << it->first << " " << family.help << "\n";
+        out << "# TYPE " << it->first << (family.type == Type::Counter ? " counter\n" : " gauge\n");
+        for (auto& item : items)
+        {
+            out << it->first << *item.labels << " ";
+            format_value(out, item.source->Value());
+            out << "\n";
+        }
+        ++it;
+    }
+
+    for (auto it = reg.histograms.begin(); it != reg.histograms.end();)
+    {
+        MergedHistograms merged = merge_histograms(it);
+        if (merged.empty())
+        {
+            it = reg.histograms.erase(it);
+            continue;
+        }
+
+        out << "# HELP " << it->first << " " << it->second.help << "\n";
+        out << "# TYPE " << it->first << " summary\n";
+        for (auto& series : merged)
+        {
+            const Histogram& histogram = *series.second.second;
+            for (double q : summary_quantiles)
+            {
+                Labels labels = series.second.first;
+                std::ostringstream quantile;
+                quantile << q;
+                labels.emplace_back("quantile", quantile.str());
+                out << it->first << format_labels(labels) << " ";
+                format_value(out, histogram.Quantile(q) / 1e9);
+                out << "\n";
+            }
+            out << it->first << "_sum" << series.first << " ";
+            format_value(out, histogram.Sum() / 1e9);
+            out << "\n" << it->first << "_count" << series.first << " " << histogram.Count() << "\n";
+        }
+        ++it;
+    }
+
+    if (!reg.threads.empty())
+    {
+        out << "# HELP streamer_thread_cpu_seconds_total CPU time of named threads\n";
+        out << "# TYPE streamer_thread_cpu_seconds_total counter\n";
+    }
+
+    for (size_t i = 0; i < reg.threads.size();)
+    {
+        timespec ts = {};
+        // thread has exited
+        if (clock_gettime(reg.threads[i].clock, &ts) != 0)
+        {
+            reg.threads[i] = reg.threads.back();
+            reg.threads.pop_back();
+            continue;
+        }
+
+        out << "streamer_thread_cpu_seconds_total" << format_labels({{"thread", reg.threads[i].name}}) << " ";
+        format_value(out, ts.tv_sec + ts.tv_nsec / 1e9);
+        out << "\n";
+        ++i;
+    }
+
+    return out.str();
+}
+
+double Total(const std::string& name)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    auto it = reg.families.find(name);
+    if (it == reg.families.end())
+        return 0;
+
+    double total = 0;
+    for (auto& series : it->second.series)
+    {
+        MetricSourcePtr source = series.source.lock();
+        if (source)
+            total += source->Value();
+    }
+    return total;
+}
+
+double ThreadCpuSeconds(const std::string& prefix)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mx);
+    double total = 0;
+    for (auto& thread : reg.threads)
+    {
+        timespec ts = {};
+        if (thread.name.compare(0, prefix.size(), prefix) == 0 && clock_gettime(thread.clock, &ts) == 0)
+            total += ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+    return total;
+}
+
+}
+
+}
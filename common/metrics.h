@@ -0,0 +1,123 @@
+#pragma once
+
+#include "histogram.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Common
+{
+
+// Value of one series at scrape time.
+struct MetricSource
+{
+    virtual ~MetricSource() = default;
+    virtual double Value() const = 0;
+};
+
+// Monotonic counter, lock-free on the hot path.
+class Counter : public MetricSource
+{
+    std::atomic<uint64_t> value{0};
+
+public:
+    void Add(uint64_t n = 1)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // cheaper form for counters written by one thread only
+    void AddSingle(uint64_t n = 1)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    double Value() const override
+    {
+        return static_cast<double>(Get());
+    }
+};
+
+class Gauge : public MetricSource
+{
+    std::atomic<int64_t> value{0};
+
+public:
+    void Set(int64_t v)
+    {
+        value.store(v, std::memory_order_relaxed);
+    }
+
+    void Add(int64_t n)
+    {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t Get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    double Value() const override
+    {
+        return static_cast<double>(Get());
+    }
+};
+
+typedef std::shared_ptr<Counter> CounterPtr;
+typedef std::shared_ptr<Gauge> GaugePtr;
+typedef std::shared_ptr<MetricSource> MetricSourcePtr;
+
+// Process wide registry rendered as Prometheus text. Registration takes a
+// lock, updates do not. Series are owned by callers, the registry keeps weak
+// references, so series of a stream disappear with the stream.
+namespace Metrics
+{
+
+typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+enum class Type
+{
+    Counter,
+    Gauge,
+};
+
+CounterPtr AddCounter(const std::string& name, const std::string& help, const Labels& labels = Labels());
+GaugePtr AddGauge(const std::string& name, const std::string& help, const Labels& labels = Labels());
+// value is read at scrape time on the scraping thread, keep the result alive;
+// value must not register metrics
+MetricSourcePtr AddCallback(const std::string& name, const std::string& help, Type type, const Labels& labels,
+                            const std::function<double()>& value);
+
+// Rendered as summary with quantiles in seconds, histograms of one name and
+// labels are merged, so every recording thread may own its histogram.
+// Counts of released histograms stay in the summary. Values are nanoseconds.
+HistogramPtr AddHistogram(const std::string& name, const std::string& help, const Labels& labels = Labels());
+
+// logs merged histograms, for periodic dumps
+void LogHistograms();
+
+// cpu time of the current thread is reported until it exits
+void RegisterThread(const std::string& name);
+
+// text exposition format 0.0.4
+std::string Render();
+
+// sum of live series of a counter or gauge, 0 if there are none
+double Total(const std::string& name);
+// cpu time of live registered threads whose name starts with prefix
+double ThreadCpuSeconds(const std::string& prefix);
+
+}
+
+}
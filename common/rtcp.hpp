@@ -0,0 +1,83 @@
+#pragma once
+
+#include "messages.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace Common
+{ namespace Rtcp {
+
+// transport layer feedback (RFC 4585), generic NACK format
+constexpr uint8_t rtpfb = 205;
+constexpr uint8_t generic_nack = 1;
+
+// Appends a generic NACK packet for seqs of media_ssrc. Every FCI entry holds
+// a sequence number and a bitmask of the 16 following it, so seqs in
+// ascending order take fewest entries.
+inline void append_generic_nack(std::vector<uint8_t>& out, uint32_t sender_ssrc, uint32_t media_ssrc, const std::vector<uint16_t>& seqs)
+{
+    std::vector<uint8_t> fci;
+    for (size_t i = 0; i < seqs.size(); )
+    {
+        uint16_t pid = seqs[i++];
+        uint16_t blp = 0;
+        for (; i < seqs.size(); ++i)
+        {
+            uint16_t distance = static_cast<uint16_t>(seqs[i] - pid);
+            if (distance > 16)
+                break;
+            if (distance)
+                blp |= 1 << (distance - 1);
+        }
+        Messages::put_be16(fci, pid);
+        Messages::put_be16(fci, blp);
+    }
+
+    // length in 32 bit words minus one
+    out.push_back(0x80 | generic_nack);
+    out.push_back(rtpfb);
+    Messages::put_be16(out, static_cast<uint16_t>(2 + fci.size() / 4));
+    Messages::put_be32(out, sender_ssrc);
+    Messages::put_be32(out, media_ssrc);
+    out.insert(out.end(), fci.begin(), fci.end());
+}
+
+// Calls on_nack(media_ssrc, seq) for every sequence number requested by
+// generic NACKs of a compound packet, other packets are skipped. False if
+// the datagram is not rtcp.
+template <typename F>
+bool parse_generic_nacks(const uint8_t* data, size_t size, F&& on_nack)
+{
+    if (size < 4 || (data[0] >> 6) != 2 || data[1] < 200 || data[1] > 206)
+        return false;
+
+    for (size_t pos = 0; pos + 4 <= size; )
+    {
+        const uint8_t* packet = data + pos;
+        size_t length = (static_cast<size_t>(Messages::get_be16(packet + 2)) + 1) * 4;
+        if ((packet[0] >> 6) != 2 || pos + length > size)
+            return false;
+        pos += length;
+
+        if (packet[1] != rtpfb || (packet[0] & 0x1f) != generic_nack || length < 12)
+            continue;
+
+        uint32_t media_ssrc = Messages::get_be32(packet + 8);
+        for (size_t fci = 12; fci + 4 <= length; fci += 4)
+        {
+            uint16_t pid = Messages::get_be16(packet + fci);
+            uint16_t blp = Messages::get_be16(packet + fci + 2);
+            on_nack(media_ssrc, pid);
+            for (unsigned bit = 0; bit < 16; ++bit)
+            {
+                if (blp & (1 << bit))
+                    on_nack(media_ssrc, static_cast<uint16_t>(pid + bit + 1));
+            }
+        }
+    }
+
+    return true;
+}
+
+}}
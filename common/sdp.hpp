@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace Common
+{ namespace Sdp {
+
+// Adds "a=ssrc:" attribute (RFC 5576) to every media section, ssrcs are in
+// order of "m=" lines. Shared port ingest routes packets by these values.
+inline std::string add_ssrcs(const std::string& sdp, const std::vector<uint32_t>& ssrcs)
+{
+    std::string result;
+    size_t media = 0;
+    size_t pos = 0;
+
+    auto close_media = [&]()
+    {
+        if (media && media <= ssrcs.size())
+            result += "a=ssrc:" + std::to_string(ssrcs[media - 1]) + " cname:streamer\r\n";
+    };
+
+    while (pos < sdp.size())
+    {
+        size_t end = sdp.find('\n', pos);
+        end = end == std::string::npos ? sdp.size() : end + 1;
+
+        if (sdp.compare(pos, 2, "m=") == 0)
+        {
+            close_media();
+            ++media;
+        }
+
+        result.append(sdp, pos, end - pos);
+        if (result.back() != '\n')
+            result += "\r\n";
+        pos = end;
+    }
+
+    close_media();
+    return result;
+}
+
+// ssrcs of "a=ssrc:" attributes in order of appearance, repeated values once
+inline std::vector<uint32_t> parse_ssrcs(const std::string& sdp)
+{
+    static const std::string attribute = "a=ssrc:";
+
+    std::vector<uint32_t> ssrcs;
+    for (size_t pos = sdp.find(attribute); pos != std::string::npos; pos = sdp.find(attribute, pos + 1))
+    {
+        if (pos && sdp[pos - 1] != '\n')
+            continue;
+
+        uint32_t ssrc = static_cast<uint32_t>(strtoul(sdp.c_str() + pos + attribute.size(), nullptr, 10));
+        bool known = false;
+        for (uint32_t value : ssrcs)
+            known = known || value == ssrc;
+        if (!known)
+            ssrcs.push_back(ssrc);
+    }
+
+    return ssrcs;
+}
+
+}}
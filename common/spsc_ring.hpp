@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+namespace Common
+{
+
+// Bounded lock-free single producer / single consumer ring.
+// Besides the consumer, the producer may take the oldest element back with
+// try_drop_oldest, so head is advanced by CAS from both sides.
+template <typename T>
+class SpscRing
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SpscRing holds trivially copyable values");
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<std::atomic<T>[]> slots;
+
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    // written by producer only
+    alignas(64) std::atomic<size_t> high_watermark{0};
+
+    static size_t round_up(size_t value)
+    {
+        size_t result = 2;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+public:
+    explicit SpscRing(size_t min_capacity)
+        : capacity(round_up(min_capacity))
+        , mask(capacity - 1)
+        , slots(new std::atomic<T>[capacity])
+    {
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // producer
+    bool try_push(T value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t used = t - head.load(std::memory_order_acquire);
+        if (used >= capacity)
+            return false;
+
+        slots[t & mask].store(value, std::memory_order_relaxed);
+        tail.store(t + 1, std::memory_order_release);
+
+        if (used + 1 > high_watermark.load(std::memory_order_relaxed))
+            high_watermark.store(used + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer
+    bool try_pop(T& value)
+    {
+        return take_head(value);
+    }
+
+    // producer, takes away the oldest element instead of the consumer
+    bool try_drop_oldest(T& value)
+    {
+        return take_head(value);
+    }
+
+    size_t size() const
+    {
+        size_t h = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - h;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t max_size() const
+    {
+        return capacity;
+    }
+
+    // high watermark of size
+    size_t max_used() const
+    {
+        return high_watermark.load(std::memory_order_relaxed);
+    }
+
+private:
+    bool take_head(T& value)
+    {
+        size_t h = head.load(std::memory_order_acquire);
+        for (;;)
+        {
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+
+            value = slots[h & mask].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+                return true;
+        }
+    }
+};
+
+}
@@ -0,0 +1,326 @@
+#include "control_proxy.h"
+
+#include "relay_app.h"
+
+#include <map>
+#include <set>
+
+#include <boost/asio.hpp>
+
+#include "common/common.h"
+#include "common/messages.h"
+
+using boost::asio::ip::tcp;
+
+namespace Relay
+{
+
+namespace
+{
+
+DECLARE_PTR(ProxySession)
+
+// Control connection of one client and its connection to the server.
+// Frames are parsed both ways: requests to know what a reply answers,
+// replies to rewrite ports. Streams outlive the connection like on the
+// server, their relay ports are closed by the relay when idle.
+class ProxySession : public std::enable_shared_from_this<ProxySession>
+        , public Common::ObjectCounter<ProxySession>
+{
+    static constexpr size_t read_size = 4096;
+
+    struct Direction
+    {
+        tcp::socket& from;
+        tcp::socket& to;
+        Common::Messages::FrameParser parser;
+        // frames queued while a write is in flight
+        std::vector<uint8_t> out;
+        std::vector<uint8_t> writing;
+
+        Direction(tcp::socket& from, tcp::socket& to)
+            : from(from), to(to)
+        {
+        }
+    };
+
+    struct Ports
+    {
+        RelayPair pair1;
+        RelayPair pair2;
+    };
+
+    tcp::socket client;
+    tcp::socket server;
+    const IUdpRelayPtr relay;
+    const std::function<void(const ProxySessionPtr&)> on_stopped;
+
+    Direction requests;
+    Direction replies;
+
+    // request ids of OPEN_STREAM waiting for reply
+    std::set<uint32_t> opens;
+    // request id of CLOSE_STREAM to request id of its OPEN_STREAM
+    std::map<uint32_t, uint32_t> closes;
+    std::map<uint32_t, Ports> streams;
+    bool stopped = false;
+
+public:
+    ProxySession(boost::asio::io_service& io, tcp::socket socket, const IUdpRelayPtr& relay,
+                 const std::function<void(const ProxySessionPtr&)>& on_stopped)
+        : client(std::move(socket))
+        , server(io)
+        , relay(relay)
+        , on_stopped(on_stopped)
+        , requests(client, server)
+        , replies(server, client)
+    {
+    }
+
+    void Start(const tcp::endpoint& endpoint)
+    {
+        auto self(shared_from_this());
+        server.async_connect(endpoint, [this, self](boost::system::error_code ec)
+        {
+            if (stopped)
+                return;
+
+            if (ec)
+            {
+                LOGW("Cannot connect to server " << ec.message());
+                Stop();
+                return;
+            }
+
+            DoRead(requests);
+            DoRead(replies);
+        });
+    }
+
+    void Stop()
+    {
+        if (stopped)
+            return;
+
+        stopped = true;
+        boost::system::error_code ec;
+        client.close(ec);
+        server.close(ec);
+        on_stopped(shared_from_this());
+    }
+
+private:
+    void DoRead(Direction& direction)
+    {
+        size_t size = 0;
+        uint8_t* data = direction.parser.Prepare(read_size, size);
+
+        auto self(shared_from_this());
+        direction.from.async_read_some(boost::asio::buffer(data, size),
+            [this, self, &direction](boost::system::error_code ec, std::size_t length)
+            {
+                if (stopped)
+                    return;
+
+                if (ec)
+                {
+                    LOG("Control connection closed " << ec);
+                    Stop();
+                    return;
+                }
+
+                direction.parser.Commit(length);
+
+                Common::Messages::Frame frame;
+                while (direction.parser.Next(frame))
+                {
+                    if (&direction == &requests)
+                        ProcessRequest(frame);
+                    else
+                        ProcessReply(frame);
+                }
+
+                if (direction.parser.Error())
+                {
+                    LOGW("Malformed control frame, close connection");
+                    Stop();
+                    return;
+                }
+
+                DoWrite(direction);
+                DoRead(direction);
+            });
+    }
+
+    void DoWrite(Direction& direction)
+    {
+        if (stopped || !direction.writing.empty() || direction.out.empty())
+            return;
+
+        direction.writing.swap(direction.out);
+
+        auto self(shared_from_this());
+        boost::asio::async_write(direction.to, boost::asio::buffer(direction.writing),
+            [this, self, &direction](boost::system::error_code ec, std::size_t )
+            {
+                direction.writing.clear();
+
+                if (ec)
+                {
+                    Stop();
+                    return;
+                }
+
+                DoWrite(direction);
+            });
+    }
+
+    void ProcessRequest(const Common::Messages::Frame& frame)
+    {
+        if (frame.type == Common::Messages::OPEN_STREAM)
+            opens.insert(frame.request_id);
+        else if (frame.type == Common::Messages::CLOSE_STREAM && frame.size >= 4)
+            closes[frame.request_id] = Common::Messages::get_be32(frame.payload);
+
+        Common::Messages::append_frame(requests.out, frame.type, frame.request_id, frame.payload, frame.size);
+    }
+
+    void ProcessReply(const Common::Messages::Frame& frame)
+    {
+        if (frame.type == Common::Messages::STREAM_CLOSED)
+            CloseStream(frame.request_id);
+
+        if (frame.type != Common::Messages::REPLY)
+        {
+            Common::Messages::append_frame(replies.out, frame.type, frame.request_id, frame.payload, frame.size);
+            return;
+        }
+
+        auto close = closes.find(frame.request_id);
+        if (close != closes.end())
+        {
+            CloseStream(close->second);
+            closes.erase(close);
+        }
+
+        if (!opens.erase(frame.request_id) || frame.size < 5 || frame.payload[0] != Common::Messages::OK)
+        {
+            Common::Messages::append_frame(replies.out, frame.type, frame.request_id, frame.payload, frame.size);
+            return;
+        }
+
+        uint16_t port1 = Common::Messages::get_be16(frame.payload + 1);
+        uint16_t port2 = Common::Messages::get_be16(frame.payload + 3);
+
+        Ports ports;
+        ports.pair1 = relay->Open(port1);
+        if (ports.pair1.port)
+            ports.pair2 = relay->Open(port2);
+        if (!ports.pair2.port)
+        {
+            // server stream is dropped by its receiver timeout
+            if (ports.pair1.port)
+                relay->Close(ports.pair1);
+            Common::Messages::append_reply(replies.out, frame.request_id, Common::Messages::NO_PORTS);
+            return;
+        }
+
+        streams[frame.request_id] = ports;
+        LOG("Stream " << frame.request_id << " ports " << port1 << ";" << port2 << " relayed on " << ports.pair1.port << ";" << ports.pair2.port);
+
+        std::vector<uint8_t> payload(frame.payload, frame.payload + frame.size);
+        payload[1] = ports.pair1.port >> 8;
+        payload[2] = ports.pair1.port & 0xff;
+        payload[3] = ports.pair2.port >> 8;
+        payload[4] = ports.pair2.port & 0xff;
+        Common::Messages::append_frame(replies.out, frame.type, frame.request_id, payload.data(), payload.size());
+    }
+
+    void CloseStream(uint32_t request_id)
+    {
+        auto it = streams.find(request_id);
+        if (it == streams.end())
+            return;
+
+        // pairs closed when idle may belong to another stream now
+        relay->Close(it->second.pair1);
+        relay->Close(it->second.pair2);
+        streams.erase(it);
+    }
+};
+
+class ControlProxy : public IControlProxy
+        , public std::enable_shared_from_this<ControlProxy>
+        , public Common::ObjectCounter<ControlProxy>
+{
+    const Common::IApplicationPtr app;
+    const IUdpRelayPtr relay;
+    const tcp::endpoint server_endpoint;
+
+    tcp::acceptor acceptor;
+    tcp::socket socket;
+
+    std::set<ProxySessionPtr> sessions;
+
+public:
+    ControlProxy(Common::IApplicationPtr app, const RelayParams& params, IUdpRelayPtr relay)
+        : app(app)
+        , relay(relay)
+        , server_endpoint(boost::asio::ip::address::from_string(params.server_addr), params.server_port)
+        , acceptor(app->GetIOService())
+        , socket(app->GetIOService())
+    {
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string(params.bind_addr), params.port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+    }
+
+    void Initialize() override
+    {
+        DoAccept();
+    }
+
+    void Uninitialize() override
+    {
+        auto stopping = sessions;
+        for (auto& session : stopping)
+            session->Stop();
+
+        boost::system::error_code ec;
+        acceptor.close(ec);
+    }
+
+private:
+    void DoAccept()
+    {
+        auto self(shared_from_this());
+        acceptor.async_accept(socket,
+            [this, self](boost::system::error_code ec)
+            {
+                if (ec)
+                    return;
+
+                std::weak_ptr<ControlProxy> weak = self;
+                auto session = std::make_shared<ProxySession>(app->GetIOService(), std::move(socket), relay, [weak](const ProxySessionPtr& session)
+                {
+                    if (auto proxy = weak.lock())
+                        proxy->sessions.erase(session);
+                });
+                sessions.insert(session);
+                session->Start(server_endpoint);
+
+                DoAccept();
+            });
+    }
+};
+
+}
+
+IControlProxyPtr CreateControlProxy(Common::IApplicationPtr app, const RelayParams& params, IUdpRelayPtr relay)
+{
+    return std::make_shared<ControlProxy>(app, params, relay);
+}
+
+}
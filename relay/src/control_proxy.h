@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common/application.h"
+
+#include "udp_relay.h"
+
+namespace Relay
+{
+
+// Accepts control connections on the relay port and pipes frames to the
+// server. Ports of OPEN_STREAM replies are replaced by relay ports, which
+// are closed with the stream.
+struct IControlProxy : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+};
+
+DECLARE_PTR_S(IControlProxy)
+
+IControlProxyPtr CreateControlProxy(Common::IApplicationPtr app, const RelayParams& params, IUdpRelayPtr relay);
+
+}
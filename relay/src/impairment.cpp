@@ -0,0 +1,98 @@
+#include "impairment.h"
+
+#include <algorithm>
+
+namespace Relay
+{
+
+bool Link::Schedule(int64_t now_us, size_t size, int64_t& due_us)
+{
+    if (!rate_bps)
+    {
+        due_us = now_us;
+        return true;
+    }
+
+    int64_t start = std::max(now_us, free_us);
+    if (start - now_us > queue_us)
+        return false;
+
+    free_us = start + static_cast<int64_t>(size * 8 * 1000000 / rate_bps);
+    due_us = free_us;
+    return true;
+}
+
+Impairment::Impairment(const ImpairmentParams& params, uint32_t seed)
+    : params(params)
+    , random(seed)
+{
+}
+
+unsigned Impairment::Apply(int64_t now_us, size_t size, Link* link, int64_t (&due_us)[max_copies])
+{
+    ++stats.packets;
+
+    if (params.burst)
+    {
+        if (in_burst)
+            in_burst = !Chance(1.0 / std::max(params.burst_length, 1u));
+        else
+            in_burst = Chance(params.burst);
+
+        if (in_burst)
+        {
+            ++stats.lost;
+            ++stats.burst_lost;
+            return 0;
+        }
+    }
+
+    if (Chance(params.loss))
+    {
+        ++stats.lost;
+        return 0;
+    }
+
+    int64_t sent_us = now_us;
+    if (link && !link->Schedule(now_us, size, sent_us))
+    {
+        ++stats.lost;
+        ++stats.queue_dropped;
+        return 0;
+    }
+
+    due_us[0] = sent_us + Delay();
+    if (Chance(params.reorder))
+    {
+        ++stats.reordered;
+        due_us[0] += static_cast<int64_t>(params.reorder_ms) * 1000;
+    }
+
+    if (!Chance(params.duplicate))
+        return 1;
+
+    // the copy takes its own path through the jitter
+    ++stats.duplicated;
+    due_us[1] = sent_us + Delay();
+    return 2;
+}
+
+double Impairment::Uniform()
+{
+    return random() * (1.0 / 4294967296.0);
+}
+
+bool Impairment::Chance(double probability)
+{
+    return probability > 0 && Uniform() < probability;
+}
+
+int64_t Impairment::Delay()
+{
+    int64_t delay = static_cast<int64_t>(params.delay_ms) * 1000;
+    if (params.jitter_ms)
+        delay += static_cast<int64_t>(Uniform() * params.jitter_ms * 1000);
+    return delay;
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+
+namespace Relay
+{
+
+struct ImpairmentParams
+{
+    // independent loss probability of a packet
+    double loss = 0;
+    // Gilbert-Elliott burst loss: probability to start a burst at a packet,
+    // all packets of a burst are lost, bursts last burst_length on average
+    double burst = 0;
+    unsigned burst_length = 5;
+    // share of packets held back by reorder_ms, so later ones pass them
+    double reorder = 0;
+    unsigned reorder_ms = 20;
+    double duplicate = 0;
+    // one way delay plus uniform jitter in [0, jitter_ms], jitter reorders
+    // packets closer than it
+    unsigned delay_ms = 0;
+    unsigned jitter_ms = 0;
+    // bottleneck shared by all streams, 0 - unlimited
+    uint64_t rate_bps = 0;
+    // packets which would wait longer for the bottleneck are dropped
+    unsigned queue_ms = 100;
+    uint32_t seed = 1;
+
+    bool Empty() const
+    {
+        return !loss && !burst && !reorder && !duplicate && !delay_ms && !jitter_ms && !rate_bps;
+    }
+};
+
+struct ImpairmentStats
+{
+    uint64_t packets = 0;
+    uint64_t lost = 0;
+    uint64_t burst_lost = 0;
+    uint64_t queue_dropped = 0;
+    uint64_t reordered = 0;
+    uint64_t duplicated = 0;
+};
+
+// Bottleneck link: packets are serialized at rate in arrival order behind
+// a drop tail queue of queue_ms.
+class Link
+{
+    const uint64_t rate_bps;
+    const int64_t queue_us;
+    int64_t free_us = 0;
+
+public:
+    Link(uint64_t rate_bps, unsigned queue_ms)
+        : rate_bps(rate_bps)
+        , queue_us(static_cast<int64_t>(queue_ms) * 1000)
+    {
+    }
+
+    // time the packet leaves the link, false if the queue is full
+    bool Schedule(int64_t now_us, size_t size, int64_t& due_us);
+};
+
+// Fate of the packets of one stream. Decisions come from an own generator,
+// so a stream sees the same losses for the same seed whatever the timing
+// of other streams is.
+class Impairment
+{
+public:
+    static constexpr unsigned max_copies = 2;
+
+private:
+    const ImpairmentParams params;
+    std::mt19937 random;
+    bool in_burst = false;
+    ImpairmentStats stats;
+
+public:
+    Impairment(const ImpairmentParams& params, uint32_t seed);
+
+    // due times of copies of a packet which arrived at now_us, 0 copies if
+    // it is lost; link may be null
+    unsigned Apply(int64_t now_us, size_t size, Link* link, int64_t (&due_us)[max_copies]);
+
+    const ImpairmentStats& Stats() const
+    {
+        return stats;
+    }
+
+private:
+    // [0, 1) from the generator alone, distributions of the standard library
+    // differ between implementations
+    double Uniform();
+    bool Chance(double probability);
+    int64_t Delay();
+};
+
+}
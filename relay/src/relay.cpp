@@ -0,0 +1,6 @@
+int RunRelayApplication(int argc, char* argv[]);
+
+int main(int argc, char* argv[])
+{
+    return RunRelayApplication(argc, argv);
+}
@@ -0,0 +1,191 @@
+#include "relay_app.h"
+
+#include <iostream>
+
+#include <boost/asio.hpp>
+
+#include "common/appimpl.h"
+
+#include "control_proxy.h"
+#include "udp_relay.h"
+
+namespace Relay
+{
+
+void RelayParams::Dump()
+{
+    LOG("Params: " << "port: " << port << std::endl
+    << "server: " << server_addr << ":" << server_port << std::endl
+    << "relay ports: " << bind_addr << ":" << first_port << " pairs " << port_pairs << std::endl
+    << "loss: " << impairment.loss << " burst: " << impairment.burst << "/" << impairment.burst_length << std::endl
+    << "reorder: " << impairment.reorder << "/" << impairment.reorder_ms << "ms duplicate: " << impairment.duplicate << std::endl
+    << "delay: " << impairment.delay_ms << "ms jitter: " << impairment.jitter_ms << "ms" << std::endl
+    << "rate: " << impairment.rate_bps << "bps queue: " << impairment.queue_ms << "ms" << std::endl
+    << "seed: " << impairment.seed << std::endl);
+}
+
+class RelayApplication
+        : public Common::ApplicationImpl<RelayApplication>
+        , public IRelayApp
+{
+    RelayParams params;
+    IUdpRelayPtr relay;
+    IControlProxyPtr proxy;
+    std::unique_ptr<boost::asio::steady_timer> stats_timer;
+
+public:
+    RelayApplication(const RelayParams& params)
+        : Common::ApplicationImpl<RelayApplication>("relay")
+        , params(params)
+    {
+    }
+
+    const RelayParams& GetParams() const  override
+    {
+        return params;
+    }
+
+    void AppRun() override
+    {
+        params.Dump();
+
+        relay = CreateUdpRelay(params);
+        relay->Initialize();
+
+        proxy = CreateControlProxy(shared_from_this(), params, relay);
+        proxy->Initialize();
+
+        if (params.stats_interval_s)
+        {
+            stats_timer.reset(new boost::asio::steady_timer(GetIOService()));
+            ScheduleStats();
+        }
+    }
+
+    void AppStop() override
+    {
+        if (stats_timer)
+        {
+            stats_timer->cancel();
+            stats_timer.reset();
+        }
+
+        if (proxy)
+        {
+            proxy->Uninitialize();
+            proxy.reset();
+        }
+
+        if (relay)
+        {
+            relay->Uninitialize();
+            DumpStats();
+            relay.reset();
+        }
+    }
+
+    std::string GetServiceName() const override
+    {
+        return "relay";
+    }
+
+private:
+    void ScheduleStats()
+    {
+        stats_timer->expires_from_now(std::chrono::seconds(params.stats_interval_s));
+        stats_timer->async_wait([this](boost::system::error_code ec)
+        {
+            if (ec || !relay)
+                return;
+
+            DumpStats();
+            ScheduleStats();
+        });
+    }
+
+    void DumpStats()
+    {
+        UdpRelayStats stats = relay->Stats();
+        LOG("Relay streams " << stats.streams << " packets " << stats.impairment.packets
+            << " forwarded " << stats.forwarded << " lost " << stats.impairment.lost
+            << " (burst " << stats.impairment.burst_lost << ", queue " << stats.impairment.queue_dropped << ")"
+            << " reordered " << stats.impairment.reordered << " duplicated " << stats.impairment.duplicated
+            << " feedback " << stats.feedback << " send errors " << stats.send_errors);
+    }
+};
+
+}
+
+int RunRelayApplication(int argc, char* argv[])
+{
+    Relay::RelayParams params;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "-help"))
+        {
+            std::cout << "usage: relay [-port 8081] [-server 127.0.0.1] [-server_port 8080] [-bind 127.0.0.1]\n"
+                      << "    [-first_port 40000] [-pairs 1000] [-idle s] [-stats s]\n"
+                      << "    [-loss p] [-burst p] [-burst_length n] [-reorder p] [-reorder_ms ms]\n"
+                      << "    [-duplicate p] [-delay ms] [-jitter ms] [-rate bps] [-queue ms] [-seed n]\n";
+            return 0;
+        }
+
+        if (i + 1 == argc)
+        {
+            std::cerr << "unknown " << argv[i] << std::endl;
+            return 1;
+        }
+
+        const char* name = argv[i];
+        const char* value = argv[++i];
+        Relay::ImpairmentParams& impairment = params.impairment;
+
+        if (!strcmp(name, "-port"))
+            params.port = atoi(value);
+        else if (!strcmp(name, "-server"))
+            params.server_addr = value;
+        else if (!strcmp(name, "-server_port"))
+            params.server_port = atoi(value);
+        else if (!strcmp(name, "-bind"))
+            params.bind_addr = value;
+        else if (!strcmp(name, "-first_port"))
+            params.first_port = atoi(value);
+        else if (!strcmp(name, "-pairs"))
+            params.port_pairs = atoi(value);
+        else if (!strcmp(name, "-idle"))
+            params.idle_timeout_s = atoi(value);
+        else if (!strcmp(name, "-stats"))
+            params.stats_interval_s = atoi(value);
+        else if (!strcmp(name, "-loss"))
+            impairment.loss = atof(value);
+        else if (!strcmp(name, "-burst"))
+            impairment.burst = atof(value);
+        else if (!strcmp(name, "-burst_length"))
+            impairment.burst_length = atoi(value);
+        else if (!strcmp(name, "-reorder"))
+            impairment.reorder = atof(value);
+        else if (!strcmp(name, "-reorder_ms"))
+            impairment.reorder_ms = atoi(value);
+        else if (!strcmp(name, "-duplicate"))
+            impairment.duplicate = atof(value);
+        else if (!strcmp(name, "-delay"))
+            impairment.delay_ms = atoi(value);
+        else if (!strcmp(name, "-jitter"))
+            impairment.jitter_ms = atoi(value);
+        else if (!strcmp(name, "-rate"))
+            impairment.rate_bps = strtoull(value, nullptr, 10);
+        else if (!strcmp(name, "-queue"))
+            impairment.queue_ms = atoi(value);
+        else if (!strcmp(name, "-seed"))
+            impairment.seed = strtoul(value, nullptr, 10);
+        else
+        {
+            std::cerr << "unknown " << name << std::endl;
+            return 1;
+        }
+    }
+
+    Common::RunApplication<Relay::RelayApplication>(params);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common/application.h"
+
+#include "impairment.h"
+
+#include <string>
+
+namespace Relay
+{
+
+struct RelayParams
+{
+    // clients connect here instead of the server port
+    int port = 8081;
+    std::string server_addr = "127.0.0.1";
+    int server_port = 8080;
+    // address of relay ports, clients send rtp to the control address
+    std::string bind_addr = "127.0.0.1";
+    // relay ports are even/odd pairs from first_port
+    uint16_t first_port = 40000;
+    unsigned port_pairs = 1000;
+    // pairs without datagrams this long are closed, server keeps streams
+    // after the control connection is gone
+    unsigned idle_timeout_s = 30;
+    // 0 - no periodic stats
+    unsigned stats_interval_s = 5;
+    ImpairmentParams impairment;
+
+    void Dump();
+};
+
+struct IRelayApp : public virtual Common::IApplication
+{
+    virtual const RelayParams& GetParams() const  = 0;
+};
+
+DECLARE_PTR_S(IRelayApp)
+
+}
@@ -0,0 +1,506 @@
+#include "udp_relay.h"
+
+#include "relay_app.h"
+
+#include "common/common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Relay
+{
+
+namespace
+{
+
+using clock = std::chrono::steady_clock;
+
+constexpr unsigned sweep_ms = 1000;
+
+int64_t NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(clock::now().time_since_epoch()).count();
+}
+
+// one relay port: client side socket bound to it, server side socket
+// connected to the server port
+struct Pipe
+{
+    int client_fd = -1;
+    int server_fd = -1;
+    sockaddr_in client = {};
+    bool has_client = false;
+    bool closed = false;
+    int64_t last_us = 0;
+    Impairment impairment;
+
+    Pipe(const ImpairmentParams& params, uint32_t seed)
+        : impairment(params, seed)
+    {
+    }
+
+    ~Pipe()
+    {
+        if (client_fd >= 0)
+            close(client_fd);
+        if (server_fd >= 0)
+            close(server_fd);
+    }
+};
+
+DECLARE_PTR_S(Pipe)
+
+// epoll registration of one side of a pipe
+struct Side
+{
+    PipePtr pipe;
+    bool client;
+};
+
+struct Stream
+{
+    uint32_t ordinal = 0;
+    PipePtr pipes[2];
+    std::unique_ptr<Side> sides[4];
+};
+
+// datagram waiting for its due time
+struct Pending
+{
+    int64_t due_us;
+    uint64_t order;
+    PipePtr pipe;
+    std::vector<uint8_t> data;
+};
+
+bool Later(const Pending& a, const Pending& b)
+{
+    return a.due_us != b.due_us ? a.due_us > b.due_us : a.order > b.order;
+}
+
+void AddStats(ImpairmentStats& total, const ImpairmentStats& stats)
+{
+    total.packets += stats.packets;
+    total.lost += stats.lost;
+    total.burst_lost += stats.burst_lost;
+    total.queue_dropped += stats.queue_dropped;
+    total.reordered += stats.reordered;
+    total.duplicated += stats.duplicated;
+}
+
+}
+
+class UdpRelay : public IUdpRelay
+        , public Common::ObjectCounter<UdpRelay>
+{
+    static constexpr int max_events = 64;
+    static constexpr size_t max_datagram = 64 * 1024;
+    static constexpr size_t max_spare = 4096;
+
+    const RelayParams params;
+    sockaddr_in bind_addr = {};
+    sockaddr_in server_addr = {};
+
+    int epoll_fd = -1;
+    int event_fd = -1;
+    std::thread thread;
+    std::atomic<bool> runing{false};
+
+    std::mutex commands_mx;
+    std::vector<std::function<void()>> commands;
+
+    // pairs taken, guarded by ports_mx, released by relay thread
+    std::mutex ports_mx;
+    std::set<uint16_t> used;
+    unsigned next_pair = 0;
+    uint32_t opened = 0;
+
+    std::mutex stats_mx;
+    UdpRelayStats published;
+
+    // owned by relay thread
+    std::map<uint16_t, Stream> streams;
+    std::vector<Pending> pending;
+    std::vector<std::vector<uint8_t>> spare;
+    std::vector<uint8_t> buffer = std::vector<uint8_t>(max_datagram);
+    uint64_t order = 0;
+    Link link;
+    UdpRelayStats stats;
+    // impairment of closed pipes
+    ImpairmentStats closed_stats;
+
+public:
+    UdpRelay(const RelayParams& params)
+        : params(params)
+        , link(params.impairment.rate_bps, params.impairment.queue_ms)
+    {
+        bind_addr.sin_family = AF_INET;
+        server_addr.sin_family = AF_INET;
+        if (inet_pton(AF_INET, params.bind_addr.c_str(), &bind_addr.sin_addr) != 1
+                || inet_pton(AF_INET, params.server_addr.c_str(), &server_addr.sin_addr) != 1)
+            THROW_ERR("Relay supports IPv4 addresses only " << params.bind_addr << " " << params.server_addr);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || event_fd < 0)
+            THROW_ERR("Cannot create relay descriptors " << strerror(errno));
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+    }
+
+    ~UdpRelay()
+    {
+        close(event_fd);
+        close(epoll_fd);
+    }
+
+    void Initialize() override
+    {
+        runing = true;
+        thread = std::thread([this](){ Run(); });
+    }
+
+    void Uninitialize() override
+    {
+        runing = false;
+        Wakeup();
+        if (thread.joinable())
+            thread.join();
+
+        pending.clear();
+        streams.clear();
+    }
+
+    RelayPair Open(uint16_t server_port) override
+    {
+        std::lock_guard<std::mutex> lock(ports_mx);
+        for (unsigned i = 0; i < params.port_pairs; ++i)
+        {
+            unsigned pair = (next_pair + i) % params.port_pairs;
+            uint16_t port = static_cast<uint16_t>(params.first_port + pair * 2);
+            if (used.count(port))
+                continue;
+
+            uint32_t ordinal = opened;
+            auto rtp = CreatePipe(port, server_port, ordinal * 2);
+            auto rtcp = rtp ? CreatePipe(port + 1, server_port + 1, ordinal * 2 + 1) : nullptr;
+            if (!rtcp)
+                continue;
+
+            next_pair = pair + 1;
+            ++opened;
+            used.insert(port);
+            Execute([this, port, ordinal, rtp, rtcp]()
+            {
+                Stream& stream = streams[port];
+                stream.ordinal = ordinal;
+                stream.pipes[0] = rtp;
+                stream.pipes[1] = rtcp;
+                for (unsigned side = 0; side < 4; ++side)
+                {
+                    const PipePtr& pipe = stream.pipes[side / 2];
+                    stream.sides[side].reset(new Side{pipe, side % 2 == 0});
+
+                    epoll_event ev = {};
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = stream.sides[side].get();
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, side % 2 == 0 ? pipe->client_fd : pipe->server_fd, &ev) < 0)
+                        LOGW("Cannot add relay fd to epoll " << strerror(errno));
+                }
+            });
+
+            LOG("Relay " << port << " -> " << server_port << " stream " << ordinal);
+            RelayPair opened_pair;
+            opened_pair.port = port;
+            opened_pair.ordinal = ordinal;
+            return opened_pair;
+        }
+
+        LOGW("There are no free relay ports for " << server_port);
+        return RelayPair();
+    }
+
+    void Close(const RelayPair& pair) override
+    {
+        Execute([this, pair]()
+        {
+            auto it = streams.find(pair.port);
+            if (it != streams.end() && it->second.ordinal == pair.ordinal)
+                CloseStream(pair.port);
+        });
+    }
+
+    UdpRelayStats Stats() override
+    {
+        std::lock_guard<std::mutex> lock(stats_mx);
+        return published;
+    }
+
+private:
+    // seed_index keeps the losses of a stream the same between runs with
+    // streams opened in the same order
+    PipePtr CreatePipe(uint16_t port, uint16_t server_port, uint32_t seed_index)
+    {
+        auto pipe = std::make_shared<Pipe>(params.impairment, params.impairment.seed + seed_index * 0x9e3779b9u);
+        pipe->last_us = NowUs();
+
+        sockaddr_in local = bind_addr;
+        local.sin_port = htons(port);
+        pipe->client_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (pipe->client_fd < 0 || bind(pipe->client_fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0)
+            return nullptr;
+
+        sockaddr_in remote = server_addr;
+        remote.sin_port = htons(server_port);
+        pipe->server_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (pipe->server_fd < 0 || connect(pipe->server_fd, reinterpret_cast<sockaddr*>(&remote), sizeof(remote)) < 0)
+        {
+            LOGW("Cannot connect relay socket to " << server_port << " " << strerror(errno));
+            return nullptr;
+        }
+
+        // bursts of many streams wait here for their due time
+        int size = 4 * 1024 * 1024;
+        setsockopt(pipe->client_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(pipe->server_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        return pipe;
+    }
+
+    void Execute(std::function<void()> f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(commands_mx);
+            commands.push_back(std::move(f));
+        }
+        Wakeup();
+    }
+
+    void Wakeup()
+    {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LOGW("Relay wakeup failed " << strerror(errno));
+    }
+
+    void RunCommands()
+    {
+        uint64_t value;
+        while (read(event_fd, &value, sizeof(value)) > 0)
+            ;
+
+        std::vector<std::function<void()>> current;
+        {
+            std::lock_guard<std::mutex> lock(commands_mx);
+            current.swap(commands);
+        }
+
+        for (auto& f : current)
+            f();
+    }
+
+    void CloseStream(uint16_t port)
+    {
+        auto it = streams.find(port);
+        if (it == streams.end())
+            return;
+
+        // datagrams queued for the pipes are skipped when due
+        for (auto& pipe : it->second.pipes)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pipe->client_fd, nullptr);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pipe->server_fd, nullptr);
+            pipe->closed = true;
+            AddStats(closed_stats, pipe->impairment.Stats());
+        }
+        streams.erase(it);
+
+        std::lock_guard<std::mutex> lock(ports_mx);
+        used.erase(port);
+        LOG("Relay " << port << " closed");
+    }
+
+    // queued copy of a datagram, sized to it
+    std::vector<uint8_t> Copy(const uint8_t* data, size_t size)
+    {
+        if (spare.empty())
+            return std::vector<uint8_t>(data, data + size);
+
+        std::vector<uint8_t> copy = std::move(spare.back());
+        spare.pop_back();
+        copy.assign(data, data + size);
+        return copy;
+    }
+
+    void Recycle(std::vector<uint8_t>&& data)
+    {
+        if (spare.size() < max_spare)
+            spare.push_back(std::move(data));
+    }
+
+    void ReadClient(const PipePtr& pipe)
+    {
+        for (;;)
+        {
+            sockaddr_in from = {};
+            socklen_t from_len = sizeof(from);
+            ssize_t size = recvfrom(pipe->client_fd, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+            if (size < 0)
+                return;
+
+            int64_t now = NowUs();
+            pipe->client = from;
+            pipe->has_client = true;
+            pipe->last_us = now;
+
+            int64_t due[Impairment::max_copies];
+            unsigned copies = pipe->impairment.Apply(now, size, &link, due);
+            for (unsigned i = 0; i < copies; ++i)
+            {
+                pending.push_back(Pending{due[i], order++, pipe, Copy(buffer.data(), size)});
+                std::push_heap(pending.begin(), pending.end(), Later);
+            }
+        }
+    }
+
+    void ReadServer(const PipePtr& pipe)
+    {
+        for (;;)
+        {
+            ssize_t size = recv(pipe->server_fd, buffer.data(), buffer.size(), 0);
+            if (size < 0)
+                return;
+
+            pipe->last_us = NowUs();
+            if (!pipe->has_client)
+                continue;
+
+            ++stats.feedback;
+            if (sendto(pipe->client_fd, buffer.data(), size, 0, reinterpret_cast<sockaddr*>(&pipe->client), sizeof(pipe->client)) < 0)
+                ++stats.send_errors;
+        }
+    }
+
+    // sends due datagrams, returns ms until the next one
+    int SendDue()
+    {
+        int64_t now = NowUs();
+        while (!pending.empty())
+        {
+            Pending& next = pending.front();
+            if (next.due_us > now)
+                return static_cast<int>(std::min<int64_t>((next.due_us - now + 999) / 1000, sweep_ms));
+
+            std::pop_heap(pending.begin(), pending.end(), Later);
+            Pending packet = std::move(pending.back());
+            pending.pop_back();
+
+            if (!packet.pipe->closed)
+            {
+                if (send(packet.pipe->server_fd, packet.data.data(), packet.data.size(), 0) < 0)
+                    ++stats.send_errors;
+                else
+                    ++stats.forwarded;
+            }
+            Recycle(std::move(packet.data));
+        }
+        return sweep_ms;
+    }
+
+    void Sweep()
+    {
+        int64_t idle_us = static_cast<int64_t>(params.idle_timeout_s) * 1000000;
+        int64_t now = NowUs();
+
+        std::vector<uint16_t> idle;
+        ImpairmentStats impairment = closed_stats;
+        for (auto& it : streams)
+        {
+            bool active = false;
+            for (auto& pipe : it.second.pipes)
+            {
+                active |= now - pipe->last_us < idle_us;
+                AddStats(impairment, pipe->impairment.Stats());
+            }
+            if (!active)
+                idle.push_back(it.first);
+        }
+
+        for (uint16_t port : idle)
+        {
+            LOG("Relay " << port << " is idle");
+            CloseStream(port);
+        }
+
+        stats.streams = streams.size();
+        stats.impairment = impairment;
+        std::lock_guard<std::mutex> lock(stats_mx);
+        published = stats;
+    }
+
+    void Run()
+    {
+        Common::register_current_thread("relay");
+
+        epoll_event events[max_events];
+        auto next_sweep = clock::now() + std::chrono::milliseconds(sweep_ms);
+
+        while (runing)
+        {
+            int timeout = SendDue();
+            int n = epoll_wait(epoll_fd, events, max_events, timeout);
+            if (n < 0 && errno != EINTR)
+            {
+                LOGE("Relay epoll error " << strerror(errno));
+                break;
+            }
+
+            bool has_commands = false;
+            for (int i = 0; i < n; ++i)
+            {
+                auto side = static_cast<Side*>(events[i].data.ptr);
+                if (!side)
+                    has_commands = true;
+                else if (side->client)
+                    ReadClient(side->pipe);
+                else
+                    ReadServer(side->pipe);
+            }
+
+            // commands may remove registrations, so run them after events
+            if (has_commands)
+                RunCommands();
+
+            auto now = clock::now();
+            if (now >= next_sweep)
+            {
+                next_sweep = now + std::chrono::milliseconds(sweep_ms);
+                Sweep();
+            }
+        }
+
+        Sweep();
+        LOG("Relay stopped");
+    }
+};
+
+IUdpRelayPtr CreateUdpRelay(const RelayParams& params)
+{
+    return std::make_shared<UdpRelay>(params);
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include "impairment.h"
+
+#include <cstdint>
+
+namespace Relay
+{
+
+struct RelayParams;
+
+struct UdpRelayStats
+{
+    // client to server datagrams after impairment, duplicates included
+    uint64_t forwarded = 0;
+    // server to client datagrams, e.g. nacks, passed as is
+    uint64_t feedback = 0;
+    uint64_t send_errors = 0;
+    unsigned streams = 0;
+    ImpairmentStats impairment;
+};
+
+// rtp/rtcp pair taken by one Open, a pair closed when idle may be taken
+// again with the same port and a new ordinal
+struct RelayPair
+{
+    uint16_t port = 0;
+    uint32_t ordinal = 0;
+};
+
+// Forwards datagrams between relay ports and server ports on its own
+// thread. Client to server datagrams go through the impairment of their
+// port, replies of the server go back to the last client address.
+struct IUdpRelay : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+    // relay pair of server_port, server_port + 1, port is 0 if there is
+    // no free pair
+    virtual RelayPair Open(uint16_t server_port) = 0;
+    // pairs left open are closed after idle timeout, closing a pair
+    // already closed does nothing even if its port was taken again
+    virtual void Close(const RelayPair& pair) = 0;
+    virtual UdpRelayStats Stats() = 0;
+};
+
+DECLARE_PTR_S(IUdpRelay)
+
+IUdpRelayPtr CreateUdpRelay(const RelayParams& params);
+
+}
@@ -0,0 +1,230 @@
+#include "admission.h"
+#include "common/common.h"
+#include "common/metrics.h"
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <time.h>
+
+namespace Server
+{
+
+namespace
+{
+
+uint64_t ProcessCpuNs()
+{
+    timespec ts = {};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// 0 if unknown
+uint64_t AvailableMemory()
+{
+    std::ifstream meminfo("/proc/meminfo");
+    std::string name;
+    uint64_t value = 0;
+    std::string unit;
+    while (meminfo >> name >> value >> unit)
+    {
+        if (name == "MemAvailable:")
+            return value * 1024;
+    }
+    return 0;
+}
+
+}
+
+class AdmissionController : public IAdmissionController
+        , public Common::ObjectCounter<AdmissionController>
+{
+    using clock = std::chrono::steady_clock;
+
+    struct Counters
+    {
+        uint64_t bytes = 0;
+        uint64_t busy_ns = 0;
+        uint64_t write_ns = 0;
+    };
+
+    const AdmissionParams params;
+    const IWriterStagePtr writer;
+    const unsigned cores;
+
+    std::mutex mx;
+    std::unordered_map<StreamLoadPtr, Counters> streams;
+    const Common::GaugePtr active_streams;
+    const Common::GaugePtr cpu_load;
+    // by reason, created on first rejection
+    std::map<std::string, Common::CounterPtr> rejected;
+    // admitted streams without traffic in a sample yet
+    unsigned unsampled = 0;
+    std::mt19937 random;
+
+    clock::time_point sampled;
+    uint64_t cpu_ns = 0;
+    uint64_t disk_bytes = 0;
+
+    // last sample rates
+    double cpu = 0;
+    double ingest_bps = 0;
+    double disk_bps = 0;
+    uint64_t free_memory = 0;
+    // per active stream, cpu is its ingest and write time
+    double stream_cpu = 0;
+    double stream_bps = 0;
+    double stream_disk_bps = 0;
+
+public:
+    AdmissionController(const AdmissionParams& params, const IWriterStagePtr& writer)
+        : params(params), writer(writer)
+        , cores(std::max(1u, std::thread::hardware_concurrency()))
+        , active_streams(Common::Metrics::AddGauge("streamer_streams", "Admitted streams"))
+        , cpu_load(Common::Metrics::AddGauge("streamer_cpu_load_percent", "Process cpu load of last admission sample, 100 - every core busy"))
+        , random(std::random_device()())
+        , sampled(clock::now())
+        , cpu_ns(ProcessCpuNs())
+        , disk_bytes(writer ? writer->BytesWritten() : 0)
+        , free_memory(AvailableMemory())
+    {
+    }
+
+    StreamLoadPtr Admit(unsigned& retry_after_ms) override
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        Sample();
+
+        const char* reason = Saturated();
+        if (reason)
+        {
+            retry_after_ms = params.retry_after_ms + random() % (params.retry_after_ms / 2 + 1);
+
+            Common::CounterPtr& counter = rejected[reason];
+            if (!counter)
+                counter = Common::Metrics::AddCounter("streamer_admission_rejected_total", "Streams rejected by admission", {{"reason", reason}});
+            counter->AddSingle();
+
+            LOGW_FMT("Stream rejected by admission: {}, streams {} cpu {} ingest bps {} disk bps {} free memory {}",
+                     reason, streams.size(), cpu, ingest_bps, disk_bps, free_memory);
+            return nullptr;
+        }
+
+        auto load = std::make_shared<StreamLoad>();
+        streams[load] = Counters();
+        active_streams->Set(streams.size());
+        ++unsampled;
+        return load;
+    }
+
+    void Release(const StreamLoadPtr& load) override
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        auto it = streams.find(load);
+        if (it == streams.end())
+            return;
+
+        if (!it->second.bytes)
+            --unsampled;
+        streams.erase(it);
+        active_streams->Set(streams.size());
+    }
+
+private:
+    // reason of rejection or nullptr
+    const char* Saturated() const
+    {
+        if (params.max_streams && streams.size() >= params.max_streams)
+            return "max streams";
+
+        if (params.min_free_memory && free_memory && free_memory < params.min_free_memory)
+            return "memory";
+
+        // streams which are not sending yet and the new one
+        double coming = unsampled + 1;
+
+        if (params.max_cpu > 0 && cpu + coming * stream_cpu > params.max_cpu)
+            return "cpu";
+
+        if (params.max_ingest_bps && ingest_bps + coming * stream_bps > params.max_ingest_bps)
+            return "ingest bitrate";
+
+        if (writer && params.max_disk_bps && disk_bps + coming * stream_disk_bps > params.max_disk_bps)
+            return "disk throughput";
+
+        return nullptr;
+    }
+
+    void Sample()
+    {
+        auto now = clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - sampled).count();
+        if (elapsed < static_cast<int64_t>(params.sample_interval_ms) * 1000000 || elapsed <= 0)
+            return;
+
+        double seconds = elapsed / 1e9;
+
+        uint64_t process_ns = ProcessCpuNs();
+        cpu = (process_ns - cpu_ns) / (elapsed * static_cast<double>(cores));
+        cpu_ns = process_ns;
+        cpu_load->Set(static_cast<int64_t>(cpu * 100));
+
+        uint64_t written = writer ? writer->BytesWritten() : 0;
+        disk_bps = (written - disk_bytes) * 8 / seconds;
+        disk_bytes = written;
+
+        uint64_t bytes = 0;
+        uint64_t busy_ns = 0;
+        unsigned active = 0;
+        unsampled = 0;
+        for (auto& it : streams)
+        {
+            Counters current;
+            current.bytes = it.first->bytes.load(std::memory_order_relaxed);
+            current.busy_ns = it.first->busy_ns.load(std::memory_order_relaxed);
+            current.write_ns = it.first->write_ns.load(std::memory_order_relaxed);
+
+            Counters& last = it.second;
+            if (current.bytes != last.bytes)
+            {
+                ++active;
+                bytes += current.bytes - last.bytes;
+                busy_ns += current.busy_ns - last.busy_ns + current.write_ns - last.write_ns;
+            }
+            else if (!current.bytes)
+                ++unsampled;
+
+            last = current;
+        }
+
+        ingest_bps = bytes * 8 / seconds;
+        if (active)
+        {
+            // measured per stream, process cpu also has threads and control
+            // work which do not grow with streams
+            stream_cpu = busy_ns / (elapsed * static_cast<double>(cores)) / active;
+            stream_bps = ingest_bps / active;
+            stream_disk_bps = disk_bps / active;
+        }
+
+        free_memory = AvailableMemory();
+        sampled = now;
+
+        LOGD_FMT("Admission sample: streams {} active {} unsampled {} cpu {} stream cpu {} ingest bps {} disk bps {}",
+                 streams.size(), active, unsampled, cpu, stream_cpu, ingest_bps, disk_bps);
+    }
+};
+
+IAdmissionControllerPtr CreateAdmissionController(const AdmissionParams& params, const IWriterStagePtr& writer)
+{
+    return std::make_shared<AdmissionController>(params, writer);
+}
+
+}
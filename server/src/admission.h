@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include "recorder.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace Server
+{
+
+struct AdmissionParams
+{
+    // 0 - no limit
+    unsigned max_streams = 0;
+    // process cpu time over all cores, 1 - every core busy
+    double max_cpu = 0.85;
+    // received bits per second of all streams, 0 - no limit
+    uint64_t max_ingest_bps = 0;
+    // recorded bits per second of all streams, 0 - no limit
+    uint64_t max_disk_bps = 0;
+    // MemAvailable of the node kept free
+    uint64_t min_free_memory = 256 * 1024 * 1024;
+    // suggested to rejected clients, spread by up to a half against bursts of retries
+    unsigned retry_after_ms = 2000;
+    unsigned sample_interval_ms = 1000;
+};
+
+// Counters of one admitted stream, each has a single writer thread.
+struct StreamLoad
+{
+    // ingest worker
+    std::atomic<uint64_t> bytes{0};
+    // ingest worker, time spent in stream processing
+    std::atomic<uint64_t> busy_ns{0};
+    // writer thread, time spent in muxing and output
+    std::atomic<uint64_t> write_ns{0};
+
+    void AddBytes(uint64_t value)
+    {
+        bytes.store(bytes.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void AddBusy(uint64_t ns)
+    {
+        busy_ns.store(busy_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+
+    void AddWrite(uint64_t ns)
+    {
+        write_ns.store(write_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+};
+
+typedef std::shared_ptr<StreamLoad> StreamLoadPtr;
+
+// Node load estimate for new streams. Load is sampled at most every
+// sample_interval_ms, a new stream is expected to cost as much as an average
+// active one: its bitrate, disk share and measured ingest and write time.
+// Streams without traffic in a sample yet are counted as coming as well.
+struct IAdmissionController : public virtual Common::IObject
+{
+    // control threads, nullptr and retry_after_ms when the node is near saturation
+    virtual StreamLoadPtr Admit(unsigned& retry_after_ms) = 0;
+    virtual void Release(const StreamLoadPtr& load) = 0;
+};
+
+DECLARE_PTR_S(IAdmissionController)
+
+// writer may be null, disk rate is not limited then
+IAdmissionControllerPtr CreateAdmissionController(const AdmissionParams& params, const IWriterStagePtr& writer);
+
+}
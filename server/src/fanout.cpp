@@ -0,0 +1,557 @@
+#include "fanout.h"
+
+#include "common/common.h"
+#include "common/metrics.h"
+#include "common/spsc_ring.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+}
+
+namespace Server
+{
+
+namespace
+{
+
+// datagram shared by subscriber queues, one buffer reference for all
+struct FanoutPacket
+{
+    AVBufferRef* buf;
+    int size;
+    std::atomic<unsigned> refs;
+
+    void Release()
+    {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            av_buffer_unref(&buf);
+            delete this;
+        }
+    }
+};
+
+}
+
+class FanoutThread;
+class FanoutStream;
+class FanoutStage;
+
+class Subscriber : public ISubscription
+        , public Common::ObjectCounter<Subscriber>
+{
+public:
+    enum class State
+    {
+        Active,
+        // by subscriber
+        Closed,
+        // queue overflow
+        Evicted,
+        // stream is over
+        Ended,
+    };
+
+    const int fd;
+    const IFanoutCallbackPtr callback;
+    const std::weak_ptr<FanoutStream> stream;
+    FanoutThread* const thread;
+
+    // ingest thread to fan-out thread
+    Common::SpscRing<FanoutPacket*> queue;
+    std::atomic<State> state{State::Active};
+
+    // fan-out thread, popped and not sent yet
+    std::vector<FanoutPacket*> batch;
+
+    Subscriber(int fd, unsigned queue_depth, const IFanoutCallbackPtr& callback, const std::weak_ptr<FanoutStream>& stream, FanoutThread* thread)
+        : fd(fd), callback(callback), stream(stream), thread(thread)
+        , queue(std::max(queue_depth, 2u))
+    {
+    }
+
+    // the last owner drops what is left, no other thread touches queue
+    ~Subscriber()
+    {
+        for (FanoutPacket* packet : batch)
+            packet->Release();
+
+        FanoutPacket* packet = nullptr;
+        while (queue.try_pop(packet))
+            packet->Release();
+
+        close(fd);
+    }
+
+    void Close() override
+    {
+        Finish(State::Closed);
+    }
+
+    // first reason wins, fan-out thread drops the subscriber
+    void Finish(State reason);
+};
+
+DECLARE_PTR(Subscriber)
+
+// Sends queued datagrams of its subscribers, a batch per subscriber with
+// one sendmmsg call.
+class FanoutThread : public Common::ObjectCounter<FanoutThread>
+{
+    static constexpr unsigned batch_size = 32;
+    // batches per subscriber in a round, keeps subscribers fair
+    static constexpr unsigned drain_batches = 4;
+    static constexpr unsigned idle_wait_ms = 10;
+    // socket buffer of a subscriber is full
+    static constexpr unsigned backlog_wait_ms = 1;
+
+    const unsigned index;
+    std::thread thread;
+    std::atomic<bool> runing{false};
+    std::atomic<bool> sleeping{false};
+    std::atomic<unsigned> load{0};
+
+    std::mutex mx;
+    std::condition_variable cond_var;
+    std::vector<SubscriberPtr> added;
+
+    const Common::GaugePtr subscribers_gauge;
+    const Common::Metrics::Labels labels;
+    Common::CounterPtr datagrams_total;
+    Common::CounterPtr send_calls;
+    Common::CounterPtr send_errors;
+
+    // fan-out thread
+    std::vector<SubscriberPtr> subscribers;
+    mmsghdr messages[batch_size];
+    iovec iovecs[batch_size];
+
+public:
+    FanoutThread(unsigned index, const Common::GaugePtr& subscribers_gauge)
+        : index(index)
+        , subscribers_gauge(subscribers_gauge)
+        , labels{{"thread", std::to_string(index)}}
+        , datagrams_total(Common::Metrics::AddCounter("streamer_fanout_datagrams_total", "Datagrams sent to subscribers", labels))
+        , send_calls(Common::Metrics::AddCounter("streamer_fanout_send_calls_total", "sendmmsg calls to subscribers", labels))
+        , send_errors(Common::Metrics::AddCounter("streamer_fanout_send_errors_total", "Datagrams not sent to subscribers on socket errors", labels))
+    {
+    }
+
+    unsigned Load() const
+    {
+        return load;
+    }
+
+    void Start()
+    {
+        runing = true;
+        thread = std::thread([this](){ Run(); });
+    }
+
+    // subscribers are dropped without callbacks
+    void Stop()
+    {
+        runing = false;
+        Notify(true);
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void Add(const SubscriberPtr& subscriber)
+    {
+        ++load;
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            added.push_back(subscriber);
+        }
+        Notify(true);
+    }
+
+    void Notify(bool force = false)
+    {
+        if (force || sleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            cond_var.notify_one();
+        }
+    }
+
+private:
+    void Reap(const SubscriberPtr& subscriber);
+
+    // true if some datagrams were sent or dropped
+    bool Drain(Subscriber& subscriber, bool& backlog)
+    {
+        bool progress = false;
+        for (unsigned round = 0; round < drain_batches; ++round)
+        {
+            auto& batch = subscriber.batch;
+            FanoutPacket* packet = nullptr;
+            while (batch.size() < batch_size && subscriber.queue.try_pop(packet))
+                batch.push_back(packet);
+
+            if (batch.empty())
+                return progress;
+
+            // connected socket, no addresses
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                iovecs[i].iov_base = batch[i]->buf->data;
+                iovecs[i].iov_len = batch[i]->size;
+                messages[i] = {};
+                messages[i].msg_hdr.msg_iov = &iovecs[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            send_calls->AddSingle();
+            int sent = sendmmsg(subscriber.fd, messages, batch.size(), MSG_DONTWAIT);
+            if (sent < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    backlog = true;
+                    return progress;
+                }
+
+                // e.g. refused by closed port of subscriber, keep the stream going
+                LOGD_FMT("Fan-out send error {}", strerror(errno));
+                send_errors->AddSingle(batch.size());
+                sent = batch.size();
+            }
+            else
+                datagrams_total->AddSingle(sent);
+
+            for (int i = 0; i < sent; ++i)
+                batch[i]->Release();
+            batch.erase(batch.begin(), batch.begin() + sent);
+            progress = true;
+
+            if (!batch.empty())
+            {
+                backlog = true;
+                return progress;
+            }
+        }
+
+        return progress;
+    }
+
+    void Run()
+    {
+        Common::register_current_thread("fanout" + std::to_string(index));
+
+        while (runing)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mx);
+                for (auto& subscriber : added)
+                    subscribers.push_back(subscriber);
+                added.clear();
+            }
+
+            bool busy = false;
+            bool backlog = false;
+            for (size_t i = 0; i < subscribers.size();)
+            {
+                if (subscribers[i]->state != Subscriber::State::Active)
+                {
+                    Reap(subscribers[i]);
+                    subscribers[i] = subscribers.back();
+                    subscribers.pop_back();
+                    continue;
+                }
+
+                busy = Drain(*subscribers[i], backlog) || busy;
+                ++i;
+            }
+
+            if (busy)
+                continue;
+
+            std::unique_lock<std::mutex> lock(mx);
+            sleeping = true;
+
+            bool pending = !added.empty();
+            for (auto& subscriber : subscribers)
+            {
+                pending = pending || subscriber->state != Subscriber::State::Active
+                        || (!backlog && !subscriber->queue.empty());
+            }
+
+            unsigned wait_ms = backlog ? backlog_wait_ms : idle_wait_ms;
+            if (!pending && runing)
+                cond_var.wait_for(lock, std::chrono::milliseconds(wait_ms));
+            sleeping = false;
+        }
+
+        subscribers_gauge->Add(-static_cast<int64_t>(subscribers.size() + added.size()));
+        subscribers.clear();
+        added.clear();
+        LOG("Fan-out " << index << " stopped");
+    }
+};
+
+class FanoutStream : public IFanoutStream
+        , public std::enable_shared_from_this<FanoutStream>
+        , public Common::ObjectCounter<FanoutStream>
+{
+    const int stream_id;
+    const std::string sdp;
+    const unsigned max_subscribers;
+    const std::weak_ptr<FanoutStage> stage;
+
+    std::mutex mx;
+    std::vector<SubscriberPtr> subscribers;
+    bool closed = false;
+    // changes with subscribers, ingest thread copies them on change only
+    std::atomic<unsigned> version{0};
+
+    // ingest thread
+    std::vector<SubscriberPtr> current;
+    unsigned current_version = 0;
+    Common::CounterPtr evictions;
+
+public:
+    FanoutStream(int stream_id, const std::string& sdp, unsigned max_subscribers, const std::weak_ptr<FanoutStage>& stage)
+        : stream_id(stream_id), sdp(sdp), max_subscribers(max_subscribers), stage(stage)
+        , evictions(Common::Metrics::AddCounter("streamer_fanout_evictions_total", "Subscribers evicted on queue overflow",
+                                                {{"stream", std::to_string(stream_id)}}))
+    {
+    }
+
+    ~FanoutStream()
+    {
+        Close();
+    }
+
+    const std::string& Sdp() const
+    {
+        return sdp;
+    }
+
+    void Publish(AVBufferRef* buf, int size) override
+    {
+        if (version.load(std::memory_order_acquire) != current_version)
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            current = subscribers;
+            current_version = version.load(std::memory_order_relaxed);
+        }
+
+        if (current.empty())
+            return;
+
+        AVBufferRef* ref = av_buffer_ref(buf);
+        if (!ref)
+            return;
+
+        auto packet = new FanoutPacket{ref, size, {static_cast<unsigned>(current.size())}};
+        for (auto& subscriber : current)
+        {
+            if (subscriber->state != Subscriber::State::Active)
+            {
+                packet->Release();
+                continue;
+            }
+
+            if (!subscriber->queue.try_push(packet))
+            {
+                LOGW_FMT("Fan-out of stream {} evicts slow subscriber", stream_id);
+                evictions->AddSingle();
+                subscriber->Finish(Subscriber::State::Evicted);
+                packet->Release();
+                continue;
+            }
+
+            subscriber->thread->Notify();
+        }
+    }
+
+    void Close() override;
+
+    // false if the stream is closed or full
+    bool Add(const SubscriberPtr& subscriber)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        if (closed || subscribers.size() >= max_subscribers)
+            return false;
+
+        subscribers.push_back(subscriber);
+        version.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    void Remove(Subscriber* subscriber)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        for (auto it = subscribers.begin(); it != subscribers.end(); ++it)
+        {
+            if (it->get() == subscriber)
+            {
+                subscribers.erase(it);
+                version.fetch_add(1, std::memory_order_release);
+                return;
+            }
+        }
+    }
+};
+
+DECLARE_PTR(FanoutStream)
+
+void Subscriber::Finish(State reason)
+{
+    State expected = State::Active;
+    if (state.compare_exchange_strong(expected, reason))
+        thread->Notify(true);
+}
+
+void FanoutThread::Reap(const SubscriberPtr& subscriber)
+{
+    --load;
+    subscribers_gauge->Add(-1);
+
+    if (auto owner = subscriber->stream.lock())
+        owner->Remove(subscriber.get());
+
+    Subscriber::State state = subscriber->state;
+    if (state == Subscriber::State::Closed)
+        return;
+
+    TRY
+    {
+        subscriber->callback->OnSubscriptionClosed(state == Subscriber::State::Evicted);
+    }
+    CATCH_ERR("Fan-out callback error: ");
+}
+
+class FanoutStage : public IFanoutStage
+        , public std::enable_shared_from_this<FanoutStage>
+        , public Common::ObjectCounter<FanoutStage>
+{
+    const FanoutParams params;
+    const Common::GaugePtr subscribers_gauge;
+    std::vector<std::unique_ptr<FanoutThread>> threads;
+
+    std::mutex mx;
+    std::map<int, FanoutStreamWPtr> streams;
+
+public:
+    FanoutStage(const FanoutParams& params)
+        : params(params)
+        , subscribers_gauge(Common::Metrics::AddGauge("streamer_fanout_subscribers", "Live subscribers of all streams"))
+    {
+        for (unsigned i = 0; i < std::max(params.threads, 1u); ++i)
+            threads.emplace_back(new FanoutThread(i, subscribers_gauge));
+    }
+
+    void Initialize() override
+    {
+        for (auto& thread : threads)
+            thread->Start();
+
+        LOG("Fan-out stage started with " << threads.size() << " threads");
+    }
+
+    void Uninitialize() override
+    {
+        for (auto& thread : threads)
+            thread->Stop();
+
+        std::lock_guard<std::mutex> lock(mx);
+        streams.clear();
+    }
+
+    IFanoutStreamPtr AddStream(int stream_id, const std::string& sdp) override
+    {
+        auto stream = std::make_shared<FanoutStream>(stream_id, sdp, params.max_subscribers, shared_from_this());
+
+        std::lock_guard<std::mutex> lock(mx);
+        streams[stream_id] = stream;
+        return stream;
+    }
+
+    void RemoveStream(int stream_id)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        streams.erase(stream_id);
+    }
+
+    ISubscriptionPtr Subscribe(int stream_id, const sockaddr_in& addr, const IFanoutCallbackPtr& callback, std::string& sdp) override
+    {
+        FanoutStreamPtr stream;
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            auto it = streams.find(stream_id);
+            if (it != streams.end())
+                stream = it->second.lock();
+        }
+
+        if (!stream)
+            return nullptr;
+
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            LOGW("Cannot open fan-out socket " << strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return nullptr;
+        }
+
+        // bursts of key frames wait here rather than in the queue
+        int buffer_size = 4 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+        FanoutThread* thread = threads.front().get();
+        for (auto& candidate : threads)
+        {
+            if (candidate->Load() < thread->Load())
+                thread = candidate.get();
+        }
+
+        auto subscriber = std::make_shared<Subscriber>(fd, params.queue_depth, callback, stream, thread);
+        if (!stream->Add(subscriber))
+            return nullptr;
+
+        subscribers_gauge->Add(1);
+        thread->Add(subscriber);
+        sdp = stream->Sdp();
+        return subscriber;
+    }
+};
+
+void FanoutStream::Close()
+{
+    std::vector<SubscriberPtr> ended;
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        if (closed)
+            return;
+
+        closed = true;
+        ended.swap(subscribers);
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    for (auto& subscriber : ended)
+        subscriber->Finish(Subscriber::State::Ended);
+
+    if (auto owner = stage.lock())
+        owner->RemoveStream(stream_id);
+}
+
+IFanoutStagePtr CreateFanoutStage(const FanoutParams& params)
+{
+    return std::make_shared<FanoutStage>(params);
+}
+
+}
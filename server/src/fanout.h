@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include <string>
+
+#include <netinet/in.h>
+
+struct AVBufferRef;
+
+namespace Server
+{
+
+struct FanoutParams
+{
+    // live subscribers per stream, 0 - fan-out is off
+    unsigned max_subscribers = 16;
+    // datagrams queued per subscriber, a subscriber which lets it fill up
+    // is evicted instead of holding the stream back
+    unsigned queue_depth = 2048;
+    unsigned threads = 1;
+};
+
+struct IFanoutCallback : public virtual Common::IObject
+{
+    // fan-out thread, not called after ISubscription::Close
+    virtual void OnSubscriptionClosed(bool evicted) = 0;
+};
+
+DECLARE_PTR_S(IFanoutCallback)
+
+struct ISubscription : public virtual Common::IObject
+{
+    // queued datagrams are dropped
+    virtual void Close() = 0;
+};
+
+DECLARE_PTR_S(ISubscription)
+
+// Publishing side of a stream, owned by its receiver.
+struct IFanoutStream : public virtual Common::IObject
+{
+    // ingest thread, every subscriber queue takes the same buffer, the
+    // caller keeps its own reference
+    virtual void Publish(AVBufferRef* buf, int size) = 0;
+    // closes subscriptions, stream is not found by Subscribe after it
+    virtual void Close() = 0;
+};
+
+DECLARE_PTR_S(IFanoutStream)
+
+// Sends datagrams of ingested streams to downstream subscribers from own
+// threads. A datagram is shared by all subscriber queues with one
+// reference count, subscribers get batches of it with sendmmsg.
+struct IFanoutStage : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+    virtual IFanoutStreamPtr AddStream(int stream_id, const std::string& sdp) = 0;
+    // nullptr if the stream is unknown or has max subscribers, sdp of the
+    // stream is returned for the subscriber
+    virtual ISubscriptionPtr Subscribe(int stream_id, const sockaddr_in& addr, const IFanoutCallbackPtr& callback, std::string& sdp) = 0;
+};
+
+DECLARE_PTR_S(IFanoutStage)
+
+IFanoutStagePtr CreateFanoutStage(const FanoutParams& params);
+
+}
@@ -0,0 +1,145 @@
+#include "fec_decoder.h"
+#include "common/fec.h"
+
+#include <algorithm>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+}
+
+namespace Server
+{
+
+FecDecoder::FecDecoder()
+    : slots(window)
+    , pending(max_pending)
+{
+}
+
+FecDecoder::~FecDecoder()
+{
+    for (auto& slot : slots)
+        av_buffer_unref(&slot.buf);
+}
+
+void FecDecoder::OnMedia(uint16_t seq, AVBufferRef* buf, int size, std::vector<Packet>& out)
+{
+    AVBufferRef* ref = av_buffer_ref(buf);
+    if (!ref)
+        return;
+
+    Store(seq, ref, size);
+    if (pending_count)
+        RecoverPending(out);
+}
+
+void FecDecoder::OnParity(const uint8_t* data, size_t size, std::vector<Packet>& out)
+{
+    ++stats.parity;
+
+    if (TryRecover(data, size, out))
+    {
+        RecoverPending(out);
+        return;
+    }
+
+    if (pending_count == max_pending)
+    {
+        ++stats.unrecovered;
+        RemovePending(0);
+    }
+    pending[pending_count++].assign(data, data + size);
+}
+
+void FecDecoder::RemovePending(size_t index)
+{
+    // swaps buffers, no copy of their data
+    std::rotate(pending.begin() + index, pending.begin() + index + 1, pending.begin() + pending_count);
+    --pending_count;
+}
+
+void FecDecoder::Store(uint16_t seq, AVBufferRef* buf, int size)
+{
+    Slot& slot = slots[seq % window];
+    av_buffer_unref(&slot.buf);
+    slot.used = true;
+    slot.seq = seq;
+    slot.buf = buf;
+    slot.size = size;
+}
+
+bool FecDecoder::TryRecover(const uint8_t* data, size_t size, std::vector<Packet>& out)
+{
+    Common::Fec::Parity parity;
+    if (!Common::Fec::parse_parity(data, size, parity))
+        return true;
+
+    const uint8_t* packets[Common::Fec::max_group];
+    size_t sizes[Common::Fec::max_group];
+    unsigned present = 0;
+    uint16_t lost = 0;
+
+    for (unsigned i = 0; i < parity.count; ++i)
+    {
+        uint16_t seq = static_cast<uint16_t>(parity.base + i);
+        const Slot& slot = slots[seq % window];
+        if (slot.used && slot.seq == seq)
+        {
+            packets[present] = slot.buf->data;
+            sizes[present++] = slot.size;
+            continue;
+        }
+
+        // slot was taken by a newer packet, group left the window
+        if (slot.used && static_cast<int16_t>(slot.seq - seq) > 0)
+        {
+            ++stats.unrecovered;
+            return true;
+        }
+        lost = seq;
+    }
+
+    if (present == parity.count)
+        return true;
+    if (present + 1 < parity.count)
+        return false;
+
+    AVBufferRef* buf = av_buffer_alloc(static_cast<int>(parity.payload_size));
+    if (!buf)
+        return true;
+
+    size_t length = Common::Fec::recover(parity, packets, sizes, present, buf->data);
+    uint16_t seq = length ? (static_cast<uint16_t>(buf->data[2]) << 8) | buf->data[3] : 0;
+    if (!length || seq != lost)
+    {
+        ++stats.unrecovered;
+        av_buffer_unref(&buf);
+        return true;
+    }
+
+    ++stats.recovered;
+    out.push_back({seq, av_buffer_ref(buf), static_cast<int>(length)});
+    Store(seq, buf, static_cast<int>(length));
+    return true;
+}
+
+void FecDecoder::RecoverPending(std::vector<Packet>& out)
+{
+    // a recovered packet may complete another group
+    for (bool progress = true; progress; )
+    {
+        progress = false;
+        for (size_t i = 0; i < pending_count; ++i)
+        {
+            if (TryRecover(pending[i].data(), pending[i].size(), out))
+            {
+                RemovePending(i);
+                progress = true;
+                break;
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common/object.h"
+
+#include <cstdint>
+#include <vector>
+
+struct AVBufferRef;
+
+namespace Server
+{
+
+struct FecStats
+{
+    uint64_t parity = 0;
+    uint64_t recovered = 0;
+    // groups which lost more than one packet
+    uint64_t unrecovered = 0;
+};
+
+// Recovers lost rtp packets of one ssrc from XOR parity packets of
+// Common::Fec. Holds references of the last media packets, a parity waits
+// while more than one packet of its group is missing, e.g. for a
+// retransmission.
+class FecDecoder : public Common::ObjectCounter<FecDecoder>
+{
+public:
+    struct Packet
+    {
+        uint16_t seq;
+        AVBufferRef* buf;
+        int size;
+    };
+
+private:
+    static constexpr size_t window = 128;
+    static constexpr size_t max_pending = 4;
+
+    struct Slot
+    {
+        bool used = false;
+        uint16_t seq = 0;
+        AVBufferRef* buf = nullptr;
+        int size = 0;
+    };
+
+    std::vector<Slot> slots;
+    // max_pending buffers kept with their capacity, the first pending_count
+    // of them wait oldest first
+    std::vector<std::vector<uint8_t>> pending;
+    size_t pending_count = 0;
+    FecStats stats;
+
+public:
+    FecDecoder();
+    ~FecDecoder();
+
+    FecDecoder(const FecDecoder&) = delete;
+    FecDecoder& operator=(const FecDecoder&) = delete;
+
+    // recovered packets are appended to out, each with a reference of its own
+    void OnMedia(uint16_t seq, AVBufferRef* buf, int size, std::vector<Packet>& out);
+    void OnParity(const uint8_t* data, size_t size, std::vector<Packet>& out);
+
+    const FecStats& Stats() const
+    {
+        return stats;
+    }
+
+private:
+    void Store(uint16_t seq, AVBufferRef* buf, int size);
+    // false while the parity has to wait
+    bool TryRecover(const uint8_t* data, size_t size, std::vector<Packet>& out);
+    // moves pending parity to the end, out of the waiting ones
+    void RemovePending(size_t index);
+    void RecoverPending(std::vector<Packet>& out);
+};
+
+}
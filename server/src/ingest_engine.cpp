@@ -0,0 +1,415 @@
+#include "ingest_engine.h"
+#include "common/common.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+namespace Server
+{
+
+namespace
+{
+
+constexpr int tick_ms = 100;
+
+class IngestWorker;
+
+// worker running on the current thread
+thread_local IngestWorker* current_worker = nullptr;
+
+class IngestWorker : public Common::ObjectCounter<IngestWorker>
+{
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int max_events = 64;
+
+    struct Registration
+    {
+        IIngestTask* task;
+        int fd;
+    };
+
+    struct TaskEntry
+    {
+        IIngestTaskPtr task;
+        std::vector<std::unique_ptr<Registration>> registrations;
+        bool ready = false;
+    };
+
+    const unsigned index;
+    int epoll_fd = -1;
+    int event_fd = -1;
+    std::thread thread;
+    std::atomic<bool> runing{false};
+    std::atomic<unsigned> load{0};
+
+    std::mutex commands_mx;
+    std::vector<std::function<void()>> commands;
+
+    // owned by worker thread
+    std::unordered_map<IIngestTask*, TaskEntry> tasks;
+    std::vector<IIngestTask*> ready;
+
+public:
+    IngestWorker(unsigned index) : index(index)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || event_fd < 0)
+            THROW_ERR("Cannot create ingest worker descriptors " << strerror(errno));
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+    }
+
+    ~IngestWorker()
+    {
+        close(event_fd);
+        close(epoll_fd);
+    }
+
+    unsigned Load() const
+    {
+        return load;
+    }
+
+    void Start()
+    {
+        runing = true;
+        thread = std::thread([this](){ Run(); });
+    }
+
+    void Stop()
+    {
+        runing = false;
+        Wakeup();
+        if (thread.joinable())
+            thread.join();
+        tasks.clear();
+        ready.clear();
+    }
+
+    void Attach(const IIngestTaskPtr& task, const std::vector<int>& fds)
+    {
+        ++load;
+        Execute([this, task, fds]()
+        {
+            TaskEntry& entry = tasks[task.get()];
+            entry.task = task;
+            for (int fd : fds)
+            {
+                entry.registrations.emplace_back(new Registration{task.get(), fd});
+
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.ptr = entry.registrations.back().get();
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                    LOGW("Cannot add fd " << fd << " to epoll " << strerror(errno));
+            }
+            MarkReady(entry);
+        });
+    }
+
+    void Detach(const IIngestTaskPtr& task)
+    {
+        if (!runing || std::this_thread::get_id() == thread.get_id())
+        {
+            Remove(task.get());
+            return;
+        }
+
+        std::promise<void> done;
+        Execute([this, &task, &done]()
+        {
+            Remove(task.get());
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    // worker thread
+    void Wake(IIngestTask* task)
+    {
+        auto it = tasks.find(task);
+        if (it != tasks.end())
+            MarkReady(it->second);
+    }
+
+private:
+    void Execute(std::function<void()> f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(commands_mx);
+            commands.push_back(std::move(f));
+        }
+        Wakeup();
+    }
+
+    void Wakeup()
+    {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LOGW("Ingest worker wakeup failed " << strerror(errno));
+    }
+
+    void Remove(IIngestTask* task)
+    {
+        auto it = tasks.find(task);
+        if (it == tasks.end())
+            return;
+
+        for (auto& reg : it->second.registrations)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, reg->fd, nullptr);
+
+        for (auto& ready_task : ready)
+        {
+            if (ready_task == task)
+                ready_task = nullptr;
+        }
+
+        tasks.erase(it);
+        --load;
+    }
+
+    void MarkReady(TaskEntry& entry)
+    {
+        if (!entry.ready)
+        {
+            entry.ready = true;
+            ready.push_back(entry.task.get());
+        }
+    }
+
+    void RunCommands()
+    {
+        uint64_t value;
+        while (read(event_fd, &value, sizeof(value)) > 0)
+            ;
+
+        std::vector<std::function<void()>> pending;
+        {
+            std::lock_guard<std::mutex> lock(commands_mx);
+            pending.swap(commands);
+        }
+
+        for (auto& f : pending)
+            f();
+    }
+
+    void RunReady()
+    {
+        std::vector<IIngestTask*> current;
+        current.swap(ready);
+
+        for (size_t i = 0; i < current.size(); ++i)
+        {
+            auto it = tasks.find(current[i]);
+            if (it == tasks.end())
+                continue;
+
+            TaskEntry& entry = it->second;
+            entry.ready = false;
+
+            bool more = false;
+            TRY
+            {
+                more = entry.task->Step();
+            }
+            CATCH_ERR("Ingest task step error: ");
+
+            // task may be detached from inside Step
+            it = tasks.find(current[i]);
+            if (more && it != tasks.end())
+                MarkReady(it->second);
+        }
+    }
+
+    void Tick()
+    {
+        for (auto& it : tasks)
+        {
+            TRY
+            {
+                it.second.task->OnTick();
+            }
+            CATCH_ERR("Ingest task tick error: ");
+        }
+
+        for (auto& it : tasks)
+            MarkReady(it.second);
+    }
+
+    void Run()
+    {
+        Common::register_current_thread("ingest" + std::to_string(index));
+        current_worker = this;
+
+        epoll_event events[max_events];
+        auto next_tick = clock::now() + std::chrono::milliseconds(tick_ms);
+
+        while (runing)
+        {
+            int timeout = ready.empty() ? tick_ms : 0;
+            int n = epoll_wait(epoll_fd, events, max_events, timeout);
+            if (n < 0 && errno != EINTR)
+            {
+                LOGE("Ingest worker epoll error " << strerror(errno));
+                break;
+            }
+
+            bool has_commands = false;
+            for (int i = 0; i < n; ++i)
+            {
+                auto reg = static_cast<Registration*>(events[i].data.ptr);
+                if (!reg)
+                {
+                    has_commands = true;
+                    continue;
+                }
+
+                auto it = tasks.find(reg->task);
+                if (it == tasks.end())
+                    continue;
+
+                TRY
+                {
+                    it->second.task->OnReadable(reg->fd);
+                }
+                CATCH_ERR("Ingest task read error: ");
+
+                MarkReady(it->second);
+            }
+
+            // commands may remove registrations, so run them after events
+            if (has_commands)
+                RunCommands();
+
+            RunReady();
+
+            auto now = clock::now();
+            if (now >= next_tick)
+            {
+                next_tick = now + std::chrono::milliseconds(tick_ms);
+                Tick();
+            }
+        }
+
+        current_worker = nullptr;
+        LOG("Ingest worker " << index << " stopped");
+    }
+};
+
+}
+
+void WakeIngestTask(IIngestTask* task)
+{
+    if (current_worker)
+        current_worker->Wake(task);
+}
+
+class IngestEngine : public IIngestEngine
+        , public Common::ObjectCounter<IngestEngine>
+{
+    std::vector<std::unique_ptr<IngestWorker>> workers;
+    std::mutex mx;
+    std::unordered_map<IIngestTask*, IngestWorker*> assigned;
+
+public:
+    IngestEngine(unsigned count)
+    {
+        if (!count)
+            count = std::max(1u, std::thread::hardware_concurrency());
+
+        for (unsigned i = 0; i < count; ++i)
+            workers.emplace_back(new IngestWorker(i));
+    }
+
+    void Initialize() override
+    {
+        av_register_all();
+        avformat_network_init();
+
+        for (auto& worker : workers)
+            worker->Start();
+
+        LOG("Ingest engine started with " << workers.size() << " workers");
+    }
+
+    void Uninitialize() override
+    {
+        for (auto& worker : workers)
+            worker->Stop();
+
+        std::lock_guard<std::mutex> lock(mx);
+        assigned.clear();
+    }
+
+    unsigned Workers() const override
+    {
+        return workers.size();
+    }
+
+    void Attach(const IIngestTaskPtr& task, const std::vector<int>& fds) override
+    {
+        IngestWorker* worker = workers.front().get();
+        for (auto& candidate : workers)
+        {
+            if (candidate->Load() < worker->Load())
+                worker = candidate.get();
+        }
+
+        Attach(worker, task, fds);
+    }
+
+    void AttachTo(unsigned worker, const IIngestTaskPtr& task, const std::vector<int>& fds) override
+    {
+        Attach(workers[worker % workers.size()].get(), task, fds);
+    }
+
+    void Detach(const IIngestTaskPtr& task) override
+    {
+        IngestWorker* worker = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            auto it = assigned.find(task.get());
+            if (it == assigned.end())
+                return;
+            worker = it->second;
+            assigned.erase(it);
+        }
+
+        worker->Detach(task);
+    }
+
+private:
+    void Attach(IngestWorker* worker, const IIngestTaskPtr& task, const std::vector<int>& fds)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            assigned[task.get()] = worker;
+        }
+
+        worker->Attach(task, fds);
+    }
+};
+
+IIngestEnginePtr CreateIngestEngine(unsigned workers)
+{
+    return std::make_shared<IngestEngine>(workers);
+}
+
+}
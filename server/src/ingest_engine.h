@@ -0,0 +1,47 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include <vector>
+
+namespace Server
+{
+
+// Unit of work driven by the ingest engine. Every call for one task comes
+// from the same worker thread, so a task needs no locking of its own state.
+struct IIngestTask : public virtual Common::IObject
+{
+    // registered descriptor is readable, drain it without blocking
+    virtual void OnReadable(int fd) = 0;
+    // advance state machine without blocking, true if there is more work to do
+    virtual bool Step() = 0;
+    // periodic call for timeouts
+    virtual void OnTick() = 0;
+};
+
+DECLARE_PTR_S(IIngestTask)
+
+struct IIngestEngine : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+    virtual unsigned Workers() const = 0;
+    // on the least loaded worker
+    virtual void Attach(const IIngestTaskPtr& task, const std::vector<int>& fds) = 0;
+    // on worker index % workers count, tasks sharing data run on one thread
+    virtual void AttachTo(unsigned worker, const IIngestTaskPtr& task, const std::vector<int>& fds) = 0;
+    // returns when the worker has dropped the task, no task calls after that
+    virtual void Detach(const IIngestTaskPtr& task) = 0;
+};
+
+DECLARE_PTR_S(IIngestEngine)
+
+// Schedules Step of a task attached to the current worker thread, for tasks
+// fed by another task of the same worker.
+void WakeIngestTask(IIngestTask* task);
+
+// workers == 0 means one worker per core
+IIngestEnginePtr CreateIngestEngine(unsigned workers);
+
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Server
+{
+
+struct JitterStats
+{
+    // arrived after their sequence number was released or given up
+    uint64_t late = 0;
+    uint64_t duplicate = 0;
+    // sequence numbers given up after max latency or on overflow
+    uint64_t lost = 0;
+    uint64_t released = 0;
+    // sender restarted its sequence numbers
+    uint64_t resyncs = 0;
+};
+
+// Reorders rtp packets of one ssrc by sequence number. Slots are indexed by
+// seq & mask, so insert and in order release are O(1). A gap holds the
+// packets behind it until the oldest of them has waited max_latency, then
+// the gap is counted as lost. A packet more than capacity ahead of the
+// gap pushes the head out, so at most capacity packets are buffered.
+template <typename T>
+class JitterBuffer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // item stays with the caller unless it is buffered
+    enum class Result
+    {
+        Buffered,
+        Late,
+        Duplicate,
+    };
+
+private:
+    // consecutive late packets which mean the sender restarted
+    static constexpr unsigned resync_late_packets = 32;
+
+    struct Slot
+    {
+        T item;
+        clock::time_point arrival;
+        bool used = false;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    clock::duration max_latency;
+
+    // sequence numbers in insertion order, so in arrival order, entries of
+    // released packets are skipped at the front
+    std::vector<uint16_t> arrivals;
+    size_t arrivals_head = 0;
+    size_t arrivals_count = 0;
+
+    bool started = false;
+    uint16_t next = 0;
+    // highest pushed sequence number
+    uint16_t newest = 0;
+    // sequence numbers skipped by the last push
+    uint16_t missed = 0;
+    size_t count = 0;
+    unsigned late_run = 0;
+    JitterStats stats;
+
+public:
+    // capacity is rounded up to a power of two
+    JitterBuffer(size_t capacity, clock::duration max_latency)
+        : max_latency(max_latency)
+    {
+        size_t size = 16;
+        while (size < capacity && size < 0x8000)
+            size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+        // an entry per sequence number in a window of two capacities
+        arrivals.resize(size * 2);
+    }
+
+    size_t Size() const
+    {
+        return count;
+    }
+
+    const JitterStats& Stats() const
+    {
+        return stats;
+    }
+
+    // packets between the last pushed one and the newest before it, new
+    // gap to request retransmission for
+    uint16_t Missed() const
+    {
+        return missed;
+    }
+
+    // seq is still awaited, neither arrived nor given up
+    bool IsMissing(uint16_t seq) const
+    {
+        return started && static_cast<int16_t>(seq - next) >= 0 && static_cast<int16_t>(newest - seq) > 0
+                && !slots[seq & mask].used;
+    }
+
+    // out(T&&) takes packets released in order by this call
+    template <typename Out>
+    Result Push(uint16_t seq, T&& item, clock::time_point arrival, Out&& out)
+    {
+        missed = 0;
+        if (!started)
+        {
+            started = true;
+            next = newest = seq;
+        }
+
+        if (static_cast<int16_t>(seq - next) < 0)
+        {
+            if (++late_run < resync_late_packets)
+            {
+                ++stats.late;
+                return Result::Late;
+            }
+
+            ++stats.resyncs;
+            Flush(out);
+            next = newest = seq;
+        }
+        late_run = 0;
+
+        // far ahead, give up head until the packet fits
+        while (static_cast<uint16_t>(seq - next) > mask)
+        {
+            if (!count)
+            {
+                stats.lost += static_cast<uint16_t>(seq - next) - mask;
+                next = static_cast<uint16_t>(seq - mask);
+                break;
+            }
+            Advance(out);
+        }
+
+        Slot& slot = slots[seq & mask];
+        if (slot.used)
+        {
+            ++stats.duplicate;
+            return Result::Duplicate;
+        }
+
+        slot.item = std::move(item);
+        slot.arrival = arrival;
+        slot.used = true;
+        ++count;
+        arrivals[(arrivals_head + arrivals_count++) % arrivals.size()] = seq;
+
+        int16_t ahead = static_cast<int16_t>(seq - newest);
+        if (ahead > 0)
+        {
+            missed = static_cast<uint16_t>(ahead - 1);
+            newest = seq;
+        }
+
+        Release(arrival, out);
+        return Result::Buffered;
+    }
+
+    // releases packets in order, gaps are given up once the oldest packet
+    // behind them has waited max latency
+    template <typename Out>
+    void Release(clock::time_point now, Out&& out)
+    {
+        while (count)
+        {
+            if (!slots[next & mask].used && now - OldestArrival() < max_latency)
+                return;
+            Advance(out);
+        }
+    }
+
+    // releases all packets in order, e.g. when the stream ends
+    template <typename Out>
+    void Flush(Out&& out)
+    {
+        while (count)
+            Advance(out);
+    }
+
+private:
+    // releases packet at head or gives up its sequence number, count > 0
+    template <typename Out>
+    void Advance(Out&& out)
+    {
+        Slot& slot = slots[next++ & mask];
+        if (!slot.used)
+        {
+            ++stats.lost;
+            return;
+        }
+
+        slot.used = false;
+        ++stats.released;
+        // all arrival entries are of released packets
+        if (!--count)
+            arrivals_head = arrivals_count = 0;
+        out(std::move(slot.item));
+    }
+
+    // count > 0
+    clock::time_point OldestArrival()
+    {
+        for (;;)
+        {
+            uint16_t seq = arrivals[arrivals_head];
+            // buffered packets are in [next, next + capacity)
+            if (slots[seq & mask].used && static_cast<uint16_t>(seq - next) <= mask)
+                return slots[seq & mask].arrival;
+
+            arrivals_head = (arrivals_head + 1) % arrivals.size();
+            --arrivals_count;
+        }
+    }
+};
+
+}
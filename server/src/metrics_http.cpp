@@ -0,0 +1,149 @@
+#include "metrics_http.h"
+#include "common/common.h"
+#include "common/metrics.h"
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+using boost::asio::ip::tcp;
+
+namespace Server
+{
+
+namespace
+{
+
+// request and response, idle clients do not hold sockets
+constexpr unsigned connection_timeout_ms = 5000;
+
+class MetricsConnection : public std::enable_shared_from_this<MetricsConnection>
+        , public Common::ObjectCounter<MetricsConnection>
+{
+    static constexpr size_t max_request_size = 8192;
+
+    tcp::socket socket;
+    boost::asio::steady_timer timer;
+    boost::asio::streambuf request;
+    std::string response;
+
+public:
+    MetricsConnection(boost::asio::io_service& io, tcp::socket socket)
+        : socket(std::move(socket)), timer(io), request(max_request_size)
+    {
+    }
+
+    void Start()
+    {
+        auto self(shared_from_this());
+        timer.expires_from_now(std::chrono::milliseconds(connection_timeout_ms));
+        timer.async_wait([this, self](const boost::system::error_code& ec)
+        {
+            if (ec)
+                return;
+
+            boost::system::error_code close_ec;
+            socket.close(close_ec);
+        });
+
+        boost::asio::async_read_until(socket, request, "\r\n\r\n",
+            [this, self](const boost::system::error_code& ec, size_t)
+            {
+                if (ec)
+                {
+                    timer.cancel();
+                    return;
+                }
+
+                std::istream stream(&request);
+                std::string method, target;
+                stream >> method >> target;
+
+                if (method == "GET" && (target == "/metrics" || target.compare(0, 9, "/metrics?") == 0))
+                    Reply("200 OK", "text/plain; version=0.0.4; charset=utf-8", Common::Metrics::Render());
+                else
+                    Reply("404 Not Found", "text/plain", "not found\n");
+            });
+    }
+
+private:
+    void Reply(const char* status, const char* type, const std::string& body)
+    {
+        response = std::string("HTTP/1.1 ") + status + "\r\n"
+                + "Content-Type: " + type + "\r\n"
+                + "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                + "Connection: close\r\n\r\n" + body;
+
+        auto self(shared_from_this());
+        boost::asio::async_write(socket, boost::asio::buffer(response),
+            [this, self](const boost::system::error_code&, size_t)
+            {
+                timer.cancel();
+                boost::system::error_code ec;
+                socket.shutdown(tcp::socket::shutdown_both, ec);
+            });
+    }
+};
+
+}
+
+class MetricsService : public IMetricsService
+        , public std::enable_shared_from_this<MetricsService>
+        , public Common::ObjectCounter<MetricsService>
+{
+    boost::asio::io_service& io;
+    const uint16_t port;
+    tcp::acceptor acceptor;
+    tcp::socket socket;
+    Common::MetricSourcePtr log_dropped;
+
+public:
+    MetricsService(boost::asio::io_service& io, uint16_t port)
+        : io(io), port(port), acceptor(io), socket(io)
+    {
+    }
+
+    void Initialize() override
+    {
+        tcp::endpoint endpoint(tcp::v4(), port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+
+        log_dropped = Common::Metrics::AddCallback("streamer_log_dropped_total", "Log records dropped on queue overflow",
+                                                   Common::Metrics::Type::Counter, {},
+                                                   []() { return static_cast<double>(Common::log_dropped_count()); });
+
+        DoAccept();
+        LOG("Metrics are served on port " << port);
+    }
+
+    void Uninitialize() override
+    {
+        boost::system::error_code ec;
+        acceptor.close(ec);
+        log_dropped.reset();
+    }
+
+private:
+    void DoAccept()
+    {
+        auto self(shared_from_this());
+        acceptor.async_accept(socket,
+            [this, self](const boost::system::error_code& ec)
+            {
+                if (ec)
+                    return;
+
+                std::make_shared<MetricsConnection>(io, std::move(socket))->Start();
+                DoAccept();
+            });
+    }
+};
+
+IMetricsServicePtr CreateMetricsService(boost::asio::io_service& io, uint16_t port)
+{
+    return std::make_shared<MetricsService>(io, port);
+}
+
+}
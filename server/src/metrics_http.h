@@ -0,0 +1,28 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include <cstdint>
+
+namespace boost { namespace asio {
+    class io_context;
+    typedef io_context io_service;
+}}
+
+namespace Server
+{
+
+// Serves Common::Metrics as Prometheus text on GET /metrics, one request
+// per connection, on the given io_service.
+struct IMetricsService : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+};
+
+DECLARE_PTR_S(IMetricsService)
+
+IMetricsServicePtr CreateMetricsService(boost::asio::io_service& io, uint16_t port);
+
+}
@@ -0,0 +1,132 @@
+#include "packet_pool.h"
+
+#include <sstream>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+}
+
+namespace Server
+{
+
+namespace
+{
+
+// opaque of one AVBufferPool, freed by pool_free when the last buffer of
+// the class is returned after the pool was uninitialized
+struct SizeClass
+{
+    std::shared_ptr<Common::BufferPool> slabs;
+    std::shared_ptr<std::atomic<uint64_t>> allocs;
+    int size;
+};
+
+void ReleaseToSlab(void* opaque, uint8_t* data)
+{
+    auto cls = static_cast<SizeClass*>(opaque);
+    cls->slabs->Release(data, cls->size);
+}
+
+AVBufferRef* AllocFromSlab(void* opaque, int size)
+{
+    auto cls = static_cast<SizeClass*>(opaque);
+
+    size_t capacity = 0;
+    uint8_t* data = cls->slabs->Acquire(size, capacity);
+    if (!data)
+        return nullptr;
+
+    ++*cls->allocs;
+
+    AVBufferRef* buf = av_buffer_create(data, size, &ReleaseToSlab, cls, 0);
+    if (!buf)
+        cls->slabs->Release(data, capacity);
+    return buf;
+}
+
+void FreeClass(void* opaque)
+{
+    delete static_cast<SizeClass*>(opaque);
+}
+
+}
+
+class PacketBufferPool::Private
+{
+public:
+    std::shared_ptr<Common::BufferPool> slabs;
+    std::shared_ptr<std::atomic<uint64_t>> allocs;
+    std::atomic<uint64_t> gets{0};
+    std::vector<std::pair<int, AVBufferPool*>> pools;
+
+    Private(bool huge_pages)
+    {
+        Common::BufferPool::Params params;
+        params.huge_pages = huge_pages;
+
+        slabs = std::make_shared<Common::BufferPool>(params);
+        allocs = std::make_shared<std::atomic<uint64_t>>(0);
+
+        for (size_t size : params.size_classes)
+        {
+            auto cls = new SizeClass{slabs, allocs, static_cast<int>(size)};
+            pools.emplace_back(cls->size, av_buffer_pool_init2(cls->size, cls, &AllocFromSlab, &FreeClass));
+        }
+    }
+
+    ~Private()
+    {
+        for (auto& pool : pools)
+            av_buffer_pool_uninit(&pool.second);
+    }
+
+    AVBufferRef* Get(size_t size)
+    {
+        for (auto& pool : pools)
+        {
+            if (static_cast<size_t>(pool.first) >= size)
+            {
+                ++gets;
+                return av_buffer_pool_get(pool.second);
+            }
+        }
+
+        return nullptr;
+    }
+};
+
+PacketBufferPool::PacketBufferPool(bool huge_pages)
+    : d(*new Private(huge_pages))
+{
+}
+
+PacketBufferPool::~PacketBufferPool()
+{
+    delete &d;
+}
+
+AVBufferRef* PacketBufferPool::Get(size_t size)
+{
+    return d.Get(size);
+}
+
+uint64_t PacketBufferPool::Gets() const
+{
+    return d.gets;
+}
+
+uint64_t PacketBufferPool::Allocs() const
+{
+    return *d.allocs;
+}
+
+std::string PacketBufferPool::Dump() const
+{
+    std::ostringstream sstr;
+    sstr << "gets " << Gets() << " allocs " << Allocs() << " slabs: " << d.slabs->Dump();
+    return sstr.str();
+}
+
+}
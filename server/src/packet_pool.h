@@ -0,0 +1,36 @@
+#pragma once
+
+#include "common/buffer_pool.h"
+
+#include <memory>
+#include <string>
+
+struct AVBufferRef;
+
+namespace Server
+{
+
+// AVBufferPool per size class, backed by Common::BufferPool slabs. Buffers
+// returned by Get are refcounted AVBufferRef, they may outlive the pool.
+class PacketBufferPool : public Common::ObjectCounter<PacketBufferPool>
+{
+    class Private;
+    Private& d;
+
+public:
+    PacketBufferPool(bool huge_pages);
+    ~PacketBufferPool();
+
+    PacketBufferPool(const PacketBufferPool&) = delete;
+    PacketBufferPool& operator=(const PacketBufferPool&) = delete;
+
+    // nullptr if size exceeds largest class or memory is over
+    AVBufferRef* Get(size_t size);
+
+    // gets - buffers handed out, allocs - buffers created because pool was empty
+    uint64_t Gets() const;
+    uint64_t Allocs() const;
+    std::string Dump() const;
+};
+
+}
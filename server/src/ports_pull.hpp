@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <deque>
+#include <mutex>
+#include <vector>
 
 namespace Server
 {
@@ -9,9 +12,10 @@ class PortsPool
     static constexpr uint16_t start_port = 35000;
     std::deque<uint16_t> free_ports;
 public:
-    PortsPool(unsigned max_clients)
+    // slice of clients for one of shards
+    PortsPool(unsigned max_clients, unsigned shard = 0, unsigned shards = 1)
     {
-        for (unsigned i = 0; i < max_clients; ++i)
+        for (unsigned i = shard; i < max_clients; i += shards)
         {
             free_ports.push_back(start_port + i*4);
             free_ports.push_back(free_ports.back()+2);
@@ -31,6 +35,47 @@ public:
     {
         free_ports.push_front(port);
     }
+
+    // client slot the port was made for
+    static unsigned client(uint16_t port)
+    {
+        return (port - start_port) / 4;
+    }
+};
+
+// Port pairs of all control shards. A shard takes ports of its own slice
+// and borrows from the other slices when it runs dry, e.g. with more
+// shards than clients. Ports go back to the slice they belong to.
+class SharedPortsPool
+{
+    std::mutex mutex;
+    std::vector<PortsPool> slices;
+public:
+    SharedPortsPool(unsigned max_clients, unsigned shards)
+    {
+        for (unsigned i = 0; i < shards; ++i)
+            slices.emplace_back(max_clients, i, shards);
+    }
+
+    uint16_t pop(unsigned shard)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < slices.size(); ++i)
+        {
+            uint16_t port = slices[(shard + i) % slices.size()].pop();
+            if (port)
+                return port;
+        }
+        return 0;
+    }
+
+    void return_port(uint16_t port)
+    {
+        if (!port)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        slices[PortsPool::client(port) % slices.size()].return_port(port);
+    }
 };
 }
 
@@ -1,7 +1,22 @@
 #include "receiver.h"
+#include "fec_decoder.h"
+#include "jitter_buffer.hpp"
+#include "udp_batch.h"
+#include "packet_pool.h"
 #include "common/common.h"
+#include "common/fec.h"
+#include "common/metrics.h"
+#include "common/rtcp.hpp"
+#include "common/sdp.hpp"
 
-#include <thread>
+#include <vector>
+
+#include <boost/circular_buffer.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 extern "C"
 {
@@ -13,6 +28,17 @@ extern "C"
 namespace Server
 {
 
+namespace
+{
+
+// a gap may be reordering, first request waits a bit
+constexpr unsigned nack_delay_ms = 5;
+constexpr unsigned nack_retry_ms = 20;
+// nack packets per ssrc at most once per interval
+constexpr unsigned nack_interval_ms = 5;
+
+}
+
 class timeout_handler {
     using clock = std::chrono::steady_clock;
     using ms = std::chrono::milliseconds;
@@ -46,32 +72,141 @@ class timeout_handler {
         }
         return actualDelay > timeout_ms ? 1 : 0;
     }
+ };
+
 
-    static int check_interrupt(void * t)
+// RFC 3550 A.1 style sequence bookkeeping of one ssrc as datagrams arrive,
+// for metrics only, reordering is done by jitter buffers.
+class RtpSequence
+{
+    uint32_t ssrc = 0;
+    uint16_t max_seq = 0;
+    uint32_t cycles = 0;
+    uint32_t base = 0;
+    uint64_t received = 0;
+
+public:
+    explicit RtpSequence(uint32_t ssrc) : ssrc(ssrc)
+    {
+    }
+
+    uint32_t Ssrc() const
     {
-        timeout_handler* th = static_cast<timeout_handler *>(t);
-        if (th && th->is_timeout())
+        return ssrc;
+    }
+
+    // false for late or duplicated packet
+    bool Update(uint16_t seq)
+    {
+        if (!received++)
         {
-            LOGW("Interrupt listen by timout " << th->reset_line);
-            return 1;
+            base = max_seq = seq;
+            return true;
         }
 
-       return 0;
+        int16_t delta = static_cast<int16_t>(seq - max_seq);
+        if (delta <= 0)
+            return false;
+
+        if (seq < max_seq)
+            cycles += 0x10000;
+        max_seq = seq;
+        return true;
     }
- };
 
+    // expected minus received, duplicates may make it negative
+    int64_t Lost() const
+    {
+        if (!received)
+            return 0;
+        int64_t expected = static_cast<int64_t>(cycles) + max_seq - base + 1;
+        return expected - static_cast<int64_t>(received);
+    }
+};
 
 class Receiver : public IReceiver
+        , public IRtpSink
         , public Common::ObjectCounter<Receiver>
         , public std::enable_shared_from_this<Receiver>
 {
-    std::thread thread;
-    bool runing = true;
-    const std::string sdp;
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int input_buffer_size = 64 * 1024;
+    static constexpr unsigned max_queued_datagrams = 8192;
+    // recvmmsg calls per socket wakeup, keeps worker fair
+    static constexpr unsigned read_batches = 4;
+    // packets demuxed per step
+    static constexpr unsigned process_budget = 32;
+    // datagrams collected before probing stream info
+    static constexpr unsigned probe_packets = 200;
+    static constexpr unsigned probe_timeout_ms = 1000;
+    // packets held per ssrc, more push the oldest gap out
+    static constexpr unsigned jitter_slots = 1024;
+    static constexpr unsigned max_nack_requests = 3;
+    // missing packets tracked per ssrc, larger gaps are left to the jitter buffer
+    static constexpr size_t max_nacks = 256;
+
+    const IIngestEnginePtr engine;
+    const IWriterStagePtr writer;
     const IReceiverCallbackPtr callback;
+    const ReceiverParams params;
+
+    // video rtp, video rtcp, audio rtp, audio rtcp
+    std::vector<int> sockets;
+    // shared port ingest
+    std::vector<uint32_t> ssrcs;
+    bool attached = false;
+    struct Datagram
+    {
+        AVBufferRef* buf = nullptr;
+        int size = 0;
+        clock::time_point arrival;
+    };
+
+    // retransmission request of a missing rtp packet
+    struct Nack
+    {
+        uint16_t seq;
+        unsigned sent;
+        clock::time_point due;
+    };
 
+    struct Jitter
+    {
+        Jitter(uint32_t ssrc, unsigned latency_ms)
+            : ssrc(ssrc)
+            , buffer(jitter_slots, std::chrono::milliseconds(latency_ms))
+        {
+        }
+
+        uint32_t ssrc;
+        JitterBuffer<Datagram> buffer;
+        // source of rtp, nacks go back from the socket it came to
+        int fd = -1;
+        sockaddr_storage peer = {};
+        socklen_t peer_len = 0;
+        std::vector<Nack> nacks;
+        clock::time_point next_nack;
+        // from the first parity packet of the ssrc
+        std::unique_ptr<FecDecoder> fec;
+    };
+
+    PacketBufferPool packet_pool;
+    boost::circular_buffer<Datagram> datagrams;
+    AVPacket* packet = nullptr;
+    UdpReadStats read_stats;
+    size_t sdp_pos = 0;
+    bool nonblocking = false;
+    clock::time_point first_datagram;
+
+    int rtcp_fd = -1;
+    sockaddr_storage rtcp_peer = {};
+    socklen_t rtcp_peer_len = 0;
+
+    AVIOContext* input_io = nullptr;
     AVFormatContext* input_fmt = nullptr;
-    AVFormatContext* output_fmt = nullptr;
+    IRecorderPtr recorder;
+    IFanoutStreamPtr fanout;
 
     timeout_handler th;
 
@@ -79,9 +214,47 @@ class Receiver : public IReceiver
 
     const int video_id;
 
+    // written by ingest worker only
+    const Common::Metrics::Labels labels;
+    Common::CounterPtr datagrams_total;
+    Common::CounterPtr bytes_total;
+    Common::CounterPtr read_errors;
+    Common::CounterPtr queue_drops;
+    Common::CounterPtr packets_total;
+    Common::CounterPtr reordered;
+    Common::GaugePtr lost;
+    Common::GaugePtr queue_depth;
+    std::vector<RtpSequence> sequences;
+    // per ssrc, empty with jitter latency 0
+    std::vector<Jitter> jitters;
+    JitterStats jitter_published;
+    Common::CounterPtr jitter_late;
+    Common::CounterPtr jitter_duplicate;
+    Common::CounterPtr jitter_lost;
+    Common::CounterPtr nack_requested;
+    Common::CounterPtr nack_recovered;
+    std::vector<uint16_t> nack_seqs;
+    std::vector<uint8_t> nack_packet;
+    FecStats fec_published;
+    Common::CounterPtr fec_parity;
+    Common::CounterPtr fec_recovered;
+    Common::CounterPtr fec_unrecovered;
+    // parity needs the jitter buffer to wait for the packets of its group
+    Common::CounterPtr fec_parity_dropped;
+    bool parity_dropped = false;
+    std::vector<FecDecoder::Packet> fec_packets;
+    // socket arrival to av_read_frame return and av_read_frame itself
+    Common::HistogramPtr read_latency;
+    Common::HistogramPtr demux_latency;
+    // arrival of first datagram read since last demuxed packet
+    clock::time_point read_arrival;
+    bool read_pending = false;
+
     enum class States
     {
         OpenInput,
+        WaitProbe,
+        ProbeInput,
         OpenOutput,
         Process,
         Fail,
@@ -90,211 +263,677 @@ class Receiver : public IReceiver
 
 public:
 
-    Receiver(const IReceiverCallbackPtr& callback, const std::string& sdp, int video_id) : sdp(sdp), callback(callback), video_id(video_id)
+    Receiver(const IIngestEnginePtr& engine, const IWriterStagePtr& writer, const IReceiverCallbackPtr& callback, const ReceiverParams& params)
+        : engine(engine), writer(writer), callback(callback), params(params)
+        , packet_pool(params.huge_pages), datagrams(max_queued_datagrams)
+        , video_id(params.video_id)
+        , labels{{"stream", std::to_string(params.video_id)}}
+        , datagrams_total(Common::Metrics::AddCounter("streamer_receiver_datagrams_total", "Received rtp and rtcp datagrams", labels))
+        , bytes_total(Common::Metrics::AddCounter("streamer_receiver_bytes_total", "Received datagram bytes", labels))
+        , read_errors(Common::Metrics::AddCounter("streamer_receiver_read_errors_total", "Failed socket reads", labels))
+        , queue_drops(Common::Metrics::AddCounter("streamer_receiver_dropped_datagrams_total", "Datagrams dropped on queue overflow or buffer shortage", labels))
+        , packets_total(Common::Metrics::AddCounter("streamer_receiver_packets_total", "Demuxed packets passed to recorder", labels))
+        , reordered(Common::Metrics::AddCounter("streamer_receiver_rtp_reordered_total", "Late or duplicated rtp packets", labels))
+        , lost(Common::Metrics::AddGauge("streamer_receiver_rtp_lost", "Estimate of lost rtp packets, expected minus received", labels))
+        , queue_depth(Common::Metrics::AddGauge("streamer_receiver_queue_depth", "Datagrams queued to demuxer", labels))
+        , jitter_late(Common::Metrics::AddCounter("streamer_receiver_jitter_late_total", "Rtp packets arrived after jitter buffer released their place", labels))
+        , jitter_duplicate(Common::Metrics::AddCounter("streamer_receiver_jitter_duplicate_total", "Duplicated rtp packets dropped by jitter buffer", labels))
+        , jitter_lost(Common::Metrics::AddCounter("streamer_receiver_jitter_lost_total", "Rtp sequence numbers given up by jitter buffer", labels))
+        , nack_requested(Common::Metrics::AddCounter("streamer_receiver_nack_requested_total", "Retransmission requests of rtp packets, repeats included", labels))
+        , nack_recovered(Common::Metrics::AddCounter("streamer_receiver_nack_recovered_total", "Requested rtp packets which arrived in time", labels))
+        , fec_parity(Common::Metrics::AddCounter("streamer_receiver_fec_parity_total", "Received fec parity packets", labels))
+        , fec_recovered(Common::Metrics::AddCounter("streamer_receiver_fec_recovered_total", "Rtp packets recovered from parity", labels))
+        , fec_unrecovered(Common::Metrics::AddCounter("streamer_receiver_fec_unrecovered_total", "Fec groups which lost more than one packet", labels))
+        , fec_parity_dropped(Common::Metrics::AddCounter("streamer_receiver_fec_parity_dropped_total", "Fec parity packets dropped with jitter buffer off", labels))
+        , read_latency(Common::Metrics::AddHistogram("streamer_stage_latency_seconds", "Latency of ingest pipeline stages", {{"stage", "read"}}))
+        , demux_latency(Common::Metrics::AddHistogram("streamer_stage_latency_seconds", "Latency of ingest pipeline stages", {{"stage", "demux"}}))
     {
+        packet = av_packet_alloc();
         LOG("Receiver CONSTRUCT " << this);
     }
 
     ~Receiver()
     {
-        LOG("Receiver DESTROY " << this);
-        if (output_fmt)
-            av_write_trailer(output_fmt);
+        LOG("Receiver DESTROY " << this << " datagrams " << read_stats.datagrams
+            << " syscalls " << read_stats.syscalls
+            << " per syscall " << read_stats.DatagramsPerSyscall()
+            << " gro " << read_stats.gro_datagrams);
+        LOG("Receiver " << video_id << " read latency us " << read_latency->Summary(1e3));
+        LOG("Receiver " << video_id << " demux latency us " << demux_latency->Summary(1e3));
+        LOG("Receiver buffers " << packet_pool.Dump());
+        for (auto& jitter : jitters)
+        {
+            const JitterStats& stats = jitter.buffer.Stats();
+            LOG("Receiver " << video_id << " jitter ssrc " << jitter.ssrc << " released " << stats.released
+                << " late " << stats.late << " duplicate " << stats.duplicate << " lost " << stats.lost
+                << " resyncs " << stats.resyncs);
+            if (jitter.fec)
+            {
+                const FecStats& fec = jitter.fec->Stats();
+                LOG("Receiver " << video_id << " fec ssrc " << jitter.ssrc << " parity " << fec.parity
+                    << " recovered " << fec.recovered << " unrecovered " << fec.unrecovered);
+            }
+            jitter.buffer.Flush([](Datagram&& datagram) { av_buffer_unref(&datagram.buf); });
+        }
+        if (recorder)
+            recorder->Finish();
         avformat_close_input(&input_fmt);
-        if (output_fmt && !(output_fmt->oformat->flags & AVFMT_NOFILE))
-            avio_closep(&output_fmt->pb);
-        avformat_free_context(output_fmt);
+        if (input_io)
+        {
+            av_freep(&input_io->buffer);
+            avio_context_free(&input_io);
+        }
+        av_packet_free(&packet);
+        for (auto& datagram : datagrams)
+            av_buffer_unref(&datagram.buf);
+        CloseSockets();
     }
 
     void Initialize() override
     {
-        auto self(shared_from_this());
-        thread = std::thread([self]()
+        if (params.fanout)
+            fanout = params.fanout->AddStream(video_id, params.sdp);
+
+        if (params.demuxer)
         {
-            self->RunAccept();
-        });
+            ssrcs = Common::Sdp::parse_ssrcs(params.sdp);
+            if (ssrcs.empty())
+                LOGE("Receiver " << video_id << " sdp has no ssrc for shared port ingest");
+            else if (!params.demuxer->AttachSink(params.demux_socket, ssrcs, shared_from_this()))
+                LOGE("Receiver " << video_id << " ssrc is already used by another stream");
+            else
+            {
+                attached = true;
+                return;
+            }
+
+            state = States::Fail;
+            engine->Attach(shared_from_this(), sockets);
+            return;
+        }
+
+        if (!OpenSockets())
+            state = States::Fail;
+
+        engine->Attach(shared_from_this(), sockets);
     }
 
     void Uninitialize() override
     {
-        runing = false;
-        thread.join();
+        if (fanout)
+            fanout->Close();
+        if (attached)
+            params.demuxer->DetachSink(params.demux_socket, ssrcs, shared_from_this());
+        else
+            engine->Detach(shared_from_this());
+        CloseSockets();
         LOG("Uninitialize successed");
     }
 
-    void RunAccept()
+    void OnReadable(int fd) override
     {
-        av_log_set_level(54);
-        //av_log_set_callback(av_log_ffmpeg_callback);
-        av_register_all();
-        avformat_network_init();
+        bool is_rtcp = false;
+        for (size_t i = 1; i < sockets.size(); i += 2)
+            is_rtcp = is_rtcp || sockets[i] == fd;
 
-        while(runing)
+        UdpBatchReader& reader = UdpBatchReader::ForCurrentThread();
+
+        for (unsigned i = 0; i < read_batches; ++i)
         {
-            switch (state)
+            int count = reader.Read(fd, read_stats);
+            if (count < 0)
             {
-            case States::OpenInput:
-                OpenInput();
-                break;
-            case States::OpenOutput:
-                OpenOutput();
-                break;
-            case States::Process:
-                Process();
-                break;
-            case States::Fail:
-                callback->OnReceiverFailed();
-                state = States::Unloading;
-                break;
-            case States::Unloading:
-                std::this_thread::sleep_for(std::chrono::microseconds(100));
-                break;
+                read_errors->AddSingle();
+                LOGW_FMT("Receive datagrams error {}", strerror(-count));
             }
+            if (count <= 0)
+                return;
+
+            for (const UdpDatagram& datagram : reader.Datagrams())
+                OnDatagram(datagram, fd, is_rtcp);
+
+            if (count < static_cast<int>(UdpBatchReader::batch_size))
+                return;
         }
     }
 
-    const char* ff_error(int errcode)
+    void OnDatagram(const UdpDatagram& datagram, int fd, bool rtcp) override
     {
-        error_buff[0] = 0;
-        av_strerror(errcode, error_buff, sizeof(error_buff));
-        return error_buff;
+        if (rtcp)
+        {
+            rtcp_fd = fd;
+            rtcp_peer = *datagram.peer;
+            rtcp_peer_len = datagram.peer_len;
+        }
+
+        if (state == States::Fail || state == States::Unloading)
+            return;
+
+        if (params.load)
+            params.load->AddBytes(datagram.size);
+
+        datagrams_total->AddSingle();
+        bytes_total->AddSingle(datagram.size);
+
+        uint16_t seq = 0;
+        uint32_t ssrc = 0;
+        bool is_rtp = !rtcp && ParseRtp(datagram.data, datagram.size, seq, ssrc);
+
+        // parity packets never reach the demuxer, they have own sequence numbers
+        if (is_rtp && Common::Fec::is_parity(datagram.data, datagram.size))
+        {
+            if (params.jitter_latency_ms)
+            {
+                OnParity(FindJitter(ssrc), datagram.data, datagram.size);
+                return;
+            }
+
+            fec_parity_dropped->AddSingle();
+            if (!parity_dropped)
+            {
+                parity_dropped = true;
+                LOGW_FMT("Receiver {} jitter buffer is off, fec parity packets are dropped", video_id);
+            }
+            return;
+        }
+
+        if (is_rtp)
+            TrackSequence(seq, ssrc);
+
+        AVBufferRef* buf = packet_pool.Get(datagram.size);
+        if (!buf)
+        {
+            queue_drops->AddSingle();
+            LOGW_FMT("Receiver {} no buffer for datagram {}", video_id, datagram.size);
+            return;
+        }
+
+        memcpy(buf->data, datagram.data, datagram.size);
+        auto now = clock::now();
+        Datagram item{buf, static_cast<int>(datagram.size), now};
+
+        if (!is_rtp || !params.jitter_latency_ms)
+        {
+            Enqueue(std::move(item));
+            return;
+        }
+
+        Jitter& jitter = FindJitter(ssrc);
+        if (params.nack && datagram.peer)
+        {
+            jitter.fd = fd;
+            memcpy(&jitter.peer, datagram.peer, datagram.peer_len);
+            jitter.peer_len = datagram.peer_len;
+        }
+
+        if (!PushJitter(jitter, seq, item, false))
+            return;
+
+        if (jitter.fec)
+        {
+            jitter.fec->OnMedia(seq, item.buf, item.size, fec_packets);
+            PushRecovered(jitter, now);
+        }
+
+        SendNacks(jitter, now);
     }
 
-    void OpenInput()
+    // false if the packet is late or duplicated and was dropped
+    bool PushJitter(Jitter& jitter, uint16_t seq, Datagram item, bool recovered)
     {
-        state = States::Fail;
-        int ret;
+        auto result = jitter.buffer.Push(seq, Datagram(item), item.arrival, [this](Datagram&& released) { Enqueue(std::move(released)); });
+        if (result != JitterBuffer<Datagram>::Result::Buffered)
+        {
+            av_buffer_unref(&item.buf);
+            return false;
+        }
 
-        AVDictionary *dict = NULL;
-        av_dict_set(&dict, "protocol_whitelist", "file,udp,rtp", 0);
+        if (params.nack)
+            TrackNacks(jitter, seq, item.arrival, recovered);
+        return true;
+    }
+
+    void OnParity(Jitter& jitter, const uint8_t* data, size_t size)
+    {
+        if (!jitter.fec)
+            jitter.fec.reset(new FecDecoder());
 
-        // echo 2097152 > /proc/sys/net/core/rmem_max
-        av_dict_set(&dict, "buffer_size", "10000000", 0);
-        av_dict_set(&dict, "fifo_size", "100000", 0);
+        jitter.fec->OnParity(data, size, fec_packets);
+        PushRecovered(jitter, clock::now());
+    }
+
+    void PushRecovered(Jitter& jitter, clock::time_point now)
+    {
+        for (auto& packet : fec_packets)
+            PushJitter(jitter, packet.seq, {packet.buf, packet.size, now}, true);
+        fec_packets.clear();
+    }
 
-        if ((ret = avformat_open_input(&input_fmt, sdp.c_str(), NULL, &dict)) < 0)
+    // recovered - packet came from fec, not as answer to nack
+    void TrackNacks(Jitter& jitter, uint16_t seq, clock::time_point now, bool recovered)
+    {
+        for (auto it = jitter.nacks.begin(); it != jitter.nacks.end(); ++it)
         {
-            LOGE("Cannot open input sdp stream " << ff_error(ret));
+            if (it->seq == seq)
+            {
+                if (it->sent && !recovered)
+                    nack_recovered->AddSingle();
+                jitter.nacks.erase(it);
+                break;
+            }
+        }
+
+        for (uint16_t i = jitter.buffer.Missed(); i && jitter.nacks.size() < max_nacks; --i)
+            jitter.nacks.push_back({static_cast<uint16_t>(seq - i), 0, now + std::chrono::milliseconds(nack_delay_ms)});
+    }
+
+    // requests due packets with one rtcp generic nack
+    void SendNacks(Jitter& jitter, clock::time_point now)
+    {
+        if (jitter.nacks.empty() || now < jitter.next_nack)
             return;
+
+        nack_seqs.clear();
+        size_t kept = 0;
+        for (Nack& nack : jitter.nacks)
+        {
+            // arrived or given up
+            if (!jitter.buffer.IsMissing(nack.seq))
+                continue;
+
+            if (nack.due <= now && nack.sent < max_nack_requests)
+            {
+                ++nack.sent;
+                nack.due = now + std::chrono::milliseconds(nack_retry_ms);
+                nack_seqs.push_back(nack.seq);
+            }
+            jitter.nacks[kept++] = nack;
         }
+        jitter.nacks.resize(kept);
 
-        input_fmt->interrupt_callback.opaque = &th;
-        input_fmt->interrupt_callback.callback = &timeout_handler::check_interrupt;
+        if (nack_seqs.empty())
+            return;
 
-        if (dict)
+        jitter.next_nack = now + std::chrono::milliseconds(nack_interval_ms);
+        nack_requested->AddSingle(nack_seqs.size());
+
+        nack_packet.clear();
+        Common::Rtcp::append_generic_nack(nack_packet, 0, jitter.ssrc, nack_seqs);
+        if (sendto(jitter.fd, nack_packet.data(), nack_packet.size(), 0, reinterpret_cast<sockaddr*>(&jitter.peer), jitter.peer_len) < 0)
+            LOGD_FMT("Receiver {} send nack error {}", video_id, strerror(errno));
+    }
+
+    void Enqueue(Datagram&& datagram)
+    {
+        // subscribers share the buffer, queue overflow below does not hit them
+        if (fanout)
+            fanout->Publish(datagram.buf, datagram.size);
+
+        if (datagrams.empty())
+            first_datagram = datagram.arrival;
+
+        if (datagrams.full())
         {
-            av_dict_free(&dict);
-            LOGW("Not all options passed");
+            queue_drops->AddSingle();
+            LOGW_FMT("Receiver {} queue overflow, drop datagram", video_id);
+            av_buffer_unref(&datagrams.front().buf);
+            datagrams.pop_front();
         }
 
-        callback->OnReceiverStarted();
+        datagrams.push_back(datagram);
+    }
 
-        if ((ret = avformat_find_stream_info(input_fmt, NULL)) < 0)
+    Jitter& FindJitter(uint32_t ssrc)
+    {
+        // video and audio, rarely more
+        for (auto& jitter : jitters)
         {
-            LOGE("Cannot find stream information");
-            return;
+            if (jitter.ssrc == ssrc)
+                return jitter;
         }
 
-        av_dump_format(input_fmt, 0, sdp.c_str(), 0);
+        jitters.emplace_back(ssrc, params.jitter_latency_ms);
+        return jitters.back();
+    }
 
-        state = States::OpenOutput;
+    bool Step() override
+    {
+        bool more;
+        if (params.load)
+        {
+            auto start = clock::now();
+            more = Advance();
+            params.load->AddBusy(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+        }
+        else
+            more = Advance();
+
+        queue_depth->Set(datagrams.size());
+        return more;
     }
 
-    bool OpenOutput()
+    static bool ParseRtp(const uint8_t* data, size_t size, uint16_t& seq, uint32_t& ssrc)
     {
-        state = States::Fail;
+        if (size < 12 || (data[0] >> 6) != 2)
+            return false;
 
-        int ret;
+        seq = (static_cast<uint16_t>(data[2]) << 8) | data[3];
+        ssrc = (static_cast<uint32_t>(data[8]) << 24) | (static_cast<uint32_t>(data[9]) << 16)
+                | (static_cast<uint32_t>(data[10]) << 8) | data[11];
+        return true;
+    }
 
-        std::ostringstream fstr;
-        fstr << "out" << std::to_string(video_id) << ".mp4";
+    void TrackSequence(uint16_t seq, uint32_t ssrc)
+    {
+        // video and audio, rarely more
+        RtpSequence* sequence = nullptr;
+        for (auto& candidate : sequences)
+        {
+            if (candidate.Ssrc() == ssrc)
+                sequence = &candidate;
+        }
+        if (!sequence)
+        {
+            sequences.emplace_back(ssrc);
+            sequence = &sequences.back();
+        }
 
-        std::string out_filename = fstr.str();
+        if (!sequence->Update(seq))
+            reordered->AddSingle();
+    }
 
-        if ((ret = avformat_alloc_output_context2(&output_fmt, 0, 0, out_filename.c_str())) < 0)
+    bool Advance()
+    {
+        switch (state)
         {
-            LOGE("Cannot open output stream" << ff_error(ret));
+        case States::OpenInput:
+            OpenInput();
+            return true;
+        case States::WaitProbe:
+            return false;
+        case States::ProbeInput:
+            ProbeInput();
+            return true;
+        case States::OpenOutput:
+            OpenOutput();
+            return true;
+        case States::Process:
+            return Process();
+        case States::Fail:
+            if (fanout)
+                fanout->Close();
+            callback->OnReceiverFailed();
+            state = States::Unloading;
+            return false;
+        case States::Unloading:
             return false;
         }
 
-        AVOutputFormat * ofmt = output_fmt->oformat;
-        for (int i = 0; i < input_fmt->nb_streams; i++) {
-            AVStream *in_stream = input_fmt->streams[i];
-            AVStream *out_stream = avformat_new_stream(output_fmt, nullptr);
+        return false;
+    }
 
-            if (!out_stream) {
-                fprintf(stderr, "Failed allocating output stream\n");
-                ret = AVERROR_UNKNOWN;
-                return false;
-            }
-            ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-            if (ret < 0) {
-                fprintf(stderr, "Failed to copy context from input to output stream codec context\n");
-                return false;
+    void OnTick() override
+    {
+        int64_t missing = 0;
+        for (auto& sequence : sequences)
+            missing += sequence.Lost();
+        lost->Set(std::max<int64_t>(missing, 0));
+
+        // gaps of a stalled stream wait for tick at most
+        auto now = clock::now();
+        JitterStats total;
+        for (auto& jitter : jitters)
+        {
+            if (state != States::Fail && state != States::Unloading)
+            {
+                jitter.buffer.Release(now, [this](Datagram&& released) { Enqueue(std::move(released)); });
+                SendNacks(jitter, now);
             }
-            //if (output_fmt->oformat->flags & AVFMT_GLOBALHEADER)
-              //  out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+            const JitterStats& stats = jitter.buffer.Stats();
+            total.late += stats.late;
+            total.duplicate += stats.duplicate;
+            total.lost += stats.lost;
         }
+        jitter_late->AddSingle(total.late - jitter_published.late);
+        jitter_duplicate->AddSingle(total.duplicate - jitter_published.duplicate);
+        jitter_lost->AddSingle(total.lost - jitter_published.lost);
+        jitter_published = total;
 
-        if (!(ofmt->flags & AVFMT_NOFILE)) {
-            ret = avio_open(&output_fmt->pb, out_filename.c_str(), AVIO_FLAG_WRITE);
-            if (ret < 0) {
-                fprintf(stderr, "Could not open output file '%s'", out_filename.c_str());
-                return false;
-            }
+        FecStats fec_total;
+        for (auto& jitter : jitters)
+        {
+            if (!jitter.fec)
+                continue;
+            const FecStats& stats = jitter.fec->Stats();
+            fec_total.parity += stats.parity;
+            fec_total.recovered += stats.recovered;
+            fec_total.unrecovered += stats.unrecovered;
         }
-        ret = avformat_write_header(output_fmt, NULL);
-        if (ret < 0) {
-            fprintf(stderr, "Error occurred when opening output file\n");
-            return false;
+        fec_parity->AddSingle(fec_total.parity - fec_published.parity);
+        fec_recovered->AddSingle(fec_total.recovered - fec_published.recovered);
+        fec_unrecovered->AddSingle(fec_total.unrecovered - fec_published.unrecovered);
+        fec_published = fec_total;
+
+        if (state == States::WaitProbe && !datagrams.empty())
+        {
+            auto waiting = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - first_datagram).count();
+            if (datagrams.size() >= probe_packets || waiting >= probe_timeout_ms)
+                state = States::ProbeInput;
+        }
+
+        if ((state == States::WaitProbe || state == States::Process) && th.is_timeout())
+        {
+            LOGW("Interrupt listen by timout " << video_id);
+            state = States::Fail;
         }
+    }
 
-        av_dump_format(output_fmt, 0, out_filename.c_str(), 1);
+    const char* ff_error(int errcode)
+    {
+        error_buff[0] = 0;
+        av_strerror(errcode, error_buff, sizeof(error_buff));
+        return error_buff;
+    }
 
-        state = States::Process;
+    bool OpenSockets()
+    {
+        for (uint16_t port : {params.video_port, params.audio_port})
+        {
+            for (uint16_t p : {port, static_cast<uint16_t>(port + 1)})
+            {
+                int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                {
+                    LOGE("Cannot create udp socket " << strerror(errno));
+                    return false;
+                }
+                sockets.push_back(fd);
+
+                // echo 2097152 > /proc/sys/net/core/rmem_max
+                int buffer_size = 10000000;
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+                if (!UdpBatchReader::EnableGro(fd))
+                    LOGD("UDP GRO is not supported for port " << p);
+
+                sockaddr_in addr = {};
+                addr.sin_family = AF_INET;
+                addr.sin_addr.s_addr = htonl(INADDR_ANY);
+                addr.sin_port = htons(p);
+
+                if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+                {
+                    LOGE("Cannot bind udp port " << p << " " << strerror(errno));
+                    return false;
+                }
+            }
+        }
 
         return true;
     }
 
-    unsigned total = 0;
-    void Process()
+    void CloseSockets()
+    {
+        for (int fd : sockets)
+            close(fd);
+        sockets.clear();
+    }
+
+    static int ReadInput(void* opaque, uint8_t* buf, int size)
+    {
+        return static_cast<Receiver*>(opaque)->ReadInput(buf, size);
+    }
+
+    int ReadInput(uint8_t* buf, int size)
+    {
+        // sdp demuxer reads session description first, until eof
+        if (sdp_pos < params.sdp.size())
+        {
+            int len = std::min<int>(size, params.sdp.size() - sdp_pos);
+            memcpy(buf, params.sdp.data() + sdp_pos, len);
+            sdp_pos += len;
+            return len;
+        }
+
+        if (datagrams.empty())
+            return nonblocking ? AVERROR(EAGAIN) : AVERROR_EOF;
+
+        Datagram& datagram = datagrams.front();
+        if (!read_pending)
+        {
+            read_arrival = datagram.arrival;
+            read_pending = true;
+        }
+        int len = std::min(size, datagram.size);
+        memcpy(buf, datagram.buf->data, len);
+        av_buffer_unref(&datagram.buf);
+        datagrams.pop_front();
+        return len;
+    }
+
+    static int WriteInput(void* opaque, uint8_t* buf, int size)
+    {
+        return static_cast<Receiver*>(opaque)->WriteInput(buf, size);
+    }
+
+    // rtcp receiver reports from rtp demuxer
+    int WriteInput(uint8_t* buf, int size)
     {
+        if (rtcp_fd >= 0)
+            sendto(rtcp_fd, buf, size, 0, reinterpret_cast<sockaddr*>(&rtcp_peer), rtcp_peer_len);
+        return size;
+    }
+
+    void OpenInput()
+    {
+        state = States::Fail;
         int ret;
-        AVPacket pkt;
-        //LOG("Process");
 
-        if ((ret = av_read_frame(input_fmt, &pkt)) < 0)
+        uint8_t* buffer = static_cast<uint8_t*>(av_malloc(input_buffer_size));
+        input_io = avio_alloc_context(buffer, input_buffer_size, 1, this, &Receiver::ReadInput, &Receiver::WriteInput, nullptr);
+        input_io->direct = 1;
+
+        input_fmt = avformat_alloc_context();
+        input_fmt->pb = input_io;
+        input_fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        AVDictionary *dict = NULL;
+        av_dict_set(&dict, "sdp_flags", "custom_io", 0);
+        // packets come in order from jitter buffers, gaps are final
+        if (params.jitter_latency_ms)
+            av_dict_set(&dict, "reorder_queue_size", "0", 0);
+
+        if ((ret = avformat_open_input(&input_fmt, "sdp", av_find_input_format("sdp"), &dict)) < 0)
         {
-            state = States::Fail;
-            LOGW("Error read frame: " << ff_error(ret));
+            LOGE("Cannot open input sdp stream " << ff_error(ret));
             return;
         }
 
-        th.reset(__LINE__);
+        if (dict)
+        {
+            av_dict_free(&dict);
+            LOGW("Not all options passed");
+        }
 
-        //LOG("Got packet " << total << " stream " << pkt.stream_index << " " << pkt.dts);
+        input_io->eof_reached = 0;
+        th.reset(__LINE__);
 
-        AVStream* in_stream = input_fmt->streams[pkt.stream_index];
-        AVStream* out_stream = output_fmt->streams[pkt.stream_index];
+        callback->OnReceiverStarted();
 
+        state = States::WaitProbe;
+    }
 
-        total += pkt.size;
-        //av_pkt_dump2(stdout, &pkt, 0, input_fmt->streams[pkt.stream_index]);
+    void ProbeInput()
+    {
+        state = States::Fail;
 
-        if ((ret = av_write_frame(output_fmt, &pkt)) < 0)
+        // reads only queued datagrams, eof when they are over
+        if (avformat_find_stream_info(input_fmt, NULL) < 0)
         {
-            LOGW("Error write packet: " << ff_error(ret) << " " << pkt.stream_index);
-            av_pkt_dump2(stdout, &pkt, 1, input_fmt->streams[pkt.stream_index]);
+            LOGE("Cannot find stream information");
             return;
         }
 
-        av_packet_unref(&pkt);
+        input_io->eof_reached = 0;
+        nonblocking = true;
+
+        av_dump_format(input_fmt, 0, params.sdp.c_str(), 0);
+
+        state = States::OpenOutput;
+    }
+
+    void OpenOutput()
+    {
+        recorder = CreateRecorder(writer, params.recording, video_id, input_fmt, params.load);
+        state = States::Process;
+    }
+
+    bool Process()
+    {
+        for (unsigned i = 0; i < process_budget; ++i)
+        {
+            int ret;
+            AVPacket& pkt = *packet;
+
+            auto start = clock::now();
+            if ((ret = av_read_frame(input_fmt, &pkt)) < 0)
+            {
+                if (ret == AVERROR(EAGAIN))
+                    return false;
+
+                state = States::Fail;
+                LOGW("Error read frame: " << ff_error(ret));
+                return true;
+            }
+
+            auto end = clock::now();
+            demux_latency->RecordSingle(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+            // packets left in demuxer queue take no new datagrams
+            if (read_pending)
+            {
+                read_latency->RecordSingle(std::chrono::duration_cast<std::chrono::nanoseconds>(end - read_arrival).count());
+                read_pending = false;
+            }
+
+            th.reset(__LINE__);
+
+            //LOG("Got packet stream " << pkt.stream_index << " " << pkt.dts);
+
+            packets_total->AddSingle();
+            //av_pkt_dump2(stdout, &pkt, 0, input_fmt->streams[pkt.stream_index]);
+
+            // takes packet reference, disk I/O runs on writer thread
+            recorder->Push(&pkt);
+        }
+
+        return true;
     }
 };
 
-IReceiverPtr CreateReceiver(const IReceiverCallbackPtr& callback, const std::string& sdp, int video_id)
+IReceiverPtr CreateReceiver(const IIngestEnginePtr& engine, const IWriterStagePtr& writer, const IReceiverCallbackPtr& callback, const ReceiverParams& params)
 {
-    return std::make_shared<Receiver>(callback, sdp, video_id);
+    return std::make_shared<Receiver>(engine, writer, callback, params);
 }
 
 }
@@ -3,6 +3,14 @@
 #include "common/object.h"
 #include "common/ptr.h"
 
+#include "admission.h"
+#include "fanout.h"
+#include "ingest_engine.h"
+#include "recorder.h"
+#include "rtp_demuxer.h"
+
+#include <string>
+
 namespace Server
 {
 
@@ -21,6 +29,28 @@ struct IReceiver : public virtual Common::IObject
 DECLARE_PTR_S(IReceiver)
 DECLARE_PTR_S(IReceiverCallback)
 
-IReceiverPtr CreateReceiver(const IReceiverCallbackPtr& callback, const std::string& sdp, int video_id);
+struct ReceiverParams
+{
+    std::string sdp;
+    int video_id = 0;
+    // rtp ports, rtcp goes to port + 1
+    uint16_t video_port = 0;
+    uint16_t audio_port = 0;
+    // shared port ingest instead of own ports, streams are found by "a=ssrc" of sdp
+    IRtpDemuxerPtr demuxer;
+    unsigned demux_socket = 0;
+    bool huge_pages = false;
+    // added latency of rtp reordering, 0 - reordering of ffmpeg rtp demuxer
+    unsigned jitter_latency_ms = 0;
+    // rtcp nacks for gaps of jitter buffers
+    bool nack = false;
+    RecorderParams recording;
+    // live subscribers get rtp and rtcp in order after jitter buffers, may be null
+    IFanoutStagePtr fanout;
+    // bitrate and cpu of the stream for admission, may be null
+    StreamLoadPtr load;
+};
+
+IReceiverPtr CreateReceiver(const IIngestEnginePtr& engine, const IWriterStagePtr& writer, const IReceiverCallbackPtr& callback, const ReceiverParams& params);
 
 }
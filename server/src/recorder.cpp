@@ -0,0 +1,650 @@
+#include "recorder.h"
+#include "admission.h"
+#include "common/common.h"
+#include "common/metrics.h"
+#include "common/spsc_ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <sys/stat.h>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace Server
+{
+
+namespace
+{
+
+// writer thread wakeup without packets
+constexpr unsigned idle_wait_ms = 10;
+
+}
+
+class WriterThread;
+
+class Recorder : public IRecorder
+        , public Common::ObjectCounter<Recorder>
+{
+    const IWriterStagePtr stage;
+    const IStoragePtr storage;
+    const RecorderParams params;
+    const int video_id;
+    const StreamLoadPtr load;
+
+    std::vector<AVCodecParameters*> codecpars;
+    std::vector<AVRational> time_bases;
+
+    // filled packets to writer, empty packets back to ingest
+    Common::SpscRing<AVPacket*> queue;
+    Common::SpscRing<AVPacket*> free_packets;
+    std::vector<AVPacket*> packets;
+
+    // ingest thread
+    std::vector<bool> skip_until_key;
+
+    // exported with stream label, every counter has a single writer thread
+    const Common::Metrics::Labels labels;
+    Common::CounterPtr pushed;
+    Common::CounterPtr written;
+    Common::CounterPtr dropped;
+    Common::CounterPtr blocked;
+    Common::CounterPtr write_errors;
+    Common::GaugePtr depth;
+    // overflow headroom is queue_depth minus it
+    Common::GaugePtr high_watermark;
+    // av_write_frame duration, writer thread
+    Common::HistogramPtr write_latency;
+
+    std::atomic<bool> finishing{false};
+    WriterThread* writer = nullptr;
+    // of writer thread
+    std::atomic<uint64_t>* bytes_written = nullptr;
+
+    // writer thread
+    AVFormatContext* output_fmt = nullptr;
+    bool opened = false;
+    bool header_written = false;
+    bool finished = false;
+
+    char error_buff[512];
+
+public:
+    Recorder(const IWriterStagePtr& stage, const IStoragePtr& storage, const RecorderParams& params, int video_id, const AVFormatContext* input,
+             const StreamLoadPtr& load)
+        : stage(stage), storage(storage), params(params), video_id(video_id), load(load)
+        , queue(std::max<size_t>(params.queue_depth, 2))
+        , free_packets(std::max<size_t>(params.queue_depth, 2))
+        , labels{{"stream", std::to_string(video_id)}}
+        , pushed(Common::Metrics::AddCounter("streamer_recorder_packets_total", "Packets pushed to recorder", labels))
+        , written(Common::Metrics::AddCounter("streamer_recorder_written_packets_total", "Packets written to output", labels))
+        , dropped(Common::Metrics::AddCounter("streamer_recorder_dropped_packets_total", "Packets dropped on queue overflow", labels))
+        , blocked(Common::Metrics::AddCounter("streamer_recorder_blocked_total", "Times ingest waited for writer", labels))
+        , write_errors(Common::Metrics::AddCounter("streamer_recorder_write_errors_total", "Failed packet writes", labels))
+        , depth(Common::Metrics::AddGauge("streamer_recorder_queue_depth", "Packets queued to writer", labels))
+        , high_watermark(Common::Metrics::AddGauge("streamer_recorder_queue_high_watermark", "Most packets queued to writer at once", labels))
+        , write_latency(Common::Metrics::AddHistogram("streamer_stage_latency_seconds", "Latency of ingest pipeline stages", {{"stage", "write"}}))
+    {
+        for (unsigned i = 0; i < input->nb_streams; ++i)
+        {
+            AVCodecParameters* par = avcodec_parameters_alloc();
+            avcodec_parameters_copy(par, input->streams[i]->codecpar);
+            codecpars.push_back(par);
+            time_bases.push_back(input->streams[i]->time_base);
+        }
+
+        skip_until_key.resize(codecpars.size(), false);
+
+        for (size_t i = 0; i < std::max<size_t>(params.queue_depth, 2); ++i)
+        {
+            packets.push_back(av_packet_alloc());
+            free_packets.try_push(packets.back());
+        }
+    }
+
+    ~Recorder()
+    {
+        CloseOutput();
+
+        for (auto& par : codecpars)
+            avcodec_parameters_free(&par);
+
+        for (auto& pkt : packets)
+            av_packet_free(&pkt);
+    }
+
+    void SetWriter(WriterThread* thread, std::atomic<uint64_t>* bytes)
+    {
+        writer = thread;
+        bytes_written = bytes;
+    }
+
+    void Push(AVPacket* pkt) override;
+
+    void Finish() override;
+
+    RecorderStats Stats() const override
+    {
+        RecorderStats stats;
+        stats.pushed = pushed->Get();
+        stats.written = written->Get();
+        stats.dropped = dropped->Get();
+        stats.blocked = blocked->Get();
+        stats.write_errors = write_errors->Get();
+        stats.depth = queue.size();
+        stats.high_watermark = queue.max_used();
+        return stats;
+    }
+
+    bool Pending() const
+    {
+        return !queue.empty() || (finishing && !finished);
+    }
+
+    bool Finished() const
+    {
+        return finished;
+    }
+
+    // writer thread, true if some packets were written
+    bool Drain(unsigned budget)
+    {
+        if (!opened)
+        {
+            opened = true;
+            if (!OpenOutput())
+                LOGE("Recorder " << video_id << " cannot open output, packets are dropped");
+        }
+
+        unsigned count = 0;
+        AVPacket* pkt = nullptr;
+        while (count < budget && queue.try_pop(pkt))
+        {
+            Write(pkt);
+            av_packet_unref(pkt);
+            free_packets.try_push(pkt);
+            ++count;
+        }
+
+        if (count)
+            depth->Set(queue.size());
+
+        if (count < budget && finishing && queue.empty())
+        {
+            CloseOutput();
+            finished = true;
+
+            RecorderStats stats = Stats();
+            LOG("Recorder " << video_id << " finished pushed " << stats.pushed
+                << " written " << stats.written << " dropped " << stats.dropped
+                << " blocked " << stats.blocked << " errors " << stats.write_errors
+                << " high watermark " << stats.high_watermark << "/" << queue.max_size());
+            LOG("Recorder " << video_id << " write latency us " << write_latency->Summary(1e3));
+        }
+
+        return count > 0;
+    }
+
+private:
+    const char* ff_error(int errcode)
+    {
+        error_buff[0] = 0;
+        av_strerror(errcode, error_buff, sizeof(error_buff));
+        return error_buff;
+    }
+
+    void Drop(AVPacket* pkt)
+    {
+        dropped->AddSingle();
+        av_packet_unref(pkt);
+    }
+
+    AVPacket* Overflow(size_t index, bool key);
+
+    bool OpenOutput()
+    {
+        int ret;
+
+        std::string out_filename;
+        const char* format_name = nullptr;
+        AVDictionary* opts = nullptr;
+
+        if (params.mode == RecordingMode::Segmented)
+        {
+            std::string dir = "out" + std::to_string(video_id);
+            if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+            {
+                LOGE("Cannot create recording directory " << dir << " " << strerror(errno));
+                return false;
+            }
+
+            out_filename = dir + "/index.m3u8";
+            format_name = "hls";
+
+            av_dict_set(&opts, "hls_segment_type", "fmp4", 0);
+            av_dict_set(&opts, "hls_fmp4_init_filename", "init.mp4", 0);
+            av_dict_set(&opts, "hls_segment_filename", (dir + "/seg%06d.m4s").c_str(), 0);
+            av_dict_set_int(&opts, "hls_time", params.segment_duration, 0);
+            av_dict_set_int(&opts, "hls_list_size", params.playlist_size, 0);
+            if (!params.playlist_size)
+                av_dict_set(&opts, "hls_playlist_type", "event", 0);
+            av_dict_set(&opts, "hls_flags", params.delete_segments ? "independent_segments+delete_segments" : "independent_segments", 0);
+        }
+        else
+        {
+            std::ostringstream fstr;
+            fstr << "out" << std::to_string(video_id) << ".mp4";
+            out_filename = fstr.str();
+        }
+
+        if ((ret = avformat_alloc_output_context2(&output_fmt, 0, format_name, out_filename.c_str())) < 0)
+        {
+            av_dict_free(&opts);
+            LOGE("Cannot open output stream" << ff_error(ret));
+            return false;
+        }
+
+        AVOutputFormat * ofmt = output_fmt->oformat;
+
+        // playlist and segments are opened by muxer
+        output_fmt->opaque = storage.get();
+        output_fmt->io_open = StorageIoOpen;
+        output_fmt->io_close = StorageIoClose;
+
+        for (auto par : codecpars)
+        {
+            AVStream *out_stream = avformat_new_stream(output_fmt, nullptr);
+
+            if (!out_stream)
+            {
+                av_dict_free(&opts);
+                LOGE("Failed allocating output stream");
+                return false;
+            }
+
+            ret = avcodec_parameters_copy(out_stream->codecpar, par);
+            if (ret < 0)
+            {
+                av_dict_free(&opts);
+                LOGE("Failed to copy context from input to output stream codec context");
+                return false;
+            }
+        }
+
+        if (!(ofmt->flags & AVFMT_NOFILE))
+        {
+            output_fmt->pb = storage->Open(out_filename);
+            if (!output_fmt->pb)
+            {
+                av_dict_free(&opts);
+                LOGE("Could not open output file " << out_filename);
+                return false;
+            }
+        }
+
+        ret = avformat_write_header(output_fmt, &opts);
+        if (opts)
+        {
+            av_dict_free(&opts);
+            LOGW("Not all recording options passed");
+        }
+
+        if (ret < 0)
+        {
+            LOGE("Error occurred when opening output file " << ff_error(ret));
+            return false;
+        }
+        header_written = true;
+
+        av_dump_format(output_fmt, 0, out_filename.c_str(), 1);
+
+        return true;
+    }
+
+    void CloseOutput()
+    {
+        if (!output_fmt)
+            return;
+
+        if (header_written)
+            av_write_trailer(output_fmt);
+
+        if (!(output_fmt->oformat->flags & AVFMT_NOFILE))
+            storage->Close(&output_fmt->pb);
+
+        avformat_free_context(output_fmt);
+        output_fmt = nullptr;
+        header_written = false;
+    }
+
+    void Write(AVPacket* pkt)
+    {
+        if (!header_written)
+            return;
+
+        AVStream* out_stream = output_fmt->streams[pkt->stream_index];
+        av_packet_rescale_ts(pkt, time_bases[pkt->stream_index], out_stream->time_base);
+
+        int size = pkt->size;
+        int ret;
+        auto start = std::chrono::steady_clock::now();
+        ret = av_write_frame(output_fmt, pkt);
+        uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        write_latency->RecordSingle(duration);
+        if (load)
+            load->AddWrite(duration);
+        if (ret < 0)
+        {
+            write_errors->AddSingle();
+            LOGW_FMT("Error write packet: {} {}", ff_error(ret), pkt->stream_index);
+            return;
+        }
+
+        written->AddSingle();
+        // single writer, no read-modify-write needed
+        bytes_written->store(bytes_written->load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+    }
+};
+
+class WriterThread : public Common::ObjectCounter<WriterThread>
+{
+    static constexpr unsigned drain_budget = 64;
+
+    const unsigned index;
+    const IStoragePtr storage;
+    std::thread thread;
+    std::atomic<bool> runing{false};
+    std::atomic<bool> sleeping{false};
+    std::atomic<unsigned> load{0};
+    std::atomic<uint64_t> bytes{0};
+
+    std::mutex mx;
+    std::condition_variable cond_var;
+    std::vector<std::shared_ptr<Recorder>> added;
+
+    // writer thread
+    std::vector<std::shared_ptr<Recorder>> recorders;
+
+public:
+    WriterThread(unsigned index, const IStoragePtr& storage) : index(index), storage(storage)
+    {}
+
+    unsigned Load() const
+    {
+        return load;
+    }
+
+    uint64_t BytesWritten() const
+    {
+        return bytes;
+    }
+
+    void Start()
+    {
+        runing = true;
+        thread = std::thread([this](){ Run(); });
+    }
+
+    // returns when all recorders are finished
+    void Stop()
+    {
+        runing = false;
+        Notify(true);
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void Add(const std::shared_ptr<Recorder>& recorder)
+    {
+        ++load;
+        recorder->SetWriter(this, &bytes);
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            added.push_back(recorder);
+        }
+        Notify(true);
+    }
+
+    void Notify(bool force = false)
+    {
+        if (force || sleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mx);
+            cond_var.notify_one();
+        }
+    }
+
+private:
+    void Run()
+    {
+        Common::register_current_thread("writer" + std::to_string(index));
+
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mx);
+                for (auto& recorder : added)
+                    recorders.push_back(recorder);
+                added.clear();
+            }
+
+            if (!runing)
+            {
+                for (auto& recorder : recorders)
+                    recorder->Finish();
+            }
+
+            bool busy = false;
+            for (auto& recorder : recorders)
+            {
+                TRY
+                {
+                    busy = recorder->Drain(drain_budget) || busy;
+                }
+                CATCH_ERR("Recorder drain error: ");
+            }
+
+            // writes of all recorders of the round go in one submission
+            storage->Submit();
+
+            for (size_t i = 0; i < recorders.size();)
+            {
+                if (recorders[i]->Finished())
+                {
+                    recorders[i] = recorders.back();
+                    recorders.pop_back();
+                    --load;
+                }
+                else
+                    ++i;
+            }
+
+            if (!runing && recorders.empty())
+                break;
+
+            if (busy)
+                continue;
+
+            std::unique_lock<std::mutex> lock(mx);
+            sleeping = true;
+
+            bool pending = !added.empty();
+            for (auto& recorder : recorders)
+                pending = pending || recorder->Pending();
+
+            if (!pending && runing)
+                cond_var.wait_for(lock, std::chrono::milliseconds(idle_wait_ms));
+            sleeping = false;
+        }
+
+        LOG("Writer " << index << " stopped");
+    }
+};
+
+void Recorder::Push(AVPacket* pkt)
+{
+    pushed->AddSingle();
+
+    size_t index = pkt->stream_index;
+    bool key = pkt->flags & AV_PKT_FLAG_KEY;
+
+    if (index >= skip_until_key.size())
+    {
+        Drop(pkt);
+        return;
+    }
+
+    if (skip_until_key[index])
+    {
+        if (!key)
+        {
+            Drop(pkt);
+            return;
+        }
+        skip_until_key[index] = false;
+    }
+
+    AVPacket* slot = nullptr;
+    if (!free_packets.try_pop(slot))
+    {
+        slot = Overflow(index, key);
+        if (!slot)
+        {
+            Drop(pkt);
+            return;
+        }
+    }
+
+    av_packet_move_ref(slot, pkt);
+    queue.try_push(slot);
+    depth->Set(queue.size());
+    high_watermark->Set(queue.max_used());
+
+    if (writer)
+        writer->Notify();
+}
+
+AVPacket* Recorder::Overflow(size_t index, bool key)
+{
+    AVPacket* slot = nullptr;
+
+    switch (params.overflow)
+    {
+    case OverflowPolicy::Block:
+        blocked->AddSingle();
+        while (!free_packets.try_pop(slot))
+        {
+            if (writer)
+                writer->Notify(true);
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        return slot;
+
+    case OverflowPolicy::DropNonKey:
+        if (!key)
+        {
+            // references of following packets are lost too
+            skip_until_key[index] = true;
+            return nullptr;
+        }
+        // key frame evicts oldest packet
+        // fallthrough
+
+    case OverflowPolicy::DropOldest:
+        if (queue.try_drop_oldest(slot))
+        {
+            dropped->AddSingle();
+            av_packet_unref(slot);
+            return slot;
+        }
+        return nullptr;
+    }
+
+    return nullptr;
+}
+
+void Recorder::Finish()
+{
+    finishing = true;
+    if (writer)
+        writer->Notify(true);
+}
+
+class WriterStage : public IWriterStage
+        , public std::enable_shared_from_this<WriterStage>
+        , public Common::ObjectCounter<WriterStage>
+{
+    const IStoragePtr storage;
+    std::vector<std::unique_ptr<WriterThread>> threads;
+
+public:
+    WriterStage(unsigned count, const StorageParams& storage_params)
+        : storage(CreateStorage(storage_params))
+    {
+        for (unsigned i = 0; i < std::max(1u, count); ++i)
+            threads.emplace_back(new WriterThread(i, storage));
+    }
+
+    const IStoragePtr& Storage() const
+    {
+        return storage;
+    }
+
+    void Initialize() override
+    {
+        for (auto& thread : threads)
+            thread->Start();
+
+        LOG("Writer stage started with " << threads.size() << " threads");
+    }
+
+    void Uninitialize() override
+    {
+        for (auto& thread : threads)
+            thread->Stop();
+    }
+
+    uint64_t BytesWritten() const override
+    {
+        uint64_t total = 0;
+        for (auto& thread : threads)
+            total += thread->BytesWritten();
+        return total;
+    }
+
+    void Add(const std::shared_ptr<Recorder>& recorder)
+    {
+        WriterThread* thread = threads.front().get();
+        for (auto& candidate : threads)
+        {
+            if (candidate->Load() < thread->Load())
+                thread = candidate.get();
+        }
+
+        thread->Add(recorder);
+    }
+};
+
+IWriterStagePtr CreateWriterStage(unsigned threads, const StorageParams& storage)
+{
+    return std::make_shared<WriterStage>(threads, storage);
+}
+
+IRecorderPtr CreateRecorder(const IWriterStagePtr& stage, const RecorderParams& params, int video_id, const AVFormatContext* input,
+                            const std::shared_ptr<StreamLoad>& load)
+{
+    auto writer_stage = std::static_pointer_cast<WriterStage>(stage);
+    auto recorder = std::make_shared<Recorder>(stage, writer_stage->Storage(), params, video_id, input, load);
+    writer_stage->Add(recorder);
+    return recorder;
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+#include "storage.h"
+
+#include <cstddef>
+#include <cstdint>
+
+struct AVFormatContext;
+struct AVPacket;
+
+namespace Server
+{
+
+struct StreamLoad;
+
+enum class OverflowPolicy
+{
+    // ingest waits for the writer
+    Block,
+    // drop incoming video packets up to the next key frame, key frames evict oldest
+    DropNonKey,
+    DropOldest,
+};
+
+enum class RecordingMode
+{
+    // out<id>.mp4, index is written by trailer
+    SingleFile,
+    // out<id>/ fragmented mp4 (CMAF) segments and HLS playlist
+    Segmented,
+};
+
+struct RecorderParams
+{
+    size_t queue_depth = 1024;
+    OverflowPolicy overflow = OverflowPolicy::DropNonKey;
+
+    RecordingMode mode = RecordingMode::SingleFile;
+    // target segment duration in seconds, segments start with key frame
+    unsigned segment_duration = 4;
+    // segments listed in playlist, 0 - all
+    unsigned playlist_size = 0;
+    // remove segments which left the playlist
+    bool delete_segments = false;
+};
+
+struct RecorderStats
+{
+    uint64_t pushed = 0;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    uint64_t blocked = 0;
+    uint64_t write_errors = 0;
+    size_t depth = 0;
+    size_t high_watermark = 0;
+};
+
+// Mux stage of a stream. Packets go from ingest thread to a writer thread
+// through a lock-free ring, disk I/O never runs on ingest thread.
+struct IRecorder : public virtual Common::IObject
+{
+    // ingest thread, takes packet reference
+    virtual void Push(AVPacket* pkt) = 0;
+    // writer flushes queued packets, writes trailer and drops recorder
+    virtual void Finish() = 0;
+    virtual RecorderStats Stats() const = 0;
+};
+
+struct IWriterStage : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    // finishes all recorders
+    virtual void Uninitialize() = 0;
+    // packet bytes given to muxers of all recordings
+    virtual uint64_t BytesWritten() const = 0;
+};
+
+DECLARE_PTR_S(IRecorder)
+DECLARE_PTR_S(IWriterStage)
+
+IWriterStagePtr CreateWriterStage(unsigned threads, const StorageParams& storage);
+
+// copies stream parameters of input, output is opened on writer thread,
+// write time is added to load if it is not null
+IRecorderPtr CreateRecorder(const IWriterStagePtr& stage, const RecorderParams& params, int video_id, const AVFormatContext* input,
+                            const std::shared_ptr<StreamLoad>& load);
+
+}
@@ -0,0 +1,403 @@
+#include "rtp_demuxer.h"
+#include "ssrc_table.hpp"
+#include "common/common.h"
+#include "common/metrics.h"
+
+#include <mutex>
+
+#include <linux/filter.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Server
+{
+
+namespace
+{
+
+constexpr size_t rtp_header_size = 12;
+constexpr size_t rtcp_header_size = 8;
+
+// rtcp packet types SR, RR, SDES, BYE, APP
+bool IsRtcp(const uint8_t* data, size_t size)
+{
+    return size >= rtcp_header_size && data[1] >= 200 && data[1] <= 204;
+}
+
+// 0 with valid false for not rtp/rtcp datagram
+uint32_t ReadSsrc(const uint8_t* data, size_t size, bool rtcp, bool& valid)
+{
+    valid = (rtcp || size >= rtp_header_size) && (data[0] >> 6) == 2;
+    if (!valid)
+        return 0;
+
+    const uint8_t* ssrc = data + (rtcp ? 4 : 8);
+    return (static_cast<uint32_t>(ssrc[0]) << 24) | (static_cast<uint32_t>(ssrc[1]) << 16)
+            | (static_cast<uint32_t>(ssrc[2]) << 8) | ssrc[3];
+}
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// Returns index of reuseport socket for udp payload, mirrors SteerSsrc.
+// Out of range loads end the program with 0.
+bool AttachSteering(int fd, unsigned members)
+{
+    sock_filter code[] =
+    {
+        // rtcp packet type is at byte 1, rtp has marker bit and payload type there
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 200, 0, 3),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, 204, 2, 0),
+        // rtcp sender ssrc
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+        BPF_STMT(BPF_JMP | BPF_JA, 1),
+        // rtp ssrc
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 1),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 2654435761u),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, members),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    sock_fprog program = {static_cast<unsigned short>(sizeof(code) / sizeof(code[0])), code};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+    {
+        LOGW("Cannot attach reuseport steering program " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Port pair read by one ingest worker, with reuseport one member of the
+// port group. The table is changed by control threads, so it is locked once
+// per recvmmsg batch.
+class DemuxSocket : public IIngestTask
+        , public Common::ObjectCounter<DemuxSocket>
+{
+    // recvmmsg calls per socket wakeup, keeps worker fair
+    static constexpr unsigned read_batches = 8;
+
+    const uint16_t port;
+    const unsigned member;
+    std::vector<int> sockets;
+
+    std::mutex mx;
+    SsrcTable<IRtpSink> table;
+
+    UdpReadStats read_stats;
+    const Common::Metrics::Labels labels;
+    Common::CounterPtr malformed;
+    Common::CounterPtr unknown;
+    Common::CounterPtr read_errors;
+
+public:
+    DemuxSocket(uint16_t port, unsigned member)
+        : port(port), member(member)
+        , labels{{"port", std::to_string(port)}, {"member", std::to_string(member)}}
+        , malformed(Common::Metrics::AddCounter("streamer_demux_malformed_total", "Datagrams which are not rtp or rtcp", labels))
+        , unknown(Common::Metrics::AddCounter("streamer_demux_unknown_ssrc_total", "Datagrams of no attached stream", labels))
+        , read_errors(Common::Metrics::AddCounter("streamer_demux_read_errors_total", "Failed socket reads", labels))
+    {
+    }
+
+    ~DemuxSocket()
+    {
+        LOG("Demux socket " << port << " datagrams " << read_stats.datagrams
+            << " per syscall " << read_stats.DatagramsPerSyscall()
+            << " unknown ssrc " << unknown->Get() << " malformed " << malformed->Get());
+        Close();
+    }
+
+    uint16_t Port() const
+    {
+        return port;
+    }
+
+    const std::vector<int>& Sockets() const
+    {
+        return sockets;
+    }
+
+    // members > 1: joins reuseport group of the port, first member attaches
+    // steering program, members must be opened in order of their indexes
+    bool Open(unsigned members)
+    {
+        for (uint16_t p : {port, static_cast<uint16_t>(port + 1)})
+        {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+            {
+                LOGE("Cannot create udp socket " << strerror(errno));
+                return false;
+            }
+            sockets.push_back(fd);
+
+            if (members > 1)
+            {
+                // group index of a socket is its bind order
+                int one = 1;
+                if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+                {
+                    LOGE("Cannot set SO_REUSEPORT " << strerror(errno));
+                    return false;
+                }
+
+                if (!member && !AttachSteering(fd, members))
+                    return false;
+            }
+
+            // all streams of the port share one kernel queue
+            int buffer_size = 64 * 1024 * 1024;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+            if (!UdpBatchReader::EnableGro(fd))
+                LOGD("UDP GRO is not supported for port " << p);
+
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(p);
+
+            if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+            {
+                LOGE("Cannot bind udp port " << p << " " << strerror(errno));
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void Close()
+    {
+        for (int fd : sockets)
+            close(fd);
+        sockets.clear();
+    }
+
+    bool Add(const std::vector<uint32_t>& ssrcs, IRtpSink* sink)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        for (size_t i = 0; i < ssrcs.size(); ++i)
+        {
+            if (!table.Insert(ssrcs[i], sink))
+            {
+                while (i--)
+                    table.Erase(ssrcs[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Remove(const std::vector<uint32_t>& ssrcs, IRtpSink* sink)
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        for (uint32_t ssrc : ssrcs)
+        {
+            if (table.Find(ssrc) == sink)
+                table.Erase(ssrc);
+        }
+    }
+
+    void OnReadable(int fd) override
+    {
+        UdpBatchReader& reader = UdpBatchReader::ForCurrentThread();
+
+        for (unsigned i = 0; i < read_batches; ++i)
+        {
+            int count = reader.Read(fd, read_stats);
+            if (count < 0)
+            {
+                read_errors->AddSingle();
+                LOGW_FMT("Demux port {} receive error {}", port, strerror(-count));
+            }
+            if (count <= 0)
+                return;
+
+            Dispatch(fd, reader.Datagrams());
+
+            if (count < static_cast<int>(UdpBatchReader::batch_size))
+                return;
+        }
+    }
+
+    bool Step() override
+    {
+        return false;
+    }
+
+    void OnTick() override
+    {
+    }
+
+private:
+    void Dispatch(int fd, const std::vector<UdpDatagram>& datagrams)
+    {
+        IRtpSink* last = nullptr;
+
+        std::lock_guard<std::mutex> lock(mx);
+        for (const UdpDatagram& datagram : datagrams)
+        {
+            bool rtcp = IsRtcp(datagram.data, datagram.size);
+            bool valid = false;
+            uint32_t ssrc = ReadSsrc(datagram.data, datagram.size, rtcp, valid);
+            if (!valid)
+            {
+                malformed->AddSingle();
+                continue;
+            }
+
+            IRtpSink* sink = table.Find(ssrc);
+            if (!sink)
+            {
+                unknown->AddSingle();
+                continue;
+            }
+
+            sink->OnDatagram(datagram, fd, rtcp);
+
+            // consecutive datagrams of one stream wake it once
+            if (sink != last)
+            {
+                WakeIngestTask(sink);
+                last = sink;
+            }
+        }
+    }
+};
+
+DECLARE_PTR(DemuxSocket)
+
+}
+
+class RtpDemuxer : public IRtpDemuxer
+        , public Common::ObjectCounter<RtpDemuxer>
+{
+    const IIngestEnginePtr engine;
+    const uint16_t first_port;
+    const unsigned count;
+    const bool reuseport;
+
+    // member i of every port is read by worker i
+    std::vector<std::vector<DemuxSocketPtr>> ports;
+
+public:
+    RtpDemuxer(const IIngestEnginePtr& engine, uint16_t first_port, unsigned count, bool reuseport)
+        : engine(engine), first_port(first_port), count(std::max(1u, count)), reuseport(reuseport)
+    {
+    }
+
+    void Initialize() override
+    {
+        unsigned members = reuseport ? engine->Workers() : 1;
+
+        if (members > 1 && !Open(members))
+        {
+            LOGW("Reuseport steering is not available, one socket per shared port");
+            Close();
+            members = 1;
+        }
+
+        if (members == 1 && !Open(members))
+            THROW_ERR("Cannot open shared ingest ports from " << first_port);
+
+        for (unsigned i = 0; i < count; ++i)
+        {
+            for (unsigned m = 0; m < members; ++m)
+                engine->AttachTo(members > 1 ? m : i, ports[i][m], ports[i][m]->Sockets());
+        }
+
+        LOG("Shared port ingest on " << count << " ports from " << first_port << " with " << members << " sockets per port");
+    }
+
+    void Uninitialize() override
+    {
+        for (auto& port : ports)
+        {
+            for (auto& member : port)
+                engine->Detach(member);
+        }
+        Close();
+    }
+
+    unsigned Sockets() const override
+    {
+        return count;
+    }
+
+    uint16_t Port(unsigned socket) const override
+    {
+        return first_port + socket * 2;
+    }
+
+    bool AttachSink(unsigned socket, const std::vector<uint32_t>& ssrcs, const IRtpSinkPtr& sink) override
+    {
+        std::vector<DemuxSocketPtr>& members = ports[socket];
+        unsigned member = SteerSsrc(ssrcs.front(), members.size());
+        for (uint32_t ssrc : ssrcs)
+        {
+            if (SteerSsrc(ssrc, members.size()) != member)
+            {
+                LOGW("Ssrc " << ssrc << " is steered to another worker than " << ssrcs.front());
+                return false;
+            }
+        }
+
+        if (!members[member]->Add(ssrcs, sink.get()))
+        {
+            LOGW("Ssrc of stream is already used by another stream");
+            return false;
+        }
+
+        // same worker as the socket, datagrams are handed over without locking
+        engine->AttachTo(members.size() > 1 ? member : socket, sink, {});
+        return true;
+    }
+
+    void DetachSink(unsigned socket, const std::vector<uint32_t>& ssrcs, const IRtpSinkPtr& sink) override
+    {
+        std::vector<DemuxSocketPtr>& members = ports[socket];
+        members[SteerSsrc(ssrcs.front(), members.size())]->Remove(ssrcs, sink.get());
+        engine->Detach(sink);
+    }
+
+private:
+    bool Open(unsigned members)
+    {
+        ports.resize(count);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            for (unsigned m = 0; m < members; ++m)
+            {
+                ports[i].push_back(std::make_shared<DemuxSocket>(Port(i), m));
+                if (!ports[i].back()->Open(members))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        for (auto& port : ports)
+        {
+            for (auto& member : port)
+                member->Close();
+        }
+        ports.clear();
+    }
+};
+
+IRtpDemuxerPtr CreateRtpDemuxer(const IIngestEnginePtr& engine, uint16_t first_port, unsigned sockets, bool reuseport)
+{
+    return std::make_shared<RtpDemuxer>(engine, first_port, sockets, reuseport);
+}
+
+}
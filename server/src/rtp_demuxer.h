@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include "ingest_engine.h"
+#include "udp_batch.h"
+
+#include <vector>
+
+namespace Server
+{
+
+// Stream fed by the demuxer. Runs on the worker of its demuxer socket, so
+// OnDatagram and task calls never overlap.
+struct IRtpSink : public IIngestTask
+{
+    // fd is the shared socket, for rtcp replies
+    virtual void OnDatagram(const UdpDatagram& datagram, int fd, bool rtcp) = 0;
+};
+
+DECLARE_PTR_S(IRtpSink)
+
+// Shared port ingest: a few UDP port pairs (rtp port, rtcp port + 1) for
+// all streams, datagrams are routed to sinks by SSRC.
+//
+// With reuseport every port pair is opened by one SO_REUSEPORT socket per
+// ingest worker and a classic BPF program picks the socket by SSRC, so the
+// kernel delivers all datagrams of a stream to its worker. Streams of one
+// session must use SSRCs which differ only in bit 0 to land on one worker.
+struct IRtpDemuxer : public virtual Common::IObject
+{
+    virtual void Initialize() = 0;
+    virtual void Uninitialize() = 0;
+
+    virtual unsigned Sockets() const = 0;
+    // rtp port of socket, rtcp port is port + 1
+    virtual uint16_t Port(unsigned socket) const = 0;
+
+    // registers ssrcs and attaches sink to the worker reading them, false if
+    // an ssrc is taken or ssrcs are steered to different workers
+    virtual bool AttachSink(unsigned socket, const std::vector<uint32_t>& ssrcs, const IRtpSinkPtr& sink) = 0;
+    // no sink calls after return
+    virtual void DetachSink(unsigned socket, const std::vector<uint32_t>& ssrcs, const IRtpSinkPtr& sink) = 0;
+};
+
+DECLARE_PTR_S(IRtpDemuxer)
+
+// reuseport socket of ssrc in a group of members, same as BPF program
+inline unsigned SteerSsrc(uint32_t ssrc, unsigned members)
+{
+    return ((ssrc >> 1) * 2654435761u >> 16) % members;
+}
+
+// sockets port pairs from first_port upward
+IRtpDemuxerPtr CreateRtpDemuxer(const IIngestEnginePtr& engine, uint16_t first_port, unsigned sockets, bool reuseport);
+
+}
@@ -1,7 +1,10 @@
 #include "server_app.h"
 
+#include <iostream>
+
 #include "common/appimpl.h"
 
+#include "metrics_http.h"
 #include "stream_svc.h"
 
 namespace Server
@@ -13,6 +16,7 @@ class ServerApplication
 {
     ServerParams params;
     IStreamServicePtr stream_svc;
+    IMetricsServicePtr metrics_svc;
 public:
     ServerApplication(const ServerParams& params)
         : Common::ApplicationImpl<ServerApplication>("server")
@@ -29,10 +33,22 @@ public:
     {
         stream_svc = CreateStreamService(shared_from_this());
         stream_svc->Initialize();
+
+        if (params.metrics_port)
+        {
+            metrics_svc = CreateMetricsService(GetIOService(), params.metrics_port);
+            metrics_svc->Initialize();
+        }
     }
 
     void AppStop() override
     {
+        if (metrics_svc)
+        {
+            metrics_svc->Uninitialize();
+            metrics_svc.reset();
+        }
+
         if (stream_svc)
         {
             stream_svc->Uninitialize();
@@ -47,11 +63,83 @@ public:
 
 };
 
+IServerAppPtr CreateServerApp(const ServerParams& params)
+{
+    return std::make_shared<ServerApplication>(params);
+}
+
 }
 
 int RunServerApplication(int argc, char* argv[])
 {
     Server::ServerParams params;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "-help"))
+        {
+            std::cout << "usage: server [-port 8080] [-metrics_port 9180]\n"
+                      << "    [-ingest_port 5000] [-ingest_sockets 1] [-ingest_reuseport 0|1]\n"
+                      << "    [-record single|segmented] [-segment_duration s] [-playlist_size n] [-delete_segments 0|1]\n"
+                      << "    [-queue_depth 1024] [-overflow block|drop_non_key|drop_oldest]\n"
+                      << "    [-storage buffered|uring] [-write_size bytes] [-direct_io 0|1] [-preallocate bytes]\n";
+            return 0;
+        }
+
+        if (i + 1 == argc)
+        {
+            std::cerr << "unknown " << argv[i] << std::endl;
+            return 1;
+        }
+
+        const char* name = argv[i];
+        const char* value = argv[++i];
+
+        if (!strcmp(name, "-port"))
+            params.port = atoi(value);
+        else if (!strcmp(name, "-metrics_port"))
+            params.metrics_port = atoi(value);
+        else if (!strcmp(name, "-ingest_port"))
+            params.ingest_port = atoi(value);
+        else if (!strcmp(name, "-ingest_sockets"))
+            params.ingest_sockets = atoi(value);
+        else if (!strcmp(name, "-ingest_reuseport"))
+            params.ingest_reuseport = atoi(value) != 0;
+        else if (!strcmp(name, "-record") && !strcmp(value, "single"))
+            params.recording.mode = Server::RecordingMode::SingleFile;
+        else if (!strcmp(name, "-record") && !strcmp(value, "segmented"))
+            params.recording.mode = Server::RecordingMode::Segmented;
+        else if (!strcmp(name, "-segment_duration"))
+            params.recording.segment_duration = atoi(value);
+        else if (!strcmp(name, "-playlist_size"))
+            params.recording.playlist_size = atoi(value);
+        else if (!strcmp(name, "-delete_segments"))
+            params.recording.delete_segments = atoi(value) != 0;
+        else if (!strcmp(name, "-queue_depth"))
+            params.recording.queue_depth = strtoull(value, nullptr, 10);
+        else if (!strcmp(name, "-overflow") && !strcmp(value, "block"))
+            params.recording.overflow = Server::OverflowPolicy::Block;
+        else if (!strcmp(name, "-overflow") && !strcmp(value, "drop_non_key"))
+            params.recording.overflow = Server::OverflowPolicy::DropNonKey;
+        else if (!strcmp(name, "-overflow") && !strcmp(value, "drop_oldest"))
+            params.recording.overflow = Server::OverflowPolicy::DropOldest;
+        else if (!strcmp(name, "-storage") && !strcmp(value, "buffered"))
+            params.storage.backend = Server::StorageBackend::Buffered;
+        else if (!strcmp(name, "-storage") && !strcmp(value, "uring"))
+            params.storage.backend = Server::StorageBackend::Uring;
+        else if (!strcmp(name, "-write_size"))
+            params.storage.write_size = strtoull(value, nullptr, 10);
+        else if (!strcmp(name, "-direct_io"))
+            params.storage.direct_io = atoi(value) != 0;
+        else if (!strcmp(name, "-preallocate"))
+            params.storage.preallocate = strtoull(value, nullptr, 10);
+        else
+        {
+            std::cerr << "unknown " << name << " " << value << std::endl;
+            return 1;
+        }
+    }
+
     Common::RunApplication<Server::ServerApplication>(params);
     return 0;
 }
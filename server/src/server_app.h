@@ -2,6 +2,10 @@
 
 #include "common/application.h"
 
+#include "admission.h"
+#include "fanout.h"
+#include "recorder.h"
+
 #include <string>
 
 namespace Server
@@ -11,6 +15,32 @@ struct ServerParams
 {
     int port = 8080;
     unsigned max_clients = 10;
+    // acceptors with own thread and sessions on the same port, 0 - one per core
+    unsigned control_shards = 1;
+    // 0 - one ingest worker per core
+    unsigned ingest_threads = 0;
+    // shared port ingest: streams are routed by ssrc from ingest_sockets port
+    // pairs starting at ingest_port instead of own ports, max_clients does not apply
+    uint16_t ingest_port = 0;
+    unsigned ingest_sockets = 1;
+    // one SO_REUSEPORT socket per ingest worker for every shared port, kernel
+    // steers datagrams to workers by ssrc
+    bool ingest_reuseport = false;
+    // back packet buffer slabs with huge pages
+    bool huge_page_buffers = false;
+    // rtp packets wait for missing ones this long before the gap is given up,
+    // 0 - ffmpeg rtp demuxer reorders with its own queue
+    unsigned jitter_latency_ms = 50;
+    // request retransmission of missing rtp packets with rtcp nacks
+    bool nack = true;
+    unsigned writer_threads = 2;
+    // prometheus text on GET /metrics, 0 - disabled
+    uint16_t metrics_port = 0;
+    RecorderParams recording;
+    // live forwarding of ingested streams to SUBSCRIBE requests
+    FanoutParams fanout;
+    StorageParams storage;
+    AdmissionParams admission;
 };
 
 struct IServerApp : public virtual Common::IApplication
@@ -20,4 +50,7 @@ struct IServerApp : public virtual Common::IApplication
 
 DECLARE_PTR_S(IServerApp)
 
+// Run() blocks until Unload(), e.g. for in-process tests
+IServerAppPtr CreateServerApp(const ServerParams& params);
+
 }
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Server
+{
+
+// Open addressing SSRC -> T* map with linear probing. Lookup is a multiply,
+// a shift and a scan of a few adjacent slots, no allocation and no pointer
+// chasing. Erase shifts the following run back, so there are no tombstones.
+template <typename T>
+class SsrcTable
+{
+    struct Slot
+    {
+        uint32_t ssrc = 0;
+        // nullptr - empty slot
+        T* value = nullptr;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    unsigned shift = 0;
+    size_t count = 0;
+
+public:
+    explicit SsrcTable(size_t capacity = 1024)
+    {
+        Rehash(capacity < 16 ? 16 : capacity);
+    }
+
+    size_t Size() const
+    {
+        return count;
+    }
+
+    T* Find(uint32_t ssrc) const
+    {
+        for (size_t i = Index(ssrc); ; i = (i + 1) & mask)
+        {
+            const Slot& slot = slots[i];
+            if (!slot.value)
+                return nullptr;
+            if (slot.ssrc == ssrc)
+                return slot.value;
+        }
+    }
+
+    // false if ssrc is already taken
+    bool Insert(uint32_t ssrc, T* value)
+    {
+        // load factor stays under 1/2
+        if ((count + 1) * 2 > slots.size())
+            Rehash(slots.size() * 2);
+
+        size_t i = Index(ssrc);
+        for (; slots[i].value; i = (i + 1) & mask)
+        {
+            if (slots[i].ssrc == ssrc)
+                return false;
+        }
+
+        slots[i].ssrc = ssrc;
+        slots[i].value = value;
+        ++count;
+        return true;
+    }
+
+    bool Erase(uint32_t ssrc)
+    {
+        size_t i = Index(ssrc);
+        for (; slots[i].value; i = (i + 1) & mask)
+        {
+            if (slots[i].ssrc == ssrc)
+                break;
+        }
+
+        if (!slots[i].value)
+            return false;
+
+        // move back entries of the run which may not stay behind the hole
+        for (size_t j = (i + 1) & mask; slots[j].value; j = (j + 1) & mask)
+        {
+            size_t home = Index(slots[j].ssrc);
+            bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable)
+            {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+
+        slots[i] = Slot();
+        --count;
+        return true;
+    }
+
+private:
+    size_t Index(uint32_t ssrc) const
+    {
+        // fibonacci hashing, sequential ssrcs spread over the table
+        return static_cast<uint32_t>(ssrc * 2654435769u) >> shift;
+    }
+
+    void Rehash(size_t capacity)
+    {
+        size_t size = 16;
+        unsigned bits = 4;
+        while (size < capacity)
+        {
+            size *= 2;
+            ++bits;
+        }
+
+        std::vector<Slot> old(size);
+        old.swap(slots);
+        mask = size - 1;
+        shift = 32 - bits;
+        count = 0;
+
+        for (const Slot& slot : old)
+        {
+            if (slot.value)
+                Insert(slot.ssrc, slot.value);
+        }
+    }
+};
+
+}
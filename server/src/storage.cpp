@@ -0,0 +1,618 @@
+#include "storage.h"
+#include "common/common.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef STREAMER_HAVE_URING
+#include <liburing.h>
+#endif
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+namespace Server
+{
+
+namespace
+{
+
+constexpr size_t block_size = 4096;
+
+class UringFile;
+
+struct WriteBuffer
+{
+    UringFile* file = nullptr;
+    uint8_t* data = nullptr;
+    size_t fill = 0;
+    // file offset of data[0]
+    int64_t offset = 0;
+    bool busy = false;
+
+    // write in flight
+    int fd = -1;
+    size_t submitted = 0;
+    size_t written = 0;
+};
+
+// Write submission of one writer thread, shared by all its files.
+class WriteQueue : public Common::ObjectCounter<WriteQueue>
+{
+#ifdef STREAMER_HAVE_URING
+    io_uring ring;
+    bool ready = false;
+    unsigned queued = 0;
+#endif
+
+public:
+    WriteQueue(unsigned entries)
+    {
+#ifdef STREAMER_HAVE_URING
+        int ret = io_uring_queue_init(entries, &ring, 0);
+        ready = ret == 0;
+        if (!ready)
+            LOGW("io_uring is not available, writes are synchronous " << strerror(-ret));
+#else
+        (void)entries;
+#endif
+    }
+
+    ~WriteQueue()
+    {
+#ifdef STREAMER_HAVE_URING
+        if (ready)
+            io_uring_queue_exit(&ring);
+#endif
+    }
+
+    static WriteQueue& ForCurrentThread(unsigned entries)
+    {
+        thread_local WriteQueue queue(entries);
+        return queue;
+    }
+
+    void Queue(WriteBuffer* buffer);
+
+    void Submit()
+    {
+#ifdef STREAMER_HAVE_URING
+        if (ready && queued)
+        {
+            io_uring_submit(&ring);
+            queued = 0;
+        }
+#endif
+    }
+
+    // completions of all files, waits for one if wait
+    void Reap(bool wait);
+};
+
+class UringFile : public Common::ObjectCounter<UringFile>
+{
+    const StorageParams params;
+    // aligned write_size
+    const size_t write_size;
+    WriteQueue& queue;
+
+    int fd = -1;
+    // unaligned head and tail in direct mode
+    int buffered_fd = -1;
+
+    std::vector<WriteBuffer> buffers;
+    WriteBuffer* current = nullptr;
+    unsigned in_flight = 0;
+
+    int64_t position = 0;
+    int64_t size = 0;
+    int64_t allocated = 0;
+    int error = 0;
+
+    std::string path;
+    AVIOContext* pb = nullptr;
+
+public:
+    UringFile(const StorageParams& params, WriteQueue& queue)
+        : params(params)
+        , write_size(std::max((params.write_size + block_size - 1) & ~(block_size - 1), block_size))
+        , queue(queue)
+    {
+        buffers.resize(std::max(2u, params.buffers));
+        for (auto& buffer : buffers)
+        {
+            void* data = nullptr;
+            if (posix_memalign(&data, block_size, write_size) == 0)
+                buffer.data = static_cast<uint8_t*>(data);
+            buffer.file = this;
+        }
+    }
+
+    ~UringFile()
+    {
+        for (auto& buffer : buffers)
+            free(buffer.data);
+    }
+
+    static int WritePacket(void* opaque, uint8_t* buf, int buf_size)
+    {
+        return static_cast<UringFile*>(opaque)->Write(buf, buf_size);
+    }
+
+    static int64_t SeekPacket(void* opaque, int64_t offset, int whence)
+    {
+        return static_cast<UringFile*>(opaque)->Seek(offset, whence);
+    }
+
+    AVIOContext* Context() const
+    {
+        return pb;
+    }
+
+    bool Open(const std::string& file_path)
+    {
+        path = file_path;
+
+        for (auto& buffer : buffers)
+        {
+            if (!buffer.data)
+            {
+                LOGE("Cannot allocate write buffers for " << path);
+                return false;
+            }
+        }
+
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        fd = open(path.c_str(), flags | (params.direct_io ? O_DIRECT : 0), 0644);
+        if (fd < 0 && params.direct_io)
+        {
+            LOGW("O_DIRECT is not supported for " << path << ", buffered writes");
+            fd = open(path.c_str(), flags, 0644);
+        }
+        else if (params.direct_io)
+            buffered_fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+
+        if (fd < 0)
+        {
+            LOGE("Cannot open " << path << " " << strerror(errno));
+            return false;
+        }
+
+        const int avio_buffer_size = 64 * 1024;
+        uint8_t* avio_buffer = static_cast<uint8_t*>(av_malloc(avio_buffer_size));
+        pb = avio_alloc_context(avio_buffer, avio_buffer_size, 1, this, nullptr, &UringFile::WritePacket, &UringFile::SeekPacket);
+        return pb != nullptr;
+    }
+
+    void Close()
+    {
+        if (pb)
+            avio_flush(pb);
+
+        Flush(true);
+        WaitAll();
+
+        if (fd >= 0)
+        {
+            // drop preallocated blocks past the end
+            if (allocated > size && ftruncate(fd, size) < 0)
+                LOGW("Cannot truncate " << path << " " << strerror(errno));
+            close(fd);
+        }
+
+        if (buffered_fd >= 0)
+            close(buffered_fd);
+
+        if (error)
+            LOGE("Write of " << path << " failed " << strerror(error));
+
+        if (pb)
+        {
+            av_freep(&pb->buffer);
+            avio_context_free(&pb);
+        }
+    }
+
+    void OnWritten(WriteBuffer* buffer, int result)
+    {
+        if (result < 0 || (result == 0 && buffer->written < buffer->submitted))
+        {
+            error = result < 0 ? -result : EIO;
+            Release(buffer);
+            return;
+        }
+
+        buffer->written += result;
+        if (buffer->written < buffer->submitted)
+        {
+            // short write, queue the rest
+            queue.Queue(buffer);
+            return;
+        }
+
+        Release(buffer);
+    }
+
+private:
+    int Write(const uint8_t* buf, int buf_size)
+    {
+        if (error)
+            return AVERROR(error);
+
+        int left = buf_size;
+        while (left > 0)
+        {
+            if (!current && !(current = Acquire(position)))
+                return AVERROR(error ? error : EIO);
+
+            size_t count = std::min<size_t>(left, write_size - current->fill);
+            memcpy(current->data + current->fill, buf, count);
+            current->fill += count;
+            buf += count;
+            left -= count;
+            position += count;
+            size = std::max(size, position);
+
+            if (current->fill == write_size)
+                Flush(false);
+        }
+
+        return buf_size;
+    }
+
+    int64_t Seek(int64_t offset, int whence)
+    {
+        if (whence & AVSEEK_SIZE)
+            return size;
+
+        whence &= ~AVSEEK_FORCE;
+
+        int64_t target;
+        switch (whence)
+        {
+        case SEEK_SET:
+            target = offset;
+            break;
+        case SEEK_CUR:
+            target = position + offset;
+            break;
+        case SEEK_END:
+            target = size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+        }
+
+        if (target == position)
+            return position;
+
+        // overlapping writes are not ordered by io_uring, complete them first
+        Flush(true);
+        WaitAll();
+
+        position = target;
+        return position;
+    }
+
+    WriteBuffer* Acquire(int64_t offset)
+    {
+        for (;;)
+        {
+            for (auto& buffer : buffers)
+            {
+                if (!buffer.busy)
+                {
+                    buffer.busy = true;
+                    buffer.fill = 0;
+                    buffer.offset = offset;
+                    return &buffer;
+                }
+            }
+
+            if (error)
+                return nullptr;
+
+            queue.Submit();
+            queue.Reap(true);
+        }
+    }
+
+    void Release(WriteBuffer* buffer)
+    {
+        if (buffer->submitted)
+            --in_flight;
+
+        buffer->busy = false;
+        buffer->submitted = 0;
+        buffer->written = 0;
+    }
+
+    void WaitAll()
+    {
+        queue.Submit();
+        while (in_flight)
+            queue.Reap(true);
+    }
+
+    bool WriteSync(int file, const uint8_t* data, size_t count, int64_t offset)
+    {
+        while (count)
+        {
+            ssize_t ret = pwrite(file, data, count, offset);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+            {
+                error = ret < 0 ? errno : EIO;
+                return false;
+            }
+            data += ret;
+            count -= ret;
+            offset += ret;
+        }
+        return true;
+    }
+
+    void Preallocate(int64_t end)
+    {
+        if (!params.preallocate || end <= allocated)
+            return;
+
+        int64_t target = allocated;
+        while (target < end)
+            target += params.preallocate;
+
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, target - allocated) < 0)
+        {
+            LOGW("Preallocation of " << path << " failed " << strerror(errno));
+            allocated = INT64_MAX;
+            return;
+        }
+
+        allocated = target;
+    }
+
+    // final - write unaligned tail now instead of moving it to the next buffer
+    void Flush(bool final)
+    {
+        WriteBuffer* buffer = current;
+        current = nullptr;
+
+        if (!buffer)
+            return;
+
+        size_t begin = 0;
+        size_t end = buffer->fill;
+
+        if (buffered_fd >= 0)
+        {
+            // O_DIRECT needs block aligned offset and size
+            begin = std::min<size_t>(end, (block_size - buffer->offset % block_size) % block_size);
+            if (begin && !WriteSync(buffered_fd, buffer->data, begin, buffer->offset))
+            {
+                Release(buffer);
+                return;
+            }
+
+            size_t tail = (end - begin) % block_size;
+            end -= tail;
+
+            if (tail && final)
+            {
+                if (!WriteSync(buffered_fd, buffer->data + end, tail, buffer->offset + end))
+                {
+                    Release(buffer);
+                    return;
+                }
+            }
+            else if (tail)
+            {
+                WriteBuffer* next = Acquire(buffer->offset + end);
+                if (next)
+                {
+                    memcpy(next->data, buffer->data + end, tail);
+                    next->fill = tail;
+                }
+                current = next;
+            }
+        }
+
+        if (begin == end)
+        {
+            Release(buffer);
+            return;
+        }
+
+        Preallocate(buffer->offset + end);
+
+        // submit [begin, end) in place
+        if (begin)
+        {
+            memmove(buffer->data, buffer->data + begin, end - begin);
+            buffer->offset += begin;
+        }
+
+        buffer->fd = fd;
+        buffer->submitted = end - begin;
+        buffer->written = 0;
+        ++in_flight;
+        queue.Queue(buffer);
+    }
+};
+
+void WriteQueue::Queue(WriteBuffer* buffer)
+{
+    const uint8_t* data = buffer->data + buffer->written;
+    size_t count = buffer->submitted - buffer->written;
+    int64_t offset = buffer->offset + buffer->written;
+
+#ifdef STREAMER_HAVE_URING
+    if (ready)
+    {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (!sqe)
+        {
+            io_uring_submit(&ring);
+            queued = 0;
+            sqe = io_uring_get_sqe(&ring);
+        }
+
+        if (sqe)
+        {
+            io_uring_prep_write(sqe, buffer->fd, data, count, offset);
+            io_uring_sqe_set_data(sqe, buffer);
+            ++queued;
+            return;
+        }
+    }
+#endif
+
+    ssize_t ret;
+    do
+    {
+        ret = pwrite(buffer->fd, data, count, offset);
+    }
+    while (ret < 0 && errno == EINTR);
+
+    buffer->file->OnWritten(buffer, ret < 0 ? -errno : static_cast<int>(ret));
+}
+
+void WriteQueue::Reap(bool wait)
+{
+#ifdef STREAMER_HAVE_URING
+    if (!ready)
+        return;
+
+    io_uring_cqe* cqe = nullptr;
+    if (wait)
+    {
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret < 0 && ret != -EINTR)
+            LOGE("io_uring wait failed " << strerror(-ret));
+    }
+
+    while (io_uring_peek_cqe(&ring, &cqe) == 0 && cqe)
+    {
+        auto buffer = static_cast<WriteBuffer*>(io_uring_cqe_get_data(cqe));
+        int result = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (buffer)
+            buffer->file->OnWritten(buffer, result);
+    }
+#else
+    (void)wait;
+#endif
+}
+
+}
+
+class BufferedStorage : public IStorage
+        , public Common::ObjectCounter<BufferedStorage>
+{
+public:
+    AVIOContext* Open(const std::string& path) override
+    {
+        AVIOContext* pb = nullptr;
+        if (avio_open(&pb, path.c_str(), AVIO_FLAG_WRITE) < 0)
+            return nullptr;
+        return pb;
+    }
+
+    void Close(AVIOContext** pb) override
+    {
+        avio_closep(pb);
+    }
+
+    void Submit() override
+    {
+    }
+};
+
+class UringStorage : public IStorage
+        , public Common::ObjectCounter<UringStorage>
+{
+    const StorageParams params;
+
+public:
+    UringStorage(const StorageParams& params) : params(params)
+    {
+#ifndef STREAMER_HAVE_URING
+        LOGW("Built without liburing, recordings use synchronous aligned writes");
+#endif
+    }
+
+    AVIOContext* Open(const std::string& path) override
+    {
+        auto file = new UringFile(params, WriteQueue::ForCurrentThread(params.queue_entries));
+        if (!file->Open(path))
+        {
+            file->Close();
+            delete file;
+            return nullptr;
+        }
+
+        return file->Context();
+    }
+
+    void Close(AVIOContext** pb) override
+    {
+        if (!*pb)
+            return;
+
+        if ((*pb)->write_packet != &UringFile::WritePacket)
+        {
+            avio_closep(pb);
+            return;
+        }
+
+        auto file = static_cast<UringFile*>((*pb)->opaque);
+        file->Close();
+        delete file;
+        *pb = nullptr;
+    }
+
+    void Submit() override
+    {
+        WriteQueue& queue = WriteQueue::ForCurrentThread(params.queue_entries);
+        queue.Submit();
+        queue.Reap(false);
+    }
+};
+
+IStoragePtr CreateStorage(const StorageParams& params)
+{
+    if (params.backend == StorageBackend::Uring)
+        return std::make_shared<UringStorage>(params);
+    return std::make_shared<BufferedStorage>();
+}
+
+int StorageIoOpen(AVFormatContext* s, AVIOContext** pb, const char* url, int flags, AVDictionary** options)
+{
+    auto storage = static_cast<IStorage*>(s->opaque);
+    if (storage && flags == AVIO_FLAG_WRITE)
+    {
+        *pb = storage->Open(url);
+        return *pb ? 0 : AVERROR(EIO);
+    }
+
+    return avio_open2(pb, url, flags, &s->interrupt_callback, options);
+}
+
+void StorageIoClose(AVFormatContext* s, AVIOContext* pb)
+{
+    auto storage = static_cast<IStorage*>(s->opaque);
+    if (storage)
+        storage->Close(&pb);
+    else
+        avio_closep(&pb);
+}
+
+}
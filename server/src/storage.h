@@ -0,0 +1,58 @@
+#pragma once
+
+#include "common/object.h"
+#include "common/ptr.h"
+
+#include <cstddef>
+#include <string>
+
+struct AVIOContext;
+struct AVFormatContext;
+struct AVDictionary;
+
+namespace Server
+{
+
+enum class StorageBackend
+{
+    // avio_open, synchronous buffered writes
+    Buffered,
+    // muxer output coalesced to large aligned buffers written by io_uring,
+    // synchronous pwrite of the same buffers when built without liburing
+    Uring,
+};
+
+struct StorageParams
+{
+    StorageBackend backend = StorageBackend::Buffered;
+    // bytes coalesced into one disk write
+    size_t write_size = 1024 * 1024;
+    // write buffers per file, in flight or filling
+    unsigned buffers = 4;
+    bool direct_io = false;
+    // fallocate step in bytes, 0 - no preallocation
+    size_t preallocate = 64 * 1024 * 1024;
+    unsigned queue_entries = 256;
+};
+
+// Output files of recordings. All calls for one file come from one writer
+// thread, writes of all files of the thread are submitted together.
+struct IStorage : public virtual Common::IObject
+{
+    // write only file for muxer, nullptr on error
+    virtual AVIOContext* Open(const std::string& path) = 0;
+    // waits for file writes to complete
+    virtual void Close(AVIOContext** pb) = 0;
+    // writer thread, submits queued writes and reaps completions
+    virtual void Submit() = 0;
+};
+
+DECLARE_PTR_S(IStorage)
+
+IStoragePtr CreateStorage(const StorageParams& params);
+
+// io_open/io_close of AVFormatContext, opaque of the context is IStorage*
+int StorageIoOpen(AVFormatContext* s, AVIOContext** pb, const char* url, int flags, AVDictionary** options);
+void StorageIoClose(AVFormatContext* s, AVIOContext* pb);
+
+}
@@ -3,13 +3,16 @@
 #include "ports_pull.hpp"
 
 #include <deque>
+#include <map>
+#include <future>
 #include <set>
-#include <fstream>
+#include <thread>
 
 #include <boost/asio.hpp>
 
 #include "common/common.h"
 #include "common/messages.h"
+#include "common/metrics.h"
 
 #include "receiver.h"
 #include "server_app.h"
@@ -27,39 +30,123 @@ struct IStreamServiceInternal : public IStreamService
     virtual void ReturnPort(uint16_t port) = 0;
     virtual uint16_t StopSession(const SessionPtr& session) = 0;
     virtual void Post(const std::function<void()>& f) = 0;
+    // unique over shards, names recording
+    virtual int NextStreamId() = 0;
+    virtual IIngestEnginePtr GetIngestEngine() = 0;
+    // null without shared port ingest
+    virtual IRtpDemuxerPtr GetRtpDemuxer() = 0;
+    virtual IWriterStagePtr GetWriterStage() = 0;
+    virtual IAdmissionControllerPtr GetAdmission() = 0;
+    // null with fan-out off
+    virtual IFanoutStagePtr GetFanout() = 0;
+    virtual const ServerParams& GetParams() const = 0;
 };
 
 DECLARE_PTR_S(IStreamServiceInternal)
 
+// Control connection of a client. Every OPEN_STREAM request owns a receiver
+// and a pair of ports, or ssrcs on a shared port, until it is closed by
+// client or fails. Streams outlive the connection, session is dropped with
+// the last of them. SUBSCRIBE requests live with the connection.
 class Session : public std::enable_shared_from_this<Session>
         , public Common::ObjectCounter<Session>
-        , public IReceiverCallback
 {
-    tcp::socket socket;
-    static constexpr unsigned max_length = 4096;
-    char data[max_length];
-    IStreamServiceInternalPtr svc;
+    static constexpr size_t read_size = 4096;
 
-    uint16_t port1 = 0;
-    uint16_t port2 = 0;
+    struct Stream
+    {
+        int video_id = 0;
+        uint16_t port1 = 0;
+        uint16_t port2 = 0;
+        // ports of shared ingest, not from pool
+        bool shared = false;
+        StreamLoadPtr load;
+        IReceiverPtr receiver;
+        bool started = false;
+    };
+
+    // routes receiver events of one stream back to the session thread
+    class StreamCallback : public IReceiverCallback
+            , public Common::ObjectCounter<StreamCallback>
+    {
+        const std::weak_ptr<Session> session;
+        const uint32_t request_id;
+
+    public:
+        StreamCallback(const std::weak_ptr<Session>& session, uint32_t request_id)
+            : session(session), request_id(request_id)
+        {}
+
+        void OnReceiverStarted() override
+        {
+            Post(true);
+        }
 
-    std::vector<std::uint8_t> write_buffer;
+        void OnReceiverFailed() override
+        {
+            Post(false);
+        }
 
-    IReceiverPtr receiver;
+    private:
+        void Post(bool started)
+        {
+            auto self = session.lock();
+            if (!self)
+                return;
 
-    const int id;
+            uint32_t id = request_id;
+            self->svc->Post([self, id, started]()
+            {
+                if (started)
+                    self->ProcessReceiverStarted(id);
+                else
+                    self->ProcessReceiverFailed(id);
+            });
+        }
+    };
 
-    enum class States
+    // routes fan-out events of one subscription back to the session thread
+    class SubscriptionCallback : public IFanoutCallback
+            , public Common::ObjectCounter<SubscriptionCallback>
     {
-        WaitPortQuery,
-        WaitSDP,
-        WaitReseiverAnswer,
-        ReseverStoped,
-        ReseverProcessed,
-    } state = States::WaitPortQuery;
+        const std::weak_ptr<Session> session;
+        const uint32_t request_id;
+
+    public:
+        SubscriptionCallback(const std::weak_ptr<Session>& session, uint32_t request_id)
+            : session(session), request_id(request_id)
+        {}
+
+        void OnSubscriptionClosed(bool evicted) override
+        {
+            auto self = session.lock();
+            if (!self)
+                return;
+
+            uint32_t id = request_id;
+            self->svc->Post([self, id, evicted]()
+            {
+                self->ProcessSubscriptionClosed(id, evicted);
+            });
+        }
+    };
+
+    tcp::socket socket;
+    IStreamServiceInternalPtr svc;
+
+    Common::Messages::FrameParser parser;
+
+    // frames queued while a write is in flight
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> writing;
+
+    std::map<uint32_t, Stream> streams;
+    std::map<uint32_t, ISubscriptionPtr> subscriptions;
+    bool stopped = false;
+    bool disconnected = false;
 
 public:
-    Session(const IStreamServiceInternalPtr& svc, tcp::socket socket, int id) : socket(std::move(socket)), svc(svc), id(id)
+    Session(const IStreamServiceInternalPtr& svc, tcp::socket socket) : socket(std::move(socket)), svc(svc)
     {
         LOG("Session CONSTRUCT " << this);
     }
@@ -76,233 +163,515 @@ public:
 
     void Stop()
     {
-        LOG("Stop");
+        if (stopped)
+            return;
 
-        if (receiver)
-        {
-            receiver->Uninitialize();
-            receiver.reset();
-        }
+        LOG("Stop");
+        stopped = true;
 
-        socket.close();
+        while (!streams.empty())
+            StopStream(streams.begin()->first);
+        CloseSubscriptions();
 
-        // return ports to pool
-        svc->ReturnPort(port1);
-        svc->ReturnPort(port2);
+        boost::system::error_code ec;
+        socket.close(ec);
 
         svc->StopSession(shared_from_this());
     }
 
 private:
-    void DoRead()
+    // client may close connection after its streams are started
+    void Disconnect()
     {
-        if (state == States::ReseverStoped)
-        {
-            Stop();
+        if (stopped || disconnected)
             return;
-        }
 
-        if (state == States::ReseverProcessed)
-            return;
+        disconnected = true;
+        out.clear();
+        CloseSubscriptions();
+        boost::system::error_code ec;
+        socket.close(ec);
+
+        if (streams.empty())
+            Stop();
+    }
+
+    void DoRead()
+    {
+        size_t size = 0;
+        uint8_t* data = parser.Prepare(read_size, size);
 
         auto self(shared_from_this());
-        socket.async_read_some(boost::asio::buffer(data, max_length),
+        socket.async_read_some(boost::asio::buffer(data, size),
             [this, self](boost::system::error_code ec, std::size_t length)
             {
+                if (stopped)
+                    return;
+
                 if (ec)
                 {
                     LOG("DoRead got error " << ec);
-                    Stop();
+                    Disconnect();
                     return;
                 }
 
-                LOG("Got message " << (int)data[0]);
+                parser.Commit(length);
 
-                if (state == States::WaitPortQuery)
-                {
-                    ProcessPortReserve(length);
-                    return;
-                }
+                Common::Messages::Frame frame;
+                while (!stopped && parser.Next(frame))
+                    ProcessFrame(frame);
 
-                if (state == States::WaitSDP)
+                if (parser.Error())
                 {
-                    ProcessStartReceiving(length);
-                    return;
+                    LOGW("Malformed control frame, close session");
+                    Stop();
                 }
+
+                if (!stopped)
+                    DoRead();
             });
     }
 
+    void Send(uint32_t request_id, Common::Messages::Status status, const std::vector<uint8_t>& data = std::vector<uint8_t>())
+    {
+        Common::Messages::append_reply(out, request_id, status, data);
+        DoWrite();
+    }
+
     void DoWrite()
     {
+        if (stopped || disconnected || !writing.empty() || out.empty())
+            return;
+
+        writing.swap(out);
+
         auto self(shared_from_this());
-        boost::asio::async_write(socket, boost::asio::buffer(write_buffer),
+        boost::asio::async_write(socket, boost::asio::buffer(writing),
           [this, self](boost::system::error_code ec, std::size_t )
           {
-              if (!ec)
-              {
-                  if (state == States::WaitPortQuery)
-                  {
-                      state = States::WaitSDP;
-                      LOG("Switch state to WaitSDP");
-                  }
+              writing.clear();
 
-                  DoRead();
-              }
-              else
+              if (ec)
               {
-                  Stop();
+                  Disconnect();
+                  return;
               }
+
+              DoWrite();
           });
     }
 
-    void ProcessPortReserve(std::size_t length)
+    void ProcessFrame(const Common::Messages::Frame& frame)
+    {
+        LOG_FMT("Got message {} request {}", (int)frame.type, frame.request_id);
+
+        switch (frame.type)
+        {
+        case Common::Messages::OPEN_STREAM:
+            ProcessOpenStream(frame);
+            break;
+        case Common::Messages::CLOSE_STREAM:
+            ProcessCloseStream(frame);
+            break;
+        case Common::Messages::SUBSCRIBE:
+            ProcessSubscribe(frame);
+            break;
+        default:
+            LOGW("Unexpected message type " << (int)frame.type);
+            Send(frame.request_id, Common::Messages::FAIL);
+            break;
+        }
+    }
+
+    // CLOSE_STREAM names a stream or a subscription by its request id
+    bool RequestIdUsed(uint32_t request_id) const
     {
-        if (data[0] != Common::Messages::RESERVE_TWO_PORTS)
+        return streams.count(request_id) || subscriptions.count(request_id);
+    }
+
+    void ProcessOpenStream(const Common::Messages::Frame& frame)
+    {
+        if (RequestIdUsed(frame.request_id))
+        {
+            LOGW("Duplicate request id " << frame.request_id);
+            Send(frame.request_id, Common::Messages::FAIL);
+            return;
+        }
+
+        // reject early, before ports and receiver, when the node is near saturation
+        unsigned retry_after_ms = 0;
+        Stream stream;
+        stream.load = svc->GetAdmission()->Admit(retry_after_ms);
+        if (!stream.load)
         {
-            LOGW("Unexpected message type " << (int)data[0]);
+            std::vector<uint8_t> retry;
+            Common::Messages::put_be32(retry, retry_after_ms);
+            Send(frame.request_id, Common::Messages::BUSY, retry);
             return;
         }
 
-        port1 = svc->PopPort();
-        port2 = svc->PopPort();
+        stream.video_id = svc->NextStreamId();
 
-        if (!port1 || !port2)
+        auto demuxer = svc->GetRtpDemuxer();
+        unsigned demux_socket = 0;
+        if (demuxer)
         {
-            LOGW("There are no free ports on server");
+            // both streams go to one port, receiver finds them by ssrc
+            demux_socket = stream.video_id % demuxer->Sockets();
+            stream.shared = true;
+            stream.port1 = stream.port2 = demuxer->Port(demux_socket);
         }
+        else
+        {
+            stream.port1 = svc->PopPort();
+            stream.port2 = svc->PopPort();
 
-        LOG("Reserver " << port1 << " " << port2);
+            if (!stream.port1 || !stream.port2)
+            {
+                LOGW("There are no free ports on server");
+                svc->ReturnPort(stream.port1);
+                svc->ReturnPort(stream.port2);
+                svc->GetAdmission()->Release(stream.load);
+                Send(frame.request_id, Common::Messages::NO_PORTS);
+                return;
+            }
+        }
 
-        uint16_t nport1 = htons(port1);
-        uint16_t nport2 = htons(port2);
+        LOG("Reserver " << stream.port1 << " " << stream.port2 << " for stream " << stream.video_id);
 
-        write_buffer.resize(4);
+        std::string sdp(reinterpret_cast<const char*>(frame.payload), frame.size);
 
-        memcpy(&write_buffer[0], &nport1, 2);
-        memcpy(&write_buffer[2], &nport2, 2);
+        LOGI("Got sdp " << sdp);
 
-        DoWrite();
+        ReceiverParams params;
+        params.sdp = sdp;
+        params.video_id = stream.video_id;
+        params.video_port = stream.port1;
+        params.audio_port = stream.port2;
+        params.demuxer = demuxer;
+        params.demux_socket = demux_socket;
+        params.load = stream.load;
+        params.huge_pages = svc->GetParams().huge_page_buffers;
+        params.jitter_latency_ms = svc->GetParams().jitter_latency_ms;
+        params.nack = svc->GetParams().nack;
+        params.recording = svc->GetParams().recording;
+        params.fanout = svc->GetFanout();
+
+        auto callback = std::make_shared<StreamCallback>(shared_from_this(), frame.request_id);
+        stream.receiver = CreateReceiver(svc->GetIngestEngine(), svc->GetWriterStage(), callback, params);
+
+        streams[frame.request_id] = stream;
+        stream.receiver->Initialize();
     }
 
-    void ProcessStartReceiving(std::size_t length)
+    void ProcessCloseStream(const Common::Messages::Frame& frame)
     {
-        if (data[0] != Common::Messages::START_STREAM)
+        uint32_t request_id = frame.size >= 4 ? Common::Messages::get_be32(frame.payload) : 0;
+        auto subscription = subscriptions.find(request_id);
+        if (subscription != subscriptions.end())
         {
-            LOGW("Unexpected message type " << (int)data[0]);
+            subscription->second->Close();
+            subscriptions.erase(subscription);
+            Send(frame.request_id, Common::Messages::OK);
             return;
         }
 
-        std::string sdp(data+1, length - 1);
+        if (frame.size < 4 || !streams.count(request_id))
+        {
+            Send(frame.request_id, Common::Messages::FAIL);
+            return;
+        }
 
-        LOGI("Got sdp " << sdp);
+        StopStream(request_id);
+        Send(frame.request_id, Common::Messages::OK);
+    }
+
+    void ProcessSubscribe(const Common::Messages::Frame& frame)
+    {
+        if (RequestIdUsed(frame.request_id))
+        {
+            LOGW("Duplicate request id " << frame.request_id);
+            Send(frame.request_id, Common::Messages::FAIL);
+            return;
+        }
 
-        std::ostringstream fns;
-        fns << "sdp" << id << ".sdp";
-        std::ofstream sdpf(fns.str());
-        sdpf << sdp;
-        sdpf.close();
+        auto fanout = svc->GetFanout();
+        boost::system::error_code ec;
+        auto peer = socket.remote_endpoint(ec);
+        if (!fanout || frame.size < 6 || ec || !peer.address().is_v4())
+        {
+            Send(frame.request_id, Common::Messages::FAIL);
+            return;
+        }
 
-        receiver = CreateReceiver(shared_from_this(), fns.str(), id);
-        receiver->Initialize();
+        int stream_id = Common::Messages::get_be32(frame.payload);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(peer.address().to_v4().to_ulong());
+        addr.sin_port = htons(Common::Messages::get_be16(frame.payload + 4));
 
-        state = States::WaitReseiverAnswer;
+        std::string sdp;
+        auto callback = std::make_shared<SubscriptionCallback>(shared_from_this(), frame.request_id);
+        auto subscription = fanout->Subscribe(stream_id, addr, callback, sdp);
+        if (!subscription)
+        {
+            LOGW("Cannot subscribe to stream " << stream_id);
+            Send(frame.request_id, Common::Messages::FAIL);
+            return;
+        }
+
+        LOG("Subscribed " << peer.address().to_string() << ":" << ntohs(addr.sin_port) << " to stream " << stream_id);
+        subscriptions[frame.request_id] = subscription;
+        Send(frame.request_id, Common::Messages::OK, std::vector<uint8_t>(sdp.begin(), sdp.end()));
     }
 
-    void OnReceiverStarted() override
+    void ProcessSubscriptionClosed(uint32_t request_id, bool evicted)
     {
-        svc->Post([this]()
-        {
-            ProcessReceiverStarted();
-        });
+        if (stopped || !subscriptions.erase(request_id))
+            return;
+
+        LOG("Subscription " << request_id << (evicted ? " evicted" : " ended with stream"));
+        Common::Messages::append_frame(out, Common::Messages::STREAM_CLOSED, request_id);
+        DoWrite();
     }
 
-    void OnReceiverFailed() override
+    void CloseSubscriptions()
     {
-        svc->Post([this]()
-        {
-            ProcessReceiverFailed();
-        });
+        for (auto& subscription : subscriptions)
+            subscription.second->Close();
+        subscriptions.clear();
     }
 
-    void ProcessReceiverStarted()
+    void StopStream(uint32_t request_id)
     {
-        if (state == States::WaitReseiverAnswer)
-        {
-            write_buffer.resize(2);
+        auto it = streams.find(request_id);
+        if (it == streams.end())
+            return;
 
-            write_buffer[0] = 'O';
-            write_buffer[1] = 'K';
+        Stream stream = it->second;
+        streams.erase(it);
 
-            state = States::ReseverProcessed;
-            DoWrite();
-        }
-        else
+        if (stream.receiver)
+            stream.receiver->Uninitialize();
+
+        // return ports to pool
+        if (!stream.shared)
         {
-            Stop();
+            svc->ReturnPort(stream.port1);
+            svc->ReturnPort(stream.port2);
         }
 
+        svc->GetAdmission()->Release(stream.load);
     }
 
-    void ProcessReceiverFailed()
+    void ProcessReceiverStarted(uint32_t request_id)
     {
-        if (state == States::WaitReseiverAnswer)
-        {
-            write_buffer.resize(4);
+        auto it = streams.find(request_id);
+        if (stopped || it == streams.end() || it->second.started)
+            return;
 
-            write_buffer[0] = 'F';
-            write_buffer[1] = 'A';
-            write_buffer[2] = 'I';
-            write_buffer[3] = 'L';
+        it->second.started = true;
 
-            state = States::ReseverStoped;
-            DoWrite();
+        std::vector<uint8_t> ports;
+        Common::Messages::put_be16(ports, it->second.port1);
+        Common::Messages::put_be16(ports, it->second.port2);
+        Common::Messages::put_be32(ports, it->second.video_id);
+        Send(request_id, Common::Messages::OK, ports);
+    }
+
+    void ProcessReceiverFailed(uint32_t request_id)
+    {
+        auto it = streams.find(request_id);
+        if (stopped || it == streams.end())
+            return;
+
+        bool started = it->second.started;
+        StopStream(request_id);
+
+        if (disconnected)
+        {
+            if (streams.empty())
+                Stop();
+            return;
         }
+
+        if (!started)
+            Send(request_id, Common::Messages::FAIL);
         else
         {
-            Stop();
+            Common::Messages::append_frame(out, Common::Messages::STREAM_CLOSED, request_id);
+            DoWrite();
         }
     }
-
 };
 
 
-class StreamService : public IStreamServiceInternal
-        , public std::enable_shared_from_this<StreamService>
-        , public Common::ObjectCounter<StreamService>
+// Acceptor, sessions and ports of one control thread. Sessions stay on the
+// shard which accepted them, receiver callbacks are posted back to it.
+class ServiceShard : public IStreamServiceInternal
+        , public std::enable_shared_from_this<ServiceShard>
+        , public Common::ObjectCounter<ServiceShard>
 {
-    const IServerAppPtr app;
+    const unsigned index;
+    const unsigned shards;
+    const ServerParams& params;
+    const IIngestEnginePtr ingest_engine;
+    const IWriterStagePtr writer_stage;
+    const IRtpDemuxerPtr demuxer;
+    const IAdmissionControllerPtr admission;
+    const IFanoutStagePtr fanout;
+
+    // own io_service and thread, or application io_service for single shard
+    std::unique_ptr<boost::asio::io_service> own_io;
+    boost::asio::io_service& io;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::thread thread;
 
     tcp::acceptor acceptor;
     tcp::socket socket;
 
-    PortsPool ports_pool;
+    // ports of all shards
+    const std::shared_ptr<SharedPortsPool> ports;
 
-    int session_ids = 100;
+    // unique over shards
+    int stream_ids;
 
     std::set<SessionPtr> sessions;
+    const Common::GaugePtr sessions_gauge;
 
 public:
-    StreamService(const IServerAppPtr& app)
-        : app(app)
-        , acceptor(app->GetIOService(), tcp::endpoint(tcp::v4(), app->GetParams().port))
-        , socket(app->GetIOService())
-        , ports_pool(app->GetParams().max_clients)
+    ServiceShard(unsigned index, unsigned shards, const ServerParams& params, boost::asio::io_service* app_io,
+                 const std::shared_ptr<SharedPortsPool>& ports, const IIngestEnginePtr& ingest_engine, const IWriterStagePtr& writer_stage, const IRtpDemuxerPtr& demuxer,
+                 const IAdmissionControllerPtr& admission, const IFanoutStagePtr& fanout)
+        : index(index), shards(shards), params(params)
+        , ingest_engine(ingest_engine), writer_stage(writer_stage), demuxer(demuxer), admission(admission), fanout(fanout)
+        , own_io(app_io ? nullptr : new boost::asio::io_service())
+        , io(app_io ? *app_io : *own_io)
+        , acceptor(io)
+        , socket(io)
+        , ports(ports)
+        , stream_ids(100 + index)
+        , sessions_gauge(Common::Metrics::AddGauge("streamer_sessions", "Control sessions, sessions stay with their streams",
+                                                   {{"shard", std::to_string(index)}}))
     {
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+        tcp::endpoint endpoint(tcp::v4(), params.port);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        // every shard listens the same port, kernel balances connections
+        if (shards > 1)
+            acceptor.set_option(reuse_port(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
     }
 
     void Initialize() override
     {
         DoAccept();
+
+        if (own_io)
+        {
+            work.reset(new boost::asio::io_service::work(*own_io));
+            thread = std::thread([this]()
+            {
+                Common::register_current_thread("ctl" + std::to_string(index));
+                TRY
+                {
+                    own_io->run();
+                }
+                CATCH_ERR("Control shard error: ");
+            });
+        }
     }
 
+    // stops sessions on shard thread
     void Uninitialize() override
     {
-        auto removing_sessions = sessions;
-        for(auto session : removing_sessions)
-            session->Stop();
-        acceptor.close();
+        if (!own_io)
+        {
+            StopSessions();
+            return;
+        }
+
+        std::promise<void> done;
+        io.post([this, &done]()
+        {
+            StopSessions();
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    // after ingest is stopped, no more callbacks
+    void Join()
+    {
+        work.reset();
+        if (own_io)
+            own_io->stop();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    uint16_t PopPort() override
+    {
+        return ports->pop(index);
+    }
+
+    void ReturnPort(uint16_t port) override
+    {
+        ports->return_port(port);
     }
 
+    uint16_t StopSession(const SessionPtr& session) override
+    {
+        sessions.erase(session);
+        sessions_gauge->Set(sessions.size());
+        return 0;
+    }
+
+    void Post(const std::function<void()>& f) override
+    {
+        io.post(f);
+    }
+
+    int NextStreamId() override
+    {
+        stream_ids += shards;
+        return stream_ids;
+    }
+
+    IIngestEnginePtr GetIngestEngine() override
+    {
+        return ingest_engine;
+    }
+
+    IRtpDemuxerPtr GetRtpDemuxer() override
+    {
+        return demuxer;
+    }
+
+    IWriterStagePtr GetWriterStage() override
+    {
+        return writer_stage;
+    }
+
+    IAdmissionControllerPtr GetAdmission() override
+    {
+        return admission;
+    }
+
+    IFanoutStagePtr GetFanout() override
+    {
+        return fanout;
+    }
+
+    const ServerParams& GetParams() const override
+    {
+        return params;
+    }
+
+private:
     void DoAccept()
     {
         auto self(shared_from_this());
@@ -311,8 +680,9 @@ public:
             {
                 if (!ec)
                 {
-                    auto session = std::make_shared<Session>(self, std::move(socket), ++session_ids);
+                    auto session = std::make_shared<Session>(self, std::move(socket));
                     sessions.insert(session);
+                    sessions_gauge->Set(sessions.size());
                     session->Start();
                 }
                 else
@@ -322,27 +692,86 @@ public:
             });
     }
 
-    uint16_t PopPort() override
+    void StopSessions()
     {
-        return ports_pool.pop();
+        auto removing_sessions = sessions;
+        for(auto session : removing_sessions)
+            session->Stop();
+        acceptor.close();
     }
+};
 
-    void ReturnPort(uint16_t port) override
+DECLARE_PTR(ServiceShard)
+
+class StreamService : public IStreamService
+        , public std::enable_shared_from_this<StreamService>
+        , public Common::ObjectCounter<StreamService>
+{
+    const IServerAppPtr app;
+
+    const IIngestEnginePtr ingest_engine;
+    const IWriterStagePtr writer_stage;
+    // shared by shards, limits are for the whole node
+    const IAdmissionControllerPtr admission;
+    IRtpDemuxerPtr demuxer;
+    IFanoutStagePtr fanout;
+
+    std::vector<ServiceShardPtr> shards;
+
+public:
+    StreamService(const IServerAppPtr& app)
+        : app(app)
+        , ingest_engine(CreateIngestEngine(app->GetParams().ingest_threads))
+        , writer_stage(CreateWriterStage(app->GetParams().writer_threads, app->GetParams().storage))
+        , admission(CreateAdmissionController(app->GetParams().admission, writer_stage))
     {
-        if (port)
-            ports_pool.return_port(port);
+        const ServerParams& params = app->GetParams();
+        if (params.ingest_port)
+            demuxer = CreateRtpDemuxer(ingest_engine, params.ingest_port, params.ingest_sockets, params.ingest_reuseport);
+        if (params.fanout.max_subscribers)
+            fanout = CreateFanoutStage(params.fanout);
+
+        unsigned count = params.control_shards;
+        if (!count)
+            count = std::max(1u, std::thread::hardware_concurrency());
+
+        auto ports = std::make_shared<SharedPortsPool>(params.max_clients, count);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            boost::asio::io_service* app_io = count == 1 ? &app->GetIOService() : nullptr;
+            shards.push_back(std::make_shared<ServiceShard>(i, count, params, app_io, ports, ingest_engine, writer_stage, demuxer, admission, fanout));
+        }
     }
 
-    uint16_t StopSession(const SessionPtr& session) override
+    void Initialize() override
     {
-        sessions.erase(session);
+        writer_stage->Initialize();
+        if (fanout)
+            fanout->Initialize();
+        ingest_engine->Initialize();
+        if (demuxer)
+            demuxer->Initialize();
+
+        for (auto& shard : shards)
+            shard->Initialize();
+
+        LOG("Stream service started with " << shards.size() << " control shards");
     }
 
-    void Post(const std::function<void()>& f) override
+    void Uninitialize() override
     {
-        app->Post(f);
+        for (auto& shard : shards)
+            shard->Uninitialize();
+        if (demuxer)
+            demuxer->Uninitialize();
+        ingest_engine->Uninitialize();
+        for (auto& shard : shards)
+            shard->Join();
+        // after ingest, flushes and closes recordings
+        writer_stage->Uninitialize();
+        if (fanout)
+            fanout->Uninitialize();
     }
-
 };
 
 IStreamServicePtr CreateStreamService(const IServerAppPtr& app)
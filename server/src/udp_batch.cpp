@@ -0,0 +1,145 @@
+#include "udp_batch.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+namespace Server
+{
+
+class UdpBatchReader::Private
+{
+public:
+    // GRO may coalesce up to 64k into one message
+    static constexpr size_t buffer_size = 65536;
+
+    std::vector<uint8_t> buffers;
+    mmsghdr msgs[batch_size];
+    iovec iovs[batch_size];
+    sockaddr_storage peers[batch_size];
+    char controls[batch_size][CMSG_SPACE(sizeof(int))];
+
+    std::vector<UdpDatagram> datagrams;
+
+    Private()
+        : buffers(buffer_size * batch_size)
+    {
+        datagrams.reserve(batch_size * 4);
+    }
+
+    void Prepare()
+    {
+        for (unsigned i = 0; i < batch_size; ++i)
+        {
+            iovs[i].iov_base = &buffers[i * buffer_size];
+            iovs[i].iov_len = buffer_size;
+
+            msghdr& hdr = msgs[i].msg_hdr;
+            hdr.msg_name = &peers[i];
+            hdr.msg_namelen = sizeof(peers[i]);
+            hdr.msg_iov = &iovs[i];
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = controls[i];
+            hdr.msg_controllen = sizeof(controls[i]);
+            hdr.msg_flags = 0;
+            msgs[i].msg_len = 0;
+        }
+    }
+
+    static size_t GroSize(msghdr& hdr)
+    {
+#ifdef UDP_GRO
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int size;
+                memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                return size > 0 ? size : 0;
+            }
+        }
+#endif
+        return 0;
+    }
+
+    int Read(int fd, UdpReadStats& stats)
+    {
+        datagrams.clear();
+        Prepare();
+
+        int count = recvmmsg(fd, msgs, batch_size, MSG_DONTWAIT, nullptr);
+        ++stats.syscalls;
+
+        if (count < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -errno;
+
+        for (int i = 0; i < count; ++i)
+        {
+            msghdr& hdr = msgs[i].msg_hdr;
+            const uint8_t* data = &buffers[i * buffer_size];
+            size_t len = msgs[i].msg_len;
+            size_t segment = GroSize(hdr);
+
+            if (!segment || segment >= len)
+            {
+                datagrams.push_back({data, len, &peers[i], hdr.msg_namelen});
+                continue;
+            }
+
+            for (size_t offset = 0; offset < len; offset += segment)
+            {
+                datagrams.push_back({data + offset, std::min(segment, len - offset), &peers[i], hdr.msg_namelen});
+                ++stats.gro_datagrams;
+            }
+        }
+
+        stats.datagrams += datagrams.size();
+        return datagrams.size();
+    }
+};
+
+UdpBatchReader::UdpBatchReader()
+    : d(*new Private())
+{
+}
+
+UdpBatchReader::~UdpBatchReader()
+{
+    delete &d;
+}
+
+int UdpBatchReader::Read(int fd, UdpReadStats& stats)
+{
+    return d.Read(fd, stats);
+}
+
+const std::vector<UdpDatagram>& UdpBatchReader::Datagrams() const
+{
+    return d.datagrams;
+}
+
+UdpBatchReader& UdpBatchReader::ForCurrentThread()
+{
+    thread_local UdpBatchReader reader;
+    return reader;
+}
+
+bool UdpBatchReader::EnableGro(int fd)
+{
+#ifdef UDP_GRO
+    int one = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+#else
+    return false;
+#endif
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/socket.h>
+
+namespace Server
+{
+
+struct UdpReadStats
+{
+    uint64_t syscalls = 0;
+    uint64_t datagrams = 0;
+    // datagrams which came coalesced by UDP GRO
+    uint64_t gro_datagrams = 0;
+
+    double DatagramsPerSyscall() const
+    {
+        return syscalls ? static_cast<double>(datagrams) / syscalls : 0;
+    }
+};
+
+struct UdpDatagram
+{
+    const uint8_t* data;
+    size_t size;
+    const sockaddr_storage* peer;
+    socklen_t peer_len;
+};
+
+// Reads many datagrams with one recvmmsg call. GRO super-packets are split
+// back to datagrams. Buffers are reused by the next Read, so consume
+// Datagrams() before reading again.
+class UdpBatchReader
+{
+    class Private;
+    Private& d;
+
+public:
+    static constexpr unsigned batch_size = 32;
+
+    UdpBatchReader();
+    ~UdpBatchReader();
+
+    UdpBatchReader(const UdpBatchReader&) = delete;
+    UdpBatchReader& operator=(const UdpBatchReader&) = delete;
+
+    // > 0 datagrams read, 0 nothing to read, < 0 -errno
+    int Read(int fd, UdpReadStats& stats);
+
+    const std::vector<UdpDatagram>& Datagrams() const;
+
+    // reader shared by all sockets polled from the current thread
+    static UdpBatchReader& ForCurrentThread();
+
+    static bool EnableGro(int fd);
+};
+
+}
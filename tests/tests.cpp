@@ -2,14 +2,48 @@
 
 #include <gtest/gtest.h>
 
+#include <fstream>
 #include <mutex>
 
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+}
+
 #include "common/common.h"
+#include "common/buffer_pool.h"
+#include "common/fec.h"
+#include "common/histogram.h"
+#include "common/messages.h"
+#include "common/metrics.h"
+#include "common/rtcp.hpp"
+#include "common/sdp.hpp"
+#include "common/spsc_ring.hpp"
 
 #include "client/src/sender.h"
 #include "client/src/client_app.h"
+#include "client/src/pacer.h"
+#include "client/src/rtp_history.h"
+
+#include "relay/src/impairment.h"
+#include "relay/src/relay_app.h"
+#include "relay/src/udp_relay.h"
 
+#include "server/src/admission.h"
+#include "server/src/fanout.h"
+#include "server/src/jitter_buffer.hpp"
 #include "server/src/ports_pull.hpp"
+#include "server/src/rtp_demuxer.h"
+#include "server/src/server_app.h"
+#include "server/src/ssrc_table.hpp"
+#include "server/src/storage.h"
+#include "server/src/udp_batch.h"
 
 TEST(ServerTest, PortsPool)
 {
@@ -22,6 +56,826 @@ TEST(ServerTest, PortsPool)
     ASSERT_EQ(port2, 35002);
 }
 
+TEST(ServerTest, PortsPoolShards)
+{
+    Server::PortsPool shard0(3, 0, 2);
+    Server::PortsPool shard1(3, 1, 2);
+
+    ASSERT_EQ(shard0.pop(), 35000);
+    ASSERT_EQ(shard0.pop(), 35002);
+    ASSERT_EQ(shard0.pop(), 35008);
+    ASSERT_EQ(shard1.pop(), 35004);
+    ASSERT_EQ(shard1.pop(), 35006);
+    ASSERT_EQ(shard1.pop(), 0);
+
+    // more shards than clients, shards without a slice borrow
+    Server::SharedPortsPool pool(2, 4);
+    ASSERT_EQ(pool.pop(3), 35000);
+    ASSERT_EQ(pool.pop(2), 35002);
+    ASSERT_EQ(pool.pop(2), 35004);
+    ASSERT_EQ(pool.pop(1), 35006);
+    ASSERT_EQ(pool.pop(0), 0);
+
+    // port goes back to its slice, any shard may take it
+    pool.return_port(35004);
+    pool.return_port(0);
+    ASSERT_EQ(pool.pop(3), 35004);
+    ASSERT_EQ(pool.pop(3), 0);
+}
+
+TEST(ServerTest, UdpBatchReader)
+{
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_GE(rx, 0);
+    ASSERT_GE(tx, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_size = sizeof(addr);
+    ASSERT_EQ(bind(rx, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    ASSERT_EQ(getsockname(rx, reinterpret_cast<sockaddr*>(&addr), &addr_size), 0);
+    ASSERT_EQ(connect(tx, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    bool gro = Server::UdpBatchReader::EnableGro(rx);
+
+    // more datagrams than a batch, sizes tell them apart
+    const unsigned count = Server::UdpBatchReader::batch_size + 8;
+    std::vector<uint8_t> data(1200);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        data[0] = i;
+        ASSERT_EQ(send(tx, data.data(), 100 + i, 0), 100 + i);
+    }
+
+    Server::UdpBatchReader reader;
+    Server::UdpReadStats stats;
+    std::vector<size_t> sizes;
+    int read = 0;
+    while ((read = reader.Read(rx, stats)) > 0)
+    {
+        for (const auto& datagram : reader.Datagrams())
+        {
+            ASSERT_EQ(datagram.data[0], sizes.size());
+            sizes.push_back(datagram.size);
+        }
+    }
+    ASSERT_EQ(read, 0);
+    ASSERT_EQ(sizes.size(), count);
+    for (unsigned i = 0; i < count; ++i)
+        ASSERT_EQ(sizes[i], 100 + i);
+    // two full batches and the empty read
+    ASSERT_EQ(stats.syscalls, 3u);
+    ASSERT_EQ(stats.datagrams, count);
+    ASSERT_DOUBLE_EQ(stats.DatagramsPerSyscall(), count / 3.0);
+
+#ifdef UDP_SEGMENT
+    // one segmented send comes as a GRO super-packet where the kernel
+    // coalesces loopback traffic, either way the reader returns segments
+    int segment = 500;
+    if (gro && setsockopt(tx, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0)
+    {
+        ASSERT_EQ(send(tx, data.data(), data.size(), 0), static_cast<ssize_t>(data.size()));
+        sizes.clear();
+        Server::UdpReadStats gso_stats;
+        while (reader.Read(rx, gso_stats) > 0)
+        {
+            for (const auto& datagram : reader.Datagrams())
+                sizes.push_back(datagram.size);
+        }
+        ASSERT_EQ(sizes, (std::vector<size_t>{500, 500, 200}));
+        ASSERT_TRUE(gso_stats.gro_datagrams == 0 || gso_stats.gro_datagrams == 3);
+    }
+#endif
+
+    close(tx);
+    close(rx);
+}
+
+namespace
+{
+
+// unaligned writes, then a header patched by a seek back as the mp4 muxer does
+void WriteRecording(Server::StorageBackend backend, const std::string& path, std::vector<uint8_t>& data)
+{
+    Server::StorageParams params;
+    params.backend = backend;
+    params.write_size = 8192;
+    params.buffers = 2;
+    params.direct_io = true;
+    params.preallocate = 16384;
+    auto storage = Server::CreateStorage(params);
+
+    AVIOContext* pb = storage->Open(path);
+    ASSERT_TRUE(pb);
+
+    std::vector<uint8_t> chunk(3001);
+    int64_t end = 0;
+    for (int i = 0; i < 70; ++i)
+    {
+        for (size_t j = 0; j < chunk.size(); ++j)
+            chunk[j] = i * 7 + j;
+        avio_write(pb, chunk.data(), chunk.size() - i);
+        end += chunk.size() - i;
+        storage->Submit();
+    }
+
+    std::fill(chunk.begin(), chunk.end(), 0xaa);
+    ASSERT_EQ(avio_seek(pb, 4097, SEEK_SET), 4097);
+    avio_write(pb, chunk.data(), chunk.size());
+    ASSERT_EQ(avio_seek(pb, end, SEEK_SET), end);
+    avio_write(pb, chunk.data(), 123);
+    storage->Close(&pb);
+
+    std::ifstream file(path, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    unlink(path.c_str());
+}
+
+}
+
+TEST(ServerTest, StorageUringMatchesBuffered)
+{
+    std::vector<uint8_t> uring;
+    std::vector<uint8_t> buffered;
+    WriteRecording(Server::StorageBackend::Uring, "storage_uring.bin", uring);
+    WriteRecording(Server::StorageBackend::Buffered, "storage_buffered.bin", buffered);
+
+    ASSERT_EQ(uring.size(), 70u * 3001 - 69 * 70 / 2 + 123);
+    ASSERT_EQ(uring[4097], 0xaa);
+    ASSERT_TRUE(uring == buffered);
+}
+
+TEST(ServerTest, SsrcTable)
+{
+    Server::SsrcTable<int> table(16);
+    std::vector<int> values(1000);
+
+    // sequential ssrcs as load generator assigns them, table grows
+    for (uint32_t i = 0; i < values.size(); ++i)
+        ASSERT_TRUE(table.Insert(0x1000 + i, &values[i]));
+    ASSERT_FALSE(table.Insert(0x1000, &values[1]));
+    ASSERT_EQ(table.Size(), values.size());
+
+    for (uint32_t i = 0; i < values.size(); i += 2)
+        ASSERT_TRUE(table.Erase(0x1000 + i));
+    ASSERT_FALSE(table.Erase(0x1000));
+
+    for (uint32_t i = 0; i < values.size(); ++i)
+        ASSERT_EQ(table.Find(0x1000 + i), i % 2 ? &values[i] : nullptr);
+    ASSERT_EQ(table.Size(), values.size() / 2);
+}
+
+TEST(ServerTest, SteerSsrcPairs)
+{
+    // video and audio ssrc of a sender differ in bit 0 and share the worker
+    std::vector<unsigned> hits(4);
+    for (uint32_t ssrc = 0x12345678; ssrc < 0x12345678 + 4000; ssrc += 2)
+    {
+        unsigned member = Server::SteerSsrc(ssrc, hits.size());
+        ASSERT_EQ(member, Server::SteerSsrc(ssrc | 1, hits.size()));
+        ++hits[member];
+    }
+
+    for (unsigned count : hits)
+        ASSERT_GT(count, 300u);
+}
+
+TEST(ServerTest, JitterBufferReorder)
+{
+    using Buffer = Server::JitterBuffer<int>;
+    auto start = Buffer::clock::now();
+    Buffer buffer(16, std::chrono::milliseconds(50));
+
+    std::vector<int> out;
+    auto push = [&](uint16_t seq, int ms)
+    {
+        return buffer.Push(seq, int(seq), start + std::chrono::milliseconds(ms), [&out](int&& value) { out.push_back(value); });
+    };
+
+    // sequence wraps, 65535 and 1 wait for 0
+    ASSERT_EQ(push(65534, 0), Buffer::Result::Buffered);
+    ASSERT_EQ(push(65535, 0), Buffer::Result::Buffered);
+    ASSERT_EQ(push(1, 1), Buffer::Result::Buffered);
+    ASSERT_EQ(push(1, 2), Buffer::Result::Duplicate);
+    ASSERT_EQ(out, (std::vector<int>{65534, 65535}));
+    ASSERT_EQ(push(0, 3), Buffer::Result::Buffered);
+    ASSERT_EQ(out, (std::vector<int>{65534, 65535, 0, 1}));
+    ASSERT_EQ(push(65535, 4), Buffer::Result::Late);
+
+    // 2 is lost, 3 is released once it has waited max latency
+    ASSERT_EQ(push(3, 10), Buffer::Result::Buffered);
+    ASSERT_EQ(buffer.Missed(), 1u);
+    ASSERT_TRUE(buffer.IsMissing(2));
+    buffer.Release(start + std::chrono::milliseconds(59), [&out](int&& value) { out.push_back(value); });
+    ASSERT_EQ(out.size(), 4u);
+    buffer.Release(start + std::chrono::milliseconds(60), [&out](int&& value) { out.push_back(value); });
+    ASSERT_EQ(out.back(), 3);
+    ASSERT_FALSE(buffer.IsMissing(2));
+    ASSERT_EQ(push(2, 61), Buffer::Result::Late);
+
+    // packet a capacity ahead pushes the gap out
+    ASSERT_EQ(push(5, 70), Buffer::Result::Buffered);
+    ASSERT_EQ(push(21, 71), Buffer::Result::Buffered);
+    ASSERT_EQ(out.back(), 5);
+    ASSERT_EQ(buffer.Size(), 1u);
+
+    const Server::JitterStats& stats = buffer.Stats();
+    ASSERT_EQ(stats.released, 6u);
+    ASSERT_EQ(stats.late, 2u);
+    ASSERT_EQ(stats.duplicate, 1u);
+    ASSERT_EQ(stats.lost, 2u);
+}
+
+namespace
+{
+
+struct FakeWriterStage : Server::IWriterStage
+{
+    std::atomic<uint64_t> bytes{0};
+
+    void Initialize() override {}
+    void Uninitialize() override {}
+
+    uint64_t BytesWritten() const override
+    {
+        return bytes;
+    }
+};
+
+Server::AdmissionParams AdmissionTestParams()
+{
+    // node load of the test machine is not limited
+    Server::AdmissionParams params;
+    params.max_cpu = 0;
+    params.min_free_memory = 0;
+    params.retry_after_ms = 1000;
+    params.sample_interval_ms = 50;
+    return params;
+}
+
+}
+
+TEST(ServerTest, AdmissionMaxStreams)
+{
+    Server::AdmissionParams params = AdmissionTestParams();
+    params.max_streams = 2;
+    auto admission = Server::CreateAdmissionController(params, nullptr);
+
+    unsigned retry_after_ms = 0;
+    auto first = admission->Admit(retry_after_ms);
+    auto second = admission->Admit(retry_after_ms);
+    ASSERT_TRUE(first);
+    ASSERT_TRUE(second);
+    ASSERT_EQ(retry_after_ms, 0u);
+
+    ASSERT_FALSE(admission->Admit(retry_after_ms));
+    ASSERT_GE(retry_after_ms, 1000u);
+    ASSERT_LE(retry_after_ms, 1500u);
+
+    admission->Release(first);
+    ASSERT_TRUE(admission->Admit(retry_after_ms));
+}
+
+TEST(ServerTest, AdmissionProjection)
+{
+    // one stream sends, four admitted ones do not yet: a new stream is
+    // projected with all of them, 6x the rate of the sending one
+    Server::AdmissionParams params = AdmissionTestParams();
+    const uint64_t bytes = 100000;
+    // about 3x the rate, sample comes in 0.1-0.2s
+    params.max_ingest_bps = bytes * 8 * 3 / 0.15;
+    auto admission = Server::CreateAdmissionController(params, nullptr);
+
+    unsigned retry_after_ms = 0;
+    std::vector<Server::StreamLoadPtr> loads;
+    for (int i = 0; i < 5; ++i)
+        loads.push_back(admission->Admit(retry_after_ms));
+    loads.front()->AddBytes(bytes);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(admission->Admit(retry_after_ms));
+    ASSERT_GE(retry_after_ms, 1000u);
+
+    // the silent ones leave, one sender and the new stream fit
+    for (int i = 1; i < 5; ++i)
+        admission->Release(loads[i]);
+    ASSERT_TRUE(admission->Admit(retry_after_ms));
+
+    // disk rate is taken from the writer stage
+    params = AdmissionTestParams();
+    params.max_disk_bps = 1;
+    auto writer = std::make_shared<FakeWriterStage>();
+    admission = Server::CreateAdmissionController(params, writer);
+    ASSERT_TRUE(admission->Admit(retry_after_ms));
+    writer->bytes = 1000;
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    ASSERT_FALSE(admission->Admit(retry_after_ms));
+}
+
+namespace
+{
+
+struct FanoutCallback : Server::IFanoutCallback
+{
+    std::atomic<int> closed{0};
+    std::atomic<bool> evicted{false};
+
+    void OnSubscriptionClosed(bool evicted) override
+    {
+        this->evicted = evicted;
+        ++closed;
+    }
+};
+
+bool WaitFor(const std::function<bool()>& done)
+{
+    for (int i = 0; i < 100; ++i)
+    {
+        if (done())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+}
+
+TEST(ServerTest, FanoutEvictsSlowSubscriber)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_size = sizeof(addr);
+    ASSERT_EQ(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    ASSERT_EQ(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_size), 0);
+    timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    Server::FanoutParams params;
+    params.max_subscribers = 2;
+    params.queue_depth = 4;
+    auto stage = Server::CreateFanoutStage(params);
+    auto stream = stage->AddStream(7, "v=0");
+
+    std::string sdp;
+    auto slow = std::make_shared<FanoutCallback>();
+    auto closed = std::make_shared<FanoutCallback>();
+    ASSERT_FALSE(stage->Subscribe(8, addr, slow, sdp));
+    ASSERT_TRUE(stage->Subscribe(7, addr, slow, sdp));
+    ASSERT_EQ(sdp, "v=0");
+    auto closed_subscription = stage->Subscribe(7, addr, closed, sdp);
+    ASSERT_TRUE(closed_subscription);
+    ASSERT_FALSE(stage->Subscribe(7, addr, slow, sdp));
+    closed_subscription->Close();
+
+    // datagram buffers are not written once published, as pool buffers
+    auto publish = [&stream](uint8_t value)
+    {
+        AVBufferRef* buf = av_buffer_alloc(4);
+        buf->data[0] = value;
+        stream->Publish(buf, 1);
+        av_buffer_unref(&buf);
+    };
+
+    // threads are not started, the fifth datagram overflows the queue
+    for (uint8_t i = 0; i < 5; ++i)
+        publish(i);
+
+    stage->Initialize();
+    ASSERT_TRUE(WaitFor([&]() { return slow->closed == 1; }));
+    ASSERT_TRUE(slow->evicted);
+    ASSERT_EQ(closed->closed, 0);
+
+    auto fast = std::make_shared<FanoutCallback>();
+    ASSERT_TRUE(WaitFor([&]() { return stage->Subscribe(7, addr, fast, sdp) != nullptr; }));
+    uint8_t data[16];
+
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        publish(10 + i);
+        ASSERT_EQ(recv(fd, data, sizeof(data), 0), 1);
+        ASSERT_EQ(data[0], 10 + i);
+    }
+
+    // closed stream ends its subscribers
+    stream->Close();
+    ASSERT_TRUE(WaitFor([&]() { return fast->closed == 1; }));
+    ASSERT_FALSE(fast->evicted);
+    ASSERT_FALSE(stage->Subscribe(7, addr, fast, sdp));
+
+    stage->Uninitialize();
+    close(fd);
+}
+
+namespace
+{
+
+// control connection of a test, a request waits for its reply
+class ControlClient
+{
+    int fd;
+    Common::Messages::FrameParser parser;
+
+public:
+    explicit ControlClient(uint16_t port)
+        : fd(socket(AF_INET, SOCK_STREAM, 0))
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+        {
+            close(fd);
+            fd = -1;
+        }
+
+        timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    ~ControlClient()
+    {
+        close(fd);
+    }
+
+    bool Connected() const
+    {
+        return fd >= 0;
+    }
+
+    // status of the reply, -1 without one; data gets the rest of the reply
+    int Request(uint8_t type, uint32_t request_id, const std::vector<uint8_t>& payload, std::vector<uint8_t>& data)
+    {
+        std::vector<uint8_t> out;
+        Common::Messages::append_frame(out, type, request_id, payload.data(), payload.size());
+        if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size()))
+            return -1;
+
+        for (;;)
+        {
+            Common::Messages::Frame frame;
+            while (parser.Next(frame))
+            {
+                // events, e.g. STREAM_CLOSED, are skipped
+                if (frame.type != Common::Messages::REPLY || frame.request_id != request_id || !frame.size)
+                    continue;
+                data.assign(frame.payload + 1, frame.payload + frame.size);
+                return frame.payload[0];
+            }
+
+            size_t size = 0;
+            uint8_t* buffer = parser.Prepare(1024, size);
+            ssize_t count = recv(fd, buffer, size, 0);
+            if (count <= 0)
+                return -1;
+            parser.Commit(count);
+        }
+    }
+};
+
+uint16_t FreeTcpPort()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_size = sizeof(addr);
+    bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_size);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+}
+
+TEST(ServerTest, RequestIdReuse)
+{
+    Server::ServerParams params;
+    params.port = FreeTcpPort();
+    params.admission.max_cpu = 0;
+    params.admission.min_free_memory = 0;
+
+    Server::IServerAppPtr server = Server::CreateServerApp(params);
+    std::thread server_thread([server]() { server->Run(); });
+
+    // server is stopped on failed assertions too
+    auto requests = [&params]()
+    {
+        std::unique_ptr<ControlClient> client;
+        auto connect = [&]()
+        {
+            client.reset(new ControlClient(params.port));
+            return client->Connected();
+        };
+        ASSERT_TRUE(WaitFor(connect));
+
+        // stream is started once its sdp is parsed, before any rtp
+        std::string sdp = "v=0\r\no=- 0 0 IN IP4 127.0.0.1\r\ns=No Name\r\nc=IN IP4 127.0.0.1\r\nt=0 0\r\n"
+                          "m=video 0 RTP/AVP 96\r\na=rtpmap:96 H264/90000\r\n";
+        std::vector<uint8_t> data;
+        ASSERT_EQ(client->Request(Common::Messages::OPEN_STREAM, 1, std::vector<uint8_t>(sdp.begin(), sdp.end()), data), Common::Messages::OK);
+        ASSERT_EQ(data.size(), 8u);
+        uint32_t stream_id = Common::Messages::get_be32(data.data() + 4);
+
+        std::vector<uint8_t> subscribe;
+        Common::Messages::put_be32(subscribe, stream_id);
+        Common::Messages::put_be16(subscribe, 9);
+
+        // CLOSE_STREAM could not tell the stream and the subscription apart
+        ASSERT_EQ(client->Request(Common::Messages::SUBSCRIBE, 1, subscribe, data), Common::Messages::FAIL);
+        ASSERT_EQ(client->Request(Common::Messages::SUBSCRIBE, 2, subscribe, data), Common::Messages::OK);
+        ASSERT_EQ(client->Request(Common::Messages::SUBSCRIBE, 2, subscribe, data), Common::Messages::FAIL);
+        ASSERT_EQ(client->Request(Common::Messages::OPEN_STREAM, 2, std::vector<uint8_t>(sdp.begin(), sdp.end()), data), Common::Messages::FAIL);
+
+        std::vector<uint8_t> close_subscription;
+        Common::Messages::put_be32(close_subscription, 2);
+        ASSERT_EQ(client->Request(Common::Messages::CLOSE_STREAM, 3, close_subscription, data), Common::Messages::OK);
+        std::vector<uint8_t> close_stream;
+        Common::Messages::put_be32(close_stream, 1);
+        ASSERT_EQ(client->Request(Common::Messages::CLOSE_STREAM, 4, close_stream, data), Common::Messages::OK);
+        ASSERT_EQ(client->Request(Common::Messages::CLOSE_STREAM, 5, close_stream, data), Common::Messages::FAIL);
+    };
+    requests();
+
+    // the run thread holds the last reference, so server stops at once
+    Common::IApplication* app = server.get();
+    server.reset();
+    app->Unload();
+    server_thread.join();
+}
+
+TEST(CommonTest, RtcpGenericNack)
+{
+    // 65530..65535 and 0 share an entry across the wrap, 40 needs its own
+    std::vector<uint16_t> seqs = {65530, 65531, 65535, 0, 40};
+    std::vector<uint8_t> packet;
+    Common::Rtcp::append_generic_nack(packet, 7, 0x12345678, seqs);
+    ASSERT_EQ(packet.size(), 20u);
+
+    // after a receiver report in one compound packet
+    std::vector<uint8_t> compound = {0x80, 201, 0, 1, 0, 0, 0, 7};
+    compound.insert(compound.end(), packet.begin(), packet.end());
+
+    std::vector<uint16_t> parsed;
+    ASSERT_TRUE(Common::Rtcp::parse_generic_nacks(compound.data(), compound.size(), [&](uint32_t ssrc, uint16_t seq)
+    {
+        ASSERT_EQ(ssrc, 0x12345678u);
+        parsed.push_back(seq);
+    }));
+    ASSERT_EQ(parsed, seqs);
+
+    uint8_t rtp[12] = {0x80, 96};
+    ASSERT_FALSE(Common::Rtcp::parse_generic_nacks(rtp, sizeof(rtp), [](uint32_t, uint16_t) {}));
+}
+
+TEST(CommonTest, FecRecover)
+{
+    // rtp packets of different lengths, group wraps sequence numbers
+    std::vector<std::vector<uint8_t>> packets;
+    Common::Fec::Encoder encoder(4);
+    std::vector<uint8_t> parity;
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        std::vector<uint8_t> packet(100 + i * 37);
+        for (size_t j = 0; j < packet.size(); ++j)
+            packet[j] = static_cast<uint8_t>(i * 31 + j);
+        uint16_t seq = static_cast<uint16_t>(65534 + i);
+        packet[0] = 0x80;
+        packet[1] = 96;
+        packet[2] = seq >> 8;
+        packet[3] = seq & 0xff;
+        packet[8] = 0x12;
+        packets.push_back(packet);
+        ASSERT_EQ(encoder.Add(packet.data(), packet.size()), i == 3);
+    }
+    parity = encoder.Parity();
+
+    Common::Fec::Parity parsed;
+    ASSERT_TRUE(Common::Fec::parse_parity(parity.data(), parity.size(), parsed));
+    ASSERT_EQ(parsed.base, 65534);
+    ASSERT_EQ(parsed.count, 4);
+    ASSERT_TRUE(parsed.Covers(1));
+    ASSERT_FALSE(parsed.Covers(2));
+    ASSERT_FALSE(Common::Fec::is_parity(packets[0].data(), packets[0].size()));
+
+    for (unsigned lost = 0; lost < 4; ++lost)
+    {
+        std::vector<const uint8_t*> present;
+        std::vector<size_t> sizes;
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            if (i == lost)
+                continue;
+            present.push_back(packets[i].data());
+            sizes.push_back(packets[i].size());
+        }
+
+        std::vector<uint8_t> out(parsed.payload_size);
+        size_t size = Common::Fec::recover(parsed, present.data(), sizes.data(), 3, out.data());
+        out.resize(size);
+        ASSERT_EQ(out, packets[lost]);
+    }
+
+    // every kernel the cpu has matches scalar on sizes off the vector width
+    for (auto kernel : {Common::Fec::XorKernel::Sse2, Common::Fec::XorKernel::Avx2})
+    {
+        if (!Common::Fec::xor_supported(kernel))
+            continue;
+        for (size_t size : {1, 15, 33, 200, 1201})
+        {
+            std::vector<uint8_t> a(size), b(size);
+            for (size_t i = 0; i < size; ++i)
+            {
+                a[i] = static_cast<uint8_t>(i * 7);
+                b[i] = static_cast<uint8_t>(i * 13 + 5);
+            }
+            std::vector<uint8_t> expected = a;
+            Common::Fec::xor_into(expected.data(), b.data(), size, Common::Fec::XorKernel::Scalar);
+            Common::Fec::xor_into(a.data(), b.data(), size, kernel);
+            ASSERT_EQ(a, expected) << Common::Fec::xor_name(kernel) << " " << size;
+        }
+    }
+}
+
+TEST(CommonTest, SdpSsrcs)
+{
+    std::string sdp = "v=0\r\ns=No Name\r\nm=video 0 RTP/AVP 96\r\na=rtpmap:96 H264/90000\r\n"
+                      "m=audio 0 RTP/AVP 97\r\na=rtpmap:97 MPEG4-GENERIC/44100/2";
+
+    std::string result = Common::Sdp::add_ssrcs(sdp, {11, 4000000000u});
+    ASSERT_NE(result.find("H264/90000\r\na=ssrc:11 cname:streamer\r\nm=audio"), std::string::npos);
+    ASSERT_EQ(Common::Sdp::parse_ssrcs(result), (std::vector<uint32_t>{11, 4000000000u}));
+    ASSERT_TRUE(Common::Sdp::parse_ssrcs(sdp).empty());
+}
+
+TEST(CommonTest, BufferPoolReuse)
+{
+    Common::BufferPool::Params params;
+    params.size_classes = {512, 2048};
+    Common::BufferPool pool(params);
+
+    size_t capacity = 0;
+    uint8_t* first = pool.Acquire(1400, capacity);
+    ASSERT_NE(first, nullptr);
+    ASSERT_EQ(capacity, 2048u);
+    pool.Release(first, capacity);
+
+    uint8_t* second = pool.Acquire(1000, capacity);
+    ASSERT_EQ(first, second);
+    pool.Release(second, capacity);
+
+    ASSERT_EQ(pool.Stats().reused, 1u);
+    ASSERT_EQ(pool.Stats().slabs, 1u);
+
+    uint8_t* big = pool.Acquire(100000, capacity);
+    ASSERT_EQ(capacity, 100000u);
+    pool.Release(big, capacity);
+    ASSERT_EQ(pool.Stats().oversized, 1u);
+}
+
+TEST(CommonTest, SpscRingDropOldest)
+{
+    Common::SpscRing<int> ring(3);
+    ASSERT_EQ(ring.max_size(), 4u);
+
+    for (int i = 0; i < 4; ++i)
+        ASSERT_TRUE(ring.try_push(i));
+    ASSERT_FALSE(ring.try_push(4));
+
+    int value = -1;
+    ASSERT_TRUE(ring.try_drop_oldest(value));
+    ASSERT_EQ(value, 0);
+    ASSERT_TRUE(ring.try_push(4));
+
+    for (int i = 1; i <= 4; ++i)
+    {
+        ASSERT_TRUE(ring.try_pop(value));
+        ASSERT_EQ(value, i);
+    }
+    ASSERT_FALSE(ring.try_pop(value));
+    ASSERT_EQ(ring.max_used(), 4u);
+}
+
+TEST(CommonTest, FrameParserSplitReads)
+{
+    using namespace Common::Messages;
+
+    std::vector<uint8_t> stream;
+    append_frame(stream, OPEN_STREAM, 7, "v=0", 3);
+    append_reply(stream, 7, OK, {0x88, 0xb8});
+
+    // byte by byte through a buffer smaller than one frame
+    FrameParser parser(4);
+    std::vector<Frame> frames;
+    std::vector<std::string> payloads;
+    for (uint8_t byte : stream)
+    {
+        size_t size = 0;
+        uint8_t* data = parser.Prepare(1, size);
+        *data = byte;
+        parser.Commit(1);
+
+        Frame frame;
+        while (parser.Next(frame))
+        {
+            frames.push_back(frame);
+            payloads.emplace_back(reinterpret_cast<const char*>(frame.payload), frame.size);
+        }
+    }
+
+    ASSERT_FALSE(parser.Error());
+    ASSERT_EQ(frames.size(), 2u);
+    ASSERT_EQ(frames[0].type, OPEN_STREAM);
+    ASSERT_EQ(frames[0].request_id, 7u);
+    ASSERT_EQ(payloads[0], "v=0");
+    ASSERT_EQ(frames[1].type, REPLY);
+    ASSERT_EQ(payloads[1].size(), 3u);
+    ASSERT_EQ(get_be16(reinterpret_cast<const uint8_t*>(payloads[1].data()) + 1), 35000);
+
+    std::vector<uint8_t> bad;
+    put_be32(bad, 1);
+    bad.resize(frame_header_size);
+    size_t size = 0;
+    memcpy(parser.Prepare(bad.size(), size), bad.data(), bad.size());
+    parser.Commit(bad.size());
+    Frame frame;
+    ASSERT_FALSE(parser.Next(frame));
+    ASSERT_TRUE(parser.Error());
+}
+
+TEST(CommonTest, MetricsRender)
+{
+    auto counter = Common::Metrics::AddCounter("test_packets_total", "Test packets", {{"stream", "a\"b"}});
+    auto gauge = Common::Metrics::AddGauge("test_depth", "Test depth");
+    counter->AddSingle(3);
+    counter->Add();
+    gauge->Set(-2);
+
+    std::string text = Common::Metrics::Render();
+    ASSERT_NE(text.find("# TYPE test_packets_total counter\n"), std::string::npos);
+    ASSERT_NE(text.find("test_packets_total{stream=\"a\\\"b\"} 4\n"), std::string::npos);
+    ASSERT_NE(text.find("# TYPE test_depth gauge\ntest_depth -2\n"), std::string::npos);
+
+    // series go away with their owners
+    counter.reset();
+    text = Common::Metrics::Render();
+    ASSERT_EQ(text.find("test_packets_total"), std::string::npos);
+    ASSERT_NE(text.find("test_depth"), std::string::npos);
+}
+
+TEST(CommonTest, MetricsHistogramRetired)
+{
+    auto first = Common::Metrics::AddHistogram("test_latency_seconds", "Test latency", {{"stage", "x"}});
+    first->Record(1000000000);
+    first->Record(1000000000);
+    std::string text = Common::Metrics::Render();
+    ASSERT_NE(text.find("test_latency_seconds_count{stage=\"x\"} 2\n"), std::string::npos);
+
+    // counts of a released histogram stay, so _count and _sum do not go down
+    first.reset();
+    auto second = Common::Metrics::AddHistogram("test_latency_seconds", "Test latency", {{"stage", "x"}});
+    second->Record(1000000000);
+    text = Common::Metrics::Render();
+    ASSERT_NE(text.find("test_latency_seconds_sum{stage=\"x\"} 3\n"), std::string::npos);
+    ASSERT_NE(text.find("test_latency_seconds_count{stage=\"x\"} 3\n"), std::string::npos);
+
+    second.reset();
+    Common::Metrics::Render();
+    text = Common::Metrics::Render();
+    ASSERT_NE(text.find("test_latency_seconds_count{stage=\"x\"} 3\n"), std::string::npos);
+}
+
+TEST(CommonTest, HistogramQuantiles)
+{
+    for (uint64_t value : std::vector<uint64_t>{0, 31, 32, 65, 1000, 123456789, Common::Histogram::max_value})
+    {
+        size_t index = Common::Histogram::Index(value);
+        ASSERT_LT(index, static_cast<size_t>(Common::Histogram::bucket_count));
+        ASSERT_GE(Common::Histogram::UpperBound(index), value);
+        ASSERT_LE(Common::Histogram::UpperBound(index) - value, value / Common::Histogram::sub_buckets);
+    }
+
+    // two recording threads merged for reading
+    Common::Histogram first, second, merged;
+    for (uint64_t i = 1; i <= 1000; ++i)
+        first.RecordSingle(i * 1000);
+    second.Record(50000000);
+
+    merged.Merge(first);
+    merged.Merge(second);
+    ASSERT_EQ(merged.Count(), 1001u);
+    ASSERT_EQ(merged.Max(), 50000000u);
+
+    uint64_t p50 = merged.Quantile(0.5);
+    ASSERT_GE(p50, 500000u);
+    ASSERT_LE(p50, 500000u + 500000u / Common::Histogram::sub_buckets);
+    ASSERT_EQ(merged.Quantile(1), 50000000u);
+    ASSERT_EQ(Common::Histogram().Quantile(0.99), 0u);
+}
+
 using namespace Client;
 
 class SenderHandler : public ISenderEvents
@@ -53,6 +907,165 @@ public:
     }
 };
 
+TEST(ClientTest, PacerSpeed)
+{
+    Client::Pacer fast(0);
+    for (int64_t t = 0; t < 1000000; t += 40000)
+    {
+        int64_t due = fast.Schedule(t);
+        ASSERT_EQ(due, 0);
+        fast.Sent(due);
+    }
+    ASSERT_EQ(fast.Stats().packets, 25u);
+    ASSERT_EQ(fast.Stats().waited, 0u);
+
+    // 200 ms of media at speed 4 is due over 50 ms from the first packet,
+    // all but the first are scheduled ahead
+    Client::Pacer pacer(4);
+    int64_t start = pacer.Schedule(0);
+    ASSERT_GT(start, 0);
+    pacer.Sent(start);
+    for (int64_t t = 20000; t <= 200000; t += 20000)
+    {
+        int64_t due = pacer.Schedule(t);
+        ASSERT_EQ(due, start + t / 4);
+        pacer.Sent(due);
+    }
+    ASSERT_EQ(pacer.Stats().packets, 11u);
+    ASSERT_EQ(pacer.Stats().waited, 10u);
+
+    // not paced, timestamp jump restarts the timeline at now
+    ASSERT_EQ(pacer.Schedule(AV_NOPTS_VALUE), 0);
+    int64_t due = pacer.Schedule(20 * 1000 * 1000 + 200000);
+    ASSERT_LE(due, Client::Pacer::Now());
+    ASSERT_EQ(pacer.Stats().resyncs, 1u);
+}
+
+TEST(ClientTest, RtpHistoryBudget)
+{
+    Client::RtpHistory history(16);
+    std::vector<uint8_t> packet(1000);
+    packet[0] = 0x80;
+    for (uint16_t seq = 0; seq < 20; ++seq)
+    {
+        packet[2] = seq >> 8;
+        packet[3] = seq & 0xff;
+        history.Store(packet.data(), packet.size());
+    }
+
+    // budget of 20 packets is 5 packets, a packet once per interval
+    unsigned sent = 0;
+    auto send = [&sent](const uint8_t*, size_t) { ++sent; };
+    history.Retransmit(2, 0, send);
+    for (uint16_t seq = 10; seq < 20; ++seq)
+        history.Retransmit(seq, 0, send);
+    history.Retransmit(10, 1000, send);
+    ASSERT_EQ(sent, 5u);
+
+    const Client::RetransmitStats& stats = history.Stats();
+    ASSERT_EQ(stats.requested, 12u);
+    ASSERT_EQ(stats.missing, 1u);
+    ASSERT_EQ(stats.limited, 6u);
+}
+
+TEST(RelayTest, ImpairmentSeeded)
+{
+    Relay::ImpairmentParams params;
+    params.loss = 0.1;
+    params.burst = 0.01;
+    params.burst_length = 4;
+    params.duplicate = 0.05;
+    params.delay_ms = 10;
+    params.jitter_ms = 5;
+
+    // same seed gives the same fate to every packet
+    auto run = [&params](uint32_t seed)
+    {
+        Relay::Impairment impairment(params, seed);
+        std::vector<int64_t> due;
+        for (int64_t i = 0; i < 10000; ++i)
+        {
+            int64_t copies[Relay::Impairment::max_copies];
+            unsigned count = impairment.Apply(i * 1000, 1200, nullptr, copies);
+            due.insert(due.end(), copies, copies + count);
+            due.push_back(-1);
+        }
+        return std::make_pair(due, impairment.Stats());
+    };
+
+    auto first = run(7);
+    ASSERT_EQ(first.first, run(7).first);
+    ASSERT_NE(first.first, run(8).first);
+
+    const Relay::ImpairmentStats& stats = first.second;
+    ASSERT_EQ(stats.packets, 10000u);
+    ASSERT_GT(stats.burst_lost, 0u);
+    ASSERT_NEAR(stats.lost / 10000.0, 0.1 + 0.04 * 0.9, 0.03);
+    ASSERT_NEAR(stats.duplicated / 10000.0, 0.05 * 0.86, 0.02);
+
+    // 12 Mbps serializes 1500 bytes in 1 ms, queue holds 5 ms of them
+    Relay::Link link(12000000, 5);
+    int64_t due = 0;
+    for (int i = 0; i < 6; ++i)
+    {
+        ASSERT_TRUE(link.Schedule(0, 1500, due));
+        ASSERT_EQ(due, (i + 1) * 1000);
+    }
+    ASSERT_FALSE(link.Schedule(0, 1500, due));
+    ASSERT_TRUE(link.Schedule(6000, 1500, due));
+    ASSERT_EQ(due, 7000);
+}
+
+TEST(RelayTest, StaleCloseKeepsReopenedPair)
+{
+    int server = socket(AF_INET, SOCK_DGRAM, 0);
+    int client = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_GE(server, 0);
+    ASSERT_GE(client, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_size = sizeof(addr);
+    ASSERT_EQ(bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    ASSERT_EQ(getsockname(server, reinterpret_cast<sockaddr*>(&addr), &addr_size), 0);
+    timeval timeout = {1, 0};
+    setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    Relay::RelayParams params;
+    params.first_port = 41000;
+    params.port_pairs = 1;
+    auto relay = Relay::CreateUdpRelay(params);
+    relay->Initialize();
+
+    Relay::RelayPair first = relay->Open(ntohs(addr.sin_port));
+    ASSERT_EQ(first.port, 41000);
+    relay->Close(first);
+
+    // the only pair is free once the relay thread closed it
+    Relay::RelayPair second;
+    for (int i = 0; i < 100 && !second.port; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        second = relay->Open(ntohs(addr.sin_port));
+    }
+    ASSERT_EQ(second.port, first.port);
+    ASSERT_NE(second.ordinal, first.ordinal);
+
+    // late close of the first stream, e.g. after an idle sweep
+    relay->Close(first);
+
+    sockaddr_in to = addr;
+    to.sin_port = htons(second.port);
+    uint8_t data[100] = {7};
+    ASSERT_EQ(sendto(client, data, sizeof(data), 0, reinterpret_cast<sockaddr*>(&to), sizeof(to)), 100);
+    ASSERT_EQ(recv(server, data, sizeof(data), 0), 100);
+    ASSERT_EQ(data[0], 7);
+
+    relay->Uninitialize();
+    close(client);
+    close(server);
+}
+
 TEST(ClientServerTest, FirstClient)
 {
     ClientParams params;